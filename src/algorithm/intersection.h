@@ -23,65 +23,205 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
  * SOFTWARE.
  */
+
 #pragma once
 
 #include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <type_traits>
+#include <algorithm>
+#include <immintrin.h>
 
 namespace algorithm {
 
-	template<typename item>
-	std::vector<item> intersection(const std::vector<std::vector<item>> &input,
-		std::function<void(item &a, const item &b)> sum_fun) {
+	/*
+		Kernels for intersecting sorted lists. The lists are arrays of records sorted by key(record), where key returns a reference
+		to the value the records are sorted by.
+	*/
 
-		if (input.size() == 0) return {};
+	// Lists at least this many times longer than the shortest list are searched with galloping instead of scanning.
+	const size_t gallop_ratio = 16;
 
-		size_t shortest_vector_position = 0;
-		size_t shortest_len = SIZE_MAX;
-		size_t iter_index = 0;
-		for (const std::vector<item> &vec : input) {
-			if (shortest_len > vec.size()) {
-				shortest_len = vec.size();
-				shortest_vector_position = iter_index;
+	/*
+		Returns the first position in [pos, len) where key(data[position]) is not less than value, or len if there is none. Exponential
+		search from pos followed by a binary search, so it costs O(log distance).
+	*/
+	template<typename item, typename value_type, typename key_fun>
+	size_t gallop_to(const item *data, size_t pos, size_t len, const value_type &value, key_fun key) {
+
+		if (pos >= len || !(key(data[pos]) < value)) return pos;
+
+		// key(data[low]) < value holds all the time.
+		size_t low = pos;
+		size_t step = 1;
+		while (low + step < len && key(data[low + step]) < value) {
+			low += step;
+			step <<= 1;
+		}
+
+		size_t first = low + 1;
+		size_t count = std::min(low + step, len) - first;
+		while (count > 0) {
+			const size_t half = count / 2;
+			if (key(data[first + half]) < value) {
+				first += half + 1;
+				count -= half + 1;
+			} else {
+				count = half;
 			}
-			iter_index++;
 		}
+		return first;
+	}
 
-		std::vector<size_t> positions(input.size(), 0);
-		std::vector<item> intersection;
+	inline bool has_avx2() {
+		static const bool supported = __builtin_cpu_supports("avx2");
+		return supported;
+	}
 
-		while (positions[shortest_vector_position] < shortest_len) {
+	/*
+		Linear scan over uint64_t keys located stride bytes apart, compares four keys at a time. Same result as gallop_to.
+	*/
+	__attribute__((target("avx2")))
+	inline size_t scan_to_avx2(const char *keys, size_t stride, size_t pos, size_t len, uint64_t value) {
 
-			bool all_equal = true;
-			item value = input[shortest_vector_position][positions[shortest_vector_position]];
+		auto key_at = [keys, stride](size_t i) {
+			return *reinterpret_cast<const uint64_t *>(keys + i * stride);
+		};
 
-			size_t iter_index = 0;
-			for (const std::vector<item> &vec : input) {
-				const size_t len = vec.size();
+		// There is no unsigned 64 bit compare so flip the sign bits and compare signed.
+		const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+		const __m256i needle = _mm256_xor_si256(_mm256_set1_epi64x(value), sign);
+		while (pos + 4 <= len) {
+			const __m256i block = _mm256_set_epi64x(key_at(pos + 3), key_at(pos + 2), key_at(pos + 1), key_at(pos));
+			const __m256i less = _mm256_cmpgt_epi64(needle, _mm256_xor_si256(block, sign));
+			const int mask = _mm256_movemask_pd(_mm256_castsi256_pd(less));
+			if (mask != 0xF) {
+				// The keys are sorted so the smaller keys are a prefix of the block.
+				return pos + __builtin_popcount(mask);
+			}
+			pos += 4;
+		}
+		while (pos < len && key_at(pos) < value) pos++;
+		return pos;
+	}
 
-				size_t *pos = &(positions[iter_index]);
-				while (*pos < len && vec[*pos] < value) {
-					(*pos)++;
-				}
-				if (((*pos < len) && (value < vec[*pos])) || *pos >= len) {
+	/*
+		Linear version of gallop_to, used when the lists have similar lengths. Uses AVX2 when the key is an uint64_t and the cpu
+		supports it.
+	*/
+	template<typename item, typename value_type, typename key_fun>
+	size_t scan_to(const item *data, size_t pos, size_t len, const value_type &value, key_fun key) {
+
+		if constexpr (std::is_same_v<decltype(key(*data)), const uint64_t &>) {
+			if (len >= pos + 8 && has_avx2()) {
+				return scan_to_avx2(reinterpret_cast<const char *>(&key(data[0])), sizeof(item), pos, len, value);
+			}
+		}
+
+		while (pos + 4 <= len && key(data[pos + 3]) < value) pos += 4;
+		while (pos < len && key(data[pos]) < value) pos++;
+		return pos;
+	}
+
+	/*
+		Intersects the sorted lists data[i][0 ... lens[i]) and calls match(positions) for every value found in all lists, positions[i]
+		is the position of the value in list i. Values are taken from the shortest list in order, the other lists are searched with
+		gallop_to or scan_to depending on how much longer they are. Duplicated values in the shortest list match the first occurrence in
+		the other lists.
+	*/
+	template<typename item, typename key_fun, typename match_fun>
+	void intersect_sorted(const std::vector<const item *> &data, const std::vector<size_t> &lens, key_fun key, match_fun match) {
+
+		const size_t num_lists = data.size();
+		if (num_lists == 0) return;
+
+		size_t shortest = 0;
+		for (size_t list = 1; list < num_lists; list++) {
+			if (lens[list] < lens[shortest]) shortest = list;
+		}
+		const size_t shortest_len = lens[shortest];
+		if (shortest_len == 0) return;
+
+		// Check the shortest lists first since they are the most likely to rule out a value.
+		std::vector<size_t> order;
+		for (size_t list = 0; list < num_lists; list++) {
+			if (list != shortest) order.push_back(list);
+		}
+		std::stable_sort(order.begin(), order.end(), [&lens](size_t a, size_t b) {
+			return lens[a] < lens[b];
+		});
+
+		std::vector<bool> gallop(num_lists, false);
+		for (size_t list : order) {
+			gallop[list] = lens[list] / shortest_len >= gallop_ratio;
+		}
+
+		std::vector<size_t> positions(num_lists, 0);
+		const item *shortest_data = data[shortest];
+		size_t &pos = positions[shortest];
+		while (pos < shortest_len) {
+
+			const auto &value = key(shortest_data[pos]);
+
+			bool all_equal = true;
+			for (size_t list : order) {
+				const size_t next = gallop[list] ? gallop_to(data[list], positions[list], lens[list], value, key) :
+					scan_to(data[list], positions[list], lens[list], value, key);
+				if (next >= lens[list]) return;
+				positions[list] = next;
+
+				const auto &found = key(data[list][next]);
+				if (value < found) {
+					// Nothing in the shortest list before found can be in the intersection.
 					all_equal = false;
+					pos = gallop_to(shortest_data, pos + 1, shortest_len, found, key);
 					break;
-				} else {
-					if (iter_index != shortest_vector_position) {
-						sum_fun(value, vec[*pos]);
-					}
 				}
-				iter_index++;
 			}
+
 			if (all_equal) {
-				intersection.push_back(value);
+				match(positions);
+				pos++;
 			}
+		}
+	}
 
-			positions[shortest_vector_position]++;
+	/*
+		Intersection of sorted vectors. sum_fun(a, b) is called with the value from the shortest vector as a and the matching values
+		from the other vectors as b, in the order of the input. key(value) returns the value the vectors are sorted by.
+	*/
+	template<typename item, typename sum_fun_type, typename key_fun>
+	std::vector<item> intersection(const std::vector<std::vector<item>> &input, sum_fun_type sum_fun, key_fun key) {
+
+		std::vector<const item *> data;
+		std::vector<size_t> lens;
+		size_t shortest = 0;
+		for (const std::vector<item> &vec : input) {
+			if (vec.size() < input[shortest].size()) shortest = data.size();
+			data.push_back(vec.data());
+			lens.push_back(vec.size());
 		}
 
+		std::vector<item> intersection;
+		intersect_sorted(data, lens, key, [&](const std::vector<size_t> &positions) {
+			item value = input[shortest][positions[shortest]];
+			for (size_t i = 0; i < input.size(); i++) {
+				if (i != shortest) {
+					sum_fun(value, input[i][positions[i]]);
+				}
+			}
+			intersection.push_back(value);
+		});
+
 		return intersection;
 	}
 
+	template<typename item, typename sum_fun_type>
+	std::vector<item> intersection(const std::vector<std::vector<item>> &input, sum_fun_type sum_fun) {
+		return intersection<item>(input, sum_fun, [](const item &a) -> const item & { return a; });
+	}
+
 	template<typename item>
 	std::vector<item> intersection(const std::vector<std::vector<item>> &input) {
 		return intersection<item>(input, [](item &a, const item &b) {});
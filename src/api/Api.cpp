@@ -49,11 +49,74 @@
 #include "system/Profiler.h"
 #include "json.hpp"
 
+#include <functional>
+#include <future>
+
 using namespace std;
 using json = nlohmann::json;
 
 namespace Api {
 
+	/*
+		Fetches the documents for all the results from the hash table in one batch.
+	*/
+	vector<ResultWithSnippet> results_with_snippets(HashTable &hash_table, const vector<FullTextRecord> &results) {
+
+		vector<uint64_t> keys;
+		for (const FullTextRecord &res : results) {
+			keys.push_back(res.m_value);
+		}
+
+		const vector<string> tsv_data = hash_table.find_many(keys);
+
+		vector<ResultWithSnippet> with_snippets;
+		for (size_t i = 0; i < results.size(); i++) {
+			with_snippets.emplace_back(ResultWithSnippet(tsv_data[i], results[i]));
+		}
+
+		return with_snippets;
+	}
+
+	/*
+		The links are sorted by target hash since apply_link_scores expects that.
+	*/
+	vector<Link::FullTextRecord> search_links(const string &query, const FullTextIndex<Link::FullTextRecord> &link_index,
+		SearchAllocation::Allocation *allocation, struct SearchMetric &metric) {
+
+		Profiler::instance profiler_links("SearchEngine::search<Link::FullTextRecord>");
+		vector<Link::FullTextRecord> links = SearchEngine::search<Link::FullTextRecord>(allocation->link_storage, link_index, {}, {},
+			query, 500000, metric);
+		profiler_links.stop();
+
+		sort(links.begin(), links.end(), [](const Link::FullTextRecord &a, const Link::FullTextRecord &b) {
+			return a.m_target_hash < b.m_target_hash;
+		});
+
+		return links;
+	}
+
+	vector<DomainLink::FullTextRecord> search_domain_links(const string &query,
+		const FullTextIndex<DomainLink::FullTextRecord> &domain_link_index, SearchAllocation::Allocation *allocation, size_t limit,
+		struct SearchMetric &metric) {
+
+		Profiler::instance profiler_domain_links("SearchEngine::search<DomainLink::FullTextRecord>");
+		vector<DomainLink::FullTextRecord> domain_links = SearchEngine::search<DomainLink::FullTextRecord>(
+			allocation->domain_link_storage, domain_link_index, {}, {}, query, limit, metric);
+		profiler_domain_links.stop();
+
+		return domain_links;
+	}
+
+	/*
+		Runs the tasks at the same time on the intersection threads of the worker that owns the allocation. The intersections of the
+		searches in the tasks run on the thread of their task.
+	*/
+	void run_concurrently(SearchAllocation::Allocation *allocation, const vector<function<void()>> &tasks) {
+		allocation->storage->intersection_pool->run(tasks.size(), [&tasks](size_t i) {
+			tasks[i]();
+		});
+	}
+
 	void search(const string &query, HashTable &hash_table, const FullTextIndex<FullTextRecord> &index,
 		SearchAllocation::Allocation *allocation, stringstream &response_stream) {
 
@@ -68,11 +131,7 @@ namespace Api {
 
 		PostProcessor post_processor(query);
 
-		vector<ResultWithSnippet> with_snippets;
-		for (FullTextRecord &res : results) {
-			const string tsv_data = hash_table.find(res.m_value);
-			with_snippets.emplace_back(ResultWithSnippet(tsv_data, res));
-		}
+		vector<ResultWithSnippet> with_snippets = results_with_snippets(hash_table, results);
 
 		post_processor.run(with_snippets);
 
@@ -90,28 +149,25 @@ namespace Api {
 		struct SearchMetric metric;
 		SearchEngine::reset_search_metric(metric);
 
-		vector<Link::FullTextRecord> links;
-		Profiler::instance profiler_links("SearchEngine::search<Link::FullTextRecord>");
-		links = SearchEngine::search<Link::FullTextRecord>(allocation->link_storage, link_index, {}, {}, query, 500000, metric);
-		profiler_links.stop();
+		struct SearchMetric link_metric;
+		SearchEngine::reset_search_metric(link_metric);
 
-		sort(links.begin(), links.end(), [](const Link::FullTextRecord &a, const Link::FullTextRecord &b) {
-			return a.m_target_hash < b.m_target_hash;
+		// Read the main index while the links are searched.
+		vector<Link::FullTextRecord> links;
+		run_concurrently(allocation, {
+			[&]() { links = search_links(query, link_index, allocation, link_metric); },
+			[&]() { SearchEngine::prefetch(index, query); }
 		});
 
 		const size_t links_handled = links.size();
-		const size_t total_url_links_found = metric.m_total_found;
+		const size_t total_url_links_found = link_metric.m_total_found;
 
 		vector<FullTextRecord> results = SearchEngine::search_deduplicate(allocation->storage, index, links, {}, query,
 			Config::result_limit, metric);
 
 		PostProcessor post_processor(query);
 
-		vector<ResultWithSnippet> with_snippets;
-		for (FullTextRecord &res : results) {
-			const string tsv_data = hash_table.find(res.m_value);
-			with_snippets.emplace_back(ResultWithSnippet(tsv_data, res));
-		}
+		vector<ResultWithSnippet> with_snippets = results_with_snippets(hash_table, results);
 
 		post_processor.run(with_snippets);
 
@@ -133,25 +189,23 @@ namespace Api {
 		struct SearchMetric metric;
 		SearchEngine::reset_search_metric(metric);
 
-		vector<Link::FullTextRecord> links;
-		Profiler::instance profiler_links("SearchEngine::search<Link::FullTextRecord>");
-		links = SearchEngine::search<Link::FullTextRecord>(allocation->link_storage, link_index, {}, {}, query, 500000, metric);
-		profiler_links.stop();
+		struct SearchMetric link_metric;
+		struct SearchMetric domain_link_metric;
+		SearchEngine::reset_search_metric(link_metric);
+		SearchEngine::reset_search_metric(domain_link_metric);
 
-		sort(links.begin(), links.end(), [](const Link::FullTextRecord &a, const Link::FullTextRecord &b) {
-			return a.m_target_hash < b.m_target_hash;
+		// The link searches are independent, run them at the same time and read the main index while waiting for them.
+		vector<Link::FullTextRecord> links;
+		vector<DomainLink::FullTextRecord> domain_links;
+		run_concurrently(allocation, {
+			[&]() { links = search_links(query, link_index, allocation, link_metric); },
+			[&]() { domain_links = search_domain_links(query, domain_link_index, allocation, 100000, domain_link_metric); },
+			[&]() { SearchEngine::prefetch(index, query); }
 		});
 
 		const size_t links_handled = links.size();
-		const size_t total_url_links_found = metric.m_total_found;
-
-		vector<DomainLink::FullTextRecord> domain_links;
-		Profiler::instance profiler_domain_links("SearchEngine::search<DomainLink::FullTextRecord>");
-		domain_links = SearchEngine::search<DomainLink::FullTextRecord>(allocation->domain_link_storage, domain_link_index, {}, {}, query,
-			100000, metric);
-		profiler_domain_links.stop();
-
-		const size_t total_domain_links_found = metric.m_total_found;
+		const size_t total_url_links_found = link_metric.m_total_found;
+		const size_t total_domain_links_found = domain_link_metric.m_total_found;
 
 		Profiler::instance profiler_index("SearchEngine::search_with_links");
 		vector<FullTextRecord> results = SearchEngine::search_deduplicate(allocation->storage, index, links, domain_links, query,
@@ -160,11 +214,7 @@ namespace Api {
 
 		PostProcessor post_processor(query);
 
-		vector<ResultWithSnippet> with_snippets;
-		for (FullTextRecord &res : results) {
-			const string tsv_data = hash_table.find(res.m_value);
-			with_snippets.emplace_back(ResultWithSnippet(tsv_data, res));
-		}
+		vector<ResultWithSnippet> with_snippets = results_with_snippets(hash_table, results);
 
 		post_processor.run(with_snippets);
 
@@ -192,11 +242,7 @@ namespace Api {
 
 		PostProcessor post_processor(query);
 
-		vector<ResultWithSnippet> with_snippets;
-		for (FullTextRecord &res : results) {
-			const string tsv_data = hash_table.find(res.m_value);
-			with_snippets.emplace_back(ResultWithSnippet(tsv_data, res));
-		}
+		vector<ResultWithSnippet> with_snippets = results_with_snippets(hash_table, results);
 
 		post_processor.run(with_snippets);
 
@@ -214,13 +260,11 @@ namespace Api {
 		struct SearchMetric metric;
 		SearchEngine::reset_search_metric(metric);
 
+		// Read the main index while the links are searched.
 		vector<Link::FullTextRecord> links;
-		Profiler::instance profiler_links("SearchEngine::search<Link::FullTextRecord>");
-		links = SearchEngine::search<Link::FullTextRecord>(allocation->link_storage, link_index, {}, {}, query, 500000, metric);
-		profiler_links.stop();
-
-		sort(links.begin(), links.end(), [](const Link::FullTextRecord &a, const Link::FullTextRecord &b) {
-			return a.m_target_hash < b.m_target_hash;
+		run_concurrently(allocation, {
+			[&]() { links = search_links(query, link_index, allocation, metric); },
+			[&]() { SearchEngine::prefetch(index, query); }
 		});
 
 		metric.m_total_url_links_found = metric.m_total_found;
@@ -233,11 +277,7 @@ namespace Api {
 
 		PostProcessor post_processor(query);
 
-		vector<ResultWithSnippet> with_snippets;
-		for (FullTextRecord &res : results) {
-			const string tsv_data = hash_table.find(res.m_value);
-			with_snippets.emplace_back(ResultWithSnippet(tsv_data, res));
-		}
+		vector<ResultWithSnippet> with_snippets = results_with_snippets(hash_table, results);
 
 		post_processor.run(with_snippets);
 
@@ -255,24 +295,22 @@ namespace Api {
 		struct SearchMetric metric;
 		SearchEngine::reset_search_metric(metric);
 
-		vector<Link::FullTextRecord> links;
-		Profiler::instance profiler_links("SearchEngine::search<Link::FullTextRecord>");
-		links = SearchEngine::search<Link::FullTextRecord>(allocation->link_storage, link_index, {}, {}, query, 500000, metric);
-		profiler_links.stop();
+		struct SearchMetric link_metric;
+		struct SearchMetric domain_link_metric;
+		SearchEngine::reset_search_metric(link_metric);
+		SearchEngine::reset_search_metric(domain_link_metric);
 
-		sort(links.begin(), links.end(), [](const Link::FullTextRecord &a, const Link::FullTextRecord &b) {
-			return a.m_target_hash < b.m_target_hash;
+		// The link searches are independent, run them at the same time and read the main index while waiting for them.
+		vector<Link::FullTextRecord> links;
+		vector<DomainLink::FullTextRecord> domain_links;
+		run_concurrently(allocation, {
+			[&]() { links = search_links(query, link_index, allocation, link_metric); },
+			[&]() { domain_links = search_domain_links(query, domain_link_index, allocation, 10000, domain_link_metric); },
+			[&]() { SearchEngine::prefetch(index, query); }
 		});
 
-		metric.m_total_url_links_found = metric.m_total_found;
-		metric.m_total_found = 0;
-
-		Profiler::instance profiler_domain_links("SearchEngine::search<DomainLink::FullTextRecord>");
-		vector<DomainLink::FullTextRecord> domain_links = SearchEngine::search<DomainLink::FullTextRecord>(allocation->domain_link_storage,
-			domain_link_index, {}, {}, query, 10000, metric);
-		profiler_domain_links.stop();
-
-		metric.m_total_domain_links_found = metric.m_total_found;
+		metric.m_total_url_links_found = link_metric.m_total_found;
+		metric.m_total_domain_links_found = domain_link_metric.m_total_found;
 
 		Profiler::instance profiler_index("SearchEngine::search_with_links");
 		vector<FullTextRecord> results = SearchEngine::search(allocation->storage, index, links, domain_links, query, Config::result_limit,
@@ -281,11 +319,7 @@ namespace Api {
 
 		PostProcessor post_processor(query);
 
-		vector<ResultWithSnippet> with_snippets;
-		for (FullTextRecord &res : results) {
-			const string tsv_data = hash_table.find(res.m_value);
-			with_snippets.emplace_back(ResultWithSnippet(tsv_data, res));
-		}
+		vector<ResultWithSnippet> with_snippets = results_with_snippets(hash_table, results);
 
 		post_processor.run(with_snippets);
 
@@ -394,11 +428,7 @@ namespace Api {
 
 		SearchEngine::sort_by_score(results);
 
-		vector<ResultWithSnippet> with_snippets;
-		for (FullTextRecord &res : results) {
-			const string tsv_data = hash_table.find(res.m_value);
-			with_snippets.emplace_back(ResultWithSnippet(tsv_data, res));
-		}
+		vector<ResultWithSnippet> with_snippets = results_with_snippets(hash_table, results);
 
 		metric.m_links_handled = links_handled;
 		metric.m_total_url_links_found = total_url_links_found;
@@ -0,0 +1,547 @@
+/*
+ * MIT License
+ *
+ * Alexandria.org
+ *
+ * Copyright (c) 2021 Josef Cullhed, <info@alexandria.org>, et al.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "FastCgiServer.h"
+#include "logger/logger.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+using namespace std;
+
+namespace Worker {
+
+	namespace {
+
+		// Record types and constants from the FastCGI specification.
+		const uint8_t fcgi_version = 1;
+		const uint8_t fcgi_begin_request = 1;
+		const uint8_t fcgi_abort_request = 2;
+		const uint8_t fcgi_end_request = 3;
+		const uint8_t fcgi_params = 4;
+		const uint8_t fcgi_stdin = 5;
+		const uint8_t fcgi_stdout = 6;
+		const uint8_t fcgi_get_values = 9;
+		const uint8_t fcgi_get_values_result = 10;
+		const uint8_t fcgi_unknown_type = 11;
+
+		const uint16_t fcgi_responder = 1;
+		const uint8_t fcgi_keep_conn = 1;
+		const uint8_t fcgi_request_complete = 0;
+		const uint8_t fcgi_unknown_role = 3;
+
+		const size_t header_len = 8;
+		const size_t max_content_len = 65535;
+
+		// epoll ids of the listening socket and the wake up eventfd, connections use ids from 2.
+		const uint64_t listen_id = 0;
+		const uint64_t wake_id = 1;
+
+		const string overloaded_response = "Status: 503 Service Unavailable\r\nContent-type: text/plain\r\n\r\nServer is busy";
+
+		void append_record(string &out, uint8_t type, uint16_t request_id, const char *data, size_t len) {
+			const char header[header_len] = {(char)fcgi_version, (char)type, (char)(request_id >> 8), (char)(request_id & 0xFF),
+				(char)(len >> 8), (char)(len & 0xFF), 0, 0};
+			out.append(header, header_len);
+			out.append(data, len);
+		}
+
+		void append_stream(string &out, uint8_t type, uint16_t request_id, const string &data) {
+			for (size_t pos = 0; pos < data.size(); pos += max_content_len) {
+				append_record(out, type, request_id, data.data() + pos, min(max_content_len, data.size() - pos));
+			}
+			// An empty record ends the stream.
+			append_record(out, type, request_id, nullptr, 0);
+		}
+
+		void append_end_request(string &out, uint16_t request_id, uint8_t protocol_status) {
+			const char body[8] = {0, 0, 0, 0, (char)protocol_status, 0, 0, 0};
+			append_record(out, fcgi_end_request, request_id, body, sizeof(body));
+		}
+
+		bool read_length(const char *data, size_t len, size_t &pos, size_t &length) {
+			if (pos >= len) return false;
+			const uint8_t first = data[pos];
+			if ((first & 0x80) == 0) {
+				length = first;
+				pos++;
+				return true;
+			}
+			if (pos + 4 > len) return false;
+			length = ((size_t)(first & 0x7F) << 24) | ((size_t)(uint8_t)data[pos + 1] << 16) | ((size_t)(uint8_t)data[pos + 2] << 8) |
+				(size_t)(uint8_t)data[pos + 3];
+			pos += 4;
+			return true;
+		}
+
+		void append_length(string &out, size_t length) {
+			if (length < 128) {
+				out.push_back((char)length);
+			} else {
+				out.push_back((char)((length >> 24) | 0x80));
+				out.push_back((char)(length >> 16));
+				out.push_back((char)(length >> 8));
+				out.push_back((char)length);
+			}
+		}
+
+		/*
+			Parses FastCGI name-value pairs. Returns false if the data is malformed.
+		*/
+		bool read_name_values(const string &data, map<string, string> &pairs) {
+			size_t pos = 0;
+			while (pos < data.size()) {
+				size_t name_len, value_len;
+				if (!read_length(data.data(), data.size(), pos, name_len)) return false;
+				if (!read_length(data.data(), data.size(), pos, value_len)) return false;
+				if (name_len > data.size() - pos || value_len > data.size() - pos - name_len) return false;
+				pairs[data.substr(pos, name_len)] = data.substr(pos + name_len, value_len);
+				pos += name_len + value_len;
+			}
+			return true;
+		}
+
+		bool parse_address(const string &address, sockaddr_in &addr) {
+			const size_t colon_pos = address.rfind(':');
+			if (colon_pos == string::npos) return false;
+			const string host = colon_pos == 0 ? "0.0.0.0" : address.substr(0, colon_pos);
+
+			memset(&addr, 0, sizeof(addr));
+			addr.sin_family = AF_INET;
+			try {
+				addr.sin_port = htons(stoi(address.substr(colon_pos + 1)));
+			} catch (...) {
+				return false;
+			}
+			return inet_pton(AF_INET, host.c_str(), &addr.sin_addr) == 1;
+		}
+
+	}
+
+	const char *FastCgiRequest::param(const string &name) const {
+		auto iter = params.find(name);
+		if (iter == params.end()) return nullptr;
+		return iter->second.c_str();
+	}
+
+	void FastCgiRequest::write(const string &data) {
+		output.append(data);
+	}
+
+	void FastCgiRequest::write(const char *data, size_t len) {
+		output.append(data, len);
+	}
+
+	FastCgiServer::FastCgiServer(const string &address, size_t max_queued)
+	: m_address(address), m_max_queued(max_queued)
+	{
+	}
+
+	FastCgiServer::~FastCgiServer() {
+		stop();
+	}
+
+	bool FastCgiServer::start() {
+
+		sockaddr_in addr;
+		if (!parse_address(m_address, addr)) {
+			LOG_ERROR("Invalid address " + m_address);
+			return false;
+		}
+
+		m_listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (m_listen_fd < 0) return false;
+
+		int reuse = 1;
+		setsockopt(m_listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+		if (::bind(m_listen_fd, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(m_listen_fd, SOMAXCONN) < 0) {
+			LOG_ERROR("Could not listen on " + m_address + ": " + strerror(errno));
+			close(m_listen_fd);
+			m_listen_fd = -1;
+			return false;
+		}
+
+		m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		m_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+		epoll_event event = {};
+		event.events = EPOLLIN;
+		event.data.u64 = listen_id;
+		epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_listen_fd, &event);
+		event.data.u64 = wake_id;
+		epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_wake_fd, &event);
+
+		m_stop = false;
+		m_thread = thread(&FastCgiServer::run, this);
+
+		return true;
+	}
+
+	void FastCgiServer::stop() {
+
+		if (!m_thread.joinable()) return;
+
+		{
+			lock_guard lock(m_queue_lock);
+			m_stop = true;
+		}
+		m_queue_cv.notify_all();
+
+		const uint64_t one = 1;
+		::write(m_wake_fd, &one, sizeof(one));
+
+		m_thread.join();
+
+		for (auto &iter : m_connections) {
+			close(iter.second.fd);
+		}
+		m_connections.clear();
+
+		close(m_listen_fd);
+		close(m_epoll_fd);
+		close(m_wake_fd);
+		m_listen_fd = m_epoll_fd = m_wake_fd = -1;
+	}
+
+	bool FastCgiServer::accept(FastCgiRequest &request) {
+
+		unique_lock lock(m_queue_lock);
+		m_queue_cv.wait(lock, [this]() { return m_stop || !m_queue.empty(); });
+		if (m_stop) return false;
+
+		request = std::move(m_queue.front());
+		m_queue.pop_front();
+
+		return true;
+	}
+
+	void FastCgiServer::finish(FastCgiRequest &request) {
+
+		{
+			lock_guard lock(m_done_lock);
+			m_done.push_back(std::move(request));
+		}
+		request = FastCgiRequest();
+
+		const uint64_t one = 1;
+		::write(m_wake_fd, &one, sizeof(one));
+	}
+
+	size_t FastCgiServer::num_queued() {
+		lock_guard lock(m_queue_lock);
+		return m_queue.size();
+	}
+
+	void FastCgiServer::run() {
+
+		const int max_events = 256;
+		epoll_event events[max_events];
+
+		while (!m_stop) {
+
+			const int num_events = epoll_wait(m_epoll_fd, events, max_events, -1);
+			if (num_events < 0) {
+				if (errno == EINTR) continue;
+				LOG_ERROR(string("epoll_wait failed: ") + strerror(errno));
+				break;
+			}
+
+			for (int i = 0; i < num_events; i++) {
+				const uint64_t id = events[i].data.u64;
+				if (id == listen_id) {
+					accept_connections();
+				} else if (id == wake_id) {
+					uint64_t value;
+					while (read(m_wake_fd, &value, sizeof(value)) > 0);
+					handle_done();
+				} else {
+					if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+						close_connection(id);
+						continue;
+					}
+					if (events[i].events & EPOLLIN) handle_input(id);
+					if (events[i].events & EPOLLOUT) handle_output(id);
+				}
+			}
+		}
+	}
+
+	void FastCgiServer::accept_connections() {
+
+		while (true) {
+			const int fd = accept4(m_listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+			if (fd < 0) {
+				if (errno == EINTR || errno == ECONNABORTED) continue;
+				if (errno != EAGAIN && errno != EWOULDBLOCK) {
+					LOG_ERROR(string("accept failed: ") + strerror(errno));
+				}
+				return;
+			}
+
+			const uint64_t connection_id = m_next_connection_id++;
+			m_connections[connection_id].fd = fd;
+
+			epoll_event event = {};
+			event.events = EPOLLIN | EPOLLRDHUP;
+			event.data.u64 = connection_id;
+			epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &event);
+		}
+	}
+
+	void FastCgiServer::handle_input(uint64_t connection_id) {
+
+		auto iter = m_connections.find(connection_id);
+		if (iter == m_connections.end()) return;
+		connection &conn = iter->second;
+
+		char buffer[64*1024];
+		while (true) {
+			const ssize_t read_bytes = read(conn.fd, buffer, sizeof(buffer));
+			if (read_bytes > 0) {
+				conn.input.append(buffer, read_bytes);
+				continue;
+			}
+			if (read_bytes < 0 && errno == EINTR) continue;
+			if (read_bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+
+			// Closed by the peer or a read error, pending responses have nowhere to go.
+			close_connection(connection_id);
+			return;
+		}
+
+		if (!parse_records(connection_id, conn)) {
+			close_connection(connection_id);
+			return;
+		}
+
+		flush(connection_id, conn);
+	}
+
+	void FastCgiServer::handle_output(uint64_t connection_id) {
+
+		auto iter = m_connections.find(connection_id);
+		if (iter == m_connections.end()) return;
+
+		flush(connection_id, iter->second);
+	}
+
+	void FastCgiServer::handle_done() {
+
+		vector<FastCgiRequest> done;
+		{
+			lock_guard lock(m_done_lock);
+			done.swap(m_done);
+		}
+
+		for (FastCgiRequest &request : done) {
+			auto iter = m_connections.find(request.connection_id);
+			// The client went away while the request was handled.
+			if (iter == m_connections.end()) continue;
+
+			connection &conn = iter->second;
+			conn.in_flight--;
+			respond(conn, request.request_id, request.keep_conn, request.output);
+			flush(request.connection_id, conn);
+		}
+	}
+
+	/*
+		Consumes all the complete records in conn.input. Returns false on protocol errors.
+	*/
+	bool FastCgiServer::parse_records(uint64_t connection_id, connection &conn) {
+
+		size_t pos = 0;
+		while (conn.input.size() - pos >= header_len) {
+			const char *header = conn.input.data() + pos;
+			const uint8_t version = header[0];
+			const uint8_t type = header[1];
+			const uint16_t request_id = ((uint8_t)header[2] << 8) | (uint8_t)header[3];
+			const size_t content_len = ((uint8_t)header[4] << 8) | (uint8_t)header[5];
+			const size_t padding_len = (uint8_t)header[6];
+
+			if (version != fcgi_version) return false;
+			if (conn.input.size() - pos < header_len + content_len + padding_len) break;
+
+			const char *content = header + header_len;
+			pos += header_len + content_len + padding_len;
+
+			if (type == fcgi_get_values) {
+				map<string, string> names;
+				if (!read_name_values(string(content, content_len), names)) return false;
+				string result;
+				for (const auto &iter : names) {
+					string value;
+					if (iter.first == "FCGI_MPXS_CONNS") value = "1";
+					else if (iter.first == "FCGI_MAX_REQS") value = to_string(m_max_queued);
+					else continue;
+					append_length(result, iter.first.size());
+					append_length(result, value.size());
+					result += iter.first + value;
+				}
+				append_record(conn.output, fcgi_get_values_result, 0, result.data(), result.size());
+				continue;
+			}
+
+			if (request_id == 0) {
+				// Management record we don't know about.
+				const char body[8] = {(char)type, 0, 0, 0, 0, 0, 0, 0};
+				append_record(conn.output, fcgi_unknown_type, 0, body, sizeof(body));
+				continue;
+			}
+
+			if (type == fcgi_begin_request) {
+				if (content_len < 8) return false;
+				const uint16_t role = ((uint8_t)content[0] << 8) | (uint8_t)content[1];
+				const bool keep_conn = content[2] & fcgi_keep_conn;
+				if (role != fcgi_responder) {
+					append_end_request(conn.output, request_id, fcgi_unknown_role);
+					if (!keep_conn) conn.close_when_done = true;
+					continue;
+				}
+				FastCgiRequest &request = conn.reading[request_id];
+				request = FastCgiRequest();
+				request.connection_id = connection_id;
+				request.request_id = request_id;
+				request.keep_conn = keep_conn;
+				continue;
+			}
+
+			auto iter = conn.reading.find(request_id);
+			// Records for requests that are already dispatched or aborted are ignored.
+			if (iter == conn.reading.end()) continue;
+			FastCgiRequest &request = iter->second;
+
+			if (type == fcgi_abort_request) {
+				append_end_request(conn.output, request_id, fcgi_request_complete);
+				if (!request.keep_conn) conn.close_when_done = true;
+				conn.reading.erase(iter);
+				continue;
+			} else if (type == fcgi_params) {
+				// The params are collected in output until the stream ends.
+				if (content_len == 0) {
+					if (!read_name_values(request.output, request.params)) return false;
+					request.output.clear();
+				} else {
+					request.output.append(content, content_len);
+				}
+			} else if (type == fcgi_stdin) {
+				if (content_len == 0) {
+					FastCgiRequest complete = std::move(request);
+					conn.reading.erase(iter);
+					dispatch(conn, std::move(complete));
+					continue;
+				}
+				request.body.append(content, content_len);
+			}
+
+			if (request.output.size() + request.body.size() > m_max_request_len) {
+				LOG_ERROR("FastCGI request larger than " + to_string(m_max_request_len) + " bytes, closing connection");
+				return false;
+			}
+		}
+
+		conn.input.erase(0, pos);
+
+		return true;
+	}
+
+	void FastCgiServer::dispatch(connection &conn, FastCgiRequest &&request) {
+
+		{
+			lock_guard lock(m_queue_lock);
+			if (m_queue.size() < m_max_queued) {
+				conn.in_flight++;
+				m_queue.push_back(std::move(request));
+				m_queue_cv.notify_one();
+				return;
+			}
+		}
+
+		LOG_INFO("Request queue is full, responding with 503");
+		respond(conn, request.request_id, request.keep_conn, overloaded_response);
+	}
+
+	void FastCgiServer::respond(connection &conn, uint16_t request_id, bool keep_conn, const string &output) {
+		append_stream(conn.output, fcgi_stdout, request_id, output);
+		append_end_request(conn.output, request_id, fcgi_request_complete);
+		if (!keep_conn) conn.close_when_done = true;
+	}
+
+	/*
+		Writes as much of the output as the socket takes and waits for EPOLLOUT for the rest. Closes the connection when the client asked
+		for it and everything is written.
+	*/
+	void FastCgiServer::flush(uint64_t connection_id, connection &conn) {
+
+		while (conn.output_pos < conn.output.size()) {
+			const ssize_t written = send(conn.fd, conn.output.data() + conn.output_pos, conn.output.size() - conn.output_pos,
+				MSG_NOSIGNAL);
+			if (written < 0) {
+				if (errno == EINTR) continue;
+				if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+				close_connection(connection_id);
+				return;
+			}
+			conn.output_pos += written;
+		}
+
+		const bool all_written = conn.output_pos == conn.output.size();
+		if (all_written) {
+			conn.output.clear();
+			conn.output_pos = 0;
+			if (conn.close_when_done && conn.in_flight == 0 && conn.reading.empty()) {
+				close_connection(connection_id);
+				return;
+			}
+		}
+
+		if (conn.want_write == all_written) {
+			conn.want_write = !all_written;
+			epoll_event event = {};
+			event.events = EPOLLIN | EPOLLRDHUP | (conn.want_write ? EPOLLOUT : 0);
+			event.data.u64 = connection_id;
+			epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, conn.fd, &event);
+		}
+	}
+
+	void FastCgiServer::close_connection(uint64_t connection_id) {
+
+		auto iter = m_connections.find(connection_id);
+		if (iter == m_connections.end()) return;
+
+		epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, iter->second.fd, nullptr);
+		close(iter->second.fd);
+		m_connections.erase(iter);
+	}
+
+}
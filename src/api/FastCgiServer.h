@@ -0,0 +1,147 @@
+/*
+ * MIT License
+ *
+ * Alexandria.org
+ *
+ * Copyright (c) 2021 Josef Cullhed, <info@alexandria.org>, et al.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <iostream>
+
+namespace Worker {
+
+	/*
+		A FastCGI request read by FastCgiServer. The worker writes the response (headers and body) to output with write().
+	*/
+	struct FastCgiRequest {
+
+		uint64_t connection_id = 0;
+		uint16_t request_id = 0;
+		bool keep_conn = false;
+
+		std::map<std::string, std::string> params;
+		std::string body;
+		std::string output;
+
+		// Returns nullptr if the param is not set, like FCGX_GetParam.
+		const char *param(const std::string &name) const;
+		void write(const std::string &data);
+		void write(const char *data, size_t len);
+
+	};
+
+	/*
+		Event driven FastCGI responder. One thread multiplexes all the connections with epoll and parses the FastCGI records, complete
+		requests are put in a queue of at most max_queued requests that the worker threads take from with accept(). Responses are handed
+		back with finish() and written by the event thread so a slow query only holds its worker, never a connection slot or the accept
+		loop. Requests arriving when the queue is full get a 503 response right away.
+
+		Usage from the worker threads:
+
+			FastCgiRequest request;
+			while (server.accept(request)) {
+				request.write("Content-type: text/plain\r\n\r\nhello");
+				server.finish(request);
+			}
+	*/
+	class FastCgiServer {
+
+	public:
+
+		FastCgiServer(const std::string &address, size_t max_queued);
+		~FastCgiServer();
+
+		// Opens the listening socket on "host:port" or ":port" and starts the event thread. Returns false if the socket can't be opened.
+		bool start();
+
+		// Stops the event thread, closes all connections and wakes up the workers blocked in accept().
+		void stop();
+
+		// Blocks until there is a request. Returns false when the server is stopped.
+		bool accept(FastCgiRequest &request);
+
+		// Sends request.output to the client and ends the request.
+		void finish(FastCgiRequest &request);
+
+		size_t num_queued();
+
+	private:
+
+		struct connection {
+			int fd;
+			std::string input;
+			std::string output;
+			size_t output_pos = 0;
+			// Requests that are still being read.
+			std::map<uint16_t, FastCgiRequest> reading;
+			// Requests queued or handled by a worker.
+			size_t in_flight = 0;
+			bool close_when_done = false;
+			bool want_write = false;
+		};
+
+		const std::string m_address;
+		const size_t m_max_queued;
+
+		// Largest request (params and body) accepted, larger requests close the connection.
+		const size_t m_max_request_len = 16*1024*1024;
+
+		int m_listen_fd = -1;
+		int m_epoll_fd = -1;
+		int m_wake_fd = -1;
+		std::thread m_thread;
+		std::atomic<bool> m_stop = false;
+
+		// Only used by the event thread.
+		std::unordered_map<uint64_t, connection> m_connections;
+		uint64_t m_next_connection_id = 2;
+
+		std::mutex m_queue_lock;
+		std::condition_variable m_queue_cv;
+		std::deque<FastCgiRequest> m_queue;
+
+		std::mutex m_done_lock;
+		std::vector<FastCgiRequest> m_done;
+
+		void run();
+		void accept_connections();
+		void handle_input(uint64_t connection_id);
+		void handle_output(uint64_t connection_id);
+		void handle_done();
+		bool parse_records(uint64_t connection_id, connection &conn);
+		void dispatch(connection &conn, FastCgiRequest &&request);
+		void respond(connection &conn, uint16_t request_id, bool keep_conn, const std::string &output);
+		void flush(uint64_t connection_id, connection &conn);
+		void close_connection(uint64_t connection_id);
+
+	};
+
+}
@@ -0,0 +1,106 @@
+/*
+ * MIT License
+ *
+ * Alexandria.org
+ *
+ * Copyright (c) 2021 Josef Cullhed, <info@alexandria.org>, et al.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "IndexRegistry.h"
+#include "logger/logger.h"
+
+#include <sys/stat.h>
+
+using namespace std;
+
+namespace Worker {
+
+	Indexes::Indexes(const string &main_name, const string &link_name, const string &domain_link_name, uint64_t generation)
+	: hash_table(main_name), hash_table_link(link_name), hash_table_domain_link(domain_link_name), index(main_name),
+		link_index(link_name), domain_link_index(domain_link_name), generation(generation)
+	{
+	}
+
+	IndexRegistry::IndexRegistry(const string &main_name, const string &link_name, const string &domain_link_name,
+		time_t check_interval)
+	: m_main_name(main_name), m_link_name(link_name), m_domain_link_name(domain_link_name), m_check_interval(check_interval),
+		m_checked_at(time(nullptr))
+	{
+		m_current = make_shared<Indexes>(m_main_name, m_link_name, m_domain_link_name, disk_generation());
+	}
+
+	shared_ptr<Indexes> IndexRegistry::current() {
+
+		shared_ptr<Indexes> indexes;
+		{
+			lock_guard lock(m_lock);
+			indexes = m_current;
+		}
+
+		// Only one thread checks the files, the others keep using the current generation.
+		const time_t now = time(nullptr);
+		time_t last_check = m_checked_at;
+		if (now - last_check < m_check_interval || !m_checked_at.compare_exchange_strong(last_check, now)) {
+			return indexes;
+		}
+
+		if (disk_generation() != indexes->generation) {
+			reload();
+			lock_guard lock(m_lock);
+			indexes = m_current;
+		}
+
+		return indexes;
+	}
+
+	void IndexRegistry::reload() {
+
+		lock_guard reload_lock(m_reload_lock);
+
+		const uint64_t generation = disk_generation();
+
+		LOG_INFO("Loading index generation " + to_string(generation));
+
+		// Load outside m_lock so the workers can go on with the old generation meanwhile.
+		shared_ptr<Indexes> indexes = make_shared<Indexes>(m_main_name, m_link_name, m_domain_link_name, generation);
+
+		lock_guard lock(m_lock);
+		m_current.swap(indexes);
+	}
+
+	/*
+		The newest modification time of the main index key files.
+	*/
+	uint64_t IndexRegistry::disk_generation() const {
+
+		uint64_t newest = 0;
+		for (size_t shard_id = 0; shard_id < Config::ft_num_shards; shard_id++) {
+			const FullTextShard<FullTextRecord> shard(m_main_name, shard_id);
+			struct stat st;
+			if (stat(shard.key_filename().c_str(), &st) == 0) {
+				newest = max<uint64_t>(newest, st.st_mtim.tv_sec * 1000000000ull + st.st_mtim.tv_nsec);
+			}
+		}
+
+		return newest;
+	}
+
+}
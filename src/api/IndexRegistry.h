@@ -0,0 +1,102 @@
+/*
+ * MIT License
+ *
+ * Alexandria.org
+ *
+ * Copyright (c) 2021 Josef Cullhed, <info@alexandria.org>, et al.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <iostream>
+
+#include "hash_table/HashTable.h"
+#include "full_text/FullTextIndex.h"
+#include "full_text/FullTextRecord.h"
+#include "link/FullTextRecord.h"
+#include "domain_link/FullTextRecord.h"
+
+namespace Worker {
+
+	/*
+		One generation of the indexes the search workers read from. The hash tables and full text indexes are safe to read from several
+		threads at the same time.
+	*/
+	struct Indexes {
+
+		Indexes(const std::string &main_name, const std::string &link_name, const std::string &domain_link_name, uint64_t generation);
+
+		HashTable hash_table;
+		HashTable hash_table_link;
+		HashTable hash_table_domain_link;
+
+		FullTextIndex<FullTextRecord> index;
+		FullTextIndex<Link::FullTextRecord> link_index;
+		FullTextIndex<DomainLink::FullTextRecord> domain_link_index;
+
+		// Newest modification time of the main index files when the generation was loaded.
+		const uint64_t generation;
+
+	};
+
+	/*
+		Process wide holder of the current index generation. The indexes are loaded once and every worker gets a reference counted handle
+		to them instead of loading its own copy.
+
+		current() checks the modification time of the main index files at most every check_interval seconds and if they have changed a
+		new generation is loaded and swapped in. Requests that already hold a handle to the old generation finish on it and the old
+		generation is freed when the last handle is released.
+	*/
+	class IndexRegistry {
+
+	public:
+
+		IndexRegistry(const std::string &main_name, const std::string &link_name, const std::string &domain_link_name,
+			time_t check_interval = 10);
+
+		std::shared_ptr<Indexes> current();
+
+		// Loads a new generation and swaps it in.
+		void reload();
+
+	private:
+
+		const std::string m_main_name;
+		const std::string m_link_name;
+		const std::string m_domain_link_name;
+		const time_t m_check_interval;
+
+		std::mutex m_lock;
+		std::shared_ptr<Indexes> m_current;
+
+		// Serializes reloads so only one new generation is loaded at a time.
+		std::mutex m_reload_lock;
+		std::atomic<time_t> m_checked_at;
+
+		uint64_t disk_generation() const;
+
+	};
+
+}
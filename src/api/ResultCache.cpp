@@ -0,0 +1,253 @@
+/*
+ * MIT License
+ *
+ * Alexandria.org
+ *
+ * Copyright (c) 2021 Josef Cullhed, <info@alexandria.org>, et al.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "ResultCache.h"
+#include "hash/Hash.h"
+#include "text/text.h"
+
+using namespace std;
+
+namespace Api {
+
+	namespace {
+
+		size_t next_power_of_two(size_t value) {
+			size_t power = 1;
+			while (power < value) power <<= 1;
+			return power;
+		}
+
+		// Assumed average size of a response, only used to size the frequency sketch.
+		const size_t expected_entry_bytes = 8*1024;
+
+	}
+
+	ResultCache::frequency_sketch::frequency_sketch(size_t width)
+	: m_mask(next_power_of_two(width) - 1), m_sample_size(sample_factor * (m_mask + 1)), m_table(depth * (m_mask + 1) / 2)
+	{
+	}
+
+	void ResultCache::frequency_sketch::increment(uint64_t hash) {
+		bool added = false;
+		for (size_t row = 0; row < depth; row++) {
+			const size_t idx = index(hash, row);
+			if (get(idx) < 15) {
+				m_table[idx >> 1] += (idx & 1) ? 0x10 : 0x01;
+				added = true;
+			}
+		}
+		if (added && ++m_additions >= m_sample_size) reset();
+	}
+
+	size_t ResultCache::frequency_sketch::frequency(uint64_t hash) const {
+		size_t freq = 15;
+		for (size_t row = 0; row < depth; row++) {
+			freq = min(freq, get(index(hash, row)));
+		}
+		return freq;
+	}
+
+	void ResultCache::frequency_sketch::clear() {
+		fill(m_table.begin(), m_table.end(), 0);
+		m_additions = 0;
+	}
+
+	size_t ResultCache::frequency_sketch::index(uint64_t hash, size_t row) const {
+		static const uint64_t seeds[depth] = {0xc3a5c85c97cb3127ull, 0xb492b66fbe98f273ull, 0x9ae16a3b2f90404full, 0xcbf29ce484222325ull};
+		uint64_t h = (hash + seeds[row]) * seeds[row];
+		h ^= h >> 32;
+		return row * (m_mask + 1) + (h & m_mask);
+	}
+
+	size_t ResultCache::frequency_sketch::get(size_t idx) const {
+		return (idx & 1) ? (m_table[idx >> 1] >> 4) : (m_table[idx >> 1] & 0x0F);
+	}
+
+	/*
+		Halves all the counters, both 4 bit counters of a byte at once.
+	*/
+	void ResultCache::frequency_sketch::reset() {
+		for (uint8_t &counters : m_table) {
+			counters = (counters >> 1) & 0x77;
+		}
+		m_additions /= 2;
+	}
+
+	ResultCache::ResultCache(size_t max_bytes, size_t num_shards)
+	: m_shard_bytes(max_bytes / num_shards), m_window_bytes(max_bytes / num_shards * window_per_mille / 1000)
+	{
+		const size_t sketch_width = max<size_t>(1024, m_shard_bytes / expected_entry_bytes);
+		for (size_t i = 0; i < num_shards; i++) {
+			m_shards.emplace_back(make_unique<shard>(sketch_width));
+		}
+	}
+
+	ResultCache::~ResultCache() {
+	}
+
+	string ResultCache::make_key(const string &route, const string &query) {
+		string key = route + "\n";
+		for (const string &word : text::get_full_text_words(query)) {
+			key += word + " ";
+		}
+		return key;
+	}
+
+	bool ResultCache::find(const string &key, uint64_t generation, string &value) {
+
+		const uint64_t hash = Hash::str(key);
+		shard &s = shard_for(hash);
+
+		lock_guard lock(s.lock);
+
+		// Misses count as well, a query that is requested often gets admitted when it is computed the next time.
+		s.sketch.increment(hash);
+
+		auto iter = s.entries.find(key);
+		if (iter == s.entries.end()) return false;
+
+		if (iter->second->generation != generation) {
+			erase(s, iter->second);
+			return false;
+		}
+
+		std::list<entry> &list = iter->second->in_window ? s.window : s.main;
+		list.splice(list.begin(), list, iter->second);
+		value = iter->second->value;
+
+		return true;
+	}
+
+	void ResultCache::insert(const string &key, const string &value, uint64_t generation) {
+
+		const uint64_t hash = Hash::str(key);
+		shard &s = shard_for(hash);
+
+		entry new_entry{key, value, hash, generation, true};
+		if (new_entry.bytes() > m_shard_bytes) return;
+
+		lock_guard lock(s.lock);
+
+		auto iter = s.entries.find(key);
+		if (iter != s.entries.end()) erase(s, iter->second);
+
+		s.window_bytes += new_entry.bytes();
+		s.window.push_front(std::move(new_entry));
+		s.entries[key] = s.window.begin();
+
+		evict_window(s);
+	}
+
+	void ResultCache::clear() {
+		for (auto &s : m_shards) {
+			lock_guard lock(s->lock);
+			s->window.clear();
+			s->main.clear();
+			s->entries.clear();
+			s->window_bytes = 0;
+			s->main_bytes = 0;
+			s->sketch.clear();
+		}
+	}
+
+	size_t ResultCache::size() {
+		size_t size = 0;
+		for (auto &s : m_shards) {
+			lock_guard lock(s->lock);
+			size += s->entries.size();
+		}
+		return size;
+	}
+
+	size_t ResultCache::bytes() {
+		size_t bytes = 0;
+		for (auto &s : m_shards) {
+			lock_guard lock(s->lock);
+			bytes += s->window_bytes + s->main_bytes;
+		}
+		return bytes;
+	}
+
+	ResultCache::shard &ResultCache::shard_for(uint64_t hash) {
+		return *m_shards[(hash >> 32) % m_shards.size()];
+	}
+
+	void ResultCache::erase(shard &s, list<entry>::iterator iter) {
+		if (iter->in_window) {
+			s.window_bytes -= iter->bytes();
+			s.entries.erase(iter->key);
+			s.window.erase(iter);
+		} else {
+			s.main_bytes -= iter->bytes();
+			s.entries.erase(iter->key);
+			s.main.erase(iter);
+		}
+	}
+
+	/*
+		Moves the entries that do not fit in the window to the main segment. When the main segment is full a candidate only gets in if
+		its key is more frequent than the keys of the entries it would evict.
+	*/
+	void ResultCache::evict_window(shard &s) {
+
+		while (s.window_bytes > m_window_bytes && !s.window.empty()) {
+
+			auto candidate = prev(s.window.end());
+			const size_t candidate_bytes = candidate->bytes();
+			const size_t candidate_freq = s.sketch.frequency(candidate->hash);
+
+			// Find the victims that make room for the candidate.
+			size_t freed = 0;
+			bool admit = true;
+			auto victim = s.main.end();
+			while (s.main_bytes - freed + candidate_bytes > m_shard_bytes - m_window_bytes && victim != s.main.begin()) {
+				--victim;
+				if (s.sketch.frequency(victim->hash) >= candidate_freq) {
+					admit = false;
+					break;
+				}
+				freed += victim->bytes();
+			}
+			if (admit && s.main_bytes - freed + candidate_bytes > m_shard_bytes - m_window_bytes) admit = false;
+
+			if (!admit) {
+				erase(s, candidate);
+				continue;
+			}
+
+			while (freed > 0) {
+				freed -= s.main.back().bytes();
+				erase(s, prev(s.main.end()));
+			}
+
+			candidate->in_window = false;
+			s.window_bytes -= candidate_bytes;
+			s.main_bytes += candidate_bytes;
+			s.main.splice(s.main.begin(), s.window, candidate);
+		}
+	}
+
+}
@@ -0,0 +1,136 @@
+/*
+ * MIT License
+ *
+ * Alexandria.org
+ *
+ * Copyright (c) 2021 Josef Cullhed, <info@alexandria.org>, et al.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace Api {
+
+	/*
+		Size bounded cache of serialized api responses shared by all the search workers.
+
+		Admission follows W-TinyLFU. A count-min sketch with 4 bit counters estimates how often each key has been requested recently,
+		new responses go into a small LRU window and when they fall out of it they only replace the LRU victim of the main segment if
+		their key is requested more often. One-off queries therefore never push the popular head queries out of the cache. The sketch
+		counters are halved every sample_factor * width requests so the frequencies follow changes in the traffic.
+
+		Every entry is stored with the index generation it was computed for and entries from other generations are never returned.
+
+		The cache is split into shards with one lock each, a shard is picked by the hash of the key.
+	*/
+	class ResultCache {
+
+	public:
+
+		ResultCache(size_t max_bytes, size_t num_shards = 16);
+		~ResultCache();
+
+		/*
+			Key for a query on a route (q, d=a, s...), the query is normalized with text::get_full_text_words so queries that
+			differ only in case or punctuation share an entry.
+		*/
+		static std::string make_key(const std::string &route, const std::string &query);
+
+		// Returns true and sets value if there is an entry for the key from this generation.
+		bool find(const std::string &key, uint64_t generation, std::string &value);
+		void insert(const std::string &key, const std::string &value, uint64_t generation);
+		void clear();
+
+		size_t size();
+		size_t bytes();
+
+	private:
+
+		// Per mille of a shard used for the admission window.
+		static const size_t window_per_mille = 10;
+		static const size_t sample_factor = 10;
+
+		class frequency_sketch {
+
+		public:
+
+			explicit frequency_sketch(size_t width);
+
+			void increment(uint64_t hash);
+			size_t frequency(uint64_t hash) const;
+			void clear();
+
+		private:
+
+			static const size_t depth = 4;
+
+			size_t m_mask;
+			size_t m_additions = 0;
+			size_t m_sample_size;
+			// depth rows of counters, two 4 bit counters per byte.
+			std::vector<uint8_t> m_table;
+
+			size_t index(uint64_t hash, size_t row) const;
+			size_t get(size_t idx) const;
+			void reset();
+
+		};
+
+		struct entry {
+			std::string key;
+			std::string value;
+			uint64_t hash;
+			uint64_t generation;
+			bool in_window;
+
+			size_t bytes() const { return key.size() + value.size() + sizeof(entry); }
+		};
+
+		struct shard {
+			std::mutex lock;
+			// Most recently used first.
+			std::list<entry> window;
+			std::list<entry> main;
+			std::unordered_map<std::string, std::list<entry>::iterator> entries;
+			size_t window_bytes = 0;
+			size_t main_bytes = 0;
+			frequency_sketch sketch;
+
+			explicit shard(size_t sketch_width) : sketch(sketch_width) {}
+		};
+
+		const size_t m_shard_bytes;
+		const size_t m_window_bytes;
+		std::vector<std::unique_ptr<shard>> m_shards;
+
+		shard &shard_for(uint64_t hash);
+		void erase(shard &s, std::list<entry>::iterator iter);
+		void evict_window(shard &s);
+
+	};
+
+}
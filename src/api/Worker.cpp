@@ -1,5 +1,8 @@
 
 #include "Worker.h"
+#include "FastCgiServer.h"
+#include "ResultCache.h"
+#include "IndexRegistry.h"
 #include "fcgio.h"
 #include "config.h"
 #include "parser/URL.h"
@@ -63,42 +66,54 @@ namespace Worker {
 
 	}
 
-	void *run_worker(void *data) {
+	void output_response(FastCgiRequest &request, stringstream &response) {
 
-		SearchAllocation::Allocation *allocation = SearchAllocation::create_allocation();
+		request.write("Content-type: application/json\r\n\r\n");
+		request.write(response.str());
 
-		Worker *worker = static_cast<Worker *>(data);
+	}
 
-		FCGX_Request request;
+	void output_binary_response(FastCgiRequest &request, stringstream &response) {
 
-		FCGX_InitRequest(&request, worker->socket_id, 0);
+		request.write("Content-type: application/octet-stream\r\n\r\n");
+		request.write(response.str());
 
-		HashTable hash_table("main_index");
-		HashTable hash_table_link("link_index");
-		HashTable hash_table_domain_link("domain_link_index");
+	}
 
-		FullTextIndex<FullTextRecord> index("main_index");
-		FullTextIndex<Link::FullTextRecord> link_index("link_index");
-		FullTextIndex<DomainLink::FullTextRecord> domain_link_index("domain_link_index");
+	void *run_worker(void *data) {
 
-		LOG_INFO("Server has started...");
+		Worker *worker = static_cast<Worker *>(data);
 
-		while (true) {
+		/*
+			Every worker owns its intersection threads. If there are enough cpus for all workers the threads are pinned to a
+			contiguous range of cpus per worker.
+		*/
+		const size_t num_cpus = std::thread::hardware_concurrency();
+		const size_t first_cpu = worker->thread_id * Config::ft_num_threads_intersection;
+		const bool pin_threads = Config::worker_count * Config::ft_num_threads_intersection <= num_cpus;
+		SearchEngine::IntersectionPool intersection_pool(Config::ft_num_threads_intersection,
+			pin_threads ? first_cpu : SearchEngine::IntersectionPool::no_pinning);
 
-			static pthread_mutex_t accept_mutex = PTHREAD_MUTEX_INITIALIZER;
+		SearchAllocation::Allocation *allocation = SearchAllocation::create_allocation(&intersection_pool);
 
-			pthread_mutex_lock(&accept_mutex);
-			int accept_response = FCGX_Accept_r(&request);
-			pthread_mutex_unlock(&accept_mutex);
+		FastCgiRequest request;
 
-			if (accept_response < 0) {
-				break;
-			}
+		LOG_INFO("Server has started...");
 
-			const char *uri_ptr = FCGX_GetParam("REQUEST_URI", request.envp);
-			const char *req_ptr = FCGX_GetParam("REQUEST_METHOD", request.envp);
+		while (worker->server->accept(request)) {
+
+			// Holding the handle keeps this generation loaded until the request is done even if a new one is swapped in.
+			shared_ptr<Indexes> indexes = worker->registry->current();
+			HashTable &hash_table = indexes->hash_table;
+			HashTable &hash_table_link = indexes->hash_table_link;
+			const FullTextIndex<FullTextRecord> &index = indexes->index;
+			const FullTextIndex<Link::FullTextRecord> &link_index = indexes->link_index;
+			const FullTextIndex<DomainLink::FullTextRecord> &domain_link_index = indexes->domain_link_index;
+
+			const char *uri_ptr = request.param("REQUEST_URI");
+			const char *req_ptr = request.param("REQUEST_METHOD");
 			if ((uri_ptr == nullptr) || (req_ptr == nullptr)) {
-				FCGX_Finish_r(&request);
+				worker->server->finish(request);
 				continue;
 			}
 			string uri(uri_ptr);
@@ -119,6 +134,24 @@ namespace Worker {
 				}
 			}
 
+			// Searches and word stats are served from the shared cache if the same normalized query has been answered before.
+			string cache_key;
+			if (query.find("q") != query.end()) {
+				cache_key = Api::ResultCache::make_key(deduplicate ? "q" : "q&d=a", query["q"]);
+			} else if (query.find("s") != query.end()) {
+				cache_key = Api::ResultCache::make_key("s", query["s"]);
+			}
+			const bool use_cache = worker->result_cache != nullptr && !cache_key.empty();
+			const uint64_t generation = indexes->generation;
+
+			string cached_response;
+			if (use_cache && worker->result_cache->find(cache_key, generation, cached_response)) {
+				request.write("Content-type: application/json\r\n\r\n");
+				request.write(cached_response);
+				worker->server->finish(request);
+				continue;
+			}
+
 			if (query.find("q") != query.end() && deduplicate) {
 				if (Config::index_text) {
 					Api::search(query["q"], hash_table, index, link_index, domain_link_index, allocation, response_stream);
@@ -141,30 +174,47 @@ namespace Worker {
 				output_binary_response(request, response_stream);
 			}
 
-			FCGX_Finish_r(&request);
+			if (use_cache) {
+				worker->result_cache->insert(cache_key, response_stream.str(), generation);
+			}
+
+			worker->server->finish(request);
+
+			SearchAllocation::release_allocation(allocation);
 		}
 
 		SearchAllocation::delete_allocation(allocation);
 
-		FCGX_Free(&request, true);
-
 		return NULL;
 	}
 
+	/*
+		Connections are handled by the epoll loop of FastCgiServer, the workers only run the searches. A slow query holds one worker
+		while the other workers and the connection handling go on.
+	*/
 	void start_server() {
-		FCGX_Init();
 
-		int socket_id = FCGX_OpenSocket("127.0.0.1:8000", 20);
-		if (socket_id < 0) {
+		FastCgiServer server("127.0.0.1:8000", Config::worker_queue_len);
+		if (!server.start()) {
 			LOG_INFO("Could not open socket, exiting");
 			return;
 		}
 
+		// The indexes are loaded once and shared by all the workers.
+		IndexRegistry registry("main_index", "link_index", "domain_link_index");
+
+		unique_ptr<Api::ResultCache> result_cache;
+		if (Config::result_cache_mb > 0) {
+			result_cache = make_unique<Api::ResultCache>(Config::result_cache_mb * 1024 * 1024);
+		}
+
 		vector<pthread_t> thread_ids(Config::worker_count);
 
 		Worker *workers = new Worker[Config::worker_count];
 		for (size_t i = 0; i < Config::worker_count; i++) {
-			workers[i].socket_id = socket_id;
+			workers[i].server = &server;
+			workers[i].result_cache = result_cache.get();
+			workers[i].registry = &registry;
 			workers[i].thread_id = i;
 
 			pthread_create(&thread_ids[i], NULL, run_worker, &workers[i]);
@@ -173,8 +223,6 @@ namespace Worker {
 		for (size_t i = 0; i < Config::worker_count; i++) {
 			pthread_join(thread_ids[i], NULL);
 		}
-
-		close(socket_id);
 	}
 
 	void download_server() {
@@ -329,6 +377,28 @@ namespace Worker {
 					accept = string(accept_ptr);
 				}
 
+				if (accept == "application/octet-stream") {
+					// Binary multi gets are answered while the keys are read.
+					auto read = [&request](char *buffer, size_t len) -> size_t {
+						return FCGX_GetStr(buffer, len, request.in);
+					};
+					auto write = [&request](const char *data, size_t len) {
+						FCGX_PutStr(data, len, request.out);
+					};
+					FCGX_FPrintF(request.out, "Content-type: application/octet-stream\r\n\r\n");
+					if (type == "url") {
+						UrlStore::handle_binary_post_request(stores.url, read, write);
+					}
+					if (type == "domain") {
+						UrlStore::handle_binary_post_request(stores.domain, read, write);
+					}
+					if (type == "robots") {
+						UrlStore::handle_binary_post_request(stores.robots, read, write);
+					}
+					FCGX_Finish_r(&request);
+					continue;
+				}
+
 				string post_data;
 				Profiler::instance prof("[urlstore] read post data");
 				while (true) {
@@ -346,29 +416,16 @@ namespace Worker {
 				prof.stop();
 
 				if (error == 0) {
-					if (accept == "application/octet-stream") {
-						if (type == "url") {
-							UrlStore::handle_binary_post_request(stores.url, post_data, response_stream);
-						}
-						if (type == "domain") {
-							UrlStore::handle_binary_post_request(stores.domain, post_data, response_stream);
-						}
-						if (type == "robots") {
-							UrlStore::handle_binary_post_request(stores.robots, post_data, response_stream);
-						}
-						output_binary_response(request, response_stream);
-					} else {
-						if (type == "url") {
-							UrlStore::handle_post_request(stores.url, post_data, response_stream);
-						}
-						if (type == "domain") {
-							UrlStore::handle_post_request(stores.domain, post_data, response_stream);
-						}
-						if (type == "robots") {
-							UrlStore::handle_post_request(stores.robots, post_data, response_stream);
-						}
-						output_response(request, response_stream);
+					if (type == "url") {
+						UrlStore::handle_post_request(stores.url, post_data, response_stream);
+					}
+					if (type == "domain") {
+						UrlStore::handle_post_request(stores.domain, post_data, response_stream);
 					}
+					if (type == "robots") {
+						UrlStore::handle_post_request(stores.robots, post_data, response_stream);
+					}
+					output_response(request, response_stream);
 				}
 			}
 
@@ -3,8 +3,15 @@
 
 #include <iostream>
 
+namespace Api {
+	class ResultCache;
+}
+
 namespace Worker {
 
+	class FastCgiServer;
+	class IndexRegistry;
+
 	struct Status {
 
 		size_t items;
@@ -15,7 +22,9 @@ namespace Worker {
 
 	struct Worker {
 
-		int socket_id;
+		FastCgiServer *server;
+		Api::ResultCache *result_cache;
+		IndexRegistry *registry;
 		int thread_id;
 
 	};
@@ -50,6 +50,8 @@ namespace Config {
 	vector<string> batches;
 	vector<string> link_batches;
 	size_t worker_count = 8;
+	size_t worker_queue_len = 64;
+	size_t result_cache_mb = 256;
 	size_t query_max_words = 10;
 	size_t query_max_len = 200;
 	size_t deduplicate_domain_count = 5;
@@ -61,6 +63,8 @@ namespace Config {
 	size_t shard_hash_table_size = 100000;
 	size_t html_parser_long_text_len = 1000;
 	size_t ft_shard_builder_buffer_len = 240000;
+	size_t indexer_merge_threads = 8;
+	size_t indexer_merge_memory_mb = 0;
 
 	size_t ft_num_shards = 2048;
 	size_t ft_max_sections = 8;
@@ -70,6 +74,7 @@ namespace Config {
 	size_t ft_num_threads_indexing = 24;
 	size_t ft_num_threads_merging = 24;
 	size_t ft_num_threads_appending = 8;
+	size_t ft_num_threads_intersection = 8;
 
 	double ft_cached_bytes_per_shard() {
 		return (ft_max_cache_gb * 1000ul*1000ul*1000ul) / (ft_num_shards * ft_num_threads_indexing);
@@ -126,6 +131,10 @@ namespace Config {
 				link_batches.push_back(parts[1]);
 			} else if (parts[0] == "worker_count") {
 				worker_count = stoi(parts[1]);
+			} else if (parts[0] == "worker_queue_len") {
+				worker_queue_len = stoi(parts[1]);
+			} else if (parts[0] == "result_cache_mb") {
+				result_cache_mb = stoi(parts[1]);
 			} else if (parts[0] == "query_max_words") {
 				query_max_words = stoi(parts[1]);
 			} else if (parts[0] == "query_max_len") {
@@ -146,12 +155,18 @@ namespace Config {
 				ft_section_depth = stoi(parts[1]);
 			} else if (parts[0] == "ft_max_cache_gb") {
 				ft_max_cache_gb = stoi(parts[1]);
+			} else if (parts[0] == "ft_num_threads_intersection") {
+				ft_num_threads_intersection = stoi(parts[1]);
 			} else if (parts[0] == "ft_num_threads_indexing") {
 				ft_num_threads_indexing = stoi(parts[1]);
 			} else if (parts[0] == "ft_num_threads_merging") {
 				ft_num_threads_merging = stoi(parts[1]);
 			} else if (parts[0] == "ft_num_threads_appending") {
 				ft_num_threads_appending = stoi(parts[1]);
+			} else if (parts[0] == "indexer_merge_threads") {
+				indexer_merge_threads = stoi(parts[1]);
+			} else if (parts[0] == "indexer_merge_memory_mb") {
+				indexer_merge_memory_mb = stoi(parts[1]);
 			} else if (parts[0] == "file_upload_user") {
 				file_upload_user = parts[1];
 			} else if (parts[0] == "file_upload_password") {
@@ -52,6 +52,10 @@ namespace Config {
 	extern std::vector<std::string> link_batches;
 
 	extern size_t worker_count;
+	// Number of search requests waiting for a worker before new requests are answered with 503.
+	extern size_t worker_queue_len;
+	// Size of the api response cache shared by the search workers, 0 disables the cache.
+	extern size_t result_cache_mb;
 	extern size_t query_max_words;
 	extern size_t query_max_len;
 	extern size_t deduplicate_domain_count;
@@ -63,6 +67,10 @@ namespace Config {
 	extern size_t shard_hash_table_size;
 	extern size_t html_parser_long_text_len;
 	extern size_t ft_shard_builder_buffer_len;
+	// Number of threads appending and merging index builders in indexer::merger.
+	extern size_t indexer_merge_threads;
+	// Memory budget for concurrent merges in indexer::merger, 0 means half of the total memory.
+	extern size_t indexer_merge_memory_mb;
 
 	/*
 		Constants only configurable at compilation time.
@@ -77,6 +85,7 @@ namespace Config {
 	extern size_t ft_num_threads_indexing;
 	extern size_t ft_num_threads_merging;
 	extern size_t ft_num_threads_appending;
+	extern size_t ft_num_threads_intersection;
 	double ft_cached_bytes_per_shard();
 
 	// Link indexer config
@@ -0,0 +1,91 @@
+/*
+ * MIT License
+ *
+ * Alexandria.org
+ *
+ * Copyright (c) 2021 Josef Cullhed, <info@alexandria.org>, et al.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "MemoryMappedFile.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace File {
+
+	MemoryMappedFile::MemoryMappedFile() {
+	}
+
+	MemoryMappedFile::MemoryMappedFile(const std::string &file_name) {
+		open(file_name);
+	}
+
+	MemoryMappedFile::~MemoryMappedFile() {
+		close();
+	}
+
+	bool MemoryMappedFile::open(const std::string &file_name) {
+
+		close();
+
+		int file_descriptor = ::open(file_name.c_str(), O_RDONLY);
+		if (file_descriptor < 0) return false;
+
+		struct stat file_stat;
+		if (fstat(file_descriptor, &file_stat) < 0 || file_stat.st_size == 0) {
+			::close(file_descriptor);
+			return false;
+		}
+
+		void *data = mmap(nullptr, file_stat.st_size, PROT_READ, MAP_SHARED, file_descriptor, 0);
+
+		// The mapping keeps its own reference to the file.
+		::close(file_descriptor);
+
+		if (data == MAP_FAILED) return false;
+
+		m_data = static_cast<char *>(data);
+		m_size = file_stat.st_size;
+
+		return true;
+	}
+
+	void MemoryMappedFile::close() {
+		if (m_data != nullptr) {
+			munmap(m_data, m_size);
+			m_data = nullptr;
+			m_size = 0;
+		}
+	}
+
+	void MemoryMappedFile::will_need(size_t offset, size_t len) const {
+		if (m_data == nullptr || offset >= m_size) return;
+
+		// madvise requires a page aligned address.
+		const size_t page_size = sysconf(_SC_PAGESIZE);
+		const size_t aligned_offset = offset - (offset % page_size);
+		if (offset + len > m_size) len = m_size - offset;
+
+		madvise(m_data + aligned_offset, len + (offset - aligned_offset), MADV_WILLNEED);
+	}
+
+}
@@ -0,0 +1,69 @@
+/*
+ * MIT License
+ *
+ * Alexandria.org
+ *
+ * Copyright (c) 2021 Josef Cullhed, <info@alexandria.org>, et al.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <iostream>
+
+namespace File {
+
+	/*
+		Read only memory mapping of a whole file. The mapping is kept until close() is called or the object is destroyed.
+	*/
+	class MemoryMappedFile {
+
+	public:
+
+		MemoryMappedFile();
+		explicit MemoryMappedFile(const std::string &file_name);
+		~MemoryMappedFile();
+
+		/*
+			Maps the file, returns false if the file could not be opened or is empty.
+		*/
+		bool open(const std::string &file_name);
+		void close();
+
+		bool is_open() const { return m_data != nullptr; }
+		const char *data() const { return m_data; }
+		size_t size() const { return m_size; }
+
+		/*
+			Hint the kernel that the range [offset, offset + len) will be read sequentially soon.
+		*/
+		void will_need(size_t offset, size_t len) const;
+
+	private:
+
+		MemoryMappedFile(const MemoryMappedFile &) = delete;
+		MemoryMappedFile &operator=(const MemoryMappedFile &) = delete;
+
+		char *m_data = nullptr;
+		size_t m_size = 0;
+
+	};
+
+}
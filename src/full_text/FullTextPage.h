@@ -0,0 +1,147 @@
+/*
+ * MIT License
+ *
+ * Alexandria.org
+ *
+ * Copyright (c) 2021 Josef Cullhed, <info@alexandria.org>, et al.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <iostream>
+#include <cstring>
+#include <algorithm>
+
+/*
+	Helpers for the page layout of the full text index. See documentation/index_file_format.md
+
+	Version 2 pages store the keys sorted ascending together with a fence table holding every fence_stride:th key. Lookups search the small
+	fence table first (interpolation search, the keys are hashes so they are close to uniformly distributed) and then binary search the
+	block of at most fence_stride keys. Version 1 pages have unsorted keys and no fence table.
+
+	Version 3 pages are laid out like version 2 pages but the records of each key are stored as a PostingBlock stream.
+*/
+namespace FullTextPage {
+
+	// Written after the hash table in the .keys file followed by the version of the pages in the .idx file. The marker is the same for all
+	// versions, only the version word changes.
+	const uint64_t format_magic = 0x32304B5446584C41ull; // "ALXFTK02"
+	const uint64_t format_version = 3;
+	const size_t fence_stride = 64;
+
+	inline size_t num_fences(size_t num_keys) {
+		return (num_keys + fence_stride - 1) / fence_stride;
+	}
+
+	inline uint64_t read_key(const char *keys, size_t i) {
+		uint64_t key;
+		memcpy(&key, keys + i * sizeof(uint64_t), sizeof(uint64_t));
+		return key;
+	}
+
+	/*
+		Returns the first index in [begin, end) where keys[index] >= key.
+	*/
+	inline size_t lower_bound(const char *keys, size_t begin, size_t end, uint64_t key) {
+		while (begin < end) {
+			const size_t middle = begin + ((end - begin) >> 1);
+			if (read_key(keys, middle) < key) {
+				begin = middle + 1;
+			} else {
+				end = middle;
+			}
+		}
+		return begin;
+	}
+
+	/*
+		Returns the first index in [begin, end) where keys[index] > key.
+	*/
+	inline size_t upper_bound(const char *keys, size_t begin, size_t end, uint64_t key) {
+		while (begin < end) {
+			const size_t middle = begin + ((end - begin) >> 1);
+			if (read_key(keys, middle) <= key) {
+				begin = middle + 1;
+			} else {
+				end = middle;
+			}
+		}
+		return begin;
+	}
+
+	/*
+		Returns the index of the last fence that is <= key or SIZE_MAX if key is smaller than the first fence.
+	*/
+	inline size_t find_fence(const char *fences, size_t num_fences, uint64_t key) {
+
+		if (num_fences == 0 || key < read_key(fences, 0)) return SIZE_MAX;
+
+		size_t low = 0;
+		size_t high = num_fences - 1;
+
+		// Interpolation steps, narrows down the range fast for uniformly distributed keys.
+		while (high - low > 8) {
+			const uint64_t low_key = read_key(fences, low);
+			const uint64_t high_key = read_key(fences, high);
+			if (key >= high_key) return high;
+			if (high_key == low_key) break;
+
+			const size_t guess = low + (size_t)((unsigned __int128)(key - low_key) * (high - low) / (high_key - low_key));
+			if (read_key(fences, guess) <= key) {
+				if (guess == low) break;
+				low = guess;
+			} else {
+				high = guess - 1;
+			}
+		}
+
+		// fences[low] <= key holds here, the remaining range is small.
+		return upper_bound(fences, low + 1, high + 1, key) - 1;
+	}
+
+	/*
+		Returns the position of the key in the sorted key list of a version 2 page or SIZE_MAX if the key is not present.
+	*/
+	inline size_t find_sorted(const char *fences, const char *keys, size_t num_keys, uint64_t key) {
+
+		const size_t fence = find_fence(fences, num_fences(num_keys), key);
+		if (fence == SIZE_MAX) return SIZE_MAX;
+
+		const size_t begin = fence * fence_stride;
+		const size_t end = std::min(begin + fence_stride, num_keys);
+		const size_t pos = lower_bound(keys, begin, end, key);
+
+		if (pos < end && read_key(keys, pos) == key) return pos;
+
+		return SIZE_MAX;
+	}
+
+	/*
+		Returns the position of the key in the unsorted key list of a version 1 page or SIZE_MAX if the key is not present.
+	*/
+	inline size_t find_unsorted(const char *keys, size_t num_keys, uint64_t key) {
+		for (size_t i = 0; i < num_keys; i++) {
+			if (read_key(keys, i) == key) return i;
+		}
+		return SIZE_MAX;
+	}
+
+}
@@ -27,11 +27,15 @@
 #pragma once
 
 #include "config.h"
+#include "PostingBlock.h"
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <new>
 #include <iostream>
 #include <span>
 #include <cassert>
+#include <cstring>
 
 template<typename DataRecord>
 class FullTextResultSet {
@@ -59,18 +63,39 @@ public:
 	}
 
 	void prepare_sections(const std::string &filename, size_t offset, size_t len);
+	void prepare_sections(const char *mapped_data, size_t len, bool compressed);
 	void read_to_section(size_t section);
 	bool has_next_section();
 	size_t num_sections();
 	void close_sections();
 	void copy_vector(const std::vector<DataRecord> &vec);
 
+	/*
+		Returns true if the result set reads its sections from PostingBlock blocks, then blocks() can be used to access the blocks
+		without decoding them.
+	*/
+	bool has_blocks() const { return m_compressed; }
+	const std::vector<PostingBlock::block_ref> &blocks();
+
+	/*
+		Gives the memory holding records after the first keep_records back to the kernel. The records there are lost. Large result sets
+		only reserve address space when they are created and the pages are allocated when they are first written, so calling this after
+		every query makes the memory follow the size of the results instead of the largest query served so far.
+	*/
+	void release_memory(size_t keep_records);
+
 private:
 
+	// Result sets larger than this are allocated with mmap so they can be released with madvise.
+	static const size_t mmap_threshold = 64*1024;
+
+	void read_blocks(size_t read_end);
+
 	FullTextResultSet(const FullTextResultSet &res) = delete;
 
 	std::span<DataRecord> m_span;
 	DataRecord *m_data_pointer;
+	bool m_mmapped = false;
 
 	size_t m_size; // The length in first section.
 	const size_t m_max_size; // The maximum number of elements the result set can hold.
@@ -79,6 +104,11 @@ private:
 	size_t m_section_len;
 	size_t m_records_read;
 	int m_file_descriptor;
+	const char *m_mapped_data = nullptr; // Points into a memory mapped index file when sections are read from a mapping.
+	bool m_compressed = false; // True if m_mapped_data holds a PostingBlock stream.
+	size_t m_mapped_pos = 0; // Position of the next block to decode in m_mapped_data.
+	size_t m_mapped_len = 0;
+	std::vector<PostingBlock::block_ref> m_blocks;
 	bool m_error = false;
 
 };
@@ -88,13 +118,36 @@ FullTextResultSet<DataRecord>::FullTextResultSet(size_t size)
 : m_size(size), m_max_size(size), m_total_num_results(0)
 {
 	m_file_descriptor = -1;
-	m_data_pointer = new DataRecord[size];
+	if (size * sizeof(DataRecord) >= mmap_threshold) {
+		void *data = mmap(nullptr, size * sizeof(DataRecord), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (data == MAP_FAILED) throw std::bad_alloc();
+		m_data_pointer = static_cast<DataRecord *>(data);
+		m_mmapped = true;
+	} else {
+		m_data_pointer = new DataRecord[size];
+	}
 	m_span = std::span<DataRecord>(m_data_pointer, size);
 }
 
 template<typename DataRecord>
 FullTextResultSet<DataRecord>::~FullTextResultSet() {
-	delete []m_data_pointer;
+	if (m_mmapped) {
+		munmap(m_data_pointer, m_max_size * sizeof(DataRecord));
+	} else {
+		delete []m_data_pointer;
+	}
+}
+
+template<typename DataRecord>
+void FullTextResultSet<DataRecord>::release_memory(size_t keep_records) {
+	if (!m_mmapped) return;
+
+	const size_t page_size = sysconf(_SC_PAGESIZE);
+	const size_t total_bytes = m_max_size * sizeof(DataRecord);
+	const size_t keep_bytes = (std::min(keep_records, m_max_size) * sizeof(DataRecord) + page_size - 1) / page_size * page_size;
+	if (keep_bytes >= total_bytes) return;
+
+	madvise((char *)m_data_pointer + keep_bytes, total_bytes - keep_bytes, MADV_DONTNEED);
 }
 
 template<typename DataRecord>
@@ -118,6 +171,42 @@ void FullTextResultSet<DataRecord>::prepare_sections(const std::string &filename
 	resize(m_size);
 }
 
+/*
+	Prepares the sections to be read from an already memory mapped file. The data pointer has to stay valid until close_sections is called.
+	If compressed is true the data is a PostingBlock stream.
+*/
+template<typename DataRecord>
+void FullTextResultSet<DataRecord>::prepare_sections(const char *mapped_data, size_t len, bool compressed) {
+
+	assert(m_file_descriptor < 0);
+
+	m_compressed = false;
+	m_blocks.clear();
+	m_mapped_data = mapped_data;
+	m_mapped_len = len;
+	m_mapped_pos = 0;
+	m_size = len / sizeof(DataRecord);
+
+	if (compressed) {
+		m_size = len >= sizeof(uint64_t) ? PostingBlock::stream_records(mapped_data) : 0;
+		m_mapped_pos = sizeof(uint64_t);
+		m_compressed = len >= sizeof(uint64_t) && !PostingBlock::stream_is_raw(mapped_data);
+		if (!m_compressed) {
+			// Raw streams hold the records directly after the header.
+			m_mapped_data += sizeof(uint64_t);
+			m_mapped_len -= std::min(m_mapped_len, sizeof(uint64_t));
+			m_size = std::min(m_size, m_mapped_len / sizeof(DataRecord));
+		}
+	}
+
+	if (m_size > m_max_size) m_size = m_max_size;
+	m_total_size = m_size;
+	if (m_size > Config::ft_max_results_per_section) m_size = Config::ft_max_results_per_section;
+
+	m_records_read = 0;
+	resize(m_size);
+}
+
 /*
 	Reads data up to and includint the section. So if the argument section equals zero the first section is read.
 */
@@ -131,6 +220,19 @@ void FullTextResultSet<DataRecord>::read_to_section(size_t section) {
 
 	size_t records_to_read = read_end - read_start;
 
+	if (m_compressed) {
+		read_blocks(read_end);
+		return;
+	}
+
+	if (m_mapped_data != nullptr) {
+		memcpy((void *)&m_data_pointer[m_records_read], &m_mapped_data[m_records_read * sizeof(DataRecord)],
+			records_to_read * sizeof(DataRecord));
+		m_error = false;
+		m_records_read += records_to_read;
+		return;
+	}
+
 	int bytes_read = ::read(m_file_descriptor, (void *)&m_data_pointer[m_records_read], (size_t)records_to_read * sizeof(DataRecord));
 	if (bytes_read < 0) {
 		m_error = true;
@@ -142,7 +244,7 @@ void FullTextResultSet<DataRecord>::read_to_section(size_t section) {
 
 template<typename DataRecord>
 bool FullTextResultSet<DataRecord>::has_next_section() {
-	if (m_file_descriptor < 0) return false;
+	if (m_file_descriptor < 0 && m_mapped_data == nullptr) return false;
 	return m_total_size > m_records_read;
 }
 
@@ -158,6 +260,73 @@ void FullTextResultSet<DataRecord>::close_sections() {
 		close(m_file_descriptor);
 		m_file_descriptor = -1;
 	}
+	m_mapped_data = nullptr;
+	m_compressed = false;
+}
+
+/*
+	Reads the headers of all blocks in the stream, the block directory is kept until the next call to prepare_sections.
+*/
+template<typename DataRecord>
+const std::vector<PostingBlock::block_ref> &FullTextResultSet<DataRecord>::blocks() {
+	if (!m_compressed || m_blocks.size()) return m_blocks;
+
+	size_t pos = sizeof(uint64_t);
+	size_t records = 0;
+	while (records < m_total_size && pos + sizeof(uint64_t) <= m_mapped_len) {
+		const char *block = m_mapped_data + pos;
+		const size_t block_size = PostingBlock::block_size<DataRecord>(block);
+		if (pos + block_size > m_mapped_len) break;
+
+		const size_t num_records = PostingBlock::block_records(block);
+		m_blocks.push_back(PostingBlock::block_ref{
+			.data = block,
+			.section = records / Config::ft_max_results_per_section,
+			.num_records = std::min(num_records, m_total_size - records),
+			.first_value = PostingBlock::block_first_value(block),
+			.max_score = PostingBlock::block_max_score(block)
+		});
+
+		records += num_records;
+		pos += block_size;
+	}
+
+	return m_blocks;
+}
+
+/*
+	Decodes blocks until at least read_end records are read. The builder starts a new block at every section so this stops at the section
+	boundary unless the index was built with another section length.
+*/
+template<typename DataRecord>
+void FullTextResultSet<DataRecord>::read_blocks(size_t read_end) {
+	m_error = false;
+	while (m_records_read < read_end) {
+		if (m_mapped_pos + sizeof(uint64_t) > m_mapped_len) {
+			m_error = true;
+			break;
+		}
+		const char *block = m_mapped_data + m_mapped_pos;
+		const size_t block_records = PostingBlock::block_records(block);
+		if (m_mapped_pos + PostingBlock::block_size<DataRecord>(block) > m_mapped_len) {
+			m_error = true;
+			break;
+		}
+
+		if (m_records_read + block_records <= m_max_size) {
+			m_mapped_pos += PostingBlock::decode_block(block, &m_data_pointer[m_records_read]);
+			m_records_read += block_records;
+		} else {
+			// The last block does not fit, only keep the records we have room for.
+			DataRecord records[PostingBlock::block_len];
+			m_mapped_pos += PostingBlock::decode_block(block, records);
+			const size_t to_copy = m_max_size - m_records_read;
+			memcpy((void *)&m_data_pointer[m_records_read], records, to_copy * sizeof(DataRecord));
+			m_records_read += to_copy;
+			break;
+		}
+	}
+	if (m_records_read > m_total_size) m_records_read = m_total_size;
 }
 
 template<typename DataRecord>
@@ -34,12 +34,16 @@
 #include <fstream>
 #include <algorithm>
 #include <cstring>
+#include <mutex>
+#include <atomic>
 
 template<typename DataRecord> class FullTextShard;
 
 #include "FullTextIndex.h"
 #include "FullTextResultSet.h"
+#include "FullTextPage.h"
 
+#include "file/MemoryMappedFile.h"
 #include "logger/logger.h"
 #include "system/Profiler.h"
 
@@ -47,11 +51,18 @@ template<typename DataRecord> class FullTextShard;
 File format explained
 
 8 bytes = unsigned int number of keys = num_keys
-8 bytes * num_keys = list of keys
+8 bytes * ceil(num_keys / FullTextPage::fence_stride) = fence table (only in version 2)
+8 bytes * num_keys = list of keys (sorted in version 2)
 8 bytes * num_keys = list of positions in file counted from data start
 8 bytes * num_keys = list of lengths
-[DATA]
+8 bytes * num_keys = list of total number of results
+[DATA] (one PostingBlock stream per key in version 3)
 
+The version is read from the marker after the hash table in the .keys file, files without the marker are version 1.
+
+The .keys and .idx files are memory mapped the first time the shard is searched and stay mapped until the shard is destroyed.
+FullTextShardBuilder never rewrites the files in place, it writes new files and renames them over the old ones, so a mapping keeps
+reading the files it mapped and new data is seen by shards created after the rename.
 */
 
 template<typename DataRecord>
@@ -63,7 +74,8 @@ public:
 	~FullTextShard();
 
 	void find(uint64_t key, FullTextResultSet<DataRecord> *result_set) const;
-	size_t read_key_pos(std::ifstream &reader, uint64_t key) const;
+	void prefetch(uint64_t key) const;
+	size_t read_key_pos(uint64_t key) const;
 	size_t total_num_results(uint64_t key) const;
 
 	std::string mountpoint() const;
@@ -76,8 +88,23 @@ public:
 
 private:
 
+	struct page_entry {
+		size_t data_pos; // Absolute position of the data in the .idx file.
+		size_t len;
+		size_t total_num_results;
+	};
+
 	std::string m_db_name;
 	size_t m_shard_id;
+
+	mutable File::MemoryMappedFile m_key_file;
+	mutable File::MemoryMappedFile m_data_file;
+	mutable std::mutex m_map_lock;
+	mutable std::atomic<bool> m_mapped = false;
+	mutable uint64_t m_format_version = 1;
+
+	bool map_files() const;
+	bool read_page_entry(uint64_t key, page_entry &entry) const;
 	
 };
 
@@ -93,91 +120,47 @@ FullTextShard<DataRecord>::~FullTextShard() {
 template<typename DataRecord>
 void FullTextShard<DataRecord>::find(uint64_t key, FullTextResultSet<DataRecord> *result_set) const {
 
-	std::ifstream reader(filename(), std::ios::binary);
-
-	size_t key_pos = read_key_pos(reader, key);
-
-	if (key_pos == SIZE_MAX) {
-		result_set->resize(0);
-		return;
-	}
-
-	// Read page.
-	Profiler::instance prof2("read keys");
-	reader.seekg(key_pos);
-
-	size_t num_keys;
-	reader.read((char *)&num_keys, sizeof(size_t));
-
-
-	LOG_INFO("num keys: " + std::to_string(num_keys));
-
-	uint64_t *keys = new uint64_t[num_keys];
-
-	reader.read((char *)keys, num_keys * sizeof(uint64_t));
-
-	prof2.stop();
-
-	Profiler::instance prof3("find key");
-
-	size_t key_data_pos = SIZE_MAX;
-	for (size_t i = 0; i < num_keys; i++) {
-		if (keys[i] == key) {
-			key_data_pos = i;
-		}
-	}
-
-	if (key_data_pos == SIZE_MAX) {
+	page_entry entry;
+	if (!read_page_entry(key, entry)) {
 		result_set->resize(0);
 		return;
 	}
 
-	prof3.stop();
-
-	char buffer[64];
-
-	Profiler::instance prof4("read data");
+	Profiler::instance prof("read data");
 
-	// Read position and length.
-	reader.seekg(key_pos + 8 + num_keys * 8 + key_data_pos * 8, std::ios::beg);
-	reader.read(buffer, 8);
-	size_t pos = *((size_t *)(&buffer[0]));
+	m_data_file.will_need(entry.data_pos, std::min(entry.len, Config::ft_max_results_per_section * sizeof(DataRecord)));
 
-	reader.seekg(key_pos + 8 + (num_keys * 8)*2 + key_data_pos * 8, std::ios::beg);
-	reader.read(buffer, 8);
-	size_t len = *((size_t *)(&buffer[0]));
-
-	reader.seekg(key_pos + 8 + (num_keys * 8)*3 + key_data_pos * 8, std::ios::beg);
-	reader.read(buffer, 8);
-	size_t total_num_results = *((size_t *)(&buffer[0]));
+	result_set->prepare_sections(m_data_file.data() + entry.data_pos, entry.len, m_format_version >= 3);
+	result_set->read_to_section(0);
+	result_set->set_total_num_results(entry.total_num_results);
+}
 
-	reader.seekg(key_pos + 8 + (num_keys * 8)*4 + pos, std::ios::beg);
+/*
+ * Reads the page header for the key and asks the kernel to start reading its data, so a later find() does not have to wait for the disk.
+ * */
+template<typename DataRecord>
+void FullTextShard<DataRecord>::prefetch(uint64_t key) const {
 
-	size_t num_records = len / sizeof(DataRecord);
-	if (num_records > Config::ft_max_results_per_section) num_records = Config::ft_max_results_per_section;
+	page_entry entry;
+	if (!read_page_entry(key, entry)) return;
 
-	result_set->prepare_sections(filename(), (size_t)reader.tellg(), len);
-	result_set->read_to_section(0);
-	result_set->resize(num_records);
-	result_set->set_total_num_results(total_num_results);
+	m_data_file.will_need(entry.data_pos, std::min(entry.len, Config::ft_max_sections * Config::ft_max_results_per_section * sizeof(DataRecord)));
 }
 
 /*
  * Reads the exact position of the key, returns SIZE_MAX if the key was not found.
  * */
 template<typename DataRecord>
-size_t FullTextShard<DataRecord>::read_key_pos(std::ifstream &reader, uint64_t key) const {
+size_t FullTextShard<DataRecord>::read_key_pos(uint64_t key) const {
 
-	Profiler::instance prof1("read_key_pos " + key_filename());
+	if (!map_files()) return SIZE_MAX;
 
 	const size_t hash_pos = key % Config::shard_hash_table_size;
 
-	std::ifstream key_reader(key_filename(), std::ios::binary);
-
-	key_reader.seekg(hash_pos * sizeof(size_t));
+	if ((hash_pos + 1) * sizeof(size_t) > m_key_file.size()) return SIZE_MAX;
 
 	size_t pos;
-	key_reader.read((char *)&pos, sizeof(size_t));
+	memcpy(&pos, m_key_file.data() + hash_pos * sizeof(size_t), sizeof(size_t));
 
 	return pos;
 }
@@ -185,42 +168,12 @@ size_t FullTextShard<DataRecord>::read_key_pos(std::ifstream &reader, uint64_t k
 template<typename DataRecord>
 size_t FullTextShard<DataRecord>::total_num_results(uint64_t key) const {
 
-	std::ifstream reader(filename(), std::ios::binary);
-
-	size_t key_pos = read_key_pos(reader, key);
-
-	if (key_pos == SIZE_MAX) {
+	page_entry entry;
+	if (!read_page_entry(key, entry)) {
 		return 0;
 	}
 
-	// Read page.
-	reader.seekg(key_pos);
-
-	size_t num_keys;
-	reader.read((char *)&num_keys, sizeof(size_t));
-
-	uint64_t *keys = new uint64_t[num_keys];
-
-	reader.read((char *)keys, num_keys * sizeof(uint64_t));
-
-	size_t key_data_pos = SIZE_MAX;
-	for (size_t i = 0; i < num_keys; i++) {
-		if (keys[i] == key) {
-			key_data_pos = i;
-		}
-	}
-
-	if (key_data_pos == SIZE_MAX) {
-		return 0;
-	}
-
-	char buffer[64];
-
-	reader.seekg(key_pos + 8 + (num_keys * 8)*3 + key_data_pos * 8, std::ios::beg);
-	reader.read(buffer, 8);
-	size_t total_num_results = *((size_t *)(&buffer[0]));
-
-	return total_num_results;
+	return entry.total_num_results;
 }
 
 template<typename DataRecord>
@@ -257,3 +210,90 @@ bool FullTextShard<DataRecord>::empty() const {
 	return disk_size() == 0;
 }
 
+/*
+ * Maps the key and data files if they are not already mapped. Returns false if the shard has no data on disk, in that case we try again on
+ * the next lookup since the shard can be written after the server has started.
+ * */
+template<typename DataRecord>
+bool FullTextShard<DataRecord>::map_files() const {
+
+	if (m_mapped) return true;
+
+	std::lock_guard lock(m_map_lock);
+
+	if (m_mapped) return true;
+
+	if (!m_key_file.open(key_filename())) return false;
+	if (!m_data_file.open(filename())) {
+		m_key_file.close();
+		return false;
+	}
+
+	m_format_version = 1;
+	const size_t marker_pos = Config::shard_hash_table_size * sizeof(uint64_t);
+	if (m_key_file.size() >= marker_pos + 2 * sizeof(uint64_t)) {
+		if (FullTextPage::read_key(m_key_file.data() + marker_pos, 0) == FullTextPage::format_magic) {
+			m_format_version = FullTextPage::read_key(m_key_file.data() + marker_pos, 1);
+		}
+	}
+
+	m_mapped = true;
+
+	return true;
+}
+
+/*
+ * Finds the key in its page and reads position, length and total number of results. Returns false if the key is not present.
+ * */
+template<typename DataRecord>
+bool FullTextShard<DataRecord>::read_page_entry(uint64_t key, page_entry &entry) const {
+
+	const size_t key_pos = read_key_pos(key);
+
+	if (key_pos == SIZE_MAX) return false;
+
+	const char *data = m_data_file.data();
+	const size_t data_size = m_data_file.size();
+
+	if (key_pos + sizeof(size_t) > data_size) return false;
+
+	size_t num_keys;
+	memcpy(&num_keys, data + key_pos, sizeof(size_t));
+
+	if (num_keys > data_size) {
+		LOG_ERROR("Corrupt page at " + std::to_string(key_pos) + " in " + filename());
+		return false;
+	}
+
+	const size_t fences_pos = key_pos + sizeof(size_t);
+	const size_t num_fences = m_format_version >= 2 ? FullTextPage::num_fences(num_keys) : 0;
+	const size_t keys_pos = fences_pos + num_fences * sizeof(uint64_t);
+	const size_t header_len = num_keys * sizeof(uint64_t) * 4;
+	if (keys_pos + header_len > data_size) {
+		LOG_ERROR("Corrupt page at " + std::to_string(key_pos) + " in " + filename());
+		return false;
+	}
+
+	size_t key_data_pos;
+	if (m_format_version >= 2) {
+		key_data_pos = FullTextPage::find_sorted(data + fences_pos, data + keys_pos, num_keys, key);
+	} else {
+		key_data_pos = FullTextPage::find_unsorted(data + keys_pos, num_keys, key);
+	}
+
+	if (key_data_pos == SIZE_MAX) return false;
+
+	size_t pos;
+	memcpy(&pos, data + keys_pos + (num_keys + key_data_pos) * sizeof(uint64_t), sizeof(size_t));
+	memcpy(&entry.len, data + keys_pos + (num_keys * 2 + key_data_pos) * sizeof(uint64_t), sizeof(size_t));
+	memcpy(&entry.total_num_results, data + keys_pos + (num_keys * 3 + key_data_pos) * sizeof(uint64_t), sizeof(size_t));
+
+	entry.data_pos = keys_pos + header_len + pos;
+
+	if (entry.data_pos + entry.len > data_size) {
+		LOG_ERROR("Data outside of file for key " + std::to_string(key) + " in " + filename());
+		return false;
+	}
+
+	return true;
+}
@@ -32,6 +32,9 @@
 #include <vector>
 #include <fstream>
 #include <algorithm>
+#include <cstdio>
+#include <functional>
+#include <queue>
 
 template<typename DataRecord> class FullTextShardBuilder;
 
@@ -39,6 +42,8 @@ template<typename DataRecord> class FullTextShardBuilder;
 #include "FullTextIndex.h"
 #include "parser/URL.h"
 #include "FullTextRecord.h"
+#include "FullTextPage.h"
+#include "PostingBlock.h"
 #include "UrlToDomain.h"
 #include "logger/logger.h"
 
@@ -89,13 +94,49 @@ private:
 	std::map<uint64_t, std::vector<DataRecord>> m_cache;
 	std::map<uint64_t, size_t> m_total_results;
 
-	void read_append_cache();
+	// Number of cache records sorted in memory at a time by merge(), every batch is written to a run file.
+	const size_t m_merge_run_len = 4000000;
+	// Number of records buffered per run while the runs are merged.
+	const size_t m_merge_read_len = 65536;
+
+	struct cache_entry {
+		uint64_t key;
+		DataRecord record;
+	};
+
+	/*
+		A sorted stream of cache entries, refill loads the next batch and returns false when the stream is done.
+	*/
+	struct entry_stream {
+		std::vector<cache_entry> entries;
+		size_t pos = 0;
+		std::function<bool(std::vector<cache_entry> &)> refill;
+
+		const cache_entry *peek() {
+			while (pos == entries.size()) {
+				entries.clear();
+				pos = 0;
+				if (!refill(entries)) return nullptr;
+			}
+			return &entries[pos];
+		}
+	};
+
+	static bool merge_order(uint64_t key_a, const DataRecord &a, uint64_t key_b, const DataRecord &b);
+	void merge_cache_files();
+	std::vector<std::string> write_sorted_runs();
+	bool read_target_page(std::ifstream &reader, uint64_t format_version, size_t page_pos, std::vector<cache_entry> &entries);
+	void finish_merged_key(uint64_t key, std::vector<DataRecord> &records, size_t total, bool is_heap);
+	std::string run_filename(size_t run) const;
 	void read_data_to_cache();
-	bool read_page(std::ifstream &reader);
+	bool read_page(std::ifstream &reader, uint64_t format_version);
+	uint64_t read_format_version() const;
 	void save_file();
+	void replace_target_files();
 	void write_key(std::ofstream &key_writer, uint64_t key, size_t page_pos);
-	size_t write_page(std::ofstream &writer, const std::vector<uint64_t> &keys);
+	size_t write_page(std::ofstream &writer, std::vector<uint64_t> &keys);
 	void reset_key_file(std::ofstream &key_writer);
+	void write_format_version(std::ofstream &key_writer);
 	void order_sections_by_value(std::vector<DataRecord> &results) const;
 
 };
@@ -208,23 +249,229 @@ void FullTextShardBuilder<DataRecord>::append() {
 template<typename DataRecord>
 void FullTextShardBuilder<DataRecord>::merge() {
 
-	read_append_cache();
-	sort_cache();
-	save_file();
+	merge_cache_files();
 	truncate_cache_files();
 
 }
 
+/*
+ * Orders cache entries by hash table page, then key and then value. That is the order the merge visits them in.
+ * */
+template<typename DataRecord>
+bool FullTextShardBuilder<DataRecord>::merge_order(uint64_t key_a, const DataRecord &a, uint64_t key_b, const DataRecord &b) {
+	const uint64_t page_a = key_a % Config::shard_hash_table_size;
+	const uint64_t page_b = key_b % Config::shard_hash_table_size;
+	if (page_a != page_b) return page_a < page_b;
+	if (key_a != key_b) return key_a < key_b;
+	return a.m_value < b.m_value;
+}
+
+/*
+ * Merges the cache files into the shard without holding more than one page of the shard in memory.
+ *
+ * The cache files are cut into sorted runs of at most m_merge_run_len records. The runs and the pages of the current shard (read in hash
+ * table order) are then merged by a k-way merge that visits every key once, with its records ordered by value. Duplicate values are
+ * skipped and the records with the highest scores are kept in a heap of at most ft_max_results_per_section * ft_max_sections records, so
+ * the result is the same as sort_cache on the whole shard. The new shard is written page by page to temporary files that replace the
+ * shard when the merge is done.
+ * */
 template<typename DataRecord>
-void FullTextShardBuilder<DataRecord>::read_append_cache() {
+void FullTextShardBuilder<DataRecord>::merge_cache_files() {
 
 	m_cache.clear();
 	m_total_results.clear();
 
-	// Read the current file.
-	read_data_to_cache();
+	const std::vector<std::string> run_files = write_sorted_runs();
+
+	std::vector<entry_stream> streams(run_files.size() + 1);
+
+	// Stream 0 is the current shard. Pages are read in hash table order using the positions in the key file.
+	std::ifstream target_reader(target_filename(), std::ios::binary);
+	const uint64_t format_version = read_format_version();
+	std::vector<uint64_t> page_positions;
+	{
+		std::ifstream key_reader(key_filename(), std::ios::binary);
+		if (target_reader.is_open() && key_reader.is_open()) {
+			page_positions.resize(Config::shard_hash_table_size, SIZE_MAX);
+			key_reader.read((char *)page_positions.data(), page_positions.size() * sizeof(uint64_t));
+			page_positions.resize(key_reader.gcount() / sizeof(uint64_t));
+		}
+	}
+
+	m_buffer = new char[m_buffer_len];
+
+	size_t next_page = 0;
+	streams[0].refill = [this, &target_reader, format_version, &page_positions, &next_page](std::vector<cache_entry> &entries) {
+		while (next_page < page_positions.size()) {
+			const uint64_t page_pos = page_positions[next_page++];
+			if (page_pos == SIZE_MAX) continue;
+			if (!read_target_page(target_reader, format_version, page_pos, entries)) return false;
+			if (entries.size()) return true;
+		}
+		return false;
+	};
+
+	std::vector<std::ifstream> run_readers;
+	for (const std::string &run_file : run_files) {
+		run_readers.emplace_back(run_file, std::ios::binary);
+	}
+	for (size_t i = 0; i < run_readers.size(); i++) {
+		std::ifstream *reader = &run_readers[i];
+		const size_t read_len = m_merge_read_len;
+		streams[i + 1].refill = [reader, read_len](std::vector<cache_entry> &entries) {
+			entries.resize(read_len);
+			reader->read((char *)entries.data(), read_len * sizeof(cache_entry));
+			entries.resize(reader->gcount() / sizeof(cache_entry));
+			return entries.size() > 0;
+		};
+	}
+
+	// Heads of the streams, ties are taken from the stream with the lowest index so records in the shard win over the cache.
+	auto later = [&streams](size_t a, size_t b) {
+		const cache_entry *ea = streams[a].peek();
+		const cache_entry *eb = streams[b].peek();
+		if (merge_order(eb->key, eb->record, ea->key, ea->record)) return true;
+		if (merge_order(ea->key, ea->record, eb->key, eb->record)) return false;
+		return a > b;
+	};
+	std::priority_queue<size_t, std::vector<size_t>, decltype(later)> heads(later);
+	for (size_t i = 0; i < streams.size(); i++) {
+		if (streams[i].peek() != nullptr) heads.push(i);
+	}
+
+	std::ofstream writer(target_filename() + ".tmp", std::ios::binary | std::ios::trunc);
+	if (!writer.is_open()) {
+		throw LOG_ERROR_EXCEPTION("Could not open full text shard. Error: " + std::string(strerror(errno)));
+	}
+
+	std::ofstream key_writer(key_filename() + ".tmp", std::ios::binary | std::ios::trunc);
+	if (!key_writer.is_open()) {
+		throw LOG_ERROR_EXCEPTION("Could not open full text shard. Error: " + std::string(strerror(errno)));
+	}
+
+	reset_key_file(key_writer);
+	write_format_version(key_writer);
+
+	const size_t max_results = Config::ft_max_results_per_section * Config::ft_max_sections;
+	auto higher_score = [](const DataRecord &a, const DataRecord &b) {
+		return a.m_score > b.m_score;
+	};
+
+	// The page being built, written when the merge moves on to the next page.
+	std::map<uint64_t, std::vector<DataRecord>> page;
+	std::map<uint64_t, size_t> page_totals;
+	auto write_current_page = [this, &page, &page_totals, &writer, &key_writer]() {
+		if (page.empty()) return;
+		const uint64_t page_id = page.begin()->first % Config::shard_hash_table_size;
+		std::vector<uint64_t> keys;
+		for (const auto &iter : page) keys.push_back(iter.first);
+		m_cache.swap(page);
+		m_total_results.swap(page_totals);
+		const size_t page_pos = write_page(writer, keys);
+		write_key(key_writer, page_id, page_pos);
+		m_cache.clear();
+		m_total_results.clear();
+		page.clear();
+		page_totals.clear();
+	};
+
+	bool has_key = false;
+	uint64_t current_key = 0;
+	uint64_t last_value = 0;
+	size_t total = 0;
+	bool is_heap = false;
+	std::vector<DataRecord> records;
+
+	auto finish_key = [&]() {
+		finish_merged_key(current_key, records, total, is_heap);
+		page_totals[current_key] = total;
+		page[current_key].swap(records);
+		records.clear();
+	};
+
+	while (!heads.empty()) {
+		const size_t stream_id = heads.top();
+		heads.pop();
+
+		const cache_entry entry = *streams[stream_id].peek();
+		streams[stream_id].pos++;
+		if (streams[stream_id].peek() != nullptr) heads.push(stream_id);
+
+		if (has_key && entry.key == current_key && entry.record.m_value == last_value) continue;
+
+		if (!has_key || entry.key != current_key) {
+			if (has_key) {
+				finish_key();
+				if (entry.key % Config::shard_hash_table_size != current_key % Config::shard_hash_table_size) write_current_page();
+			}
+			has_key = true;
+			current_key = entry.key;
+			total = 0;
+			is_heap = false;
+		}
+
+		last_value = entry.record.m_value;
+		total++;
+
+		if (!is_heap) {
+			records.push_back(entry.record);
+			if (records.size() > max_results) {
+				// From here only the max_results records with the highest scores are kept, the lowest score is first in the heap.
+				std::make_heap(records.begin(), records.end(), higher_score);
+				std::pop_heap(records.begin(), records.end(), higher_score);
+				records.pop_back();
+				is_heap = true;
+			}
+		} else if (entry.record.m_score > records.front().m_score) {
+			std::pop_heap(records.begin(), records.end(), higher_score);
+			records.back() = entry.record;
+			std::push_heap(records.begin(), records.end(), higher_score);
+		}
+	}
+
+	if (has_key) {
+		finish_key();
+		write_current_page();
+	}
+
+	delete [] m_buffer;
+	m_buffer = nullptr;
+
+	writer.close();
+	key_writer.close();
+	target_reader.close();
+	run_readers.clear();
+
+	for (const std::string &run_file : run_files) {
+		std::remove(run_file.c_str());
+	}
+
+	replace_target_files();
+}
+
+/*
+ * Gives the records of a merged key the same layout as sort_cache. records holds the unique records in value order unless is_heap is
+ * true, then it holds the max_results records with the highest scores.
+ * */
+template<typename DataRecord>
+void FullTextShardBuilder<DataRecord>::finish_merged_key(uint64_t key, std::vector<DataRecord> &records, size_t total, bool is_heap) {
+
+	if (total <= Config::ft_max_results_per_section && !is_heap) return;
+
+	std::sort(records.begin(), records.end(), [](const DataRecord &a, const DataRecord &b) {
+		return a.m_score > b.m_score;
+	});
+
+	order_sections_by_value(records);
+}
+
+/*
+ * Reads the cache files in batches of m_merge_run_len records, sorts every batch in merge order and writes it to a run file. Returns the
+ * names of the run files.
+ * */
+template<typename DataRecord>
+std::vector<std::string> FullTextShardBuilder<DataRecord>::write_sorted_runs() {
 
-	// Read the cache into memory.
 	std::ifstream reader(cache_filename(), std::ios::binary);
 	if (!reader.is_open()) {
 		throw LOG_ERROR_EXCEPTION("Could not open full text shard (" + cache_filename() + "). Error: " + std::string(strerror(errno)));
@@ -235,45 +482,76 @@ void FullTextShardBuilder<DataRecord>::read_append_cache() {
 		throw LOG_ERROR_EXCEPTION("Could not open full text shard (" + key_cache_filename() + "). Error: " + std::string(strerror(errno)));
 	}
 
-	const size_t buffer_len = 100000;
-	const size_t buffer_size = sizeof(DataRecord) * buffer_len;
-	const size_t key_buffer_size = sizeof(uint64_t) * buffer_len;
-	char *buffer;
-	char *key_buffer;
-	try {
-		buffer = new char[buffer_size];
-	} catch (std::bad_alloc &exception) {
-		std::cout << "bad_alloc detected: " << exception.what() << " file: " << __FILE__ << " line: " << __LINE__ << std::endl;
-		std::cout << "tried to allocate: " << buffer_size << " bytes" << std::endl;
-		return;
-	}
-	try {
-		key_buffer = new char[key_buffer_size];
-	} catch (std::bad_alloc &exception) {
-		std::cout << "bad_alloc detected: " << exception.what() << " file: " << __FILE__ << " line: " << __LINE__ << std::endl;
-		std::cout << "tried to allocate: " << key_buffer_size << " bytes" << std::endl;
-		return;
-	}
+	std::vector<std::string> run_files;
 
-	reader.seekg(0, std::ios::beg);
+	const size_t read_len = 100000;
+	std::vector<DataRecord> records(read_len);
+	std::vector<uint64_t> keys(read_len);
+	std::vector<cache_entry> run;
 
-	while (!reader.eof()) {
+	bool done = false;
+	while (!done) {
 
-		reader.read(buffer, buffer_size);
-		key_reader.read(key_buffer, key_buffer_size);
+		reader.read((char *)records.data(), read_len * sizeof(DataRecord));
+		key_reader.read((char *)keys.data(), read_len * sizeof(uint64_t));
 
-		const size_t read_bytes = reader.gcount();
-		const size_t num_records = read_bytes / sizeof(DataRecord);
+		const size_t num_records = std::min(reader.gcount() / sizeof(DataRecord), key_reader.gcount() / sizeof(uint64_t));
+		done = num_records < read_len;
 
 		for (size_t i = 0; i < num_records; i++) {
-			const DataRecord *record = (DataRecord *)&buffer[i * sizeof(DataRecord)];
-			const uint64_t key = *((uint64_t *)&key_buffer[i * sizeof(uint64_t)]);
-			m_cache[key].push_back(*record);
+			run.push_back(cache_entry{keys[i], records[i]});
+		}
+
+		if (run.size() >= m_merge_run_len || (done && run.size())) {
+			std::stable_sort(run.begin(), run.end(), [](const cache_entry &a, const cache_entry &b) {
+				return merge_order(a.key, a.record, b.key, b.record);
+			});
+
+			run_files.push_back(run_filename(run_files.size()));
+			std::ofstream run_writer(run_files.back(), std::ios::binary | std::ios::trunc);
+			if (!run_writer.is_open()) {
+				throw LOG_ERROR_EXCEPTION("Could not open run file (" + run_files.back() + "). Error: " + std::string(strerror(errno)));
+			}
+			run_writer.write((const char *)run.data(), run.size() * sizeof(cache_entry));
+
+			run.clear();
 		}
 	}
 
-	delete [] key_buffer;
-	delete [] buffer;
+	return run_files;
+}
+
+/*
+ * Reads the page at page_pos of the shard and appends its records to entries in merge order.
+ * */
+template<typename DataRecord>
+bool FullTextShardBuilder<DataRecord>::read_target_page(std::ifstream &reader, uint64_t format_version, size_t page_pos,
+		std::vector<cache_entry> &entries) {
+
+	reader.clear();
+	reader.seekg(page_pos, std::ios::beg);
+
+	const bool read = read_page(reader, format_version);
+
+	// The map is ordered by key, the records of a key are stored section by section so they are sorted by value here.
+	for (auto &iter : m_cache) {
+		std::sort(iter.second.begin(), iter.second.end(), [](const DataRecord &a, const DataRecord &b) {
+			return a.m_value < b.m_value;
+		});
+		for (const DataRecord &record : iter.second) {
+			entries.push_back(cache_entry{iter.first, record});
+		}
+	}
+
+	m_cache.clear();
+	m_total_results.clear();
+
+	return read;
+}
+
+template<typename DataRecord>
+std::string FullTextShardBuilder<DataRecord>::run_filename(size_t run) const {
+	return cache_filename() + ".run" + std::to_string(run);
 }
 
 template<typename DataRecord>
@@ -347,6 +625,8 @@ void FullTextShardBuilder<DataRecord>::read_data_to_cache() {
 	if (file_size == 0) return;
 	reader.seekg(0, std::ios::beg);
 
+	const uint64_t format_version = read_format_version();
+
 	try {
 		m_buffer = new char[m_buffer_len];
 	} catch (std::bad_alloc &exception) {
@@ -354,13 +634,13 @@ void FullTextShardBuilder<DataRecord>::read_data_to_cache() {
 		std::cout << "tried to allocate: " << m_buffer_len << " bytes" << std::endl;
 		return;
 	}
-	while (read_page(reader)) {
+	while (read_page(reader, format_version)) {
 	}
-	delete m_buffer;
+	delete [] m_buffer;
 }
 
 template<typename DataRecord>
-bool FullTextShardBuilder<DataRecord>::read_page(std::ifstream &reader) {
+bool FullTextShardBuilder<DataRecord>::read_page(std::ifstream &reader, uint64_t format_version) {
 
 	char buffer[64];
 
@@ -370,6 +650,11 @@ bool FullTextShardBuilder<DataRecord>::read_page(std::ifstream &reader) {
 
 	uint64_t num_keys = *((uint64_t *)(&buffer[0]));
 
+	if (format_version >= 2) {
+		// Skip the fence table, it is rebuilt when the page is written.
+		reader.seekg(FullTextPage::num_fences(num_keys) * sizeof(uint64_t), std::ios::cur);
+	}
+
 	char *vector_buffer;
 	try {
 		vector_buffer = new char[num_keys * 8];
@@ -409,10 +694,26 @@ bool FullTextShardBuilder<DataRecord>::read_page(std::ifstream &reader) {
 		size_t total = *((size_t *)(&vector_buffer[i*8]));
 		m_total_results[keys[i]] = total;
 	}
-	delete vector_buffer;
+	delete [] vector_buffer;
 
 	if (data_size == 0) return true;
 
+	if (format_version >= 3) {
+		// Every key is a PostingBlock stream.
+		std::vector<char> stream;
+		for (size_t i = 0; i < num_keys; i++) {
+			stream.resize(lens[i]);
+			reader.read(stream.data(), lens[i]);
+			if ((size_t)reader.gcount() != lens[i]) {
+				LOG_INFO("Data stopped before end. Ignoring shard " + std::to_string(m_shard_id));
+				m_cache.clear();
+				return false;
+			}
+			PostingBlock::decode(stream.data(), lens[i], m_cache[keys[i]]);
+		}
+		return true;
+	}
+
 	// Read the data.
 	size_t total_read_data = 0;
 	size_t key_id = 0;
@@ -454,29 +755,34 @@ bool FullTextShardBuilder<DataRecord>::read_page(std::ifstream &reader) {
 template<typename DataRecord>
 void FullTextShardBuilder<DataRecord>::save_file() {
 
-	std::ofstream writer(target_filename(), std::ios::binary | std::ios::trunc);
+	std::ofstream writer(target_filename() + ".tmp", std::ios::binary | std::ios::trunc);
 	if (!writer.is_open()) {
 		throw LOG_ERROR_EXCEPTION("Could not open full text shard. Error: " + std::string(strerror(errno)));
 	}
 
-	std::ofstream key_writer(key_filename(), std::ios::binary | std::ios::trunc);
+	std::ofstream key_writer(key_filename() + ".tmp", std::ios::binary | std::ios::trunc);
 	if (!key_writer.is_open()) {
 		throw LOG_ERROR_EXCEPTION("Could not open full text shard. Error: " + std::string(strerror(errno)));
 	}
 
 	reset_key_file(key_writer);
+	write_format_version(key_writer);
 
 	std::unordered_map<uint64_t, std::vector<uint64_t>> pages;
 	for (auto &iter : m_cache) {
 		pages[iter.first % Config::shard_hash_table_size].push_back(iter.first);
 	}
 
-	for (const auto &iter : pages) {
+	for (auto &iter : pages) {
 		const size_t page_pos = write_page(writer, iter.second);
 		writer.flush();
 		write_key(key_writer, iter.first, page_pos);
 	}
 
+	writer.close();
+	key_writer.close();
+	replace_target_files();
+
 	/*std::sort(keys.begin(), keys.end(), [](const uint64_t a, const uint64_t b) {
 		return a < b;
 	});
@@ -487,6 +793,18 @@ void FullTextShardBuilder<DataRecord>::save_file() {
 	*/
 }
 
+/*
+ * Renames the written .tmp files over the shard files. The shard files are never rewritten in place since FullTextShard keeps them
+ * mapped, the mappings keep reading the old files until the shards are recreated.
+ * */
+template<typename DataRecord>
+void FullTextShardBuilder<DataRecord>::replace_target_files() {
+	if (std::rename((target_filename() + ".tmp").c_str(), target_filename().c_str()) != 0 ||
+		std::rename((key_filename() + ".tmp").c_str(), key_filename().c_str()) != 0) {
+		throw LOG_ERROR_EXCEPTION("Could not replace full text shard " + target_filename() + ". Error: " + std::string(strerror(errno)));
+	}
+}
+
 template<typename DataRecord>
 void FullTextShardBuilder<DataRecord>::write_key(std::ofstream &key_writer, uint64_t key, size_t page_pos) {
 	assert(key < Config::shard_hash_table_size);
@@ -496,26 +814,39 @@ void FullTextShardBuilder<DataRecord>::write_key(std::ofstream &key_writer, uint
 
 /*
  * Writes the page with keys, appending it to the file stream writer. Takes data from m_cache.
+ * The keys are sorted and every FullTextPage::fence_stride:th key is written to the fence table before the keys. The records of each key
+ * are written as a PostingBlock stream.
  * */
 template<typename DataRecord>
-size_t FullTextShardBuilder<DataRecord>::write_page(std::ofstream &writer, const std::vector<uint64_t> &keys) {
+size_t FullTextShardBuilder<DataRecord>::write_page(std::ofstream &writer, std::vector<uint64_t> &keys) {
 
 	const size_t page_pos = writer.tellp();
 
+	std::sort(keys.begin(), keys.end());
+
 	size_t num_keys = keys.size();
 
+	std::vector<uint64_t> fences;
+	for (size_t i = 0; i < num_keys; i += FullTextPage::fence_stride) {
+		fences.push_back(keys[i]);
+	}
+
 	writer.write((char *)&num_keys, 8);
+	writer.write((char *)fences.data(), fences.size() * 8);
 	writer.write((char *)keys.data(), keys.size() * 8);
 
 	std::vector<size_t> v_pos;
 	std::vector<size_t> v_len;
 	std::vector<size_t> v_tot;
+	std::vector<std::vector<uint64_t>> streams;
 
 	size_t pos = 0;
 	for (uint64_t key : keys) {
 
+		streams.push_back(PostingBlock::encode(m_cache[key], Config::ft_max_results_per_section));
+
 		// Store position and length
-		size_t len = m_cache[key].size() * sizeof(DataRecord);
+		size_t len = streams.back().size() * sizeof(uint64_t);
 		
 		v_pos.push_back(pos);
 		v_len.push_back(len);
@@ -529,8 +860,8 @@ size_t FullTextShardBuilder<DataRecord>::write_page(std::ofstream &writer, const
 	writer.write((char *)v_tot.data(), keys.size() * 8);
 
 	// Write data.
-	for (uint64_t key : keys) {
-		writer.write((char *)m_cache[key].data(), sizeof(DataRecord) * m_cache[key].size());
+	for (const std::vector<uint64_t> &stream : streams) {
+		writer.write((char *)stream.data(), stream.size() * sizeof(uint64_t));
 	}
 
 	return page_pos;
@@ -545,6 +876,33 @@ void FullTextShardBuilder<DataRecord>::reset_key_file(std::ofstream &key_writer)
 	}
 }
 
+/*
+ * Writes the format marker after the hash table in the key file.
+ * */
+template<typename DataRecord>
+void FullTextShardBuilder<DataRecord>::write_format_version(std::ofstream &key_writer) {
+	key_writer.seekp(Config::shard_hash_table_size * sizeof(uint64_t));
+	key_writer.write((char *)&FullTextPage::format_magic, sizeof(uint64_t));
+	key_writer.write((char *)&FullTextPage::format_version, sizeof(uint64_t));
+}
+
+/*
+ * Returns the format version of the pages in the current target file. Files written before the format marker was added are version 1.
+ * */
+template<typename DataRecord>
+uint64_t FullTextShardBuilder<DataRecord>::read_format_version() const {
+	std::ifstream key_reader(key_filename(), std::ios::binary);
+	if (!key_reader.is_open()) return 1;
+
+	uint64_t marker[2] = {0, 0};
+	key_reader.seekg(Config::shard_hash_table_size * sizeof(uint64_t));
+	key_reader.read((char *)marker, sizeof(marker));
+
+	if (key_reader.gcount() != sizeof(marker) || marker[0] != FullTextPage::format_magic) return 1;
+
+	return marker[1];
+}
+
 template<typename DataRecord>
 std::string FullTextShardBuilder<DataRecord>::mountpoint() const {
 	return std::to_string(m_shard_id % 8);
@@ -578,6 +936,8 @@ void FullTextShardBuilder<DataRecord>::truncate() {
 
 	truncate_cache_files();
 
+	// Unlink instead of truncating in place, shards may have the file mapped.
+	std::remove(target_filename().c_str());
 	std::ofstream target_writer(target_filename(), std::ios::trunc);
 	target_writer.close();
 }
@@ -0,0 +1,91 @@
+/*
+ * MIT License
+ *
+ * Alexandria.org
+ *
+ * Copyright (c) 2021 Josef Cullhed, <info@alexandria.org>, et al.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "PostingBlock.h"
+
+namespace PostingBlock {
+
+	size_t bit_width(uint64_t value) {
+		if (value == 0) return 0;
+		return 64 - __builtin_clzll(value);
+	}
+
+	/*
+		Value i is stored in lane i % lanes_len at bit position (i / lanes_len) * width of that lane. Word j of a lane is stored at
+		packed[j * lanes_len + lane].
+	*/
+	__attribute__((target_clones("avx2", "default")))
+	void pack(const uint64_t *values, size_t len, size_t width, uint64_t *packed) {
+
+		const size_t words = packed_words(len, width);
+		for (size_t i = 0; i < words; i++) packed[i] = 0;
+		if (width == 0) return;
+
+		const size_t rows = (len + lanes_len - 1) / lanes_len;
+		for (size_t i = 0; i < rows; i++) {
+			const size_t bit = i * width;
+			const size_t word = bit / 64;
+			const size_t shift = bit % 64;
+			for (size_t lane = 0; lane < lanes_len; lane++) {
+				const uint64_t value = values[i * lanes_len + lane];
+				packed[word * lanes_len + lane] |= value << shift;
+				if (shift + width > 64) {
+					packed[(word + 1) * lanes_len + lane] |= value >> (64 - shift);
+				}
+			}
+		}
+	}
+
+	__attribute__((target_clones("avx2", "default")))
+	void unpack(const uint64_t *packed, size_t len, size_t width, uint64_t *values) {
+
+		const size_t rows = (len + lanes_len - 1) / lanes_len;
+
+		if (width == 0) {
+			for (size_t i = 0; i < rows * lanes_len; i++) values[i] = 0;
+			return;
+		}
+
+		const uint64_t mask = width == 64 ? UINT64_MAX : (1ull << width) - 1;
+
+		for (size_t i = 0; i < rows; i++) {
+			const size_t bit = i * width;
+			const size_t word = bit / 64;
+			const size_t shift = bit % 64;
+			if (shift + width > 64) {
+				for (size_t lane = 0; lane < lanes_len; lane++) {
+					values[i * lanes_len + lane] = ((packed[word * lanes_len + lane] >> shift) |
+						(packed[(word + 1) * lanes_len + lane] << (64 - shift))) & mask;
+				}
+			} else {
+				for (size_t lane = 0; lane < lanes_len; lane++) {
+					values[i * lanes_len + lane] = (packed[word * lanes_len + lane] >> shift) & mask;
+				}
+			}
+		}
+	}
+
+}
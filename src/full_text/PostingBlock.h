@@ -0,0 +1,365 @@
+/*
+ * MIT License
+ *
+ * Alexandria.org
+ *
+ * Copyright (c) 2021 Josef Cullhed, <info@alexandria.org>, et al.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include "FullTextRecord.h"
+#include "link/FullTextRecord.h"
+#include "domain_link/FullTextRecord.h"
+
+/*
+	Block compressed posting lists. See documentation/index_file_format.md
+
+	The records of a key are written as blocks of at most block_len records. Every block holds one column per record field:
+	- m_value is delta encoded from the first value in the block.
+	- m_score is stored as the float bits minus the smallest float bits in the block (frame of reference, lossless).
+	- The remaining 64 bit fields are stored minus the smallest value in the block.
+	Each column is bit packed with the smallest bit width that fits the largest value in the column. The bits are packed in lanes_len
+	interleaved lanes so the same shift and mask is applied to lanes_len consecutive words at a time, that lets the compiler turn the
+	unpacking into vector instructions.
+
+	Block layout, everything is 8 byte words:
+	1 word: num_records | value_width << 16 | score_width << 24 | column widths << (32 + 8 * column)
+	1 word: first value
+	1 word: score base bits | max score bits << 32
+	num_columns words: column bases
+	packed value deltas, packed scores, packed columns
+*/
+namespace PostingBlock {
+
+	const size_t block_len = 128;
+	const size_t lanes_len = 4;
+
+	/*
+		Block meta data read from the block header without decoding the block.
+	*/
+	struct block_ref {
+		const char *data;
+		size_t section;
+		size_t num_records;
+		uint64_t first_value;
+		float max_score;
+	};
+
+	/*
+		Describes the fields of a record except m_value and m_score. Every record type stored in a full text index needs a specialization.
+	*/
+	template<typename DataRecord>
+	struct columns;
+
+	template<>
+	struct columns<FullTextRecord> {
+		static const size_t count = 1;
+		static uint64_t get(const FullTextRecord &record, size_t) { return record.m_domain_hash; }
+		static void set(FullTextRecord &record, size_t, uint64_t value) { record.m_domain_hash = value; }
+	};
+
+	template<>
+	struct columns<Link::FullTextRecord> {
+		static const size_t count = 2;
+		static uint64_t get(const Link::FullTextRecord &record, size_t column) {
+			return column == 0 ? record.m_source_domain : record.m_target_hash;
+		}
+		static void set(Link::FullTextRecord &record, size_t column, uint64_t value) {
+			if (column == 0) record.m_source_domain = value;
+			else record.m_target_hash = value;
+		}
+	};
+
+	template<>
+	struct columns<DomainLink::FullTextRecord> {
+		static const size_t count = 2;
+		static uint64_t get(const DomainLink::FullTextRecord &record, size_t column) {
+			return column == 0 ? record.m_source_domain : record.m_target_domain;
+		}
+		static void set(DomainLink::FullTextRecord &record, size_t column, uint64_t value) {
+			if (column == 0) record.m_source_domain = value;
+			else record.m_target_domain = value;
+		}
+	};
+
+	// Set in the stream header when the records are stored uncompressed, used when compression would make the key larger.
+	const uint64_t raw_stream_flag = 1ull << 63;
+
+	/*
+		Number of 8 byte words used by a packed column of len values with the given bit width. Columns are padded to a multiple of
+		lanes_len values.
+	*/
+	inline size_t packed_words(size_t len, size_t width) {
+		const size_t rows = (len + lanes_len - 1) / lanes_len;
+		return lanes_len * ((width * rows + 63) / 64);
+	}
+
+	size_t bit_width(uint64_t value);
+
+	/*
+		Packs len values into packed_words(len, width) words. Values must fit in width bits and values must hold len rounded up to a
+		multiple of lanes_len values.
+	*/
+	void pack(const uint64_t *values, size_t len, size_t width, uint64_t *packed);
+
+	/*
+		Unpacks len values from packed_words(len, width) words. Writes len rounded up to a multiple of lanes_len values.
+	*/
+	void unpack(const uint64_t *packed, size_t len, size_t width, uint64_t *values);
+
+	/*
+		Appends the block with records [0, len) to dest, len must be less or equal to block_len.
+	*/
+	template<typename DataRecord>
+	void encode_block(const DataRecord *records, size_t len, std::vector<uint64_t> &dest) {
+
+		const size_t num_columns = columns<DataRecord>::count;
+
+		uint64_t values[block_len] = {0};
+		uint64_t scores[block_len] = {0};
+		uint64_t column_values[num_columns][block_len];
+		uint64_t column_bases[num_columns];
+
+		uint64_t max_delta = 0;
+		for (size_t i = 1; i < len; i++) {
+			values[i] = records[i].m_value - records[i - 1].m_value;
+			max_delta |= values[i];
+		}
+
+		uint32_t score_base = UINT32_MAX;
+		float max_score = records[0].m_score;
+		for (size_t i = 0; i < len; i++) {
+			uint32_t score_bits;
+			memcpy(&score_bits, &records[i].m_score, sizeof(uint32_t));
+			score_base = std::min(score_base, score_bits);
+			max_score = std::max(max_score, records[i].m_score);
+		}
+		uint64_t max_score_offset = 0;
+		for (size_t i = 0; i < len; i++) {
+			uint32_t score_bits;
+			memcpy(&score_bits, &records[i].m_score, sizeof(uint32_t));
+			scores[i] = score_bits - score_base;
+			max_score_offset |= scores[i];
+		}
+
+		uint64_t header = len | (bit_width(max_delta) << 16) | (bit_width(max_score_offset) << 24);
+		for (size_t column = 0; column < num_columns; column++) {
+			uint64_t base = UINT64_MAX;
+			for (size_t i = 0; i < len; i++) {
+				base = std::min(base, columns<DataRecord>::get(records[i], column));
+			}
+			uint64_t max_offset = 0;
+			for (size_t i = 0; i < block_len; i++) {
+				column_values[column][i] = i < len ? columns<DataRecord>::get(records[i], column) - base : 0;
+				max_offset |= column_values[column][i];
+			}
+			column_bases[column] = base;
+			header |= bit_width(max_offset) << (32 + 8 * column);
+		}
+
+		uint32_t max_score_bits;
+		memcpy(&max_score_bits, &max_score, sizeof(uint32_t));
+
+		dest.push_back(header);
+		dest.push_back(records[0].m_value);
+		dest.push_back(score_base | ((uint64_t)max_score_bits << 32));
+		dest.insert(dest.end(), column_bases, column_bases + num_columns);
+
+		auto pack_column = [&dest, len](const uint64_t *column, size_t width) {
+			const size_t offset = dest.size();
+			dest.resize(offset + packed_words(len, width));
+			pack(column, len, width, &dest[offset]);
+		};
+
+		pack_column(values, (header >> 16) & 0xFF);
+		pack_column(scores, (header >> 24) & 0xFF);
+		for (size_t column = 0; column < num_columns; column++) {
+			pack_column(column_values[column], (header >> (32 + 8 * column)) & 0xFF);
+		}
+	}
+
+	/*
+		Returns the number of records in the block starting at data.
+	*/
+	inline size_t block_records(const char *data) {
+		uint64_t header;
+		memcpy(&header, data, sizeof(uint64_t));
+		return header & 0xFFFF;
+	}
+
+	/*
+		Returns the first (and smallest) value in the block starting at data.
+	*/
+	inline uint64_t block_first_value(const char *data) {
+		uint64_t first_value;
+		memcpy(&first_value, data + sizeof(uint64_t), sizeof(uint64_t));
+		return first_value;
+	}
+
+	/*
+		Returns the largest score in the block starting at data.
+	*/
+	inline float block_max_score(const char *data) {
+		uint32_t max_score_bits;
+		memcpy(&max_score_bits, data + 2 * sizeof(uint64_t) + sizeof(uint32_t), sizeof(uint32_t));
+		float max_score;
+		memcpy(&max_score, &max_score_bits, sizeof(float));
+		return max_score;
+	}
+
+	/*
+		Returns the size in bytes of the block starting at data.
+	*/
+	template<typename DataRecord>
+	size_t block_size(const char *data) {
+		uint64_t header;
+		memcpy(&header, data, sizeof(uint64_t));
+		const size_t len = header & 0xFFFF;
+		size_t words = 3 + columns<DataRecord>::count + packed_words(len, (header >> 16) & 0xFF) +
+			packed_words(len, (header >> 24) & 0xFF);
+		for (size_t column = 0; column < columns<DataRecord>::count; column++) {
+			words += packed_words(len, (header >> (32 + 8 * column)) & 0xFF);
+		}
+		return words * sizeof(uint64_t);
+	}
+
+	/*
+		Decodes the block starting at data into dest, returns the size in bytes of the block.
+	*/
+	template<typename DataRecord>
+	size_t decode_block(const char *data, DataRecord *dest) {
+
+		const size_t num_columns = columns<DataRecord>::count;
+
+		uint64_t fixed[3 + num_columns];
+		memcpy(fixed, data, sizeof(fixed));
+		const uint64_t header = fixed[0];
+		const size_t len = header & 0xFFFF;
+
+		const char *packed_data = data + sizeof(fixed);
+
+		// Copy the packed words to an aligned buffer, the block is not guaranteed to be 8 byte aligned in the file.
+		uint64_t packed[block_len];
+		uint64_t values[block_len];
+
+		auto unpack_column = [&packed_data, &packed, &values, len](size_t width) {
+			const size_t words = packed_words(len, width);
+			memcpy(packed, packed_data, words * sizeof(uint64_t));
+			unpack(packed, len, width, values);
+			packed_data += words * sizeof(uint64_t);
+		};
+
+		unpack_column((header >> 16) & 0xFF);
+		uint64_t value = fixed[1];
+		for (size_t i = 0; i < len; i++) {
+			value += values[i];
+			dest[i].m_value = value;
+		}
+
+		unpack_column((header >> 24) & 0xFF);
+		const uint32_t score_base = fixed[2] & 0xFFFFFFFF;
+		for (size_t i = 0; i < len; i++) {
+			const uint32_t score_bits = score_base + (uint32_t)values[i];
+			memcpy(&dest[i].m_score, &score_bits, sizeof(float));
+		}
+
+		for (size_t column = 0; column < num_columns; column++) {
+			unpack_column((header >> (32 + 8 * column)) & 0xFF);
+			for (size_t i = 0; i < len; i++) {
+				columns<DataRecord>::set(dest[i], column, fixed[3 + column] + values[i]);
+			}
+		}
+
+		return packed_data - data;
+	}
+
+	/*
+		Encodes all records into blocks. A new block is started at every multiple of section_len so sections can be decoded separately.
+		The stream starts with one word holding the number of records. If the blocks would be larger than the records themselves the
+		records are stored as they are and raw_stream_flag is set in the first word.
+	*/
+	template<typename DataRecord>
+	std::vector<uint64_t> encode(const std::vector<DataRecord> &records, size_t section_len) {
+		std::vector<uint64_t> dest;
+		dest.push_back(records.size());
+		for (size_t start = 0; start < records.size(); ) {
+			const size_t section_end = std::min(records.size(), (start / section_len + 1) * section_len);
+			const size_t len = std::min(block_len, section_end - start);
+			encode_block(&records[start], len, dest);
+			start += len;
+		}
+
+		const size_t raw_words = (records.size() * sizeof(DataRecord) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+		if (dest.size() > raw_words + 1) {
+			dest.assign(raw_words + 1, 0);
+			dest[0] = records.size() | raw_stream_flag;
+			memcpy(&dest[1], records.data(), records.size() * sizeof(DataRecord));
+		}
+
+		return dest;
+	}
+
+	/*
+		Returns the number of records in an encoded stream.
+	*/
+	inline size_t stream_records(const char *data) {
+		uint64_t header;
+		memcpy(&header, data, sizeof(uint64_t));
+		return header & ~raw_stream_flag;
+	}
+
+	inline bool stream_is_raw(const char *data) {
+		uint64_t header;
+		memcpy(&header, data, sizeof(uint64_t));
+		return header & raw_stream_flag;
+	}
+
+	/*
+		Decodes a whole stream of len bytes and appends the records to dest.
+	*/
+	template<typename DataRecord>
+	void decode(const char *data, size_t len, std::vector<DataRecord> &dest) {
+		if (len < sizeof(uint64_t)) return;
+		const size_t num_records = stream_records(data);
+		const size_t offset = dest.size();
+		if (stream_is_raw(data)) {
+			const size_t available = std::min(num_records, (len - sizeof(uint64_t)) / sizeof(DataRecord));
+			dest.resize(offset + available);
+			memcpy(&dest[offset], data + sizeof(uint64_t), available * sizeof(DataRecord));
+			return;
+		}
+		dest.resize(offset + num_records);
+		size_t pos = sizeof(uint64_t);
+		size_t decoded = 0;
+		while (decoded < num_records && pos < len) {
+			const size_t block_records_len = block_records(data + pos);
+			pos += decode_block(data + pos, &dest[offset + decoded]);
+			decoded += block_records_len;
+		}
+		dest.resize(offset + decoded);
+	}
+
+}
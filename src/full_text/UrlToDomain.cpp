@@ -34,6 +34,7 @@ UrlToDomain::UrlToDomain(const string &db_name)
 : m_db_name(db_name)
 {
 	indexer::merger::register_appender((size_t)this, [this]() {
+		std::lock_guard guard(m_lock);
 		for (size_t bucket_id = 0; bucket_id < 8; bucket_id++) {
 			write(bucket_id);
 		}
@@ -82,6 +82,47 @@ string HashTable::find(uint64_t key) {
 	return m_shards[key % Config::ht_num_shards]->find(key);
 }
 
+vector<string> HashTable::find_many(const vector<uint64_t> &keys) {
+
+	vector<string> values(keys.size());
+
+	// Indices into keys for every shard.
+	map<size_t, vector<size_t>> shard_keys;
+	for (size_t i = 0; i < keys.size(); i++) {
+		shard_keys[keys[i] % Config::ht_num_shards].push_back(i);
+	}
+
+	auto find_in_shard = [this, &keys, &values](size_t shard_id, const vector<size_t> &indices) {
+		vector<uint64_t> shard_key_values;
+		for (size_t i : indices) {
+			shard_key_values.push_back(keys[i]);
+		}
+		vector<string> shard_values = m_shards[shard_id]->find_many(shard_key_values);
+		for (size_t i = 0; i < indices.size(); i++) {
+			values[indices[i]] = std::move(shard_values[i]);
+		}
+	};
+
+	if (shard_keys.size() == 1) {
+		find_in_shard(shard_keys.begin()->first, shard_keys.begin()->second);
+		return values;
+	}
+
+	call_once(m_find_pool_once, [this]() {
+		m_find_pool = make_unique<ThreadPool>(m_num_find_threads);
+	});
+
+	vector<future<void>> futures;
+	for (const auto &iter : shard_keys) {
+		futures.emplace_back(m_find_pool->enqueue(find_in_shard, iter.first, cref(iter.second)));
+	}
+	for (future<void> &fut : futures) {
+		fut.get();
+	}
+
+	return values;
+}
+
 size_t HashTable::size() const {
 	return m_num_items;
 }
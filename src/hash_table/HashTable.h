@@ -30,6 +30,8 @@
 #include <thread>
 #include <vector>
 #include <map>
+#include <memory>
+#include <mutex>
 
 #include "HashTableShard.h"
 #include "system/SubSystem.h"
@@ -47,6 +49,12 @@ public:
 	void add(uint64_t key, const std::string &value);
 	void truncate();
 	std::string find(uint64_t key);
+
+	/*
+		Same as calling find for every key but the keys are grouped by shard and the shards are read in parallel. Returns the values in
+		the same order as the keys.
+	*/
+	std::vector<std::string> find_many(const std::vector<uint64_t> &keys);
 	size_t size() const;
 	void print_all_items() const;
 
@@ -56,4 +64,9 @@ private:
 	const std::string m_db_name;
 	size_t m_num_items;
 
+	// Threads for find_many, created on first use. The hash table can be shared by several threads.
+	const size_t m_num_find_threads = 8;
+	std::unique_ptr<ThreadPool> m_find_pool;
+	std::once_flag m_find_pool_once;
+
 };
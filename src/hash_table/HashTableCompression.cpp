@@ -0,0 +1,237 @@
+/*
+ * MIT License
+ *
+ * Alexandria.org
+ *
+ * Copyright (c) 2021 Josef Cullhed, <info@alexandria.org>, et al.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "HashTableCompression.h"
+#include "logger/logger.h"
+#include <zlib.h>
+#include <cstring>
+#include <queue>
+#include <unordered_map>
+#include <unordered_set>
+
+using namespace std;
+
+namespace HashTableCompression {
+
+	const size_t kmer_len = 8;
+	const size_t segment_len = 64;
+
+	// Total number of sample bytes used for training.
+	const size_t max_sample_bytes = 100 * max_dictionary_len;
+
+	struct deflate_context {
+		z_stream stream;
+		deflate_context() {
+			memset(&stream, 0, sizeof(stream));
+			deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15, 8, Z_DEFAULT_STRATEGY);
+		}
+		~deflate_context() {
+			deflateEnd(&stream);
+		}
+	};
+
+	struct inflate_context {
+		z_stream stream;
+		inflate_context() {
+			memset(&stream, 0, sizeof(stream));
+			// 15 + 32 detects zlib and gzip headers.
+			inflateInit2(&stream, 15 + 32);
+		}
+		~inflate_context() {
+			inflateEnd(&stream);
+		}
+	};
+
+	inline uint64_t read_kmer(const string &sample, size_t pos) {
+		uint64_t kmer;
+		memcpy(&kmer, sample.data() + pos, kmer_len);
+		return kmer;
+	}
+
+	string train_dictionary(const vector<string> &all_samples, size_t max_len) {
+
+		if (all_samples.size() < min_training_samples) return "";
+
+		// Take evenly spread samples.
+		size_t total_bytes = 0;
+		for (const string &sample : all_samples) total_bytes += sample.size();
+		const size_t step = total_bytes > max_sample_bytes ? (total_bytes + max_sample_bytes - 1) / max_sample_bytes : 1;
+		vector<const string *> samples;
+		for (size_t i = 0; i < all_samples.size(); i += step) {
+			samples.push_back(&all_samples[i]);
+		}
+
+		// Number of samples containing each kmer.
+		unordered_map<uint64_t, uint32_t> counts;
+		for (const string *sample : samples) {
+			unordered_set<uint64_t> seen;
+			for (size_t i = 0; i + kmer_len <= sample->size(); i++) {
+				const uint64_t kmer = read_kmer(*sample, i);
+				if (seen.insert(kmer).second) counts[kmer]++;
+			}
+		}
+
+		auto segment_score = [&counts](const string &sample, size_t offset) {
+			size_t score = 0;
+			const size_t end = min(offset + segment_len, sample.size());
+			for (size_t i = offset; i + kmer_len <= end; i++) {
+				const uint32_t count = counts[read_kmer(sample, i)];
+				// Strings seen in only one sample are not worth storing.
+				if (count > 1) score += count;
+			}
+			return score;
+		};
+
+		// Candidates are (score, sample, offset), re-scored lazily since picking a segment zeroes the counts of its kmers.
+		priority_queue<tuple<size_t, size_t, size_t>> candidates;
+		for (size_t sample_id = 0; sample_id < samples.size(); sample_id++) {
+			const string &sample = *samples[sample_id];
+			for (size_t offset = 0; offset + kmer_len <= sample.size(); offset += segment_len / 2) {
+				const size_t score = segment_score(sample, offset);
+				if (score > 0) candidates.emplace(score, sample_id, offset);
+			}
+		}
+
+		vector<string> segments;
+		size_t dictionary_len = 0;
+		while (candidates.size() && dictionary_len < max_len) {
+			auto [score, sample_id, offset] = candidates.top();
+			candidates.pop();
+
+			const string &sample = *samples[sample_id];
+			const size_t current_score = segment_score(sample, offset);
+			if (current_score == 0) continue;
+			if (candidates.size() && current_score < get<0>(candidates.top())) {
+				candidates.emplace(current_score, sample_id, offset);
+				continue;
+			}
+
+			const size_t len = min({segment_len, sample.size() - offset, max_len - dictionary_len});
+			segments.push_back(sample.substr(offset, len));
+			dictionary_len += len;
+
+			for (size_t i = offset; i + kmer_len <= offset + len; i++) {
+				counts[read_kmer(sample, i)] = 0;
+			}
+		}
+
+		// Best segments last.
+		string dictionary;
+		dictionary.reserve(dictionary_len);
+		for (auto iter = segments.rbegin(); iter != segments.rend(); iter++) {
+			dictionary.append(*iter);
+		}
+
+		return dictionary;
+	}
+
+	string compress(const string &value, const string &dictionary) {
+
+		thread_local deflate_context context;
+		z_stream &stream = context.stream;
+
+		deflateReset(&stream);
+		if (dictionary.size()) {
+			deflateSetDictionary(&stream, (const Bytef *)dictionary.data(), dictionary.size());
+		}
+
+		string compressed(deflateBound(&stream, value.size()) + 16, '\0');
+		stream.next_in = (Bytef *)value.data();
+		stream.avail_in = value.size();
+		stream.next_out = (Bytef *)compressed.data();
+		stream.avail_out = compressed.size();
+
+		while (true) {
+			const int ret = deflate(&stream, Z_FINISH);
+			if (ret == Z_STREAM_END) break;
+			if (ret != Z_OK && ret != Z_BUF_ERROR) {
+				throw LOG_ERROR_EXCEPTION("deflate failed with error " + to_string(ret));
+			}
+			const size_t used = compressed.size() - stream.avail_out;
+			compressed.resize(compressed.size() * 2);
+			stream.next_out = (Bytef *)compressed.data() + used;
+			stream.avail_out = compressed.size() - used;
+		}
+
+		compressed.resize(stream.total_out);
+
+		return compressed;
+	}
+
+	bool try_decompress(const char *data, size_t len, const string &dictionary, string &value) {
+
+		thread_local inflate_context context;
+		z_stream &stream = context.stream;
+
+		inflateReset(&stream);
+
+		value.clear();
+
+		string decompressed(max(len * 4, (size_t)1024), '\0');
+		stream.next_in = (Bytef *)data;
+		stream.avail_in = len;
+		stream.next_out = (Bytef *)decompressed.data();
+		stream.avail_out = decompressed.size();
+
+		while (true) {
+			int ret = inflate(&stream, Z_NO_FLUSH);
+			if (ret == Z_NEED_DICT) {
+				if (dictionary.empty() ||
+					inflateSetDictionary(&stream, (const Bytef *)dictionary.data(), dictionary.size()) != Z_OK) {
+					LOG_ERROR("Value is compressed with a dictionary we do not have");
+					return false;
+				}
+				continue;
+			}
+			if (ret == Z_STREAM_END) break;
+			if (ret != Z_OK && ret != Z_BUF_ERROR) {
+				LOG_ERROR("Could not decompress value, inflate returned " + to_string(ret));
+				return false;
+			}
+			if (stream.avail_out > 0) {
+				// No progress possible, the input is truncated.
+				LOG_ERROR("Could not decompress value, the data is truncated");
+				return false;
+			}
+			const size_t used = decompressed.size() - stream.avail_out;
+			decompressed.resize(decompressed.size() * 2);
+			stream.next_out = (Bytef *)decompressed.data() + used;
+			stream.avail_out = decompressed.size() - used;
+		}
+
+		decompressed.resize(stream.total_out);
+		value = std::move(decompressed);
+
+		return true;
+	}
+
+	string decompress(const char *data, size_t len, const string &dictionary) {
+		string value;
+		try_decompress(data, len, dictionary, value);
+		return value;
+	}
+
+}
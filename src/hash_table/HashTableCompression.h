@@ -0,0 +1,65 @@
+/*
+ * MIT License
+ *
+ * Alexandria.org
+ *
+ * Copyright (c) 2021 Josef Cullhed, <info@alexandria.org>, et al.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <iostream>
+#include <vector>
+
+/*
+	Compression of the values in the hash table. Values are stored as zlib streams compressed with a dictionary that is trained per shard
+	by HashTableShardBuilder::optimize and stored in the .dict file of the shard. Older values stored as gzip streams are still readable.
+
+	zlib keeps a window of 32 kb so the dictionary is at most that long. The zlib header holds the checksum of the dictionary so a value is
+	never decompressed with the wrong dictionary.
+*/
+namespace HashTableCompression {
+
+	const size_t max_dictionary_len = 32768;
+
+	// Shards with fewer values than this do not get a dictionary.
+	const size_t min_training_samples = 128;
+
+	/*
+		Builds a dictionary from the most common 64 byte segments of the samples. The most useful segments are placed last since zlib
+		encodes short distances with fewer bits.
+	*/
+	std::string train_dictionary(const std::vector<std::string> &samples, size_t max_len = max_dictionary_len);
+
+	/*
+		Compress and decompress values. An empty dictionary means no dictionary. Both reuse one zlib context per thread. decompress
+		handles both zlib and gzip streams and returns an empty string if the data is corrupt or the dictionary does not match.
+	*/
+	std::string compress(const std::string &value, const std::string &dictionary);
+	std::string decompress(const char *data, size_t len, const std::string &dictionary);
+
+	/*
+		Same as decompress but tells corrupt data apart from an empty value, returns false and leaves value empty if the data could not be
+		decompressed.
+	*/
+	bool try_decompress(const char *data, size_t len, const std::string &dictionary, std::string &value);
+
+}
@@ -0,0 +1,110 @@
+/*
+ * MIT License
+ *
+ * Alexandria.org
+ *
+ * Copyright (c) 2021 Josef Cullhed, <info@alexandria.org>, et al.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <iostream>
+#include <cstring>
+#include <cstdint>
+
+#include "config.h"
+
+/*
+	Layout of the .pos file of a hash table shard.
+
+	Version 1 files have no header and hold records of key + position of the record in the .data file, sorted by key.
+
+	Version 2 files start with a header of magic, version and the number of sorted records. The records are key + position of the record
+	in the .data file + length of the compressed value, all 8 bytes. The first num_sorted records are sorted by key. Records appended by
+	HashTableShardBuilder::write after that are unsorted and newer than the sorted records, HashTableShardBuilder::sort merges them.
+*/
+namespace HashTablePositions {
+
+	const uint64_t format_magic = 0x534F505448584C41ull; // "ALXHTPOS"
+	const uint64_t format_version = 2;
+	const size_t header_len = 3 * sizeof(uint64_t);
+
+	// Value length for version 1 records where the length is only stored in the .data file.
+	const uint64_t unknown_len = UINT64_MAX;
+
+	struct record {
+		uint64_t key;
+		uint64_t pos;
+		uint64_t len;
+	};
+
+	inline size_t record_len(uint64_t version) {
+		return Config::ht_key_size + (version >= 2 ? 2 : 1) * sizeof(uint64_t);
+	}
+
+	/*
+		Returns the version of the pos file with the given content.
+	*/
+	inline uint64_t read_version(const char *data, size_t len) {
+		uint64_t magic;
+		if (len < header_len) return 1;
+		memcpy(&magic, data, sizeof(uint64_t));
+		if (magic != format_magic) return 1;
+		uint64_t version;
+		memcpy(&version, data + sizeof(uint64_t), sizeof(uint64_t));
+		return version;
+	}
+
+	inline uint64_t read_num_sorted(const char *data) {
+		uint64_t num_sorted;
+		memcpy(&num_sorted, data + 2 * sizeof(uint64_t), sizeof(uint64_t));
+		return num_sorted;
+	}
+
+	/*
+		Reads record number i from records, the part of the file after the header.
+	*/
+	inline record read_record(const char *records, size_t i, uint64_t version) {
+		const char *ptr = records + i * record_len(version);
+		record rec;
+		memcpy(&rec.key, ptr, sizeof(uint64_t));
+		memcpy(&rec.pos, ptr + Config::ht_key_size, sizeof(uint64_t));
+		if (version >= 2) {
+			memcpy(&rec.len, ptr + Config::ht_key_size + sizeof(uint64_t), sizeof(uint64_t));
+		} else {
+			rec.len = unknown_len;
+		}
+		return rec;
+	}
+
+	inline void write_header(std::ostream &out, uint64_t num_sorted) {
+		out.write((const char *)&format_magic, sizeof(uint64_t));
+		out.write((const char *)&format_version, sizeof(uint64_t));
+		out.write((const char *)&num_sorted, sizeof(uint64_t));
+	}
+
+	inline void write_record(std::ostream &out, const record &rec) {
+		out.write((const char *)&rec.key, Config::ht_key_size);
+		out.write((const char *)&rec.pos, sizeof(uint64_t));
+		out.write((const char *)&rec.len, sizeof(uint64_t));
+	}
+
+}
@@ -31,9 +31,9 @@
 using namespace std;
 
 HashTableShard::HashTableShard(const string &db_name, size_t shard_id)
-: m_db_name(db_name), m_shard_id(shard_id), m_loaded(false), m_size(0)
+: m_db_name(db_name), m_shard_id(shard_id)
 {
-	load();
+	map_files();
 }
 
 HashTableShard::~HashTableShard() {
@@ -42,40 +42,37 @@ HashTableShard::~HashTableShard() {
 
 string HashTableShard::find(uint64_t key) {
 
-	if (!m_loaded) load();
+	HashTablePositions::record rec;
+	if (!find_record(key, rec)) return "";
 
-	const uint64_t key_significant = key >> (64-m_significant);
-	auto iter = m_pos.find(key_significant);
-	if (iter == m_pos.end()) return "";
+	return read_value(rec);
+}
 
-	auto pos_pair = iter->second;
-	size_t pos_in_posfile = pos_pair.first;
-	size_t len_in_posfile = pos_pair.second;
+vector<string> HashTableShard::find_many(const vector<uint64_t> &keys) {
 
-	ifstream infile_pos(filename_pos(), ios::binary);
-	infile_pos.seekg(pos_in_posfile, ios::beg);
+	vector<string> values(keys.size());
 
-	const size_t record_len = Config::ht_key_size + sizeof(size_t);
-	const size_t byte_len = len_in_posfile * record_len;
-	const size_t pos_buffer_len = 200000;
-	char pos_buffer[pos_buffer_len];
-	if (byte_len > pos_buffer_len) {
-		throw LOG_ERROR_EXCEPTION("byte_len ("+to_string(byte_len)+") larger than pos_buffer_len ("+to_string(pos_buffer_len)+")");
+	// Pairs of (record, index in keys).
+	vector<pair<HashTablePositions::record, size_t>> data_positions;
+	for (size_t i = 0; i < keys.size(); i++) {
+		HashTablePositions::record rec;
+		if (find_record(keys[i], rec)) data_positions.emplace_back(rec, i);
 	}
 
-	infile_pos.read(pos_buffer, byte_len);
-	infile_pos.close();
+	std::sort(data_positions.begin(), data_positions.end(), [](const auto &a, const auto &b) {
+		return a.first.pos < b.first.pos;
+	});
 
-	size_t pos = string::npos;
-	for (size_t i = 0; i < byte_len; i+= record_len) {
-		uint64_t tmp_key = *((uint64_t *)&pos_buffer[i]);
-		if (tmp_key == key) {
-			pos = *((size_t *)&pos_buffer[i + Config::ht_key_size]);
-		}
+	if (data_positions.size()) {
+		const size_t first = data_positions.front().first.pos;
+		m_data_file.will_need(first, data_positions.back().first.pos - first);
+	}
+
+	for (const auto &iter : data_positions) {
+		values[iter.second] = read_value(iter.first);
 	}
-	if (pos == string::npos) return "";
 
-	return data_at_position(pos);
+	return values;
 }
 
 string HashTableShard::filename_data() const {
@@ -88,117 +85,129 @@ string HashTableShard::filename_pos() const {
 	return "/mnt/" + to_string(disk_shard) + "/hash_table/ht_" + m_db_name + "_" + to_string(m_shard_id) + ".pos";
 }
 
+string HashTableShard::filename_dict() const {
+	size_t disk_shard = m_shard_id % 8;
+	return "/mnt/" + to_string(disk_shard) + "/hash_table/ht_" + m_db_name + "_" + to_string(m_shard_id) + ".dict";
+}
+
 size_t HashTableShard::shard_id() const {
 	return m_shard_id;
 }
 
-size_t HashTableShard::size() const {
-	return m_size;
+size_t HashTableShard::size() {
+	if (!map_files()) return 0;
+	return m_num_records;
 }
 
 size_t HashTableShard::file_size() const {
+	if (m_mapped) return m_data_file.size();
 	ifstream infile(filename_data(), ios::ate | ios::binary);
 	size_t file_size = infile.tellg();
 	return file_size;
 }
 
-void HashTableShard::load() {
-	m_loaded = true;
-	ifstream infile(filename_pos(), ios::binary);
-	const size_t record_len = Config::ht_key_size + sizeof(size_t);
-	const size_t buffer_len = record_len * 10000;
-	char buffer[buffer_len];
-
-	vector<uint64_t> keys;
-	vector<size_t> positions;
-	if (infile.is_open()) {
-		size_t latest_pos = 0;
-		do {
-			infile.read(buffer, buffer_len);
-
-			size_t read_bytes = infile.gcount();
-
-			for (size_t i = 0; i < read_bytes; i += record_len) {
-				keys.push_back(*((uint64_t *)&buffer[i]));
-				positions.push_back(latest_pos);
-				latest_pos += record_len;
-			}
-
-		} while (!infile.eof());
-	}
-	infile.close();
+void HashTableShard::print_all_items() {
 
-	m_size = keys.size();
+	if (!map_files()) return;
 
-	size_t idx = 0;
-	for (uint64_t key : keys) {
-		const uint64_t key_significant = key >> (64-m_significant);
-		if (m_pos.find(key_significant) == m_pos.end()) {
-			m_pos[key_significant] = make_pair(positions[idx], 0);
-		}
-		m_pos[key_significant].second++;
-		idx++;
+	for (size_t i = 0; i < m_num_records; i++) {
+		const HashTablePositions::record rec = HashTablePositions::read_record(records(), i, m_version);
+		cout << rec.key << " => " << read_value(rec) << endl;
 	}
-
-	//LOG_INFO("Loaded shard " + to_string(m_shard_id));
 }
 
-void HashTableShard::print_all_items() {
+/*
+ * Maps the pos and data files and reads the dictionary if it is not already done. The three files are opened together so the positions,
+ * values and dictionary are from the same generation of the shard. Returns false if the shard has no data, in that case we try again on
+ * the next lookup since the shard can be written after the server has started.
+ * */
+bool HashTableShard::map_files() {
 
-	ifstream infile(filename_pos(), ios::binary);
-	const size_t record_len = Config::ht_key_size + sizeof(size_t);
-	const size_t buffer_len = record_len * 10000;
-	char buffer[buffer_len];
+	if (m_mapped) return true;
 
-	vector<uint64_t> keys;
-	vector<size_t> positions;
-	if (infile.is_open()) {
-		do {
-			infile.read(buffer, buffer_len);
+	std::lock_guard lock(m_map_lock);
 
-			size_t read_bytes = infile.gcount();
+	if (m_mapped) return true;
 
-			for (size_t i = 0; i < read_bytes; i += record_len) {
-				keys.push_back(*((uint64_t *)&buffer[i]));
-				positions.push_back(*((size_t *)&buffer[i + Config::ht_key_size]));
-			}
+	if (!m_pos_file.open(filename_pos())) return false;
+	if (!m_data_file.open(filename_data())) {
+		m_pos_file.close();
+		return false;
+	}
 
-		} while (!infile.eof());
+	m_dictionary.clear();
+	ifstream infile_dict(filename_dict(), ios::binary);
+	if (infile_dict.is_open()) {
+		m_dictionary = string(istreambuf_iterator<char>(infile_dict), istreambuf_iterator<char>());
 	}
-	infile.close();
 
-	for (size_t i = 0; i < keys.size(); i++) {
-		cout << keys[i] << " => " << data_at_position(positions[i]) << endl;
+	m_version = HashTablePositions::read_version(m_pos_file.data(), m_pos_file.size());
+	if (m_version >= 2) {
+		m_num_records = (m_pos_file.size() - HashTablePositions::header_len) / HashTablePositions::record_len(m_version);
+		m_num_sorted = std::min(HashTablePositions::read_num_sorted(m_pos_file.data()), m_num_records);
+	} else {
+		m_num_records = m_pos_file.size() / HashTablePositions::record_len(m_version);
+		m_num_sorted = m_num_records;
 	}
+
+	m_mapped = true;
+
+	return true;
 }
 
-string HashTableShard::data_at_position(size_t pos) {
+const char *HashTableShard::records() const {
+	return m_pos_file.data() + (m_version >= 2 ? HashTablePositions::header_len : 0);
+}
 
-	ifstream infile(filename_data(), ios::binary);
-	infile.seekg(pos, ios::beg);
+bool HashTableShard::find_record(uint64_t key, HashTablePositions::record &rec) {
 
-	// Read key
-	uint64_t read_key;
-	infile.read((char *)&read_key, sizeof(uint64_t));
+	if (!map_files()) return false;
 
-	// Read data length.
-	size_t data_len;
-	infile.read((char *)&data_len, sizeof(size_t));
+	const char *data = records();
 
-	char *buffer = new char[data_len];
+	// Records appended after the last sort are newer than the sorted ones.
+	for (size_t i = m_num_records; i > m_num_sorted; i--) {
+		rec = HashTablePositions::read_record(data, i - 1, m_version);
+		if (rec.key == key) return true;
+	}
 
-	infile.read(buffer, data_len);
-	stringstream ss(string(buffer, data_len));
+	size_t begin = 0;
+	size_t end = m_num_sorted;
+	while (begin < end) {
+		const size_t middle = begin + ((end - begin) >> 1);
+		rec = HashTablePositions::read_record(data, middle, m_version);
+		if (rec.key < key) {
+			begin = middle + 1;
+		} else {
+			end = middle;
+		}
+	}
+	if (begin == m_num_sorted) return false;
 
-	boost::iostreams::filtering_istream decompress_stream;
-	decompress_stream.push(boost::iostreams::gzip_decompressor());
-	decompress_stream.push(ss);
+	rec = HashTablePositions::read_record(data, begin, m_version);
+	return rec.key == key;
+}
 
-	stringstream decompressed;
-	decompressed << decompress_stream.rdbuf();
+string HashTableShard::read_value(const HashTablePositions::record &rec) const {
 
-	delete []buffer;
+	const size_t header_len = Config::ht_key_size + sizeof(size_t);
+	const char *data = m_data_file.data();
+	const size_t data_size = m_data_file.size();
 
-	return decompressed.str();
-}
+	if (rec.pos + header_len > data_size) {
+		LOG_ERROR("Could not read value length at " + to_string(rec.pos) + " in " + filename_data());
+		return "";
+	}
+
+	size_t data_len = rec.len;
+	if (data_len == HashTablePositions::unknown_len) {
+		memcpy(&data_len, data + rec.pos + Config::ht_key_size, sizeof(size_t));
+	}
 
+	if (data_len > data_size - rec.pos - header_len) {
+		LOG_ERROR("Could not read value at " + to_string(rec.pos) + " in " + filename_data());
+		return "";
+	}
+
+	return HashTableCompression::decompress(data + rec.pos + header_len, data_len, m_dictionary);
+}
@@ -28,15 +28,25 @@
 
 #include <iostream>
 #include <map>
-#include <unordered_map>
 #include <vector>
 #include <fstream>
 #include <algorithm>
 #include <stdio.h>
 #include <string.h>
 
+#include <atomic>
+#include <mutex>
+
 #include "HashTable.h"
+#include "HashTablePositions.h"
+#include "HashTableCompression.h"
+#include "file/MemoryMappedFile.h"
 
+/*
+	The .pos and .data files are memory mapped and the .dict file is read the first time the shard is used, the keys are binary searched
+	in the mapping, see HashTablePositions.h for the layout. The files stay mapped until the shard is destroyed. HashTableShardBuilder
+	renames new files over the old ones so a shard keeps reading the generation of files it mapped.
+*/
 class HashTableShard {
 
 public:
@@ -46,10 +56,17 @@ public:
 
 	std::string find(uint64_t key);
 
+	/*
+		Finds all the keys with one pass over the data file, the reads are sorted by position. Returns the values in the same order as
+		the keys, missing keys give empty strings.
+	*/
+	std::vector<std::string> find_many(const std::vector<uint64_t> &keys);
+
 	std::string filename_data() const;
 	std::string filename_pos() const;
+	std::string filename_dict() const;
 	size_t shard_id() const;
-	size_t size() const;
+	size_t size();
 	size_t file_size() const;
 	void print_all_items();
 
@@ -57,15 +74,21 @@ private:
 
 	const std::string m_db_name;
 	size_t m_shard_id;
-	bool m_loaded;
-	size_t m_size;
 
-	const int m_significant = 12;
+	File::MemoryMappedFile m_pos_file;
+	File::MemoryMappedFile m_data_file;
+	std::mutex m_map_lock;
+	std::atomic<bool> m_mapped = false;
+	uint64_t m_version = 1;
+	size_t m_num_records = 0;
+	size_t m_num_sorted = 0;
 
-	// Maps keys to positions in file.
-	std::unordered_map<uint64_t, std::pair<size_t, size_t>> m_pos;
+	// Compression dictionary of the shard, empty if the shard has none.
+	std::string m_dictionary;
 
-	void load();
-	std::string data_at_position(size_t pos);
+	bool map_files();
+	const char *records() const;
+	bool find_record(uint64_t key, HashTablePositions::record &rec);
+	std::string read_value(const HashTablePositions::record &rec) const;
 
 };
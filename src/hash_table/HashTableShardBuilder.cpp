@@ -29,6 +29,7 @@
 #include "logger/logger.h"
 #include "file/File.h"
 #include "indexer/merger.h"
+#include <set>
 
 using namespace std;
 
@@ -50,33 +51,29 @@ void HashTableShardBuilder::write() {
 
 	std::lock_guard guard(m_lock);
 
+	// Records are appended in the current format, so older pos files are converted first.
+	if (pos_file_version() < HashTablePositions::format_version) sort();
+
 	ofstream outfile(filename_data(), ios::binary | ios::app);
 	ofstream outfile_pos(filename_pos(), ios::binary | ios::app);
 
+	if (outfile_pos.tellp() == 0) HashTablePositions::write_header(outfile_pos, 0);
+
 	size_t last_pos = outfile.tellp();
 
+	const string dictionary = read_dictionary();
+
 	for (const auto &iter : m_cache) {
 		outfile.write((char *)&iter.first, Config::ht_key_size);
 
-		// Compress data
-		stringstream ss(iter.second);
-
-		boost::iostreams::filtering_istream compress_stream;
-		compress_stream.push(boost::iostreams::gzip_compressor());
-		compress_stream.push(ss);
-
-		stringstream compressed;
-		compressed << compress_stream.rdbuf();
-
-		string compressed_string(compressed.str());
+		const string compressed_string = HashTableCompression::compress(iter.second, dictionary);
 
 		const size_t data_len = compressed_string.size();
 		outfile.write((char *)&data_len, sizeof(size_t));
 
 		outfile.write(compressed_string.c_str(), data_len);
 
-		outfile_pos.write((char *)&iter.first, Config::ht_key_size);
-		outfile_pos.write((char *)&last_pos, sizeof(size_t));
+		HashTablePositions::write_record(outfile_pos, HashTablePositions::record{iter.first, last_pos, data_len});
 		last_pos += data_len + Config::ht_key_size + sizeof(size_t);
 	}
 
@@ -85,6 +82,10 @@ void HashTableShardBuilder::write() {
 
 void HashTableShardBuilder::truncate() {
 	std::lock_guard guard(m_lock);
+	// Unlink instead of truncating in place, shards may have the positions file mapped.
+	File::delete_file(filename_data());
+	File::delete_file(filename_pos());
+	File::delete_file(filename_dict());
 	ofstream outfile(filename_data(), ios::binary | ios::trunc);
 	ofstream outfile_pos(filename_pos(), ios::binary | ios::trunc);
 }
@@ -93,13 +94,20 @@ void HashTableShardBuilder::sort() {
 
 	read_keys();
 
-	ofstream outfile_pos(filename_pos(), ios::binary | ios::trunc);
+	/*
+		Write to a temporary file and rename it so shards that have the old file mapped keep reading the old file.
+	*/
+	ofstream outfile_pos(filename_pos_tmp(), ios::binary | ios::trunc);
+	HashTablePositions::write_header(outfile_pos, m_sort_pos.size());
 	for (const auto &iter : m_sort_pos) {
-		outfile_pos.write((char *)&iter.first, Config::ht_key_size);
-		outfile_pos.write((char *)&iter.second, sizeof(size_t));
+		HashTablePositions::write_record(outfile_pos, iter.second);
 	}
 	outfile_pos.close();
 	m_sort_pos.clear();
+
+	if (rename(filename_pos_tmp().c_str(), filename_pos().c_str()) != 0) {
+		LOG_ERROR("Could not rename " + filename_pos_tmp() + " to " + filename_pos());
+	}
 }
 
 void HashTableShardBuilder::optimize() {
@@ -135,6 +143,12 @@ void HashTableShardBuilder::optimize() {
 		hash_map[key] = string(buffer, data_len);
 	}
 
+	delete [] buffer;
+
+	const bool has_dictionary = recompress(hash_map);
+
+	HashTablePositions::write_header(outfile_pos, hash_map.size());
+
 	size_t last_pos = 0;
 	for (const auto &iter : hash_map) {
 		const size_t key = iter.first;
@@ -143,8 +157,7 @@ void HashTableShardBuilder::optimize() {
 		outfile_data.write((char *)&data_len, sizeof(size_t));
 		outfile_data.write(iter.second.c_str(), data_len);
 
-		outfile_pos.write((char *)&key, Config::ht_key_size);
-		outfile_pos.write((char *)&last_pos, sizeof(size_t));
+		HashTablePositions::write_record(outfile_pos, HashTablePositions::record{key, last_pos, data_len});
 
 		last_pos += data_len + Config::ht_key_size + sizeof(size_t);
 	}
@@ -152,14 +165,71 @@ void HashTableShardBuilder::optimize() {
 	outfile_data.close();
 	outfile_pos.close();
 
-	File::copy_file(filename_data_tmp(), filename_data());
-	File::copy_file(filename_pos_tmp(), filename_pos());
-	File::delete_file(filename_data_tmp());
-	File::delete_file(filename_pos_tmp());
+	/*
+		Rename the files instead of rewriting them in place, shards that have the old files mapped keep reading them. The dictionary is
+		replaced right after the data it compresses and the pos file last.
+	*/
+	if (rename(filename_data_tmp().c_str(), filename_data().c_str()) != 0) {
+		LOG_ERROR("Could not rename " + filename_data_tmp() + " to " + filename_data());
+	}
+	if (!has_dictionary) {
+		File::delete_file(filename_dict());
+	} else if (rename(filename_dict_tmp().c_str(), filename_dict().c_str()) != 0) {
+		LOG_ERROR("Could not rename " + filename_dict_tmp() + " to " + filename_dict());
+	}
+	if (rename(filename_pos_tmp().c_str(), filename_pos().c_str()) != 0) {
+		LOG_ERROR("Could not rename " + filename_pos_tmp() + " to " + filename_pos());
+	}
 
 	sort();
 }
 
+/*
+ * Trains a new dictionary on the values and compresses all the values with it. The values in hash_map are compressed and are
+ * replaced in place. Shards that are too small for a dictionary and never had one are left as they are. Values that can not be
+ * decompressed are logged and kept as they are stored. The new dictionary is written to the tmp file and optimize renames it together
+ * with the data, returns false if the values are stored without dictionary.
+ * */
+bool HashTableShardBuilder::recompress(map<size_t, string> &hash_map) {
+
+	const string old_dictionary = read_dictionary();
+
+	if (hash_map.size() < HashTableCompression::min_training_samples && old_dictionary.empty()) return false;
+
+	set<size_t> corrupt_keys;
+	for (auto &iter : hash_map) {
+		string value;
+		if (HashTableCompression::try_decompress(iter.second.c_str(), iter.second.size(), old_dictionary, value)) {
+			iter.second = std::move(value);
+		} else {
+			LOG_ERROR("Could not decompress value for key " + to_string(iter.first) + " in " + filename_data() + ", keeping it as stored");
+			corrupt_keys.insert(iter.first);
+		}
+	}
+
+	// Train on at most max_training_samples values spread evenly over the shard.
+	const size_t step = hash_map.size() / m_max_training_samples + 1;
+	vector<string> samples;
+	size_t idx = 0;
+	for (const auto &iter : hash_map) {
+		if (idx++ % step == 0 && !corrupt_keys.count(iter.first)) samples.push_back(iter.second);
+	}
+	const string dictionary = HashTableCompression::train_dictionary(samples);
+	samples.clear();
+
+	for (auto &iter : hash_map) {
+		if (corrupt_keys.count(iter.first)) continue;
+		iter.second = HashTableCompression::compress(iter.second, dictionary);
+	}
+
+	if (dictionary.empty()) return false;
+
+	ofstream outfile_dict(filename_dict_tmp(), ios::binary | ios::trunc);
+	outfile_dict.write(dictionary.c_str(), dictionary.size());
+
+	return true;
+}
+
 void HashTableShardBuilder::add(uint64_t key, const string &value) {
 	std::lock_guard guard(m_lock);
 	m_cache[key] = value;
@@ -175,6 +245,11 @@ string HashTableShardBuilder::filename_pos() const {
 	return "/mnt/" + to_string(disk_shard) + "/hash_table/ht_" + m_db_name + "_" + to_string(m_shard_id) + ".pos";
 }
 
+string HashTableShardBuilder::filename_dict() const {
+	size_t disk_shard = m_shard_id % 8;
+	return "/mnt/" + to_string(disk_shard) + "/hash_table/ht_" + m_db_name + "_" + to_string(m_shard_id) + ".dict";
+}
+
 string HashTableShardBuilder::filename_data_tmp() const {
 	size_t disk_shard = m_shard_id % 8;
 	return "/mnt/" + to_string(disk_shard) + "/hash_table/ht_" + m_db_name + "_" + to_string(m_shard_id) + ".data.tmp";
@@ -185,26 +260,61 @@ string HashTableShardBuilder::filename_pos_tmp() const {
 	return "/mnt/" + to_string(disk_shard) + "/hash_table/ht_" + m_db_name + "_" + to_string(m_shard_id) + ".pos.tmp";
 }
 
+string HashTableShardBuilder::filename_dict_tmp() const {
+	size_t disk_shard = m_shard_id % 8;
+	return "/mnt/" + to_string(disk_shard) + "/hash_table/ht_" + m_db_name + "_" + to_string(m_shard_id) + ".dict.tmp";
+}
+
+/*
+ * Reads all the records in the pos file into m_sort_pos, later records replace earlier records with the same key.
+ * */
 void HashTableShardBuilder::read_keys() {
-	ifstream infile(filename_pos(), ios::binary);
-	const size_t record_len = Config::ht_key_size + sizeof(size_t);
-	const size_t buffer_len = record_len * 10000;
-	char buffer[buffer_len];
+	ifstream infile(filename_pos(), ios::binary | ios::ate);
+	if (!infile.is_open()) return;
 
-	if (infile.is_open()) {
-		do {
-			infile.read(buffer, buffer_len);
+	const size_t file_size = infile.tellg();
+	infile.seekg(0, ios::beg);
 
-			size_t read_bytes = infile.gcount();
+	vector<char> buffer(file_size);
+	infile.read(buffer.data(), file_size);
+	infile.close();
 
-			for (size_t i = 0; i < read_bytes; i += record_len) {
-				const uint64_t key = *((uint64_t *)&buffer[i]);
-				const size_t pos = *((size_t *)&buffer[i + Config::ht_key_size]);
-				m_sort_pos[key] = pos;
+	const uint64_t version = HashTablePositions::read_version(buffer.data(), buffer.size());
+	const size_t header_len = version >= 2 ? HashTablePositions::header_len : 0;
+	const size_t num_records = (buffer.size() - std::min(header_len, buffer.size())) / HashTablePositions::record_len(version);
+
+	// Version 1 files only have the value lengths in the data file.
+	ifstream infile_data;
+	if (version < 2) infile_data.open(filename_data(), ios::binary);
+
+	for (size_t i = 0; i < num_records; i++) {
+		HashTablePositions::record rec = HashTablePositions::read_record(buffer.data() + header_len, i, version);
+		if (rec.len == HashTablePositions::unknown_len) {
+			infile_data.seekg(rec.pos + Config::ht_key_size, ios::beg);
+			if (!infile_data.read((char *)&rec.len, sizeof(size_t))) {
+				LOG_ERROR("Could not read value length at " + to_string(rec.pos) + " in " + filename_data());
+				infile_data.clear();
+				continue;
 			}
-
-		} while (!infile.eof());
+		}
+		m_sort_pos[rec.key] = rec;
 	}
-	infile.close();
 }
 
+uint64_t HashTableShardBuilder::pos_file_version() const {
+	ifstream infile(filename_pos(), ios::binary);
+	char header[HashTablePositions::header_len];
+	infile.read(header, HashTablePositions::header_len);
+	const size_t read_bytes = infile.gcount();
+
+	// Empty files are written in the current format.
+	if (read_bytes == 0) return HashTablePositions::format_version;
+
+	return HashTablePositions::read_version(header, read_bytes);
+}
+
+string HashTableShardBuilder::read_dictionary() const {
+	ifstream infile(filename_dict(), ios::binary);
+	if (!infile.is_open()) return "";
+	return string(istreambuf_iterator<char>(infile), istreambuf_iterator<char>());
+}
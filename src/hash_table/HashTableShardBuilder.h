@@ -31,6 +31,8 @@
 #include <mutex>
 
 #include "HashTable.h"
+#include "HashTablePositions.h"
+#include "HashTableCompression.h"
 
 class HashTableShardBuilder {
 
@@ -51,6 +53,8 @@ public:
 	std::string filename_pos() const;
 	std::string filename_data_tmp() const;
 	std::string filename_pos_tmp() const;
+	std::string filename_dict() const;
+	std::string filename_dict_tmp() const;
 
 private:
 
@@ -58,9 +62,15 @@ private:
 	const std::string m_db_name;
 	size_t m_shard_id;
 	const size_t m_cache_limit;
-	std::map<uint64_t, size_t> m_sort_pos;
+	std::map<uint64_t, HashTablePositions::record> m_sort_pos;
 	std::mutex m_lock;
 
+	// Number of values the dictionary is trained on.
+	const size_t m_max_training_samples = 4096;
+
 	void read_keys();
+	std::string read_dictionary() const;
+	bool recompress(std::map<size_t, std::string> &hash_map);
+	uint64_t pos_file_version() const;
 
 };
@@ -28,6 +28,9 @@
 
 #include <iostream>
 #include <vector>
+#include <array>
+#include <atomic>
+#include <mutex>
 #include <map>
 #include <cstring>
 #include <cassert>
@@ -36,7 +39,6 @@
 #include "algorithm/hyper_log_log.h"
 #include "config.h"
 #include "logger/logger.h"
-#include "memory/debugger.h"
 
 namespace indexer {
 
@@ -83,11 +85,22 @@ namespace indexer {
 		const size_t m_max_num_keys = 10000;
 		const size_t m_buffer_len = Config::ft_shard_builder_buffer_len;
 		char *m_buffer;
-		std::mutex m_lock;
+		// Serializes writes to the cache files, records are added while the merger appends.
+		std::mutex m_append_lock;
+
+		/*
+			Records added by add() are staged in one of m_num_stripes buffers picked by the calling thread, so indexer threads adding to the
+			same builder do not wait for each other. Aligned to avoid false sharing between the stripes.
+		*/
+		struct alignas(64) staging_buffer {
+			std::mutex lock;
+			std::vector<uint64_t> keys;
+			std::vector<data_record> records;
+		};
+		static const size_t m_num_stripes = 16;
+		std::array<staging_buffer, m_num_stripes> m_staging;
 
 		// Caches
-		std::vector<uint64_t> m_keys;
-		std::vector<data_record> m_records;
 		std::map<uint64_t, std::vector<data_record>> m_cache;
 		std::map<uint64_t, size_t> m_result_sizes;
 
@@ -98,6 +111,9 @@ namespace indexer {
 		float m_avg_document_size = 0.0f;
 		size_t m_unique_document_count = 0;
 
+		static size_t stripe_id();
+		size_t cache_size();
+		size_t merge_size();
 		void read_append_cache();
 		void read_data_to_cache();
 		bool read_page(std::ifstream &reader);
@@ -127,22 +143,22 @@ namespace indexer {
 	template<typename data_record>
 	index_builder<data_record>::index_builder(const std::string &db_name, size_t id)
 	: m_db_name(db_name), m_id(id), m_hash_table_size(Config::shard_hash_table_size), m_max_results(Config::ft_max_results_per_section) {
-		merger::register_merger((size_t)this, [this]() {merge();});
-		merger::register_appender((size_t)this, [this]() {append();});
+		merger::register_merger((size_t)this, [this]() {merge();}, [this]() {return merge_size();});
+		merger::register_appender((size_t)this, [this]() {append();}, [this]() {return cache_size();});
 	}
 
 	template<typename data_record>
 	index_builder<data_record>::index_builder(const std::string &db_name, size_t id, size_t hash_table_size)
 	: m_db_name(db_name), m_id(id), m_hash_table_size(hash_table_size), m_max_results(Config::ft_max_results_per_section) {
-		merger::register_merger((size_t)this, [this]() {append();});
-		merger::register_appender((size_t)this, [this]() {append();});
+		merger::register_merger((size_t)this, [this]() {append();}, [this]() {return cache_size();});
+		merger::register_appender((size_t)this, [this]() {append();}, [this]() {return cache_size();});
 	}
 
 	template<typename data_record>
 	index_builder<data_record>::index_builder(const std::string &db_name, size_t id, size_t hash_table_size, size_t max_results)
 	: m_db_name(db_name), m_id(id), m_hash_table_size(hash_table_size), m_max_results(max_results) {
-		merger::register_merger((size_t)this, [this]() {append();});
-		merger::register_appender((size_t)this, [this]() {append();});
+		merger::register_merger((size_t)this, [this]() {append();}, [this]() {return cache_size();});
+		merger::register_appender((size_t)this, [this]() {append();}, [this]() {return cache_size();});
 	}
 
 	template<typename data_record>
@@ -155,22 +171,32 @@ namespace indexer {
 
 		indexer::merger::lock();
 
-		m_lock.lock();
+		staging_buffer &staging = m_staging[stripe_id()];
+
+		std::lock_guard guard(staging.lock);
 
 		// Amortized constant
-		m_keys.push_back(key);
-		m_records.push_back(record);
+		staging.keys.push_back(key);
+		staging.records.push_back(record);
 
-		assert(m_records.size() == m_keys.size());
+		assert(staging.records.size() == staging.keys.size());
 
-		m_lock.unlock();
+	}
 
+	/*
+		Returns the staging buffer of the calling thread. Threads get consecutive ids so up to m_num_stripes threads never share a buffer.
+	*/
+	template<typename data_record>
+	size_t index_builder<data_record>::stripe_id() {
+		static std::atomic<size_t> next_id = 0;
+		thread_local const size_t id = next_id++ % m_num_stripes;
+		return id;
 	}
 
 	template<typename data_record>
 	void index_builder<data_record>::append() {
 
-		assert(m_records.size() == m_keys.size());
+		std::lock_guard append_guard(m_append_lock);
 
 		std::ofstream record_writer(cache_filename(), std::ios::binary | std::ios::app);
 		if (!record_writer.is_open()) {
@@ -184,49 +210,67 @@ namespace indexer {
 				std::string(strerror(errno)));
 		}
 
-		record_writer.write((const char *)m_records.data(), m_records.size() * sizeof(data_record));
-		key_writer.write((const char *)m_keys.data(), m_keys.size() * sizeof(uint64_t));
+		for (staging_buffer &staging : m_staging) {
 
-		m_records.clear();
-		m_keys.clear();
-		m_records.shrink_to_fit();
-		m_keys.shrink_to_fit();
+			// Take the staged records so add() can continue while they are written.
+			std::vector<uint64_t> keys;
+			std::vector<data_record> records;
+			staging.lock.lock();
+			keys.swap(staging.keys);
+			records.swap(staging.records);
+			staging.lock.unlock();
+
+			assert(records.size() == keys.size());
+
+			record_writer.write((const char *)records.data(), records.size() * sizeof(data_record));
+			key_writer.write((const char *)keys.data(), keys.size() * sizeof(uint64_t));
+		}
 	}
 
 	template<typename data_record>
 	void index_builder<data_record>::merge() {
 
-		//const size_t mem_before = memory::allocated_memory();
-
-		memory::reset_usage();
+		std::lock_guard append_guard(m_append_lock);
 
 		{
 			std::unique_ptr<::algorithm::hyper_log_log<size_t>> hll =
 				std::make_unique<::algorithm::hyper_log_log<size_t>>();
 
 			read_meta(hll);
-			memory::record_usage();
 			read_append_cache();
-			memory::record_usage();
 			count_unique(hll);
-			memory::record_usage();
 			sort_cache();
-			memory::record_usage();
 			save_file();
-			memory::record_usage();
 			save_meta(hll);
-			memory::record_usage();
 			truncate_cache_files();
-			memory::record_usage();
 		}
+	}
 
-		//const size_t mem_usage = memory::get_usage();
-		//const size_t mem_peak = memory::get_usage_peak();
-		//const size_t mem_after = memory::allocated_memory();
-
-		/*std::cout << "did merge: " << target_filename() << " mem bef: " << mem_before << " mem_after: " << mem_after << " mem_usage: " << mem_usage
-			<< " mem_peak: " << mem_peak << std::endl;*/
+	/*
+		Number of bytes cached in memory by add().
+	*/
+	template<typename data_record>
+	size_t index_builder<data_record>::cache_size() {
+		size_t size = 0;
+		for (staging_buffer &staging : m_staging) {
+			std::lock_guard guard(staging.lock);
+			size += staging.records.capacity() * sizeof(data_record) + staging.keys.capacity() * sizeof(uint64_t);
+		}
+		return size;
+	}
 
+	/*
+		Estimated number of bytes read into memory by merge(), the records cached in memory, the cache file and the current shard files
+		that read_append_cache() reads before merging the cache into them.
+	*/
+	template<typename data_record>
+	size_t index_builder<data_record>::merge_size() {
+		size_t size = cache_size();
+		for (const std::string &filename : {cache_filename(), target_filename(), key_filename()}) {
+			std::ifstream reader(filename, std::ios::binary | std::ios::ate);
+			if (reader.is_open()) size += (size_t)reader.tellg();
+		}
+		return size;
 	}
 
 	/*
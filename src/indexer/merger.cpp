@@ -25,10 +25,16 @@
  */
 
 #include "merger.h"
+#include "config.h"
 #include "memory/memory.h"
 #include "memory/debugger.h"
 #include "utils/thread_pool.hpp"
 #include <map>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 #include <chrono>
 #include <thread>
 
@@ -38,114 +44,240 @@ namespace indexer {
 
 	namespace merger {
 
+		// Fraction of the total memory where the largest builders start to be appended to disk.
 		const double mem_limit = 0.5;
-
-		bool is_merging = false;
-		map<size_t, std::function<void()>> mergers;
-		map<size_t, std::function<void()>> appenders;
+		// Appending continues until this fraction of the total memory is estimated to be allocated.
+		const double mem_limit_low = 0.4;
+		// Writers wait in lock() while more than this fraction of the total memory is allocated.
+		const double mem_limit_hard = 0.7;
+
+		struct registered_function {
+			std::function<void()> run;
+			std::function<size_t()> size;
+		};
+
+		map<size_t, registered_function> mergers;
+		map<size_t, registered_function> appenders;
+		// Number of running merges and appends per builder id, deregister_merger waits for them.
+		map<size_t, size_t> running;
 		mutex merger_lock;
+		condition_variable running_cond;
+
+		atomic<bool> writers_paused = false;
+		mutex writers_lock;
+		condition_variable writers_cond;
 
-		void wait_for_merges() {
-			while (is_merging) {
-				std::this_thread::sleep_for(100ms);
+		void pause_writers(bool pause) {
+			if (writers_paused == pause) return;
+			{
+				lock_guard guard(writers_lock);
+				writers_paused = pause;
 			}
+			if (!pause) writers_cond.notify_all();
 		}
 
 		void lock() {
-			if (is_merging) {
-				wait_for_merges();
+			if (writers_paused) {
+				unique_lock<mutex> lock(writers_lock);
+				writers_cond.wait(lock, []() {
+					return !writers_paused;
+				});
 			}
 		}
 
 		void register_appender(size_t id, std::function<void()> append) {
-			merger_lock.lock();
-			appenders[id] = append;
-			merger_lock.unlock();
+			register_appender(id, append, nullptr);
+		}
+
+		void register_appender(size_t id, std::function<void()> append, std::function<size_t()> size) {
+			lock_guard guard(merger_lock);
+			appenders[id] = registered_function{append, size};
 		}
 
 		void register_merger(size_t id, std::function<void()> merge) {
-			merger_lock.lock();
-			mergers[id] = merge;
-			merger_lock.unlock();
+			register_merger(id, merge, nullptr);
+		}
+
+		void register_merger(size_t id, std::function<void()> merge, std::function<size_t()> size) {
+			lock_guard guard(merger_lock);
+			mergers[id] = registered_function{merge, size};
 		}
 
 		void deregister_merger(size_t id) {
-			merger_lock.lock();
+			unique_lock<mutex> lock(merger_lock);
 			appenders.erase(id);
 			mergers.erase(id);
-			merger_lock.unlock();
+			running_cond.wait(lock, [id]() {
+				return running.count(id) == 0;
+			});
+		}
+
+		/*
+			Returns pairs of (size, id) for the registered functions, the largest first. Builders without a size function are last.
+		*/
+		vector<pair<size_t, size_t>> sizes_largest_first(const map<size_t, registered_function> &functions) {
+			vector<pair<size_t, size_t>> sizes;
+			{
+				lock_guard guard(merger_lock);
+				sizes.reserve(functions.size());
+				for (const auto &iter : functions) {
+					sizes.emplace_back(iter.second.size ? iter.second.size() : 0, iter.first);
+				}
+			}
+			sort(sizes.begin(), sizes.end(), [](const pair<size_t, size_t> &a, const pair<size_t, size_t> &b) {
+				return a.first > b.first;
+			});
+			return sizes;
+		}
+
+		/*
+			Runs the registered function of the builder if it is still registered. The builder can not be deregistered while it runs.
+		*/
+		void run_registered(map<size_t, registered_function> &functions, size_t id) {
+			std::function<void()> fun;
+			{
+				lock_guard guard(merger_lock);
+				auto iter = functions.find(id);
+				if (iter == functions.end()) return;
+				fun = iter->second.run;
+				running[id]++;
+			}
+
+			try {
+				fun();
+			} catch (...) {
+
+			}
+
+			{
+				lock_guard guard(merger_lock);
+				if (--running[id] == 0) running.erase(id);
+			}
+			running_cond.notify_all();
 		}
 
-		bool merge_thread_is_running = true;
+		atomic<bool> merge_thread_is_running = true;
 		thread merge_thread_obj;
 
-		void append_all() {
-			is_merging = true;
-			this_thread::sleep_for(1000ms);
+		/*
+			Appends the largest builders until at least bytes_to_free bytes are estimated to be written. Builders without a size are only
+			appended when the known sizes are not enough. Writers keep adding to all other builders meanwhile.
+		*/
+		void append_largest(size_t bytes_to_free) {
 
-			size_t available_memory = memory::get_total_memory();
+			vector<pair<size_t, size_t>> sizes = sizes_largest_first(appenders);
 
-			std::cout << "APPENDING ALL: " << appenders.size() << " mergers allocated memory: " << memory::allocated_memory() << " limit is: " <<
-				(available_memory * mem_limit) << std::endl;
-			
-			utils::thread_pool pool(24);
+			size_t num_appends = 0;
+			size_t bytes_appended = 0;
+			while (num_appends < sizes.size() && bytes_appended < bytes_to_free) {
+				bytes_appended += sizes[num_appends].first;
+				num_appends++;
+			}
 
-			merger_lock.lock();
-			for (auto &iter : appenders) {
-				pool.enqueue([iter]() {
-					try {
-						iter.second();
-					} catch (...) {
+			std::cout << "APPENDING: " << num_appends << " of " << sizes.size() << " appenders allocated memory: " << memory::allocated_memory()
+				<< " estimated bytes: " << bytes_appended << std::endl;
 
-					}
+			utils::thread_pool pool(Config::indexer_merge_threads);
+
+			for (size_t i = 0; i < num_appends; i++) {
+				const size_t id = sizes[i].second;
+				pool.enqueue([id]() {
+					run_registered(appenders, id);
 				});
 			}
 
 			pool.run_all();
 
 			cout << "done... allocated memory: " << memory::allocated_memory() << endl;
+		}
 
-			merger_lock.unlock();
-			is_merging = false;
+		void append_all() {
+			append_largest(SIZE_MAX);
+		}
+
+		/*
+			Size of the memory budget for concurrent merges.
+		*/
+		size_t merge_memory_budget() {
+			if (Config::indexer_merge_memory_mb > 0) return Config::indexer_merge_memory_mb * 1024ull * 1024ull;
+			return memory::get_total_memory() * mem_limit;
 		}
 
+		/*
+			Runs all merges on Config::indexer_merge_threads threads, the largest first. A merge only starts when its size fits within the
+			memory budget together with the running merges, or when no other merge is running.
+		*/
 		void merge_all() {
-			is_merging = true;
-			this_thread::sleep_for(1000ms);
 
-			size_t available_memory = memory::get_total_memory();
+			vector<pair<size_t, size_t>> sizes = sizes_largest_first(mergers);
+
+			const size_t budget = merge_memory_budget();
 
-			std::cout << "MERGING ALL: " << mergers.size() << " mergers allocated memory: " << memory::allocated_memory() << " limit is: " <<
-				(available_memory * mem_limit) << std::endl;
-			
-			utils::thread_pool pool(1);
-
-			for (auto &iter : mergers) {
-				pool.enqueue([iter]() {
-					try {
-						iter.second();
-					} catch (...) {
-						
+			std::cout << "MERGING ALL: " << sizes.size() << " mergers allocated memory: " << memory::allocated_memory() << " budget is: " <<
+				budget << std::endl;
+
+			mutex budget_lock;
+			condition_variable budget_cond;
+			size_t running_bytes = 0;
+
+			utils::thread_pool pool(Config::indexer_merge_threads);
+
+			for (const auto &iter : sizes) {
+				const size_t size = iter.first;
+				const size_t id = iter.second;
+				pool.enqueue([size, id, budget, &budget_lock, &budget_cond, &running_bytes]() {
+					{
+						unique_lock<mutex> lock(budget_lock);
+						budget_cond.wait(lock, [size, budget, &running_bytes]() {
+							return running_bytes == 0 || running_bytes + size <= budget;
+						});
+						running_bytes += size;
 					}
+
+					run_registered(mergers, id);
+
+					{
+						lock_guard guard(budget_lock);
+						running_bytes -= size;
+					}
+					budget_cond.notify_all();
 				});
 			}
 
 			pool.run_all();
 
 			cout << "done... allocated memory: " << memory::allocated_memory() << endl;
-
-			is_merging = false;
 		}
 
+		/*
+			Appends the largest builders when the allocated memory goes above mem_limit. Writers are paused during the appends when the
+			hard limit is reached and stay paused after a round only while the appends free memory. The allocated memory also counts
+			memory that is not held by the builders so the hard limit can be out of reach, then the writers are resumed.
+		*/
 		void merge_thread() {
 			memory::update();
 			size_t available_memory = memory::get_total_memory();
+			bool hard_limit_unreachable = false;
 			while (merge_thread_is_running) {
-				if (memory::allocated_memory() > available_memory * mem_limit) {
-					append_all();
+				const size_t allocated = memory::allocated_memory();
+				if (allocated > available_memory * mem_limit_hard) {
+					pause_writers(true);
+				}
+				if (allocated > available_memory * mem_limit) {
+					append_largest(allocated - available_memory * mem_limit_low);
+				}
+				const size_t allocated_after = memory::allocated_memory();
+				const bool above_hard_limit = allocated_after > available_memory * mem_limit_hard;
+				const bool freed_memory = allocated_after < allocated;
+				if (above_hard_limit && !freed_memory && !hard_limit_unreachable) {
+					cout << "appending did not free memory, allocated memory " << allocated_after << " is above the hard limit " <<
+						(size_t)(available_memory * mem_limit_hard) << ", resuming writers" << endl;
 				}
+				hard_limit_unreachable = above_hard_limit && !freed_memory;
+				pause_writers(above_hard_limit && freed_memory);
 				this_thread::sleep_for(100ms);
 			}
+			pause_writers(false);
 		}
 
 		void start_merge_thread() {
@@ -35,8 +35,16 @@ namespace indexer {
 
 	namespace merger {
 		void lock();
+
+		/*
+			Registers the merge and append functions of a builder. The optional size function returns the number of bytes the builder has
+			cached, that is used to flush the largest builders first and to schedule the final merges within the memory budget.
+			deregister_merger waits for running merges and appends of the builder to finish.
+		*/
 		void register_merger(size_t id, std::function<void()> merge);
+		void register_merger(size_t id, std::function<void()> merge, std::function<size_t()> size);
 		void register_appender(size_t id, std::function<void()> append);
+		void register_appender(size_t id, std::function<void()> append, std::function<size_t()> size);
 		void deregister_merger(size_t id);
 
 		void start_merge_thread();
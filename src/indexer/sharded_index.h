@@ -84,7 +84,9 @@ namespace indexer {
 			results.emplace_back(find(key));
 		}
 
-		return ::algorithm::intersection(results);
+		return ::algorithm::intersection(results, [](data_record &a, const data_record &b) {}, [](const data_record &record) -> const uint64_t & {
+			return record.m_value;
+		});
 	}
 
 }
@@ -26,63 +26,75 @@
 
 #include "logger.h"
 #include <thread>
-#include <queue>
+#include <atomic>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
 
 using namespace std;
 
 namespace logger {
 
+	/*
+		Log records are formatted by the logging thread straight into a slot of a bounded ring buffer (a multi producer single consumer
+		queue with a sequence number per slot) and written by the logger thread with writev in batches. Logging never takes a lock or
+		allocates. When the buffer is full error messages wait up to m_error_wait for a free slot, other messages are dropped and counted.
+	*/
+	const size_t num_slots = 4096;
+	const size_t record_len = 1024;
+	const size_t max_batch = 256;
+
+	struct alignas(64) slot {
+		atomic<size_t> sequence;
+		size_t len;
+		char text[record_len];
+	};
+
+	slot m_ring[num_slots];
+	alignas(64) atomic<size_t> m_enqueue_pos = 0;
+	alignas(64) atomic<size_t> m_dequeue_pos = 0;
+	atomic<size_t> m_dropped = 0;
+
 	thread m_logger_thread;
-	mutex *m_lock = nullptr;
-	queue<string> *m_queue = nullptr;
-	ofstream m_file;
+	int m_fd = -1;
 	chrono::seconds m_reopen_interval = std::chrono::seconds(300);
+	chrono::milliseconds m_error_wait = std::chrono::milliseconds(100);
 	chrono::system_clock::time_point m_last_reopen;
-	bool m_verbose = false;
-	bool m_run_logger = true;
-	bool m_logger_started = false;
+	atomic<bool> m_verbose = false;
+	atomic<bool> m_run_logger = true;
+	atomic<bool> m_logger_started = false;
 
 	void verbose(bool verbose) {
 		m_verbose = verbose;
 	}
 
 	void initialize() {
-		m_lock = new mutex;
-		m_queue = new queue<string>;
+		for (size_t i = 0; i < num_slots; i++) {
+			m_ring[i].sequence.store(i, memory_order_relaxed);
+		}
+		m_enqueue_pos = 0;
+		m_dequeue_pos = 0;
+		m_last_reopen = chrono::system_clock::time_point{};
 		m_logger_started = true;
 	}
 
 	void de_initialize() {
-		delete m_lock;
-		delete m_queue;
-		m_lock = nullptr;
-		m_queue = nullptr;
 		m_logger_started = false;
+		if (m_fd >= 0) ::close(m_fd);
+		m_fd = -1;
 	}
 
+	/*
+		Reopens the log file every m_reopen_interval so rotated files are released. Only called from the logger thread.
+	*/
 	void reopen() {
 		auto now = chrono::system_clock::now();
-		m_lock->lock();
 		if (now - m_last_reopen > m_reopen_interval) {
 			m_last_reopen = now;
-			try {
-				m_file.close();
-			} catch (...) {
-
-			}
-			try {
-				m_file.open(Config::log_file_path, ofstream::out | ofstream::app);
-				m_last_reopen = chrono::system_clock::now();
-			} catch (exception &error) {
-				try {
-					m_file.close();
-				} catch (...) {
-					
-				}
-				throw error;
-			}
+			if (m_fd >= 0) ::close(m_fd);
+			m_fd = ::open(Config::log_file_path.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
 		}
-		m_lock->unlock();
 	}
 
 	string timestamp() {
@@ -96,6 +108,22 @@ namespace logger {
 		return buffer;
 	}
 
+	/*
+		Writes the timestamp to buffer without allocating, the formatted second is cached per thread.
+	*/
+	void timestamp(char *buffer) {
+		thread_local time_t last_time = 0;
+		thread_local char last_timestamp[20] = {0};
+		const time_t tt = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+		if (tt != last_time) {
+			tm gmt{}; gmtime_r(&tt, &gmt);
+			snprintf(last_timestamp, sizeof(last_timestamp), "%04d-%02d-%02d %02d:%02d:%02d", gmt.tm_year + 1900, (short)gmt.tm_mon + 1,
+				(short)gmt.tm_mday, (short)gmt.tm_hour, (short)gmt.tm_min, (short)gmt.tm_sec);
+			last_time = tt;
+		}
+		memcpy(buffer, last_timestamp, sizeof(last_timestamp));
+	}
+
 	string format(const string &type, const string &file, int line, const string &message, const string &meta) {
 		string output;
 		output.append(timestamp());
@@ -106,42 +134,151 @@ namespace logger {
 		return output;
 	}
 
+	/*
+		Claims the next free slot, returns nullptr if the ring buffer is full.
+	*/
+	slot *claim_slot(size_t &pos) {
+		pos = m_enqueue_pos.load(memory_order_relaxed);
+		while (true) {
+			slot *s = &m_ring[pos % num_slots];
+			const size_t sequence = s->sequence.load(memory_order_acquire);
+			const intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+			if (diff == 0) {
+				if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) return s;
+			} else if (diff < 0) {
+				return nullptr;
+			} else {
+				pos = m_enqueue_pos.load(memory_order_relaxed);
+			}
+		}
+	}
+
+	slot *claim_slot(size_t &pos, bool wait) {
+		slot *s = claim_slot(pos);
+		if (s != nullptr || !wait) return s;
+		const auto deadline = chrono::steady_clock::now() + m_error_wait;
+		while (s == nullptr && chrono::steady_clock::now() < deadline) {
+			this_thread::yield();
+			s = claim_slot(pos);
+		}
+		return s;
+	}
+
+	void publish_slot(slot *s, size_t pos, size_t len) {
+		// Records longer than the slot are truncated, every record ends with a newline.
+		if (len >= record_len) len = record_len - 1;
+		s->text[len] = '\n';
+		s->len = len + 1;
+		s->sequence.store(pos + 1, memory_order_release);
+	}
+
 	void log_message(const string &type, const string &file, int line, const string &message, const string &meta) {
-		log_string(format(type, file, line, message, meta));
+		if (!m_logger_started) return; // logger thread not started.
+
+		size_t pos;
+		slot *s = claim_slot(pos, type == "error");
+		if (s == nullptr) {
+			m_dropped.fetch_add(1, memory_order_relaxed);
+			return;
+		}
+
+		timestamp(s->text);
+		const int len = snprintf(s->text + 19, record_len - 19, " [%s] %s:%d %s %s", type.c_str(), file.c_str(), line, message.c_str(),
+			meta.c_str());
+		publish_slot(s, pos, 19 + max(len, 0));
 	}
 
 	void log_string(const string &message) {
-		if (!m_logger_started || m_lock == nullptr || m_queue == nullptr) return; // logger thread not started.
-		m_lock->lock();
-		if (m_verbose) cout << message << endl;
-		m_queue->push(message);
-		m_lock->unlock();
+		if (!m_logger_started) return; // logger thread not started.
+
+		size_t pos;
+		slot *s = claim_slot(pos, false);
+		if (s == nullptr) {
+			m_dropped.fetch_add(1, memory_order_relaxed);
+			return;
+		}
+
+		const size_t len = min(message.size(), record_len - 1);
+		memcpy(s->text, message.data(), len);
+		publish_slot(s, pos, len);
 	}
 
 	void log(const string &type, const string &file, int line, const string &message) {
 		log_message(type, file, line, message, "");
 	}
 
-	void write_message_to_logfile(const string &message) {
-		m_file << message << endl;
+	size_t num_dropped() {
+		return m_dropped;
 	}
 
-	void logger_thread() {
-		initialize();
-		reopen();
-		while (true) {
-			while (m_queue->empty() && m_run_logger) {
-				std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	void write_all(int fd, struct iovec *iov, int iovcnt) {
+		while (iovcnt > 0) {
+			ssize_t written = ::writev(fd, iov, iovcnt);
+			if (written < 0) {
+				if (errno == EINTR) continue;
+				return;
+			}
+			while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+				written -= iov->iov_len;
+				iov++;
+				iovcnt--;
 			}
+			if (iovcnt > 0) {
+				iov->iov_base = (char *)iov->iov_base + written;
+				iov->iov_len -= written;
+			}
+		}
+	}
 
-			if (m_queue->empty()) break;
+	/*
+		Writes up to max_batch published records with one writev and releases their slots. Returns the number of records written.
+	*/
+	size_t write_batch() {
+		struct iovec iov[max_batch + 1];
+		const size_t start = m_dequeue_pos.load(memory_order_relaxed);
+		size_t num = 0;
+		while (num < max_batch) {
+			slot *s = &m_ring[(start + num) % num_slots];
+			if (s->sequence.load(memory_order_acquire) != start + num + 1) break;
+			iov[num].iov_base = s->text;
+			iov[num].iov_len = s->len;
+			num++;
+		}
+
+		if (num == 0) return 0;
 
-			m_lock->lock();
-			string message = m_queue->front();
-			m_queue->pop();
-			m_lock->unlock();
+		if (m_fd >= 0) write_all(m_fd, iov, num);
+		if (m_verbose) {
+			for (size_t i = 0; i < num; i++) iov[i] = {m_ring[(start + i) % num_slots].text, m_ring[(start + i) % num_slots].len};
+			write_all(STDOUT_FILENO, iov, num);
+		}
 
-			write_message_to_logfile(message);
+		for (size_t i = 0; i < num; i++) {
+			m_ring[(start + i) % num_slots].sequence.store(start + i + num_slots, memory_order_release);
+		}
+		m_dequeue_pos.store(start + num, memory_order_release);
+
+		return num;
+	}
+
+	void write_dropped() {
+		static size_t reported = 0;
+		const size_t dropped = m_dropped.load(memory_order_relaxed) - reported;
+		if (dropped == 0 || m_fd < 0) return;
+		reported += dropped;
+		string message = timestamp() + " [error] logger: dropped " + to_string(dropped) + " messages\n";
+		struct iovec iov = {message.data(), message.size()};
+		write_all(m_fd, &iov, 1);
+	}
+
+	void logger_thread() {
+		initialize();
+		while (true) {
+			reopen();
+			write_dropped();
+			if (write_batch() > 0) continue;
+			if (!m_run_logger) break;
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
 		}
 
 		de_initialize();
@@ -167,8 +304,14 @@ namespace logger {
 		}
 	}
 
+	/*
+		Waits until the records logged so far are written, at most one second.
+	*/
 	void sync() {
-		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		const size_t pos = m_enqueue_pos.load();
+		for (size_t i = 0; i < 1000 && m_logger_started && m_dequeue_pos.load() < pos; i++) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
 	}
 
 	logged_exception::logged_exception(const string &message, const string &file, int line)
@@ -177,4 +320,3 @@ namespace logger {
 		m_formatted_message = format("EXCEPTION", m_file, m_line, m_message, "");
 	}
 }
-
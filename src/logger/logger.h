@@ -48,6 +48,9 @@ namespace logger {
 	void log(const std::string &type, const std::string &file, int line, const std::string &message);
 	void log(const std::string &type, const std::string &file, int line, const std::string &message, const std::string &meta);
 
+	// Number of messages dropped because the log buffer was full.
+	size_t num_dropped();
+
 	void start_logger_thread();
 	void join_logger_thread();
 	void sync();
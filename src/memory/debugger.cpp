@@ -29,15 +29,43 @@
 #include <new>
 #include <cstdlib>
 #include <array>
-#include <mutex>
+#include <atomic>
 
 using namespace std;
 
 namespace memory {
 
-	mutex lock;
-	size_t mem_counter;
-	size_t ptr_counter;
+	/*
+		Allocations are counted per thread so operator new and delete never wait for each other. Every thread gets one of num_counters
+		cache line aligned counters, the counters are summed when read. Memory is often freed by another thread than the one that allocated
+		it so a single counter can be negative.
+	*/
+	struct alignas(64) thread_counter {
+		atomic<int64_t> mem_counter = 0;
+		atomic<int64_t> ptr_counter = 0;
+	};
+
+	const size_t num_counters = 256;
+	array<thread_counter, num_counters> counters;
+	atomic<size_t> next_counter = 0;
+
+	inline thread_counter &current_counter() {
+		// No allocations here, this is called from operator new.
+		thread_local const size_t counter_id = next_counter.fetch_add(1, memory_order_relaxed) % num_counters;
+		return counters[counter_id];
+	}
+
+	inline void count_allocation(size_t n) {
+		thread_counter &counter = current_counter();
+		counter.mem_counter.fetch_add(n, memory_order_relaxed);
+		counter.ptr_counter.fetch_add(1, memory_order_relaxed);
+	}
+
+	inline void count_deallocation(size_t n) {
+		thread_counter &counter = current_counter();
+		counter.mem_counter.fetch_sub(n, memory_order_relaxed);
+		counter.ptr_counter.fetch_sub(1, memory_order_relaxed);
+	}
 
 	bool debugger_enabled() {
 		return false;
@@ -56,11 +84,19 @@ namespace memory {
 	}
 
 	size_t allocated_memory() {
-		return mem_counter;
+		int64_t sum = 0;
+		for (const thread_counter &counter : counters) {
+			sum += counter.mem_counter.load(memory_order_relaxed);
+		}
+		return sum > 0 ? sum : 0;
 	}
 
 	size_t num_allocated() {
-		return ptr_counter;
+		int64_t sum = 0;
+		for (const thread_counter &counter : counters) {
+			sum += counter.ptr_counter.load(memory_order_relaxed);
+		}
+		return sum > 0 ? sum : 0;
 	}
 
 	size_t record_usage_base = 0;
@@ -96,10 +132,7 @@ void *operator new(size_t n) {
 	void *m = malloc(n + sizeof(size_t));
 
 	if (m) {
-		memory::lock.lock();
-		memory::mem_counter += n;
-		memory::ptr_counter++;
-		memory::lock.unlock();
+		memory::count_allocation(n);
 		static_cast<size_t *>(m)[0] = n;
 		return &(static_cast<size_t *>(m)[1]);
 	}
@@ -112,10 +145,7 @@ void *operator new[](size_t n) {
 	void *m = malloc(n + sizeof(size_t));
 
 	if (m) {
-		memory::lock.lock();
-		memory::mem_counter += n;
-		memory::ptr_counter++;
-		memory::lock.unlock();
+		memory::count_allocation(n);
 		static_cast<size_t *>(m)[0] = n;
 		return &(static_cast<size_t *>(m)[1]);
 	}
@@ -128,10 +158,7 @@ void operator delete(void *p) noexcept {
 	void *realp = &(static_cast<size_t *>(p)[-1]);
 	const size_t n = static_cast<size_t *>(p)[-1];
 
-	memory::lock.lock();
-	memory::mem_counter -= n;
-	memory::ptr_counter--;
-	memory::lock.unlock();
+	memory::count_deallocation(n);
 
 	free(realp);
 }
@@ -141,10 +168,7 @@ void operator delete[](void *p) noexcept {
 	void *realp = &(static_cast<size_t *>(p)[-1]);
 	const size_t n = static_cast<size_t *>(p)[-1];
 
-	memory::lock.lock();
-	memory::mem_counter -= n;
-	memory::ptr_counter--;
-	memory::lock.unlock();
+	memory::count_deallocation(n);
 
 	free(realp);
 }
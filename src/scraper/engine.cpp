@@ -0,0 +1,268 @@
+/*
+ * MIT License
+ *
+ * Alexandria.org
+ *
+ * Copyright (c) 2021 Josef Cullhed, <info@alexandria.org>, et al.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "engine.h"
+#include "hash/Hash.h"
+#include "logger/logger.h"
+
+using namespace std;
+
+namespace Scraper {
+
+	engine::engine(store *store, size_t num_threads) :
+		m_store(store)
+	{
+		for (size_t i = 0; i < num_threads; i++) {
+			auto new_worker = make_unique<worker>();
+			new_worker->multi = curl_multi_init();
+			new_worker->wheel = make_unique<timer_wheel<scraper *>>(m_tick_ms, m_num_slots, now_ms());
+			m_workers.push_back(move(new_worker));
+		}
+	}
+
+	engine::~engine() {
+		stop();
+		for (auto &worker : m_workers) {
+			for (const auto &iter : worker->requests) {
+				curl_multi_remove_handle(worker->multi, iter.first);
+			}
+			worker->requests.clear();
+			// The scraper destructors upload the domain info.
+			worker->scrapers.clear();
+			worker->finished.clear();
+			curl_multi_cleanup(worker->multi);
+		}
+		curl_slist_free_all(m_connect_to);
+	}
+
+	void engine::set_connect_to(const string &host_port) {
+		m_connect_to = curl_slist_append(m_connect_to, ("::" + host_port).c_str());
+	}
+
+	void engine::push_urls(const vector<string> &urls) {
+		map<string, vector<URL>> domain_urls;
+		for (const string &url_str : urls) {
+			URL url(url_str);
+			domain_urls[url.host()].push_back(url);
+		}
+		if (domain_urls.empty()) return;
+
+		vector<string> domains;
+		for (const auto &iter : domain_urls) {
+			domains.push_back(iter.first);
+		}
+
+		vector<UrlStore::DomainData> domain_datas;
+		int error = UrlStore::get_many(domains, domain_datas);
+		if (error == UrlStore::ERROR || domain_datas.size() != domains.size()) {
+			LOG_INFO("Could not download domain data");
+			domain_datas.assign(domains.size(), UrlStore::DomainData());
+		}
+
+		size_t domain_idx = 0;
+		for (auto &iter : domain_urls) {
+			worker &worker = *m_workers[Hash::str(iter.first) % m_workers.size()];
+			lock_guard guard(worker.lock);
+			worker.incoming.push_back(new_urls{iter.first, domain_datas[domain_idx++], move(iter.second)});
+		}
+	}
+
+	void engine::start() {
+		m_running = true;
+		for (auto &worker : m_workers) {
+			worker->thread = thread([this, &worker]() {
+				this->run_worker(*worker);
+			});
+		}
+	}
+
+	void engine::stop() {
+		m_running = false;
+		for (auto &worker : m_workers) {
+			if (worker->thread.joinable()) worker->thread.join();
+		}
+	}
+
+	bool engine::finished() {
+		for (auto &worker : m_workers) {
+			lock_guard guard(worker->lock);
+			if (worker->incoming.size() || worker->scrapers.size()) return false;
+		}
+		return true;
+	}
+
+	size_t engine::num_scrapers() {
+		size_t num_scrapers = 0;
+		for (auto &worker : m_workers) {
+			lock_guard guard(worker->lock);
+			num_scrapers += worker->scrapers.size() + worker->incoming.size();
+		}
+		return num_scrapers;
+	}
+
+	bool engine::full() {
+		return num_scrapers() >= m_max_connections * m_domains_per_connection;
+	}
+
+	/*
+	 * Counts all scrapers in stats. Finished scrapers are counted once and then destroyed, the unfinished scrapers are counted from the
+	 * counts the workers made on their threads.
+	 * */
+	void engine::gather_statistics(stats &stats, size_t urls_in_queue) {
+		vector<unique_ptr<scraper>> finished;
+		stats.start_count(urls_in_queue);
+		for (auto &worker : m_workers) {
+			lock_guard guard(worker->lock);
+			stats.count_unfinished(worker->counts);
+			for (auto &finished_scraper : worker->finished) {
+				stats.count_finished(*finished_scraper);
+				finished.push_back(move(finished_scraper));
+			}
+			worker->finished.clear();
+		}
+		stats.end_count();
+	}
+
+	void engine::run_worker(worker &worker) {
+		while (m_running) {
+			add_incoming(worker);
+			start_requests(worker);
+			read_responses(worker);
+			count_scrapers(worker);
+			curl_multi_poll(worker.multi, nullptr, 0, m_tick_ms, nullptr);
+		}
+	}
+
+	void engine::add_incoming(worker &worker) {
+		lock_guard guard(worker.lock);
+		for (new_urls &domain_urls : worker.incoming) {
+			auto iter = worker.scrapers.find(domain_urls.domain);
+			if (iter == worker.scrapers.end()) {
+				auto new_scraper = make_unique<scraper>(domain_urls.domain, m_store);
+				new_scraper->set_domain_data(domain_urls.domain_data);
+				new_scraper->set_connect_to(m_connect_to);
+				new_scraper->set_timeout(m_timeout);
+				// Downloads robots.txt on the next tick.
+				worker.wheel->schedule(new_scraper.get(), 0);
+				iter = worker.scrapers.emplace(domain_urls.domain, move(new_scraper)).first;
+			}
+			for (const URL &url : domain_urls.urls) {
+				iter->second->push_url(url);
+			}
+		}
+		worker.incoming.clear();
+	}
+
+	/*
+	 * Starts requests for the domains that are due, as long as the worker is below its share of the max connections. Domains over the
+	 * limit stay ready until requests finish.
+	 * */
+	void engine::start_requests(worker &worker) {
+		worker.wheel->advance(now_ms(), worker.ready);
+
+		const size_t max_requests = max(m_max_connections / m_workers.size(), (size_t)1);
+		size_t num_started = 0;
+		for (; num_started < worker.ready.size() && worker.requests.size() < max_requests; num_started++) {
+			start_request(worker, worker.ready[num_started]);
+		}
+		worker.ready.erase(worker.ready.begin(), worker.ready.begin() + num_started);
+	}
+
+	void engine::start_request(worker &worker, scraper *scraper) {
+		URL url;
+		const bool robots = !scraper->has_robots();
+		if (robots) {
+			url = scraper->robots_url();
+		} else if (!scraper->next_url(url)) {
+			finish_scraper(worker, scraper);
+			return;
+		}
+
+		scraper->prepare_request(url);
+		worker.requests[scraper->curl()] = request{scraper, url, robots};
+		curl_multi_add_handle(worker.multi, scraper->curl());
+	}
+
+	void engine::read_responses(worker &worker) {
+		int running_handles;
+		curl_multi_perform(worker.multi, &running_handles);
+
+		int msgs_left;
+		CURLMsg *msg;
+		while ((msg = curl_multi_info_read(worker.multi, &msgs_left)) != nullptr) {
+			if (msg->msg != CURLMSG_DONE) continue;
+
+			CURL *curl = msg->easy_handle;
+			const CURLcode res = msg->data.result;
+			curl_multi_remove_handle(worker.multi, curl);
+
+			auto iter = worker.requests.find(curl);
+			const request req = iter->second;
+			worker.requests.erase(iter);
+
+			if (req.robots) {
+				req.owner->handle_robots_response(res, req.url);
+			} else {
+				req.owner->handle_response(res, req.url);
+			}
+
+			worker.wheel->schedule(req.owner, req.owner->next_delay_ms());
+		}
+	}
+
+	void engine::finish_scraper(worker &worker, scraper *scraper) {
+		scraper->finish();
+		lock_guard guard(worker.lock);
+		auto iter = worker.scrapers.find(scraper->domain());
+		worker.finished.push_back(move(iter->second));
+		worker.scrapers.erase(iter);
+		// Count the unfinished scrapers again on this tick, the finished scraper is counted by gather_statistics.
+		worker.counted_ms = 0;
+	}
+
+	void engine::count_scrapers(worker &worker) {
+		const size_t now = now_ms();
+		if (now < worker.counted_ms + m_count_interval_ms) return;
+		worker.counted_ms = now;
+
+		scraper_counts counts;
+		for (const auto &iter : worker.scrapers) {
+			counts.num_scrapers++;
+			counts.num_scraped += iter.second->num_scraped();
+			counts.num_scraped_non200 += iter.second->num_scraped_non200();
+			counts.num_errors += iter.second->num_errors();
+			counts.num_assigned += iter.second->size();
+		}
+
+		lock_guard guard(worker.lock);
+		worker.counts = counts;
+	}
+
+	size_t engine::now_ms() const {
+		return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+}
@@ -0,0 +1,127 @@
+/*
+ * MIT License
+ *
+ * Alexandria.org
+ *
+ * Copyright (c) 2021 Josef Cullhed, <info@alexandria.org>, et al.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <unordered_map>
+#include <curl/curl.h>
+#include "scraper.h"
+#include "timer_wheel.h"
+
+namespace Scraper {
+
+	/*
+	 * Scrapes many domains from a few threads. The domains are partitioned over the threads, every thread drives its domains with a
+	 * curl multi handle and keeps each domain in a timer wheel until its next request is allowed. A domain has at most one request in
+	 * flight so the politeness of the scraper class is kept.
+	 * */
+	class engine {
+		public:
+
+			engine(store *store, size_t num_threads = 4);
+			~engine();
+
+			void set_timeout(size_t timeout) { m_timeout = timeout; }
+			void set_max_connections(size_t max_connections) { m_max_connections = max_connections; }
+			// Sends all requests to host:port instead of the host of the url, used to scrape a local server in tests.
+			void set_connect_to(const std::string &host_port);
+
+			// Adds urls to the scrapers of their domains, domain data of the domains is downloaded with one request.
+			void push_urls(const std::vector<std::string> &urls);
+
+			void start();
+			void stop();
+			bool finished();
+
+			/*
+			 * Number of domains with a scraper or with urls waiting to be added to a scraper. The engine is full when it has
+			 * m_domains_per_connection domains per connection, most of the domains wait for their next request.
+			 * */
+			size_t num_scrapers();
+			bool full();
+
+			// Counts the finished scrapers and the last counts of the unfinished scrapers from the workers.
+			void gather_statistics(stats &stats, size_t urls_in_queue);
+
+		private:
+
+			struct request {
+				scraper *owner;
+				URL url;
+				bool robots;
+			};
+
+			struct new_urls {
+				std::string domain;
+				UrlStore::DomainData domain_data;
+				std::vector<URL> urls;
+			};
+
+			struct worker {
+				std::thread thread;
+				CURLM *multi;
+				std::unique_ptr<timer_wheel<scraper *>> wheel;
+				std::vector<scraper *> ready;
+				std::unordered_map<CURL *, request> requests;
+
+				// Guards incoming, finished, counts and insertions and removals in scrapers.
+				std::mutex lock;
+				std::vector<new_urls> incoming;
+				std::map<std::string, std::unique_ptr<scraper>> scrapers;
+				std::vector<std::unique_ptr<scraper>> finished;
+				// Counts of the unfinished scrapers, made by the worker thread since only it changes the scrapers.
+				scraper_counts counts;
+				size_t counted_ms = 0;
+			};
+
+			store *m_store;
+			std::vector<std::unique_ptr<worker>> m_workers;
+			std::atomic<bool> m_running = false;
+			std::atomic<size_t> m_timeout = 30;
+			std::atomic<size_t> m_max_connections = 1000;
+			curl_slist *m_connect_to = nullptr;
+			const size_t m_tick_ms = 100;
+			const size_t m_num_slots = 4096;
+			const size_t m_domains_per_connection = 10;
+			const size_t m_count_interval_ms = 1000;
+
+			void run_worker(worker &worker);
+			void add_incoming(worker &worker);
+			void start_requests(worker &worker);
+			void start_request(worker &worker, scraper *scraper);
+			void read_responses(worker &worker);
+			void finish_scraper(worker &worker, scraper *scraper);
+			void count_scrapers(worker &worker);
+			size_t now_ms() const;
+
+	};
+
+}
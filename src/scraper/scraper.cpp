@@ -25,6 +25,7 @@
  */
 
 #include "scraper.h"
+#include "engine.h"
 #include "parser/HtmlParser.h"
 #include "system/datetime.h"
 #include "text/text.h"
@@ -101,6 +102,14 @@ namespace Scraper {
 		m_urls_assigned += scraper.size();
 	}
 
+	void stats::count_unfinished(const scraper_counts &counts) {
+		m_unfinished_scraped_urls += counts.num_scraped;
+		m_unfinished_scraped_urls_non200 += counts.num_scraped_non200;
+		m_unfinished_scraped_errors += counts.num_errors;
+		m_unfinished_scrapers += counts.num_scrapers;
+		m_urls_assigned += counts.num_assigned;
+	}
+
 	void stats::run() {
 		size_t time_start = Profiler::timestamp();
 		while (m_running) {
@@ -150,22 +159,28 @@ namespace Scraper {
 		download_domain_data();
 		download_robots();
 
-		while (m_queue.size()) {
-			URL url = filter_url(m_queue.front());
-			m_queue.pop();
-			if (robots_allow_url(url)) {
-				if (m_timeout) {
-					this_thread::sleep_for(std::chrono::seconds(m_timeout/2 + (rand() % m_timeout)));
-				}
-				handle_url(url);
-			}
-			if (m_consecutive_error_count > 20) break;
+		URL url;
+		while (next_url(url)) {
+			this_thread::sleep_for(std::chrono::milliseconds(next_delay_ms()));
+			handle_url(url);
 		}
 
 		m_finished = true;
 	}
 
-	void scraper::handle_url(const URL &url) {
+	void scraper::set_domain_data(const UrlStore::DomainData &domain_data) {
+		m_domain_data = domain_data;
+		m_domain_data.m_domain = m_domain;
+	}
+
+	URL scraper::robots_url() {
+		return filter_url(URL("http://" + m_domain + "/robots.txt"));
+	}
+
+	/*
+	 * Sets up m_curl for a request to url, the response is written to m_buffer.
+	 * */
+	void scraper::prepare_request(const URL &url) {
 		m_buffer.resize(0);
 		curl_easy_setopt(m_curl, CURLOPT_USERAGENT, user_agent().c_str());
 		curl_easy_setopt(m_curl, CURLOPT_FOLLOWLOCATION, 1l);
@@ -175,9 +190,33 @@ namespace Scraper {
 		curl_easy_setopt(m_curl, CURLOPT_URL, url.str().c_str());
 		curl_easy_setopt(m_curl, CURLOPT_TIMEOUT, 30);
 		curl_easy_setopt(m_curl, CURLOPT_ERRORBUFFER, m_curl_error_buffer);
+		if (m_connect_to != nullptr) curl_easy_setopt(m_curl, CURLOPT_CONNECT_TO, m_connect_to);
+	}
 
+	/*
+	 * Pops the next url that robots.txt allows us to scrape. Returns false when the scraper is done.
+	 * */
+	bool scraper::next_url(URL &url) {
+		while (m_queue.size() && m_consecutive_error_count <= 20) {
+			url = filter_url(m_queue.front());
+			m_queue.pop();
+			if (robots_allow_url(url)) return true;
+		}
+		return false;
+	}
+
+	size_t scraper::next_delay_ms() const {
+		if (m_timeout == 0) return 0;
+		return (m_timeout/2 + (rand() % m_timeout)) * 1000;
+	}
+
+	void scraper::handle_url(const URL &url) {
+		prepare_request(url);
 		CURLcode res = curl_easy_perform(m_curl);
+		handle_response(res, url);
+	}
 
+	void scraper::handle_response(CURLcode res, const URL &url) {
 		if (res == CURLE_OK) {
 			m_consecutive_error_count = 0;
 			long response_code;
@@ -255,7 +294,6 @@ namespace Scraper {
 		m_num_errors++;
 		m_consecutive_error_count++;
 		m_store->add_curl_error(url.str() + "\t" + to_string(curl_error) + "\t" + error_msg + "\n");
-		m_store->upload_curl_errors();
 	}
 
 	void scraper::handle_200_response(const string &data, size_t response_code, const string &ip, const URL &url) {
@@ -291,7 +329,6 @@ namespace Scraper {
 					+ '\n');
 			}
 			m_store->add_link_data(links);
-			m_store->upload_results();
 		}
 	}
 
@@ -316,7 +353,6 @@ namespace Scraper {
 				+ '\t' + ip
 				+ '\n');
 			m_store->add_non_200_scraper_data(line);
-			m_store->upload_non_200_results();
 		}
 	}
 
@@ -335,8 +371,15 @@ namespace Scraper {
 	}
 
 	void scraper::download_robots() {
-		const URL robots_path = filter_url(URL("http://" + m_domain + "/robots.txt"));
-		m_robots_content = simple_get(robots_path);
+		const URL robots_path = robots_url();
+		prepare_request(robots_path);
+		CURLcode res = curl_easy_perform(m_curl);
+		handle_robots_response(res, robots_path);
+	}
+
+	void scraper::handle_robots_response(CURLcode res, const URL &url) {
+		m_robots_content = simple_get_response(res, url);
+		m_has_robots = true;
 
 		scraper::upload_robots_txt(m_robots_content);
 	}
@@ -348,17 +391,12 @@ namespace Scraper {
 	}
 
 	string scraper::simple_get(const URL &url) {
-		curl_easy_setopt(m_curl, CURLOPT_USERAGENT, user_agent().c_str());
-		curl_easy_setopt(m_curl, CURLOPT_FOLLOWLOCATION, 1l);
-		curl_easy_setopt(m_curl, CURLOPT_MAXREDIRS, 5l);
-		curl_easy_setopt(m_curl, CURLOPT_WRITEFUNCTION, curl_string_reader);
-		curl_easy_setopt(m_curl, CURLOPT_WRITEDATA, this);
-		curl_easy_setopt(m_curl, CURLOPT_URL, url.str().c_str());
-		curl_easy_setopt(m_curl, CURLOPT_TIMEOUT, 30);
-		curl_easy_setopt(m_curl, CURLOPT_ERRORBUFFER, m_curl_error_buffer);
-
-		m_buffer.resize(0);
+		prepare_request(url);
 		CURLcode res = curl_easy_perform(m_curl);
+		return simple_get_response(res, url);
+	}
+
+	string scraper::simple_get_response(CURLcode res, const URL &url) {
 		if (res == CURLE_OK) {
 			long response_code;
 			char *new_url_str = nullptr;
@@ -463,71 +501,45 @@ namespace Scraper {
 	}
 
 	void run_scraper_on_urls(const vector<string> &input_urls) {
-		size_t max_scrapers = 1000;
 		Scraper::store store;
 		Scraper::stats stats;
-		map<string, unique_ptr<scraper>> scrapers;
+		Scraper::engine engine(&store);
 
 		stats.start_thread(60); // Report statistics every minute.
+		engine.start();
 
 		vector<string> urls = input_urls;
-		while (urls.size() || scrapers.size()) {
-
-			LOG_INFO("Starting scrapers with: " + to_string(urls.size()) + " urls");
+		while (urls.size() || !engine.finished()) {
 
-			size_t new_max_scrapers = read_max_scrapers();
-			if (new_max_scrapers) {
-				max_scrapers = new_max_scrapers;
+			// The max number of scrapers limits the number of concurrent requests.
+			size_t max_scrapers = read_max_scrapers();
+			if (max_scrapers) {
+				engine.set_max_connections(max_scrapers);
 			}
 
-			vector<string> unhandled_urls;
-
-			for (const string &url_str : urls) {
-				URL url(url_str);
-
-				if (scrapers.count(url.host()) == 0) {
-					if (scrapers.size() >= max_scrapers) {
-						unhandled_urls.push_back(url_str);
-					} else {
-						scrapers[url.host()] = make_unique<scraper>(url.host(), &store);
-						scrapers[url.host()]->push_url(url);
-					}
-				} else {
-					scrapers[url.host()]->push_url(url);
-				}
-			}
-			// Start scrapers.
-			for (auto &iter : scrapers) {
-				if (!iter.second->started()) {
-					iter.second->start_thread();
-				}
-			}
-			
-			// Wait for some scrapers to finish before we assign new scrapers again.
-			while (scrapers.size() > max_scrapers * 0.8) {
-				stats.gather_statistics(scrapers, urls.size());
-				for (auto iter = scrapers.begin(); iter != scrapers.end(); ) {
-					if (iter->second->finished()) {
-						iter = scrapers.erase(iter);
-					} else {
-						iter++;
-					}
-				}
+			// Wait for some domains to finish before we take new urls.
+			if (engine.full()) {
+				engine.gather_statistics(stats, urls.size());
 				this_thread::sleep_for(1000ms);
+				continue;
 			}
-			stats.gather_statistics(scrapers, urls.size());
-			urls = unhandled_urls;
+
+			LOG_INFO("Starting scrapers with: " + to_string(urls.size()) + " urls");
+
+			engine.push_urls(urls);
 
 			// Check for new urls and append them.
-			vector<string> new_urls = download_scraper_urls();
-			urls.insert(urls.end(), new_urls.begin(), new_urls.end());
+			urls = download_scraper_urls();
+			engine.gather_statistics(stats, urls.size());
 
 			if (urls.size() == 0) {
 				// We don't have any new urls. Just sleep a bit before checking again.
 				std::this_thread::sleep_for(std::chrono::seconds(60));
 			}
 		}
-		
+
+		engine.stop();
+		engine.gather_statistics(stats, 0);
 	}
 
 	void url_downloader() {
@@ -24,6 +24,8 @@
  * SOFTWARE.
  */
 
+#pragma once
+
 #include <iostream>
 #include <queue>
 #include <curl/curl.h>
@@ -61,6 +63,22 @@ namespace Scraper {
 			size_t size() const { return m_queue.size(); }
 			bool blocked() const { return m_blocked; }
 
+			/*
+			 * Non blocking interface used by the engine. The engine performs the requests on curl() and passes the result to the
+			 * handle functions, at most one request per scraper is in flight.
+			 * */
+			CURL *curl() { return m_curl; }
+			void set_domain_data(const UrlStore::DomainData &domain_data);
+			void set_connect_to(curl_slist *connect_to) { m_connect_to = connect_to; }
+			URL robots_url();
+			bool has_robots() const { return m_has_robots; }
+			void prepare_request(const URL &url);
+			void handle_robots_response(CURLcode res, const URL &url);
+			void handle_response(CURLcode res, const URL &url);
+			bool next_url(URL &url);
+			size_t next_delay_ms() const;
+			void finish() { m_finished = true; }
+
 		private:
 			std::thread m_thread;
 			bool m_started = false;
@@ -74,11 +92,13 @@ namespace Scraper {
 			size_t m_num_errors = 0;
 			bool m_blocked = false;
 			CURL *m_curl;
+			curl_slist *m_connect_to = nullptr;
 			store *m_store;
 			std::queue<URL> m_queue;
 			googlebot::RobotsMatcher m_robots;
 			UrlStore::DomainData m_domain_data;
 			std::string m_robots_content;
+			bool m_has_robots = false;
 			size_t m_num_total = 0;
 			size_t m_num_www = 0;
 			size_t m_num_https = 0;
@@ -96,6 +116,7 @@ namespace Scraper {
 			void download_robots();
 			bool robots_allow_url(const URL &url) const;
 			std::string simple_get(const URL &url);
+			std::string simple_get_response(CURLcode res, const URL &url);
 			void upload_domain_info();
 			void upload_robots_txt(const std::string &robots_content);
 			URL filter_url(const URL &url);
@@ -105,6 +126,17 @@ namespace Scraper {
 			friend size_t curl_string_reader(char *ptr, size_t size, size_t nmemb, void *userdata);
 	};
 
+	/*
+	 * Counts of a group of unfinished scrapers.
+	 * */
+	struct scraper_counts {
+		size_t num_scrapers = 0;
+		size_t num_scraped = 0;
+		size_t num_scraped_non200 = 0;
+		size_t num_errors = 0;
+		size_t num_assigned = 0;
+	};
+
 	class stats {
 		public:
 			stats();
@@ -115,6 +147,7 @@ namespace Scraper {
 			void end_count();
 			void count_finished(const scraper &scraper);
 			void count_unfinished(const scraper &scraper);
+			void count_unfinished(const scraper_counts &counts);
 
 		private:
 			std::thread m_thread;
@@ -28,189 +28,297 @@
 #include "system/System.h"
 #include "system/datetime.h"
 #include "parser/Warc.h"
+#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+#include <boost/iostreams/device/back_inserter.hpp>
 
 using namespace std;
 
 namespace Scraper {
 
 	store::store() {
-
+		m_uploader = thread([this]() {
+			this->run_uploader();
+		});
 	}
 	
 	store::~store() {
-		m_upload_limit = 0;
-		upload_results();
-		upload_non_200_results();
-		UrlStore::update_many(m_url_datas, UrlStore::update_url | UrlStore::update_redirect | UrlStore::update_http_code |
-				UrlStore::update_last_visited);
+		{
+			lock_guard guard(m_uploader_lock);
+			m_stopping = true;
+		}
+		m_uploader_cv.notify_one();
+		m_staged_cv.notify_all();
+		m_uploader.join();
+
+		flush();
 	}
 
 	void store::add_url_data(const UrlStore::UrlData &data) {
-		m_lock.lock();
-		m_url_datas.push_back(data);
-		m_lock.unlock();
-		upload_url_datas();
+		staging_buffer &staging = m_staging[stripe_id()];
+		{
+			lock_guard guard(staging.lock);
+			staging.url_datas.push_back(data);
+		}
+		notify_if_full(m_num_url_datas, m_url_data_upload_limit);
 	}
 
 	void store::add_domain_data(const UrlStore::DomainData &data) {
-		m_lock.lock();
-		m_domain_datas.push_back(data);
-		m_lock.unlock();
-		upload_domain_datas();
+		staging_buffer &staging = m_staging[stripe_id()];
+		{
+			lock_guard guard(staging.lock);
+			staging.domain_datas.push_back(data);
+		}
+		notify_if_full(m_num_domain_datas, m_url_data_upload_limit);
 	}
 
 	void store::add_robots_data(const UrlStore::RobotsData &data) {
-		m_lock.lock();
-		m_robots_datas.push_back(data);
-		m_lock.unlock();
-		upload_robots_datas();
+		staging_buffer &staging = m_staging[stripe_id()];
+		{
+			lock_guard guard(staging.lock);
+			staging.robots_datas.push_back(data);
+		}
+		notify_if_full(m_num_robots_datas, m_url_data_upload_limit);
 	}
 
 	void store::add_scraper_data(const std::string &line) {
-		m_lock.lock();
-		m_results.push_back(line);
-		m_lock.unlock();
+		staging_buffer &staging = m_staging[stripe_id()];
+		{
+			lock_guard guard(staging.lock);
+			staging.results.push_back(line);
+			staging.tail_sequence = ++m_result_sequence;
+			staging.tail = line;
+		}
+		notify_if_full(m_num_results, m_upload_limit);
 	}
 
 	void store::add_non_200_scraper_data(const std::string &line) {
-		m_lock.lock();
-		m_non_200_results.push_back(line);
-		m_lock.unlock();
+		staging_buffer &staging = m_staging[stripe_id()];
+		{
+			lock_guard guard(staging.lock);
+			staging.non_200_results.push_back(line);
+		}
+		notify_if_full(m_num_non_200_results, m_non_200_upload_limit);
 	}
 
 	void store::add_link_data(const std::string &links) {
-		m_lock.lock();
-		m_link_results.push_back(links);
-		m_lock.unlock();
+		staging_buffer &staging = m_staging[stripe_id()];
+		{
+			lock_guard guard(staging.lock);
+			staging.link_results.push_back(links);
+		}
+		m_num_link_results++;
 	}
 
 	void store::add_curl_error(const string &line) {
-		m_lock.lock();
-		m_curl_errors.push_back(line);
-		m_lock.unlock();
+		staging_buffer &staging = m_staging[stripe_id()];
+		{
+			lock_guard guard(staging.lock);
+			staging.curl_errors.push_back(line);
+		}
+		notify_if_full(m_num_curl_errors, m_curl_errors_upload_limit);
 	}
 
-	void store::upload_url_datas() {
-		m_lock.lock();
-		if (m_url_datas.size() > 1000) {
-			vector<UrlStore::UrlData> tmp_datas;
-			tmp_datas.swap(m_url_datas);
-			m_lock.unlock();
-			UrlStore::update_many(tmp_datas, UrlStore::update_url | UrlStore::update_redirect | UrlStore::update_http_code |
-					UrlStore::update_last_visited);
-			return;
+	/*
+	 * Returns the last added result.
+	 * */
+	std::string store::tail() {
+		size_t tail_sequence = 0;
+		string tail;
+		for (staging_buffer &staging : m_staging) {
+			lock_guard guard(staging.lock);
+			if (staging.tail_sequence > tail_sequence) {
+				tail_sequence = staging.tail_sequence;
+				tail = staging.tail;
+			}
 		}
-		m_lock.unlock();
+		return tail;
 	}
 
-	void store::upload_domain_datas() {
-		m_lock.lock();
-		if (m_domain_datas.size() > 1000) {
-			vector<UrlStore::DomainData> tmp_datas;
-			tmp_datas.swap(m_domain_datas);
-			m_lock.unlock();
-			UrlStore::update_many(tmp_datas, UrlStore::update_has_https | UrlStore::update_has_www);
-			return;
-		}
-		m_lock.unlock();
+	void store::flush() {
+		upload(true);
 	}
 
-	void store::upload_robots_datas() {
-		m_lock.lock();
-		if (m_robots_datas.size() > 1000) {
-			vector<UrlStore::RobotsData> tmp_datas;
-			tmp_datas.swap(m_robots_datas);
-			m_lock.unlock();
-			UrlStore::update_many(tmp_datas, UrlStore::update_robots);
-			return;
-		}
-		m_lock.unlock();
+	size_t store::num_staged() const {
+		return m_num_url_datas + m_num_domain_datas + m_num_robots_datas + m_num_results + m_num_non_200_results + m_num_link_results +
+			m_num_curl_errors;
 	}
 
-	void store::upload_results() {
-		m_lock.lock();
-		if (m_results.size() >= m_upload_limit) {
-			const string all_results = boost::algorithm::join(m_results, "");
-			const string all_link_results = boost::algorithm::join(m_link_results, "");
+	/*
+	 * Returns the staging buffer of the calling thread. Threads get consecutive ids so up to m_num_stripes threads never share a buffer.
+	 * */
+	size_t store::stripe_id() {
+		static atomic<size_t> next_id = 0;
+		thread_local const size_t id = next_id++ % m_num_stripes;
+		return id;
+	}
 
-			m_results.resize(0);
-			m_link_results.resize(0);
+	/*
+	 * Wakes the uploader when a file is full. Blocks the calling thread while m_max_staged_files files are staged, so the staged data
+	 * is bounded when the uploads can not keep up.
+	 * */
+	void store::notify_if_full(atomic<size_t> &num_staged, size_t limit) {
+		const size_t staged = ++num_staged;
+		if (staged == limit) {
+			m_uploader_cv.notify_one();
+		}
+		if (staged > limit * m_max_staged_files) {
+			unique_lock lock(m_uploader_lock);
+			m_staged_cv.wait(lock, [this, &num_staged, limit]() {
+				return num_staged <= limit * m_max_staged_files || m_stopping;
+			});
+		}
+	}
 
-			m_lock.unlock();
+	void store::run_uploader() {
+		unique_lock lock(m_uploader_lock);
+		while (!m_stopping) {
+			m_uploader_cv.wait_for(lock, chrono::seconds(1));
+			lock.unlock();
+			upload(false);
+			lock.lock();
+		}
+	}
 
-			internal_upload_results(all_results, all_link_results);
+	/*
+	 * Uploads the staged data that reached its upload limit, or all staged data if flush is true.
+	 * */
+	void store::upload(bool flush) {
+		lock_guard upload_guard(m_upload_lock);
 
-			return;
+		if (m_num_url_datas >= m_url_data_upload_limit || (flush && m_num_url_datas)) {
+			swap_staged(&staging_buffer::url_datas, m_num_url_datas);
+			UrlStore::update_many(take_spares(&staging_buffer::url_datas), UrlStore::update_url | UrlStore::update_redirect |
+				UrlStore::update_http_code | UrlStore::update_last_visited);
+		}
+
+		if (m_num_domain_datas >= m_url_data_upload_limit || (flush && m_num_domain_datas)) {
+			swap_staged(&staging_buffer::domain_datas, m_num_domain_datas);
+			UrlStore::update_many(take_spares(&staging_buffer::domain_datas), UrlStore::update_has_https | UrlStore::update_has_www);
 		}
-		m_lock.unlock();
-	}
 
-	void store::upload_non_200_results() {
-		m_lock.lock();
-		if (m_non_200_results.size() >= m_non_200_upload_limit) {
-			const string all_results = boost::algorithm::join(m_non_200_results, "");
+		if (m_num_robots_datas >= m_url_data_upload_limit || (flush && m_num_robots_datas)) {
+			swap_staged(&staging_buffer::robots_datas, m_num_robots_datas);
+			UrlStore::update_many(take_spares(&staging_buffer::robots_datas), UrlStore::update_robots);
+		}
 
-			m_non_200_results.resize(0);
+		if (m_num_results >= m_upload_limit || (flush && m_num_results)) {
+			swap_staged_results();
 
-			m_lock.unlock();
+			const string path = warc_path("files");
+			try_upload_until_complete(Warc::get_result_path(path), compress_spares(&staging_buffer::results));
+			try_upload_until_complete(Warc::get_link_result_path(path), compress_spares(&staging_buffer::link_results));
+		}
 
-			internal_upload_non_200_results(all_results);
+		if (m_num_non_200_results >= m_non_200_upload_limit || (flush && m_num_non_200_results)) {
+			swap_staged(&staging_buffer::non_200_results, m_num_non_200_results);
+			try_upload_until_complete(Warc::get_result_path(warc_path("non-200-responses")),
+				compress_spares(&staging_buffer::non_200_results));
+		}
 
-			return;
+		if (m_num_curl_errors >= m_curl_errors_upload_limit || (flush && m_num_curl_errors)) {
+			swap_staged(&staging_buffer::curl_errors, m_num_curl_errors);
+			try_upload_until_complete(Warc::get_result_path(warc_path("curl-errors")), compress_spares(&staging_buffer::curl_errors));
 		}
-		m_lock.unlock();
 	}
 
-	void store::upload_curl_errors() {
-		m_lock.lock();
-		if (m_curl_errors.size() >= m_curl_errors_upload_limit) {
-			const string all_results = boost::algorithm::join(m_curl_errors, "");
+	/*
+	 * Swaps the staged vectors of all stripes with the empty spares. The scraper threads only wait for the swap.
+	 * */
+	template <typename T>
+	size_t store::swap_staged(vector<T> staging_buffer::*member, atomic<size_t> &num_staged) {
+		size_t num_swapped = 0;
+		for (size_t i = 0; i < m_num_stripes; i++) {
+			lock_guard guard(m_staging[i].lock);
+			std::swap(m_staging[i].*member, m_spares[i].*member);
+			num_swapped += (m_spares[i].*member).size();
+		}
+		num_staged -= num_swapped;
+		notify_swapped();
+		return num_swapped;
+	}
 
-			m_curl_errors.resize(0);
+	/*
+	 * Swaps the results and their links in the same critical section so a result is uploaded in the same file as its links.
+	 * */
+	void store::swap_staged_results() {
+		size_t num_results = 0;
+		size_t num_link_results = 0;
+		for (size_t i = 0; i < m_num_stripes; i++) {
+			lock_guard guard(m_staging[i].lock);
+			std::swap(m_staging[i].results, m_spares[i].results);
+			std::swap(m_staging[i].link_results, m_spares[i].link_results);
+			num_results += m_spares[i].results.size();
+			num_link_results += m_spares[i].link_results.size();
+		}
+		m_num_results -= num_results;
+		m_num_link_results -= num_link_results;
+		notify_swapped();
+	}
 
-			m_lock.unlock();
+	/*
+	 * Wakes the scraper threads blocked in notify_if_full.
+	 * */
+	void store::notify_swapped() {
+		{
+			lock_guard guard(m_uploader_lock);
+		}
+		m_staged_cv.notify_all();
+	}
 
-			internal_upload_curl_errors(all_results);
+	template <typename T>
+	vector<T> store::take_spares(vector<T> staging_buffer::*member) {
+		vector<T> datas;
+		for (staging_buffer &spare : m_spares) {
+			datas.insert(datas.end(), (spare.*member).begin(), (spare.*member).end());
+			(spare.*member).clear();
+		}
+		return datas;
+	}
 
-			return;
+	string store::compress_spares(vector<string> staging_buffer::*member) {
+		vector<const vector<string> *> lines;
+		for (staging_buffer &spare : m_spares) {
+			lines.push_back(&(spare.*member));
+			m_num_uploaded_lines += (spare.*member).size();
+		}
+		const string compressed = compress_lines(lines);
+		for (staging_buffer &spare : m_spares) {
+			(spare.*member).clear();
 		}
-		m_lock.unlock();
+		return compressed;
 	}
 
-	std::string store::tail() const {
-		if (m_results.size() == 0) return "";
-		return m_results.back();
+	/*
+	 * Compresses the joined lines with a streaming gzip, the lines are never joined uncompressed.
+	 * */
+	string store::compress_lines(const vector<const vector<string> *> &lines) {
+		string compressed;
+		boost::iostreams::filtering_ostream gz_stream;
+		gz_stream.push(boost::iostreams::gzip_compressor());
+		gz_stream.push(boost::iostreams::back_inserter(compressed));
+		for (const vector<string> *group : lines) {
+			for (const string &line : *group) {
+				gz_stream.write(line.data(), line.size());
+			}
+		}
+		gz_stream.reset();
+		return compressed;
 	}
 
-	void store::try_upload_until_complete(const string &path, const string &data) {
+	void store::try_upload_until_complete(const string &path, const string &compressed_data) {
 
 		size_t retry_num = 1;
-		while (Transfer::upload_gz_file(path, data) == Transfer::ERROR) {
+		while (Transfer::upload_file(path, compressed_data) == Transfer::ERROR) {
 			LOG_INFO("Error uploading file " + path + " retry no " + to_string(retry_num++));
 			std::this_thread::sleep_for(std::chrono::seconds(30));
 		}
 	}
 
-	void store::internal_upload_results(const string &all_results, const string &all_link_results) {
+	string store::warc_path(const string &dir) {
 		const string thread_hash = to_string(System::thread_id());
-		const string warc_path = "crawl-data/ALEXANDRIA-SCRAPER-01/files/" + thread_hash + "-" + to_string(System::cur_datetime()) + "-" +
+		return "crawl-data/ALEXANDRIA-SCRAPER-01/" + dir + "/" + thread_hash + "-" + to_string(System::cur_datetime()) + "-" +
 			to_string(m_file_index++) + ".warc.gz";
-		try_upload_until_complete(Warc::get_result_path(warc_path), all_results);
-		try_upload_until_complete(Warc::get_link_result_path(warc_path), all_link_results);
-	}
-
-	void store::internal_upload_non_200_results(const string &all_results) {
-		const string thread_hash = to_string(System::thread_id());
-		const string warc_path = "crawl-data/ALEXANDRIA-SCRAPER-01/non-200-responses/" + thread_hash + "-" + to_string(System::cur_datetime()) +
-			"-" + to_string(m_file_index++) + ".warc.gz";
-		try_upload_until_complete(Warc::get_result_path(warc_path), all_results);
-	}
-
-	void store::internal_upload_curl_errors(const string &all_results) {
-		const string thread_hash = to_string(System::thread_id());
-		const string warc_path = "crawl-data/ALEXANDRIA-SCRAPER-01/curl-errors/" + thread_hash + "-" + to_string(System::cur_datetime()) +
-			"-" + to_string(m_file_index++) + ".warc.gz";
-		try_upload_until_complete(Warc::get_result_path(warc_path), all_results);
 	}
 
 }
@@ -24,6 +24,13 @@
  * SOFTWARE.
  */
 
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 #include "urlstore/UrlStore.h"
 #include "urlstore/UrlData.h"
 #include "urlstore/DomainData.h"
@@ -33,6 +40,10 @@ namespace Scraper {
 
 	/*
 	 * Responsible for storing scraper data on a file and upload it to our fileserver when the file reaches a number of urls.
+	 *
+	 * The scraper threads append to per thread staging buffers. A background uploader swaps out the staged data when a file is full,
+	 * compresses it with a streaming gzip and uploads it, so adding data never waits for serialization or the network. If the uploads
+	 * fall behind, for example while the fileserver is down, the scraper threads block when m_max_staged_files files are staged.
 	 * */
 	class store {
 		public:
@@ -46,32 +57,77 @@ namespace Scraper {
 			void add_non_200_scraper_data(const std::string &line);
 			void add_link_data(const std::string &links);
 			void add_curl_error(const std::string &line);
-			void upload_url_datas();
-			void upload_domain_datas();
-			void upload_robots_datas();
-			void upload_results();
-			void upload_non_200_results();
-			void upload_curl_errors();
-			std::string tail() const;
+			std::string tail();
+
+			// Uploads all staged data.
+			void flush();
+			// Number of items staged and not yet handed to the uploader.
+			size_t num_staged() const;
+			// Number of result, link, non 200 and curl error lines compressed for upload.
+			size_t num_uploaded_lines() const { return m_num_uploaded_lines; }
+
+			static std::string compress_lines(const std::vector<const std::vector<std::string> *> &lines);
 
 		private:
-			std::mutex m_lock;
-			std::vector<UrlStore::UrlData> m_url_datas;
-			std::vector<UrlStore::DomainData> m_domain_datas;
-			std::vector<UrlStore::RobotsData> m_robots_datas;
-			std::vector<std::string> m_results;
-			std::vector<std::string> m_non_200_results;
-			std::vector<std::string> m_link_results;
-			std::vector<std::string> m_curl_errors;
+
+			/*
+			 * Staged data, one buffer per stripe. The uploader swaps the vectors with its spare buffers so both sides keep their
+			 * allocations. Aligned to avoid false sharing between the stripes.
+			 * */
+			struct alignas(64) staging_buffer {
+				std::mutex lock;
+				std::vector<UrlStore::UrlData> url_datas;
+				std::vector<UrlStore::DomainData> domain_datas;
+				std::vector<UrlStore::RobotsData> robots_datas;
+				std::vector<std::string> results;
+				std::vector<std::string> non_200_results;
+				std::vector<std::string> link_results;
+				std::vector<std::string> curl_errors;
+				size_t tail_sequence = 0;
+				std::string tail;
+			};
+			static const size_t m_num_stripes = 16;
+			std::array<staging_buffer, m_num_stripes> m_staging;
+			std::array<staging_buffer, m_num_stripes> m_spares;
+
+			// Number of staged items, the uploader is woken when one of them reaches its limit.
+			std::atomic<size_t> m_num_url_datas = 0;
+			std::atomic<size_t> m_num_domain_datas = 0;
+			std::atomic<size_t> m_num_robots_datas = 0;
+			std::atomic<size_t> m_num_results = 0;
+			std::atomic<size_t> m_num_non_200_results = 0;
+			std::atomic<size_t> m_num_link_results = 0;
+			std::atomic<size_t> m_num_curl_errors = 0;
+			std::atomic<size_t> m_result_sequence = 0;
+			std::atomic<size_t> m_num_uploaded_lines = 0;
+
+			std::thread m_uploader;
+			std::mutex m_uploader_lock;
+			std::condition_variable m_uploader_cv;
+			std::condition_variable m_staged_cv;
+			std::mutex m_upload_lock;
+			bool m_stopping = false;
+
 			size_t m_file_index = 0;
-			size_t m_upload_limit = 50000;
-			size_t m_non_200_upload_limit = 10000;
-			size_t m_curl_errors_upload_limit = 10000;
+			const size_t m_url_data_upload_limit = 1000;
+			const size_t m_upload_limit = 50000;
+			const size_t m_non_200_upload_limit = 10000;
+			const size_t m_curl_errors_upload_limit = 10000;
+			const size_t m_max_staged_files = 4;
 
-			void try_upload_until_complete(const std::string &path, const std::string &data);
-			void internal_upload_results(const std::string &all_results, const std::string &all_link_results);
-			void internal_upload_non_200_results(const std::string &all_results);
-			void internal_upload_curl_errors(const std::string &all_results);
+			static size_t stripe_id();
+			void notify_if_full(std::atomic<size_t> &num_staged, size_t limit);
+			void run_uploader();
+			void upload(bool flush);
+			template <typename T>
+			size_t swap_staged(std::vector<T> staging_buffer::*member, std::atomic<size_t> &num_staged);
+			void swap_staged_results();
+			void notify_swapped();
+			template <typename T>
+			std::vector<T> take_spares(std::vector<T> staging_buffer::*member);
+			std::string compress_spares(std::vector<std::string> staging_buffer::*member);
+			void try_upload_until_complete(const std::string &path, const std::string &compressed_data);
+			std::string warc_path(const std::string &dir);
 
 	};
 
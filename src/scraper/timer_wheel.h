@@ -0,0 +1,101 @@
+/*
+ * MIT License
+ *
+ * Alexandria.org
+ *
+ * Copyright (c) 2021 Josef Cullhed, <info@alexandria.org>, et al.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <vector>
+
+namespace Scraper {
+
+	/*
+	 * Hashed timer wheel. Items are scheduled a number of milliseconds ahead and returned by advance when the wheel has passed their
+	 * tick. Scheduling and expiring is O(1), items further away than one revolution wait a number of rounds in their slot.
+	 * */
+	template <typename T>
+	class timer_wheel {
+		public:
+
+			timer_wheel(size_t tick_ms, size_t num_slots, size_t now_ms);
+
+			void schedule(const T &item, size_t delay_ms);
+			void advance(size_t now_ms, std::vector<T> &expired);
+			size_t size() const { return m_size; }
+			size_t tick_ms() const { return m_tick_ms; }
+
+		private:
+
+			struct entry {
+				T item;
+				size_t rounds;
+			};
+
+			const size_t m_tick_ms;
+			std::vector<std::vector<entry>> m_slots;
+			size_t m_current_tick;
+			size_t m_size = 0;
+
+	};
+
+	template <typename T>
+	timer_wheel<T>::timer_wheel(size_t tick_ms, size_t num_slots, size_t now_ms)
+	: m_tick_ms(tick_ms), m_slots(num_slots), m_current_tick(now_ms / tick_ms) {
+	}
+
+	/*
+	 * Schedules the item at least delay_ms from the current tick. A delay of zero expires on the next tick.
+	 * */
+	template <typename T>
+	void timer_wheel<T>::schedule(const T &item, size_t delay_ms) {
+		const size_t ticks = delay_ms > m_tick_ms ? (delay_ms + m_tick_ms - 1) / m_tick_ms : 1;
+		const size_t slot = (m_current_tick + ticks) % m_slots.size();
+		m_slots[slot].push_back(entry{item, (ticks - 1) / m_slots.size()});
+		m_size++;
+	}
+
+	/*
+	 * Moves the wheel forward to now_ms and appends the items that expired to expired.
+	 * */
+	template <typename T>
+	void timer_wheel<T>::advance(size_t now_ms, std::vector<T> &expired) {
+		const size_t now_tick = now_ms / m_tick_ms;
+		while (m_current_tick < now_tick) {
+			m_current_tick++;
+			std::vector<entry> &slot = m_slots[m_current_tick % m_slots.size()];
+			size_t kept = 0;
+			for (entry &e : slot) {
+				if (e.rounds == 0) {
+					expired.push_back(e.item);
+					m_size--;
+				} else {
+					e.rounds--;
+					slot[kept++] = e;
+				}
+			}
+			slot.resize(kept);
+		}
+	}
+
+}
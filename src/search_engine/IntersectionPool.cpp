@@ -0,0 +1,215 @@
+/*
+ * MIT License
+ *
+ * Alexandria.org
+ *
+ * Copyright (c) 2021 Josef Cullhed, <info@alexandria.org>, et al.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "IntersectionPool.h"
+#include "config.h"
+#include "logger/logger.h"
+#include <pthread.h>
+
+namespace SearchEngine {
+
+	// The pool whose task the current thread is running, nested runs on it can not wait for the pool.
+	thread_local const IntersectionPool *running_pool = nullptr;
+
+	/*
+		Marks the current thread as running a task of pool while in scope.
+	*/
+	class running_task {
+		public:
+			explicit running_task(const IntersectionPool *pool) : m_previous(running_pool) { running_pool = pool; }
+			~running_task() { running_pool = m_previous; }
+		private:
+			const IntersectionPool *m_previous;
+	};
+
+	IntersectionPool::IntersectionPool(size_t num_threads, size_t first_cpu) {
+		if (num_threads == 0) num_threads = 1;
+		m_ranges = std::make_unique<task_range[]>(num_threads);
+		for (size_t slot = 0; slot < num_threads; slot++) {
+			m_ranges[slot].range.store(0);
+		}
+
+		const size_t num_cpus = std::thread::hardware_concurrency();
+		for (size_t slot = 1; slot < num_threads; slot++) {
+			m_threads.emplace_back([this, slot]() {
+				this->handle_work(slot);
+			});
+
+			if (first_cpu != no_pinning && num_cpus > 0) {
+				cpu_set_t cpu_set;
+				CPU_ZERO(&cpu_set);
+				CPU_SET((first_cpu + slot - 1) % num_cpus, &cpu_set);
+				if (pthread_setaffinity_np(m_threads.back().native_handle(), sizeof(cpu_set_t), &cpu_set) != 0) {
+					LOG_INFO("Could not set cpu affinity for intersection thread");
+				}
+			}
+		}
+	}
+
+	IntersectionPool::~IntersectionPool() {
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			m_stop = true;
+		}
+		m_start.notify_all();
+		for (std::thread &thread : m_threads) {
+			thread.join();
+		}
+	}
+
+	void IntersectionPool::run(size_t num_tasks, const std::function<void(size_t)> &task) {
+
+		if (num_tasks == 0) return;
+
+		if (running_pool == this) {
+			for (size_t i = 0; i < num_tasks; i++) {
+				task(i);
+			}
+			return;
+		}
+
+		std::lock_guard<std::mutex> run_lock(m_run_lock);
+
+		if (m_threads.size() == 0 || num_tasks == 1) {
+			running_task running(this);
+			for (size_t i = 0; i < num_tasks; i++) {
+				task(i);
+			}
+			return;
+		}
+
+		const size_t num_slots = num_threads();
+		for (size_t slot = 0; slot < num_slots; slot++) {
+			const uint64_t begin = slot * num_tasks / num_slots;
+			const uint64_t end = (slot + 1) * num_tasks / num_slots;
+			m_ranges[slot].range.store((begin << 32) | end, std::memory_order_relaxed);
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			m_task = &task;
+			m_exception = nullptr;
+			m_active = m_threads.size();
+			m_generation++;
+		}
+		m_start.notify_all();
+
+		run_tasks(0);
+
+		std::exception_ptr exception;
+		{
+			std::unique_lock<std::mutex> lock(m_lock);
+			m_done.wait(lock, [this] {
+				return m_active == 0;
+			});
+			m_task = nullptr;
+			exception = m_exception;
+		}
+
+		if (exception) {
+			std::rethrow_exception(exception);
+		}
+	}
+
+	IntersectionPool &IntersectionPool::shared() {
+		static IntersectionPool pool(Config::ft_num_threads_intersection);
+		return pool;
+	}
+
+	void IntersectionPool::handle_work(size_t slot) {
+		uint64_t generation = 0;
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lock(m_lock);
+				m_start.wait(lock, [this, generation] {
+					return m_stop || m_generation != generation;
+				});
+				if (m_stop) return;
+				generation = m_generation;
+			}
+
+			run_tasks(slot);
+
+			{
+				std::lock_guard<std::mutex> lock(m_lock);
+				m_active--;
+				if (m_active == 0) m_done.notify_one();
+			}
+		}
+	}
+
+	void IntersectionPool::run_tasks(size_t slot) {
+		running_task running(this);
+		size_t task;
+		while (next_task(slot, task)) {
+			try {
+				(*m_task)(task);
+			} catch (...) {
+				std::lock_guard<std::mutex> lock(m_lock);
+				if (!m_exception) m_exception = std::current_exception();
+			}
+		}
+	}
+
+	bool IntersectionPool::next_task(size_t slot, size_t &task) {
+		if (take_first(slot, task)) return true;
+
+		const size_t num_slots = num_threads();
+		for (size_t i = 1; i < num_slots; i++) {
+			if (take_last((slot + i) % num_slots, task)) return true;
+		}
+		return false;
+	}
+
+	bool IntersectionPool::take_first(size_t slot, size_t &task) {
+		std::atomic<uint64_t> &range = m_ranges[slot].range;
+		uint64_t current = range.load(std::memory_order_acquire);
+		while (true) {
+			const uint64_t begin = current >> 32;
+			const uint64_t end = current & 0xFFFFFFFFull;
+			if (begin >= end) return false;
+			if (range.compare_exchange_weak(current, ((begin + 1) << 32) | end, std::memory_order_acq_rel)) {
+				task = begin;
+				return true;
+			}
+		}
+	}
+
+	bool IntersectionPool::take_last(size_t slot, size_t &task) {
+		std::atomic<uint64_t> &range = m_ranges[slot].range;
+		uint64_t current = range.load(std::memory_order_acquire);
+		while (true) {
+			const uint64_t begin = current >> 32;
+			const uint64_t end = current & 0xFFFFFFFFull;
+			if (begin >= end) return false;
+			if (range.compare_exchange_weak(current, (begin << 32) | (end - 1), std::memory_order_acq_rel)) {
+				task = end - 1;
+				return true;
+			}
+		}
+	}
+
+}
@@ -0,0 +1,101 @@
+/*
+ * MIT License
+ *
+ * Alexandria.org
+ *
+ * Copyright (c) 2021 Josef Cullhed, <info@alexandria.org>, et al.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace SearchEngine {
+
+	/*
+		Long lived thread pool used for running the partitions of calculate_intersection in parallel. Each search worker owns one pool so
+		no threads are created while serving a request.
+
+		run() splits the tasks into one contiguous range per thread, the calling thread takes part as slot 0. A thread that runs out of
+		tasks steals from the back of the other ranges. If first_cpu is given the pool threads are pinned to the cpus
+		[first_cpu, first_cpu + num_threads - 1) so the threads of one worker stay on neighbouring cores.
+	*/
+	class IntersectionPool {
+
+	public:
+
+		static const size_t no_pinning = SIZE_MAX;
+
+		explicit IntersectionPool(size_t num_threads, size_t first_cpu = no_pinning);
+		~IntersectionPool();
+
+		/*
+			Runs task(i) for every i in [0, num_tasks) and returns when all tasks are done. Only one run is active at a time, concurrent
+			callers wait for their turn. A run called from a task of the same pool runs its tasks on the calling thread. Rethrows the
+			first exception thrown by a task.
+		*/
+		void run(size_t num_tasks, const std::function<void(size_t)> &task);
+
+		// Number of threads running tasks, including the calling thread.
+		size_t num_threads() const { return m_threads.size() + 1; }
+
+		/*
+			Process wide pool for callers that do not own one.
+		*/
+		static IntersectionPool &shared();
+
+	private:
+
+		struct alignas(64) task_range {
+			// begin in the upper 32 bits, end in the lower 32 bits.
+			std::atomic<uint64_t> range;
+		};
+
+		std::vector<std::thread> m_threads;
+		std::unique_ptr<task_range[]> m_ranges;
+
+		std::mutex m_run_lock;
+
+		std::mutex m_lock;
+		std::condition_variable m_start;
+		std::condition_variable m_done;
+		const std::function<void(size_t)> *m_task = nullptr;
+		std::exception_ptr m_exception;
+		uint64_t m_generation = 0;
+		size_t m_active = 0;
+		bool m_stop = false;
+
+		void handle_work(size_t slot);
+		void run_tasks(size_t slot);
+		bool next_task(size_t slot, size_t &task);
+		bool take_first(size_t slot, size_t &task);
+		bool take_last(size_t slot, size_t &task);
+
+	};
+
+}
@@ -28,14 +28,22 @@
 
 namespace SearchAllocation {
 
-	Allocation *create_allocation() {
+	Allocation *create_allocation(SearchEngine::IntersectionPool *intersection_pool) {
+		if (intersection_pool == nullptr) intersection_pool = &SearchEngine::IntersectionPool::shared();
+
 		Allocation *allocation = new Allocation;
-		allocation->storage = create_storage<FullTextRecord>();
-		allocation->link_storage = create_storage<Link::FullTextRecord>();
-		allocation->domain_link_storage = create_storage<DomainLink::FullTextRecord>();
+		allocation->storage = create_storage<FullTextRecord>(intersection_pool);
+		allocation->link_storage = create_storage<Link::FullTextRecord>(intersection_pool);
+		allocation->domain_link_storage = create_storage<DomainLink::FullTextRecord>(intersection_pool);
 		return allocation;
 	}
 
+	void release_allocation(Allocation *allocation) {
+		release_storage(allocation->storage);
+		release_storage(allocation->link_storage);
+		release_storage(allocation->domain_link_storage);
+	}
+
 	void delete_allocation(Allocation *allocation) {
 		delete_storage(allocation->storage);
 		delete_storage(allocation->link_storage);
@@ -30,6 +30,7 @@
 #include "full_text/FullTextRecord.h"
 #include "link/FullTextRecord.h"
 #include "domain_link/FullTextRecord.h"
+#include "IntersectionPool.h"
 #include "config.h"
 #include <map>
 #include <vector>
@@ -50,6 +51,9 @@ namespace SearchAllocation {
 
 		// To hold the intersection of the result sets.
 		FullTextResultSet<DataRecord> * intersected_result;
+
+		// Threads used to intersect the result sets, owned by whoever created the allocation.
+		SearchEngine::IntersectionPool *intersection_pool;
 	};
 
 	struct Allocation {
@@ -59,7 +63,7 @@ namespace SearchAllocation {
 	};
 
 	template <typename DataRecord>
-	Storage<DataRecord> *create_storage() {
+	Storage<DataRecord> *create_storage(SearchEngine::IntersectionPool *intersection_pool = nullptr) {
 		Storage<DataRecord> *storage = new Storage<DataRecord>;
 
 		// Allocate result_sets.
@@ -67,10 +71,22 @@ namespace SearchAllocation {
 			storage->result_sets.push_back(new FullTextResultSet<DataRecord>(Config::ft_max_results_per_section * Config::ft_max_sections));
 		}
 		storage->intersected_result = new FullTextResultSet<DataRecord>(Config::ft_max_results_per_section * Config::ft_max_sections);
+		storage->intersection_pool = intersection_pool;
 
 		return storage;
 	}
 
+	/*
+		Keeps the first section of every result set and gives the rest of the memory back to the kernel.
+	*/
+	template <typename DataRecord>
+	void release_storage(Storage<DataRecord> *storage) {
+		for (FullTextResultSet<DataRecord> *result_set : storage->result_sets) {
+			result_set->release_memory(Config::ft_max_results_per_section);
+		}
+		storage->intersected_result->release_memory(Config::ft_max_results_per_section);
+	}
+
 	template <typename DataRecord>
 	void delete_storage(Storage<DataRecord> *storage) {
 
@@ -82,7 +98,16 @@ namespace SearchAllocation {
 		delete storage;
 	}
 
-	Allocation *create_allocation();
+	/*
+		If no intersection pool is given the searches run on SearchEngine::IntersectionPool::shared().
+	*/
+	Allocation *create_allocation(SearchEngine::IntersectionPool *intersection_pool = nullptr);
 	void delete_allocation(Allocation *allocation);
 
+	/*
+		The result sets only reserve address space, memory is allocated when a query writes to them. Call release_allocation between
+		queries to return the memory used by large queries.
+	*/
+	void release_allocation(Allocation *allocation);
+
 }
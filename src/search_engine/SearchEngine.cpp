@@ -43,6 +43,76 @@ namespace SearchEngine {
 		metric.m_link_url_matches = 0;
 	}
 
+	link_bonus make_link_bonus(const vector<Link::FullTextRecord> &links, const vector<DomainLink::FullTextRecord> &domain_links) {
+
+		link_bonus bonus;
+		bonus.links = &links;
+
+		// Same as apply_domain_link_scores.
+		map<pair<uint64_t, uint64_t>, uint64_t> domain_unique;
+		for (const DomainLink::FullTextRecord &link : domain_links) {
+			if (domain_unique.count(std::make_pair(link.m_source_domain, link.m_target_domain)) == 0) {
+				const float domain_score = link_score(link.m_score);
+				bonus.domain_scores[link.m_target_domain] += domain_score;
+				bonus.domain_counts[link.m_target_domain]++;
+				domain_unique[std::make_pair(link.m_source_domain, link.m_target_domain)] = link.m_source_domain;
+			}
+		}
+
+		float max_domain_score = 0.0f;
+		for (const auto &iter : bonus.domain_scores) {
+			max_domain_score = max(max_domain_score, iter.second);
+		}
+
+		// Largest sum of link scores for one target, links are ordered by target hash.
+		float max_url_score = 0.0f;
+		for (size_t i = 0; i < links.size(); ) {
+			const uint64_t target_hash = links[i].m_target_hash;
+			vector<uint64_t> source_domains;
+			float url_score = 0.0f;
+			for ( ; i < links.size() && links[i].m_target_hash == target_hash; i++) {
+				if (find(source_domains.begin(), source_domains.end(), links[i].m_source_domain) == source_domains.end()) {
+					url_score += link_score(links[i].m_score);
+					source_domains.push_back(links[i].m_source_domain);
+				}
+			}
+			max_url_score = max(max_url_score, url_score);
+		}
+
+		bonus.max_bonus = max_domain_score + max_url_score;
+
+		return bonus;
+	}
+
+	void apply_link_bonus(const link_bonus &bonus, FullTextRecord &record, struct SearchMetric &metric) {
+
+		if (bonus.domain_scores.size()) {
+			auto iter = bonus.domain_scores.find(record.m_domain_hash);
+			if (iter != bonus.domain_scores.end()) {
+				record.m_score += iter->second;
+				metric.m_link_domain_matches += bonus.domain_counts.at(record.m_domain_hash);
+			}
+		}
+
+		if (bonus.links == nullptr || bonus.links->size() == 0) return;
+
+		const vector<Link::FullTextRecord> &links = *bonus.links;
+		auto first = lower_bound(links.begin(), links.end(), record.m_value, [](const Link::FullTextRecord &link, uint64_t value) {
+			return link.m_target_hash < value;
+		});
+
+		// Only one link per source domain is counted, same as apply_link_scores.
+		vector<uint64_t> source_domains;
+		for (auto iter = first; iter != links.end() && iter->m_target_hash == record.m_value; iter++) {
+			if (find(source_domains.begin(), source_domains.end(), iter->m_source_domain) == source_domains.end()) {
+				const float url_score = link_score(iter->m_score);
+				record.m_score += url_score;
+				metric.m_link_url_matches++;
+				source_domains.push_back(iter->m_source_domain);
+			}
+		}
+	}
+
 	vector<FullTextRecord> search_deduplicate(SearchAllocation::Storage<FullTextRecord> *storage,
 		const FullTextIndex<FullTextRecord> &index, const vector<Link::FullTextRecord> &links,
 		const vector<DomainLink::FullTextRecord> &domain_links, const string &query, size_t limit, struct SearchMetric &metric) {
@@ -42,8 +42,12 @@
 #include "hash/Hash.h"
 #include "sort/Sort.h"
 #include "algorithm/algorithm.h"
+#include "algorithm/intersection.h"
 #include "SearchAllocation.h"
 #include <cassert>
+#include <queue>
+#include <limits>
+#include <type_traits>
 
 namespace SearchEngine {
 
@@ -90,15 +94,25 @@ namespace SearchEngine {
 	template<typename DataRecord>
 	FullTextResultSet<DataRecord> *search_remote(const std::string &query, SearchAllocation::Storage<DataRecord> *storage);
 
+	/*
+		Starts reading the index data for all the words in the query without searching. Used to overlap the disk reads of the main index
+		with the link searches that have to finish before the main search can score its results.
+	*/
+	template<typename DataRecord>
+	void prefetch(const FullTextIndex<DataRecord> &index, const string &query);
+
 }
 
 namespace SearchEngine {
 
+	// Intersections with fewer records than this are merged on the calling thread.
+	const size_t min_parallel_merge = 100000;
+
 	template<typename DataRecord>
 	class comparator_class {
 	public:
 		// Comparator function
-		bool operator()(DataRecord &a, DataRecord &b)
+		bool operator()(const DataRecord &a, const DataRecord &b) const
 		{
 			if (a.m_score == b.m_score) return a.m_value < b.m_value;
 			return a.m_score > b.m_score;
@@ -107,6 +121,31 @@ namespace SearchEngine {
 
 	void reset_search_metric(struct SearchMetric &metric);
 
+	/*
+		The score a single link adds to its target.
+	*/
+	inline float link_score(float score) {
+		return expm1(25.0f*score) / 50.0f;
+	}
+
+	/*
+		Holds what apply_domain_link_scores and apply_link_scores would add to a FullTextRecord so the final score of a record can be
+		calculated before the whole intersection is known. The links has to be ordered by m_target_hash ascending and has to outlive this.
+	*/
+	struct link_bonus {
+		const vector<Link::FullTextRecord> *links = nullptr;
+		unordered_map<uint64_t, float> domain_scores;
+		unordered_map<uint64_t, int> domain_counts;
+		float max_bonus = 0.0f; // Upper bound of the bonus any record can get.
+	};
+
+	link_bonus make_link_bonus(const vector<Link::FullTextRecord> &links, const vector<DomainLink::FullTextRecord> &domain_links);
+
+	/*
+		Adds the domain link score and link score to the record in the same order as apply_domain_link_scores and apply_link_scores.
+	*/
+	void apply_link_bonus(const link_bonus &bonus, FullTextRecord &record, struct SearchMetric &metric);
+
 	template<typename DataRecord>
 	void set_total_found(const vector<FullTextResultSet<DataRecord> *> result_vector, struct SearchMetric &metric, double result_quote) {
 
@@ -158,7 +197,7 @@ namespace SearchEngine {
 			} else if (hash1 == hash2) {
 
 				if (domain_unique.count(std::make_pair(links[i].m_source_domain, links[i].m_target_hash)) == 0) {
-					const float url_score = expm1(25.0f*links[i].m_score) / 50.0f;
+					const float url_score = link_score(links[i].m_score);
 					data[j].m_score += url_score;
 					applied_links++;
 					domain_unique[std::make_pair(links[i].m_source_domain, links[i].m_target_hash)] = links[i].m_source_domain;
@@ -189,7 +228,7 @@ namespace SearchEngine {
 
 					if (domain_unique.count(std::make_pair(link.m_source_domain, link.m_target_domain)) == 0) {
 
-						const float domain_score = expm1(25.0f*link.m_score) / 50.0f;
+						const float domain_score = link_score(link.m_score);
 						domain_scores[link.m_target_domain] += domain_score;
 						domain_counts[link.m_target_domain]++;
 						domain_unique[std::make_pair(link.m_source_domain, link.m_target_domain)] = link.m_source_domain;
@@ -231,62 +270,36 @@ namespace SearchEngine {
 			return;
 		}
 
-		size_t shortest_vector_position = 0;
-		size_t shortest_len = SIZE_MAX;
-		{
-			size_t iter_index = 0;
-			for (FullTextResultSet<DataRecord> *result_set : result_sets) {
-				if (shortest_len > result_set->size()) {
-					shortest_len = result_set->size();
-					shortest_vector_position = iter_index;
-				}
-				iter_index++;
-			}
+		vector<const DataRecord *> data;
+		vector<size_t> lens;
+		size_t shortest = 0;
+		for (size_t i = 0; i < result_sets.size(); i++) {
+			if (result_sets[i]->size() < result_sets[shortest]->size()) shortest = i;
+			data.push_back(result_sets[i]->section_pointer(sections[i]));
+			lens.push_back(result_sets[i]->size());
 		}
 
-		vector<size_t> positions(result_sets.size(), 0);
-
-		const DataRecord *shortest_data = result_sets[shortest_vector_position]->section_pointer(sections[shortest_vector_position]);
-
-		while (positions[shortest_vector_position] < shortest_len) {
-
-			bool all_equal = true;
-			uint64_t value = shortest_data[positions[shortest_vector_position]].m_value;
+		auto record_value = [](const DataRecord &record) -> const uint64_t & {
+			return record.m_value;
+		};
 
+		algorithm::intersect_sorted(data, lens, record_value, [&](const vector<size_t> &positions) {
 			float score_sum = 0.0f;
-			size_t iter_index = 0;
-			for (FullTextResultSet<DataRecord> *result_set : result_sets) {
-				const DataRecord *data_arr = result_set->section_pointer(sections[iter_index]);
-				const size_t len = result_set->size();
-
-				size_t *pos = &(positions[iter_index]);
-				
-				// this is a linear search.
-				while (*pos < len && value > data_arr[*pos].m_value) {
-					(*pos)++;
-				}
-
-				if (*pos < len && value == data_arr[*pos].m_value) {
-					const float score = data_arr[*pos].m_score;
-					score_sum += score;
-				}
-				if ((*pos < len && value < data_arr[*pos].m_value) || *pos >= len) {
-					all_equal = false;
-					break;
-				}
-				iter_index++;
-			}
-			if (all_equal) {
-				dest.push_back(shortest_data[positions[shortest_vector_position]]);
-				dest.back().m_score = score_sum / result_sets.size();
+			for (size_t i = 0; i < data.size(); i++) {
+				score_sum += data[i][positions[i]].m_score;
 			}
-
-			positions[shortest_vector_position]++;
-		}
+			dest.push_back(data[shortest][positions[shortest]]);
+			dest.back().m_score = score_sum / result_sets.size();
+		});
 	}
 
+	/*
+		Intersects the result sets and stores the result in dest ordered by value. The partitions are intersected in parallel on pool,
+		if no pool is given the process wide IntersectionPool::shared() is used.
+	*/
 	template<typename DataRecord>
-	void calculate_intersection(const vector<FullTextResultSet<DataRecord> *> &result_sets, FullTextResultSet<DataRecord> *dest) {
+	void calculate_intersection(const vector<FullTextResultSet<DataRecord> *> &result_sets, FullTextResultSet<DataRecord> *dest,
+		IntersectionPool *pool = nullptr) {
 
 		for (FullTextResultSet<DataRecord> *result : result_sets) {
 			if (result->size() == 0) return;
@@ -325,33 +338,243 @@ namespace SearchEngine {
 			sorted_result_sets[i]->read_to_section(maximum[i]);
 		}
 
-		size_t idx = 0;
-		const size_t num_threads = 8;
+		if (pool == nullptr) pool = &IntersectionPool::shared();
 
-		ThreadPool pool(num_threads);
 		vector<vector<DataRecord>> results(partitions.size());
-		std::vector<std::future<vector<DataRecord>>> thread_results;
-		for (const vector<int> &partition : partitions) {
-			thread_results.emplace_back(pool.enqueue([sorted_result_sets, partition]() {
-				vector<DataRecord> result;
-				value_intersection(sorted_result_sets, partition, result);
-				return result;
-			}));
-			idx++;
-		}
-		idx = 0;
-		for (auto && result: thread_results) {
-			results[idx] = result.get();
-			idx++;
-		}
-		// merge
-		vector<DataRecord> merged_vec;
-		Sort::merge_arrays(results, [](const DataRecord &a, const DataRecord &b) {
+		pool->run(partitions.size(), [&sorted_result_sets, &partitions, &results](size_t idx) {
+			value_intersection(sorted_result_sets, partitions[idx], results[idx]);
+		});
+		// Merge the partitions straight into dest.
+		vector<span<const DataRecord>> spans;
+		size_t total = 0;
+		for (const vector<DataRecord> &result : results) {
+			spans.emplace_back(result);
+			total += result.size();
+		}
+		Sort::parallel_merge(spans, [](const DataRecord &a, const DataRecord &b) {
+			return a.m_value < b.m_value;
+		}, dest->data_pointer(), total >= min_parallel_merge ? pool->num_threads() : 1,
+		[pool](size_t num_tasks, const std::function<void(size_t)> &task) {
+			pool->run(num_tasks, task);
+		});
+		dest->resize(total);
+	}
+
+	/*
+		Returns true if all the result sets can be searched with block_max_intersection.
+	*/
+	template<typename DataRecord>
+	bool has_block_max_scores(const vector<FullTextResultSet<DataRecord> *> &result_sets) {
+		for (FullTextResultSet<DataRecord> *result_set : result_sets) {
+			if (!result_set->has_blocks()) return false;
+		}
+		return true;
+	}
+
+	/*
+		Top k intersection with block max pruning. Calculates the same result as calculate_intersection followed by
+		apply_domain_link_scores, apply_link_scores and get_unsorted_results_with_top_scores but keeps the best limit results in a heap and
+		skips every block of the shortest list where the sum of the largest scores of the overlapping blocks, plus the largest possible
+		link bonus, can not beat the worst result in the heap. Skipped blocks are never decoded.
+
+		The result is stored in dest ordered by value. Returns the estimated size of the full intersection.
+	*/
+	template<typename DataRecord>
+	size_t block_max_intersection(const vector<FullTextResultSet<DataRecord> *> &result_sets, const link_bonus &bonus, size_t limit,
+		FullTextResultSet<DataRecord> *dest, struct SearchMetric &metric) {
+
+		const size_t num_lists = result_sets.size();
+
+		vector<FullTextResultSet<DataRecord> *> sorted_result_sets(result_sets);
+		sort(sorted_result_sets.begin(), sorted_result_sets.end(), [](const FullTextResultSet<DataRecord> *a,
+				const FullTextResultSet<DataRecord> *b) {
+			return a->total_num_results() < b->total_num_results();
+		});
+
+		// Index of the first block of every section for every list.
+		vector<vector<size_t>> section_starts(num_lists);
+		vector<int> lengths;
+		for (size_t list = 0; list < num_lists; list++) {
+			const vector<PostingBlock::block_ref> &blocks = sorted_result_sets[list]->blocks();
+			for (size_t i = 0; i < blocks.size(); i++) {
+				if (i == 0 || blocks[i].section != blocks[i - 1].section) section_starts[list].push_back(i);
+			}
+			section_starts[list].push_back(blocks.size());
+			lengths.push_back(section_starts[list].size() - 1);
+			if (lengths.back() == 0) return 0;
+		}
+
+		vector<vector<int>> partitions = algorithm::incremental_partitions(lengths, Config::ft_section_depth);
+
+		std::priority_queue<DataRecord, vector<DataRecord>, comparator_class<DataRecord>> heap;
+		const float max_bonus = bonus.max_bonus * 1.0001f + 0.0001f; // Room for rounding errors when adding the scores.
+
+		size_t matches = 0;
+		size_t evaluated_records = 0;
+		size_t skipped_records = 0;
+
+		DataRecord driver_records[PostingBlock::block_len];
+		vector<vector<DataRecord>> list_records(num_lists);
+
+		auto record_value = [](const DataRecord &record) -> const uint64_t & {
+			return record.m_value;
+		};
+
+		for (size_t partition_id = 0; partition_id < partitions.size(); partition_id++) {
+			const vector<int> &partition = partitions[partition_id];
+
+			// The list with the fewest records in this partition drives the intersection.
+			size_t driver = 0;
+			size_t driver_len = SIZE_MAX;
+			vector<size_t> cursors(num_lists);
+			vector<size_t> ends(num_lists);
+			for (size_t list = 0; list < num_lists; list++) {
+				cursors[list] = section_starts[list][partition[list]];
+				ends[list] = section_starts[list][partition[list] + 1];
+				const size_t list_len = ends[list] - cursors[list];
+				if (list_len < driver_len) {
+					driver_len = list_len;
+					driver = list;
+				}
+			}
+
+			const vector<PostingBlock::block_ref> &driver_blocks = sorted_result_sets[driver]->blocks();
+
+			auto block_high = [&](size_t block) {
+				return block + 1 < ends[driver] ? driver_blocks[block + 1].first_value : UINT64_MAX;
+			};
+
+			/*
+				Decodes the driver block and the overlapping blocks of the other lists from block_cursors and calls on_match with the data and
+				positions of every record in the intersection. Returns the number of records in the driver block.
+			*/
+			auto intersect_block = [&](size_t block, const vector<size_t> &block_cursors, auto &&on_match) {
+				const uint64_t high = block_high(block);
+				PostingBlock::decode_block(driver_blocks[block].data, driver_records);
+				const size_t driver_records_len = driver_blocks[block].num_records;
+
+				for (size_t list = 0; list < num_lists; list++) {
+					if (list == driver) continue;
+					const vector<PostingBlock::block_ref> &blocks = sorted_result_sets[list]->blocks();
+					list_records[list].clear();
+					for (size_t i = block_cursors[list]; i < ends[list] && blocks[i].first_value < high; i++) {
+						const size_t offset = list_records[list].size();
+						list_records[list].resize(offset + PostingBlock::block_len);
+						PostingBlock::decode_block(blocks[i].data, &list_records[list][offset]);
+						list_records[list].resize(offset + blocks[i].num_records);
+					}
+				}
+
+				vector<const DataRecord *> data(num_lists);
+				vector<size_t> lens(num_lists);
+				for (size_t list = 0; list < num_lists; list++) {
+					data[list] = list == driver ? driver_records : list_records[list].data();
+					lens[list] = list == driver ? driver_records_len : list_records[list].size();
+				}
+
+				algorithm::intersect_sorted(data, lens, record_value, [&](const vector<size_t> &positions) {
+					on_match(data, positions);
+				});
+
+				return driver_records_len;
+			};
+
+			// Skipped blocks of the first partition together with the cursors of the other lists, see the shortcut below.
+			vector<pair<size_t, vector<size_t>>> skipped_blocks;
+
+			for (size_t block = cursors[driver]; block < ends[driver]; block++) {
+
+				const uint64_t low = driver_blocks[block].first_value;
+				const uint64_t high = block_high(block);
+
+				// Find the blocks in the other lists that overlaps [low, high) and sum the largest scores.
+				float max_score_sum = 0.0f;
+				bool overlaps = true;
+				for (size_t list = 0; list < num_lists; list++) {
+					if (list == driver) {
+						max_score_sum += driver_blocks[block].max_score;
+						continue;
+					}
+					const vector<PostingBlock::block_ref> &blocks = sorted_result_sets[list]->blocks();
+					while (cursors[list] + 1 < ends[list] && blocks[cursors[list] + 1].first_value <= low) cursors[list]++;
+
+					float max_score = -std::numeric_limits<float>::infinity();
+					for (size_t i = cursors[list]; i < ends[list] && blocks[i].first_value < high; i++) {
+						max_score = std::max(max_score, blocks[i].max_score);
+					}
+					if (max_score == -std::numeric_limits<float>::infinity()) {
+						overlaps = false;
+						break;
+					}
+					max_score_sum += max_score;
+				}
+
+				if (!overlaps) {
+					continue;
+				}
+
+				if (heap.size() >= limit && max_score_sum / num_lists + max_bonus < heap.top().m_score) {
+					skipped_records += driver_blocks[block].num_records;
+					if (partition_id == 0) skipped_blocks.emplace_back(block, cursors);
+					continue;
+				}
+
+				evaluated_records += intersect_block(block, cursors, [&](const vector<const DataRecord *> &data,
+						const vector<size_t> &positions) {
+					float score_sum = 0.0f;
+					for (size_t list = 0; list < num_lists; list++) {
+						score_sum += data[list][positions[list]].m_score;
+					}
+
+					matches++;
+
+					DataRecord record = data[driver][positions[driver]];
+					record.m_score = score_sum / num_lists;
+					if constexpr (std::is_same_v<DataRecord, FullTextRecord>) {
+						apply_link_bonus(bonus, record, metric);
+					}
+
+					if (heap.size() < limit) {
+						heap.push(record);
+					} else if (comparator_class<DataRecord>{}(record, heap.top())) {
+						heap.pop();
+						heap.push(record);
+					}
+				});
+			}
+
+			if (partition_id == 0) {
+				/*
+					Same shortcut as calculate_intersection, the top sections are enough if they give enough results. The skipped blocks can not
+					change the heap but their matches count towards the limit, so they are counted when they decide if the shortcut is taken.
+				*/
+				if (matches < Config::result_limit && matches + skipped_records >= Config::result_limit) {
+					for (const auto &[block, block_cursors] : skipped_blocks) {
+						const size_t num_records = intersect_block(block, block_cursors, [&matches](const vector<const DataRecord *> &,
+								const vector<size_t> &) {
+							matches++;
+						});
+						skipped_records -= num_records;
+						evaluated_records += num_records;
+					}
+				}
+				if (matches >= Config::result_limit) break;
+			}
+		}
+
+		vector<DataRecord> top_results;
+		top_results.reserve(heap.size());
+		while (heap.size()) {
+			top_results.push_back(heap.top());
+			heap.pop();
+		}
+		sort(top_results.begin(), top_results.end(), [](const DataRecord &a, const DataRecord &b) {
 			return a.m_value < b.m_value;
-		}, merged_vec);
+		});
+		dest->copy_vector(top_results);
 
-		// copy.
-		dest->copy_vector(merged_vec);
+		if (evaluated_records == 0) return matches;
+		return matches + (size_t)((double)skipped_records * matches / evaluated_records);
 	}
 
 	template<typename DataRecord>
@@ -505,12 +728,31 @@ namespace SearchEngine {
 		vector<FullTextResultSet<DataRecord> *> result_vector = search_shards<DataRecord>(storage->result_sets, shards, words);
 
 		FullTextResultSet<DataRecord> *flat_result;
-		if (result_vector.size() > 1) {
+		if (result_vector.size() > 1 && limit > 0 && has_block_max_scores(result_vector)) {
+
+			// Intersect, score and keep the top results in one pass.
+			flat_result = storage->intersected_result;
+			flat_result->resize(0);
+
+			link_bonus bonus;
+			if constexpr (std::is_same_v<DataRecord, FullTextRecord>) {
+				bonus = make_link_bonus(links, domain_links);
+			}
+			const size_t intersection_size = block_max_intersection<DataRecord>(result_vector, bonus, limit, flat_result, metric);
+
+			set_total_found<DataRecord>(result_vector, metric, (double)intersection_size / largest_result(result_vector));
+
+			for (FullTextResultSet<DataRecord> *result_set : result_vector) {
+				result_set->close_sections();
+			}
+
+			return flat_result;
+		} else if (result_vector.size() > 1) {
 
 			// We need to calculate the intersection of the given results.
 			flat_result = storage->intersected_result;
 			flat_result->resize(0);
-			calculate_intersection<DataRecord>(result_vector, flat_result);
+			calculate_intersection<DataRecord>(result_vector, flat_result, storage->intersection_pool);
 
 			set_total_found<DataRecord>(result_vector, metric, (double)flat_result->size() / largest_result(result_vector));
 		} else {
@@ -548,7 +790,7 @@ namespace SearchEngine {
 			// We need to calculate the intersection of the given results.
 			flat_result = storage->intersected_result;
 			flat_result->resize(0);
-			calculate_intersection<DataRecord>(result_vector, flat_result);
+			calculate_intersection<DataRecord>(result_vector, flat_result, storage->intersection_pool);
 
 			set_total_found<DataRecord>(result_vector, metric, (double)flat_result->size() / largest_result(result_vector));
 		} else {
@@ -640,6 +882,16 @@ namespace SearchEngine {
 		return ret;
 	}
 
+	template<typename DataRecord>
+	void prefetch(const FullTextIndex<DataRecord> &index, const string &query) {
+
+		vector<string> words = text::get_full_text_words(query, Config::query_max_words);
+		for (const string &word : words) {
+			const uint64_t word_hash = Hash::str(word);
+			index.shards()[word_hash % Config::ft_num_shards]->prefetch(word_hash);
+		}
+	}
+
 	template<typename DataRecord>
 	FullTextResultSet<DataRecord> *search_remote(const std::string &query, SearchAllocation::Storage<DataRecord> *storage) {
 		storage->result_sets[0]->resize(0);
@@ -26,6 +26,8 @@
 
 #pragma once
 
+#include <algorithm>
+#include <functional>
 #include <vector>
 #include <span>
 
@@ -79,54 +81,135 @@ namespace Sort {
 		}, res);
 	}
 
+	/*
+		k-way merge with a loser tree. Writes the merged records to dest which must have room for all of them. The merge is stable, equal
+		records are taken from the array that comes first in arrays.
+
+		The internal nodes 1 ... k-1 of the tree hold the array that lost the comparison at that node and node 0 holds the overall winner,
+		so every output record costs log(k) comparisons against the losers on the path from its leaf to the root.
+	*/
 	template<typename DataRecord, typename F>
-	void merge_array_range(const std::vector<std::vector<DataRecord>> &arrays, size_t i, size_t j, F compare, std::vector<DataRecord> &res) {
-		if (i == j) {
-			for (const DataRecord &rec : arrays[i]) {
-				res.push_back(rec);
+	void loser_tree_merge(const std::vector<std::span<const DataRecord>> &arrays, F compare, DataRecord *dest) {
+
+		const size_t k = arrays.size();
+		if (k == 0) return;
+		if (k == 1) {
+			std::copy(arrays[0].begin(), arrays[0].end(), dest);
+			return;
+		}
+
+		std::vector<size_t> pos(k, 0);
+
+		// True if the head of array a should be output before the head of array b.
+		auto beats = [&arrays, &pos, &compare](size_t a, size_t b) {
+			if (pos[a] == arrays[a].size()) return false;
+			if (pos[b] == arrays[b].size()) return true;
+			if (compare(arrays[b][pos[b]], arrays[a][pos[a]])) return false;
+			if (compare(arrays[a][pos[a]], arrays[b][pos[b]])) return true;
+			return a < b;
+		};
+
+		std::vector<size_t> tree(k);
+
+		// Plays the initial tournament below node, the leaf of array i is node k + i.
+		std::function<size_t(size_t)> play = [&](size_t node) -> size_t {
+			if (node >= k) return node - k;
+			const size_t left = play(2 * node);
+			const size_t right = play(2 * node + 1);
+			if (beats(left, right)) {
+				tree[node] = right;
+				return left;
 			}
-		} else if (j - i == 1) {
-			merge_arrays(arrays[i], arrays[j], compare, res);
-		} else {
-			std::vector<DataRecord> out1;
-			std::vector<DataRecord> out2;
+			tree[node] = left;
+			return right;
+		};
+		tree[0] = play(1);
 
-			merge_array_range(arrays, i, (i + j)/2, compare, out1);
-			merge_array_range(arrays, (i + j)/2 + 1, j, compare, out2);
+		size_t total = 0;
+		for (const auto &array : arrays) total += array.size();
 
-			merge_arrays(out1, out2, compare, res);
+		for (size_t out = 0; out < total; out++) {
+			size_t winner = tree[0];
+			dest[out] = arrays[winner][pos[winner]++];
+
+			for (size_t node = (winner + k) / 2; node >= 1; node /= 2) {
+				if (beats(tree[node], winner)) std::swap(tree[node], winner);
+			}
+			tree[0] = winner;
 		}
 	}
 
-	template<typename DataRecord, typename F>
-	void merge_arrays(const std::vector<std::vector<DataRecord>> &arrays, F compare, std::vector<DataRecord> &res) {
-		if (arrays.size() == 0) return;
-		merge_array_range(arrays, 0, arrays.size() - 1, compare, res);
-	}
+	/*
+		Same result as loser_tree_merge but the value range is split into num_parts parts that are merged in parallel. The splitters are
+		taken from the longest array and every array is cut at the first record not less than the splitter, so equal records always end
+		up in the same part and the merge stays stable.
+
+		run(num_tasks, task) has to call task(i) for every i in [0, num_tasks) and return when all calls are done.
+	*/
+	template<typename DataRecord, typename F, typename R>
+	void parallel_merge(const std::vector<std::span<const DataRecord>> &arrays, F compare, DataRecord *dest, size_t num_parts, R run) {
+
+		size_t total = 0;
+		size_t longest = 0;
+		for (size_t i = 0; i < arrays.size(); i++) {
+			total += arrays[i].size();
+			if (arrays[i].size() > arrays[longest].size()) longest = i;
+		}
 
-	template<typename DataRecord, typename F>
-	void merge_array_range(const std::vector<std::span<DataRecord> *> &arrays, size_t i, size_t j, F compare, std::vector<DataRecord> &res) {
-		if (i == j) {
-			for (const DataRecord &rec : *(arrays[i])) {
-				res.push_back(rec);
+		if (num_parts <= 1 || arrays.size() <= 1 || arrays[longest].size() < num_parts) {
+			loser_tree_merge(arrays, compare, dest);
+			return;
+		}
+
+		// cuts[p][i] is where part p starts in array i.
+		std::vector<std::vector<size_t>> cuts(num_parts + 1, std::vector<size_t>(arrays.size(), 0));
+		for (size_t i = 0; i < arrays.size(); i++) cuts[num_parts][i] = arrays[i].size();
+		for (size_t p = 1; p < num_parts; p++) {
+			const DataRecord &splitter = arrays[longest][p * arrays[longest].size() / num_parts];
+			for (size_t i = 0; i < arrays.size(); i++) {
+				cuts[p][i] = std::lower_bound(arrays[i].begin(), arrays[i].end(), splitter, compare) - arrays[i].begin();
 			}
-		} else if (j - i == 1) {
-			merge_arrays(arrays[i], arrays[j], compare, res);
-		} else {
-			std::vector<DataRecord> out1;
-			std::vector<DataRecord> out2;
+		}
 
-			merge_array_range(arrays, i, (i + j)/2, compare, out1);
-			merge_array_range(arrays, (i + j)/2 + 1, j, compare, out2);
+		std::vector<size_t> offsets(num_parts + 1, 0);
+		for (size_t p = 0; p < num_parts; p++) {
+			offsets[p + 1] = offsets[p];
+			for (size_t i = 0; i < arrays.size(); i++) offsets[p + 1] += cuts[p + 1][i] - cuts[p][i];
+		}
 
-			merge_arrays(out1, out2, compare, res);
+		run(num_parts, [&arrays, &cuts, &offsets, &compare, dest](size_t p) {
+			std::vector<std::span<const DataRecord>> parts;
+			for (size_t i = 0; i < arrays.size(); i++) {
+				parts.push_back(arrays[i].subspan(cuts[p][i], cuts[p + 1][i] - cuts[p][i]));
+			}
+			loser_tree_merge(parts, compare, dest + offsets[p]);
+		});
+	}
+
+	template<typename DataRecord, typename F>
+	void merge_arrays(const std::vector<std::vector<DataRecord>> &arrays, F compare, std::vector<DataRecord> &res) {
+		std::vector<std::span<const DataRecord>> spans;
+		size_t total = 0;
+		for (const auto &array : arrays) {
+			spans.emplace_back(array);
+			total += array.size();
 		}
+		const size_t offset = res.size();
+		res.resize(offset + total);
+		loser_tree_merge(spans, compare, res.data() + offset);
 	}
 
 	template<typename DataRecord, typename F>
 	void merge_arrays(const std::vector<std::span<DataRecord> *> &arrays, F compare, std::vector<DataRecord> &res) {
-		if (arrays.size() == 0) return;
-		merge_array_range(arrays, 0, arrays.size() - 1, compare, res);
+		std::vector<std::span<const DataRecord>> spans;
+		size_t total = 0;
+		for (const auto *array : arrays) {
+			spans.emplace_back(array->data(), array->size());
+			total += array->size();
+		}
+		const size_t offset = res.size();
+		res.resize(offset + total);
+		loser_tree_merge(spans, compare, res.data() + offset);
 	}
 
 }
@@ -32,7 +32,8 @@ namespace System {
 
 	size_t cur_date() {
 		time_t tt = time(NULL);
-		struct tm tm = *localtime(&tt);
+		struct tm tm;
+		localtime_r(&tt, &tm);
 		size_t year_since_00 = tm.tm_year - 100;
 		size_t year = 2000 + year_since_00;
 		return (year * 100 * 100) + ((tm.tm_mon + 1) * 100) + tm.tm_mday;
@@ -40,7 +41,8 @@ namespace System {
 
 	size_t cur_time() {
 		time_t tt = time(NULL);
-		struct tm tm = *localtime(&tt);
+		struct tm tm;
+		localtime_r(&tt, &tm);
 		return (tm.tm_hour * 100 * 100) + (tm.tm_min * 100) + tm.tm_sec;
 	}
 
@@ -52,8 +54,10 @@ namespace System {
 	const string iso8601_datetime() {
 		time_t now;
 		time(&now);
+		struct tm tm;
+		gmtime_r(&now, &tm);
 		char buf[21];
-		strftime(buf, sizeof(buf), "%FT%TZ", gmtime(&now));
+		strftime(buf, sizeof(buf), "%FT%TZ", &tm);
 		return string(buf);
 	}
 
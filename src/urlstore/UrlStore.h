@@ -27,10 +27,17 @@
 #pragma once
 
 #include <iostream>
+#include <sstream>
 #include <vector>
 #include <deque>
+#include <memory>
+#include <functional>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
 #include <future>
 #include <thread>
+#include <mutex>
 #include <boost/filesystem.hpp>
 #include "config.h"
 #include "hash/Hash.h"
@@ -56,15 +63,92 @@ namespace UrlStore {
 	const int OK = 0;
 	const int ERROR = 1;
 
+	/*
+		Records are written as deltas, an update never reads the stored record. A delta is stored under the private key followed by
+		delta_separator and the big endian sequence number of the write, so the deltas of a record are sorted after it in write order. The
+		value is the update bitmask followed by the record. Reads fold the stored record and its deltas with apply_update, a delta with
+		replace_bitmask replaces the record. UrlStore::fold_deltas writes the folded records back and removes the deltas.
+	*/
+	const char delta_separator = '\0';
+	const size_t replace_bitmask = SIZE_MAX;
+
+	/*
+		Key of the sequence number after the newest delta of a shard, it is written together with the deltas so the store can continue
+		the sequence without reading the deltas when it is opened. The key is sorted before all records and is not folded.
+	*/
+	const string next_sequence_key = string(1, delta_separator) + "next_sequence";
+
+	inline string delta_key(const string &private_key, uint64_t sequence) {
+		string key = private_key;
+		key.push_back(delta_separator);
+		for (int shift = 56; shift >= 0; shift -= 8) {
+			key.push_back((char)((sequence >> shift) & 0xFF));
+		}
+		return key;
+	}
+
+	inline string delta_value(const string &data_str, size_t update_bitmask) {
+		string value;
+		value.append((char *)&update_bitmask, sizeof(size_t));
+		value.append(data_str);
+		return value;
+	}
+
+	// Number of records in write data, the records are parsed the same way by get_write_data.
+	inline size_t num_records(const string &write_data) {
+		const char *cstr = write_data.c_str();
+		const size_t len = write_data.size();
+		size_t num = 0;
+		size_t iter = 2*sizeof(size_t);
+		while (iter + sizeof(size_t) <= len) {
+			size_t data_len = *((size_t *)&cstr[iter]);
+			iter += sizeof(size_t);
+
+			if (data_len + iter > len) break;
+
+			num++;
+			iter += data_len;
+		}
+		return num;
+	}
+
+	/*
+	 * Folds the deltas in write order into the record. record is nullptr if only deltas are stored, then the first delta is the record.
+	 * Returns the record as a string.
+	 * */
+	template <typename StoreData>
+	string fold_record(const string *record, const vector<string> &deltas) {
+		if (deltas.empty()) return record != nullptr ? *record : string();
+
+		bool has_data = record != nullptr;
+		StoreData data = has_data ? StoreData(*record) : StoreData();
+		for (const string &delta : deltas) {
+			if (delta.size() < sizeof(size_t)) continue;
+			const size_t update_bitmask = *((size_t *)delta.c_str());
+			StoreData update(delta.c_str() + sizeof(size_t), delta.size() - sizeof(size_t));
+			if (!has_data || update_bitmask == replace_bitmask) {
+				data = update;
+				has_data = true;
+			} else {
+				data.apply_update(update, update_bitmask);
+			}
+		}
+		return data.to_str();
+	}
+
 	template <typename StoreData>
 	class UrlStoreBatch {
 		public:
 			UrlStoreBatch();
 			~UrlStoreBatch();
 
-			void set(const StoreData &data);
+			void set(const StoreData &data, uint64_t sequence);
+			void update(const StoreData &data, size_t update_bitmask, uint64_t sequence);
 
 			std::vector<leveldb::WriteBatch> m_batches;
+			// Sequence number after the newest delta of every shard in the batch.
+			std::vector<uint64_t> m_next_sequences;
+			size_t m_num_deltas = 0;
 	};
 
 	template <typename StoreData>
@@ -77,8 +161,18 @@ namespace UrlStore {
 			void set(const StoreData &data);
 			StoreData get(const string &public_key);
 
+			// Multi get, values[i] is the stored value of public_keys[i] or an empty string.
+			void get_many(const vector<string> &public_keys, vector<string> &values);
+
 			// Bulk inserts.
 			void write_batch(UrlStoreBatch<StoreData> &batch);
+			void write_batches(vector<UrlStoreBatch<StoreData>> &batches);
+			uint64_t next_sequence() { return m_sequence++; }
+			uint64_t reserve_sequences(size_t num) { return m_sequence.fetch_add(num); }
+
+			// Deltas written since the last fold_deltas.
+			size_t num_deltas() const { return m_num_deltas; }
+			void fold_deltas();
 
 			// Pending inserts.
 			bool has_pending_insert();
@@ -88,6 +182,40 @@ namespace UrlStore {
 		private:
 			std::vector<KeyValueStore *> m_shards;
 			std::deque<std::string> m_pending_inserts;
+			std::mutex m_pending_lock;
+
+			/*
+			 * A shard is compacted when the bytes written to it since its last compaction reach its size divided by
+			 * m_compaction_write_amplification, so compactions rewrite at most that many bytes per byte written.
+			 * */
+			const size_t m_compaction_write_amplification = 4;
+			const size_t m_min_compaction_bytes = 64*1024*1024;
+			std::vector<size_t> m_bytes_since_compaction;
+			std::vector<std::future<void>> m_compactions;
+
+			// Number of keys below which get_many looks up the shards on the calling thread.
+			const size_t m_min_parallel_get = 64;
+			// Entries the iterator steps over before get_many seeks to the next key instead.
+			const size_t m_max_iterator_steps = 8;
+
+			/*
+			 * Sequence numbers of the deltas, starting at the time of startup in microseconds or after the newest stored delta if that
+			 * is later, so they grow across restarts.
+			 * */
+			std::atomic<uint64_t> m_sequence;
+			std::atomic<size_t> m_num_deltas = 0;
+
+			// Guards writing deltas together with next_sequence_key and m_next_stored_sequences, one lock per shard.
+			std::vector<std::mutex> m_write_locks;
+			std::vector<uint64_t> m_next_stored_sequences;
+
+			void get_sorted(KeyValueStore *shard, vector<std::pair<string, size_t>> &keys, vector<string> &values);
+			void fold_shard(KeyValueStore *shard);
+			void write_shard(size_t shard, vector<UrlStoreBatch<StoreData>> &batches);
+			void maybe_compact(size_t shard);
+			size_t shard_size(size_t shard);
+			uint64_t read_next_sequence(size_t shard);
+			void write_deltas(size_t shard, leveldb::WriteBatch &batch, uint64_t next_sequence);
 
 	};
 
@@ -99,7 +227,7 @@ namespace UrlStore {
 
 	template <typename StoreData>
 	UrlStoreBatch<StoreData>::UrlStoreBatch()
-	: m_batches(Config::url_store_shards)
+	: m_batches(Config::url_store_shards), m_next_sequences(Config::url_store_shards, 0)
 	{
 		
 	}
@@ -110,22 +238,46 @@ namespace UrlStore {
 	}
 
 	template <typename StoreData>
-	void UrlStoreBatch<StoreData>::set(const StoreData &data) {
-		const size_t shard = Hash::str(data.private_key()) % Config::url_store_shards;
-		m_batches[shard].Put(data.private_key(), data.to_str());
+	void UrlStoreBatch<StoreData>::set(const StoreData &data, uint64_t sequence) {
+		update(data, replace_bitmask, sequence);
 	}
 
 	template <typename StoreData>
-	UrlStore<StoreData>::UrlStore()  {
+	void UrlStoreBatch<StoreData>::update(const StoreData &data, size_t update_bitmask, uint64_t sequence) {
+		const string private_key = data.private_key();
+		const size_t shard = Hash::str(private_key) % Config::url_store_shards;
+		m_batches[shard].Put(delta_key(private_key, sequence), delta_value(data.to_str(), update_bitmask));
+		m_next_sequences[shard] = std::max(m_next_sequences[shard], sequence + 1);
+		m_num_deltas++;
+	}
+
+	template <typename StoreData>
+	UrlStore<StoreData>::UrlStore()
+	: m_write_locks(Config::url_store_shards), m_next_stored_sequences(Config::url_store_shards, 0)
+	{
 		const string &db_prefix = StoreData::uri;
 		for (size_t i = 0; i < Config::url_store_shards; i++) {
 			boost::filesystem::create_directories("/mnt/" + std::to_string(i % 8) + "/store/"+db_prefix+"/url_store_" + std::to_string(i));
 			m_shards.push_back(new KeyValueStore("/mnt/" + std::to_string(i % 8) + "/store/"+db_prefix+"/url_store_" + std::to_string(i)));
 		}
+		m_bytes_since_compaction.resize(Config::url_store_shards, 0);
+		m_compactions.resize(Config::url_store_shards);
+
+		// The clock can be behind the stored deltas, after a restart on another clock or if the sequences were reserved faster than
+		// one per microsecond.
+		uint64_t sequence = std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::system_clock::now().time_since_epoch()).count();
+		for (size_t shard = 0; shard < m_shards.size(); shard++) {
+			sequence = std::max(sequence, read_next_sequence(shard));
+		}
+		m_sequence = sequence;
 	}
 
 	template <typename StoreData>
 	UrlStore<StoreData>::~UrlStore() {
+		for (std::future<void> &compaction : m_compactions) {
+			if (compaction.valid()) compaction.wait();
+		}
 		for (KeyValueStore *shard : m_shards) {
 			delete shard;
 		}
@@ -133,32 +285,270 @@ namespace UrlStore {
 
 	template <typename StoreData>
 	void UrlStore<StoreData>::set(const StoreData &data) {
-		const size_t shard = Hash::str(data.private_key()) % Config::url_store_shards;
-		m_shards[shard]->set(data.private_key(), data.to_str());
+		const string private_key = data.private_key();
+		const size_t shard = Hash::str(private_key) % Config::url_store_shards;
+		const uint64_t sequence = next_sequence();
+		leveldb::WriteBatch batch;
+		batch.Put(delta_key(private_key, sequence), delta_value(data.to_str(), replace_bitmask));
+		write_deltas(shard, batch, sequence + 1);
+		m_num_deltas++;
 	}
 
 	template <typename StoreData>
 	StoreData UrlStore<StoreData>::get(const string &public_key) {
-		const size_t shard = Hash::str(StoreData::public_key_to_private_key(public_key)) % Config::url_store_shards;
-		string value = m_shards[shard]->get(StoreData::public_key_to_private_key(public_key));
-		if (value.size()) return StoreData(value);
+		const string private_key = StoreData::public_key_to_private_key(public_key);
+		const size_t shard = Hash::str(private_key) % Config::url_store_shards;
+		vector<std::pair<string, size_t>> keys = {{private_key, 0}};
+		vector<string> values(1);
+		get_sorted(m_shards[shard], keys, values);
+		if (values[0].size()) return StoreData(values[0]);
 		return StoreData();
 	}
 
+	/*
+	 * Partitions the keys by shard and looks up every shard with a single iterator sweep over its sorted keys, all shards in parallel.
+	 * */
+	template <typename StoreData>
+	void UrlStore<StoreData>::get_many(const vector<string> &public_keys, vector<string> &values) {
+
+		values.assign(public_keys.size(), string());
+
+		vector<vector<std::pair<string, size_t>>> shard_keys(m_shards.size());
+		for (size_t i = 0; i < public_keys.size(); i++) {
+			string private_key = StoreData::public_key_to_private_key(public_keys[i]);
+			const size_t shard = Hash::str(private_key) % Config::url_store_shards;
+			shard_keys[shard].emplace_back(std::move(private_key), i);
+		}
+
+		if (public_keys.size() < m_min_parallel_get) {
+			for (size_t shard = 0; shard < m_shards.size(); shard++) {
+				if (shard_keys[shard].size()) get_sorted(m_shards[shard], shard_keys[shard], values);
+			}
+			return;
+		}
+
+		vector<std::future<void>> futures;
+		for (size_t shard = 0; shard < m_shards.size(); shard++) {
+			if (shard_keys[shard].empty()) continue;
+			futures.emplace_back(std::async(std::launch::async, [this, shard, &shard_keys, &values]() {
+				get_sorted(m_shards[shard], shard_keys[shard], values);
+			}));
+		}
+
+		for (auto &future : futures) {
+			future.get();
+		}
+	}
+
+	/*
+	 * Sorts the (private key, position) pairs and reads them in order with one iterator. Keys close to each other are reached by stepping
+	 * the iterator, others by seeking. The deltas of a record follow it so they are read by the same sweep.
+	 * */
+	template <typename StoreData>
+	void UrlStore<StoreData>::get_sorted(KeyValueStore *shard, vector<std::pair<string, size_t>> &keys, vector<string> &values) {
+
+		std::sort(keys.begin(), keys.end());
+
+		std::unique_ptr<leveldb::Iterator> iter(shard->db()->NewIterator(leveldb::ReadOptions()));
+		for (size_t i = 0; i < keys.size(); i++) {
+			const leveldb::Slice key = keys[i].first;
+
+			// The iterator has passed repeated keys already.
+			if (i > 0 && keys[i].first == keys[i - 1].first) {
+				values[keys[i].second] = values[keys[i - 1].second];
+				continue;
+			}
+
+			for (size_t steps = 0; steps < m_max_iterator_steps && iter->Valid() && iter->key().compare(key) < 0; steps++) {
+				iter->Next();
+			}
+			if (!iter->Valid() || iter->key().compare(key) < 0) {
+				iter->Seek(key);
+			}
+
+			string record;
+			bool has_record = false;
+			if (iter->Valid() && iter->key() == key) {
+				record = iter->value().ToString();
+				has_record = true;
+				iter->Next();
+			}
+
+			const string delta_prefix = keys[i].first + delta_separator;
+			vector<string> deltas;
+			while (iter->Valid() && iter->key().starts_with(delta_prefix)) {
+				deltas.push_back(iter->value().ToString());
+				iter->Next();
+			}
+
+			values[keys[i].second] = fold_record<StoreData>(has_record ? &record : nullptr, deltas);
+		}
+	}
+
+	/*
+	 * Writes the folded records of all shards and deletes their deltas, then compacts the shards. Deltas written while a shard is folded
+	 * are newer than the ones in the iterator snapshot and are kept.
+	 * */
+	template <typename StoreData>
+	void UrlStore<StoreData>::fold_deltas() {
+		m_num_deltas = 0;
+		for (KeyValueStore *shard : m_shards) {
+			fold_shard(shard);
+			shard->compact();
+		}
+	}
+
+	template <typename StoreData>
+	void UrlStore<StoreData>::fold_shard(KeyValueStore *shard) {
+
+		const size_t max_batch_size = 64*1024*1024;
+
+		leveldb::WriteBatch batch;
+		std::unique_ptr<leveldb::Iterator> iter(shard->db()->NewIterator(leveldb::ReadOptions()));
+		iter->SeekToFirst();
+		while (iter->Valid()) {
+			const string key = iter->key().ToString();
+			if (key == next_sequence_key) {
+				iter->Next();
+				continue;
+			}
+			const string private_key = key.substr(0, key.find(delta_separator));
+
+			string record;
+			bool has_record = false;
+			if (key == private_key) {
+				record = iter->value().ToString();
+				has_record = true;
+				iter->Next();
+			}
+
+			const string delta_prefix = private_key + delta_separator;
+			vector<string> deltas;
+			vector<string> delta_keys;
+			while (iter->Valid() && iter->key().starts_with(delta_prefix)) {
+				deltas.push_back(iter->value().ToString());
+				delta_keys.push_back(iter->key().ToString());
+				iter->Next();
+			}
+
+			if (deltas.empty()) continue;
+
+			// A record and its deltas are always written in the same batch so readers never see a partial fold.
+			batch.Put(private_key, fold_record<StoreData>(has_record ? &record : nullptr, deltas));
+			for (const string &delta_key : delta_keys) {
+				batch.Delete(delta_key);
+			}
+
+			if (batch.ApproximateSize() > max_batch_size) {
+				shard->db()->Write(leveldb::WriteOptions(), &batch);
+				batch.Clear();
+			}
+		}
+
+		shard->db()->Write(leveldb::WriteOptions(), &batch);
+	}
+
+	/*
+	 * Returns the sequence number after the newest delta written to the shard, zero if no deltas were written.
+	 * */
+	template <typename StoreData>
+	uint64_t UrlStore<StoreData>::read_next_sequence(size_t shard) {
+		const string value = m_shards[shard]->get(next_sequence_key);
+		uint64_t next = 0;
+		if (value.size() == sizeof(uint64_t)) memcpy(&next, value.c_str(), sizeof(uint64_t));
+		m_next_stored_sequences[shard] = next;
+		return next;
+	}
+
+	/*
+	 * Writes the batch to the shard together with next_sequence_key if next_sequence is after the stored one. Writes to a shard are
+	 * serialized so the stored sequence never goes back.
+	 * */
+	template <typename StoreData>
+	void UrlStore<StoreData>::write_deltas(size_t shard, leveldb::WriteBatch &batch, uint64_t next_sequence) {
+		std::lock_guard guard(m_write_locks[shard]);
+		if (next_sequence > m_next_stored_sequences[shard]) {
+			batch.Put(next_sequence_key, string((char *)&next_sequence, sizeof(uint64_t)));
+			m_next_stored_sequences[shard] = next_sequence;
+		}
+		m_shards[shard]->db()->Write(leveldb::WriteOptions(), &batch);
+	}
+
 	template <typename StoreData>
 	void UrlStore<StoreData>::write_batch(UrlStoreBatch<StoreData> &batch) {
 		for (size_t shard = 0; shard < Config::url_store_shards; shard++) {
-			m_shards[shard]->db()->Write(leveldb::WriteOptions(), &batch.m_batches[shard]);
+			write_deltas(shard, batch.m_batches[shard], batch.m_next_sequences[shard]);
 		}
+		m_num_deltas += batch.m_num_deltas;
+	}
+
+	/*
+	 * Writes the batches with one writer per shard, the shards concurrently and the batches of each shard in order.
+	 * */
+	template <typename StoreData>
+	void UrlStore<StoreData>::write_batches(vector<UrlStoreBatch<StoreData>> &batches) {
+		vector<std::future<void>> writers;
+		for (size_t shard = 0; shard < Config::url_store_shards; shard++) {
+			writers.emplace_back(std::async(std::launch::async, [this, shard, &batches]() {
+				write_shard(shard, batches);
+			}));
+		}
+		for (auto &writer : writers) {
+			writer.get();
+		}
+		for (const UrlStoreBatch<StoreData> &batch : batches) {
+			m_num_deltas += batch.m_num_deltas;
+		}
+	}
+
+	template <typename StoreData>
+	void UrlStore<StoreData>::write_shard(size_t shard, vector<UrlStoreBatch<StoreData>> &batches) {
+		for (UrlStoreBatch<StoreData> &batch : batches) {
+			if (batch.m_batches[shard].Count() == 0) continue;
+			m_bytes_since_compaction[shard] += batch.m_batches[shard].ApproximateSize();
+			write_deltas(shard, batch.m_batches[shard], batch.m_next_sequences[shard]);
+		}
+		maybe_compact(shard);
+	}
+
+	/*
+	 * Starts a background compaction of the shard if it has used up its write amplification budget. Writes to the shard continue while
+	 * it is compacted.
+	 * */
+	template <typename StoreData>
+	void UrlStore<StoreData>::maybe_compact(size_t shard) {
+		if (m_bytes_since_compaction[shard] < m_min_compaction_bytes) return;
+
+		std::future<void> &compaction = m_compactions[shard];
+		if (compaction.valid() && compaction.wait_for(std::chrono::seconds(0)) != std::future_status::ready) return;
+
+		if (m_bytes_since_compaction[shard] * m_compaction_write_amplification < shard_size(shard)) return;
+
+		m_bytes_since_compaction[shard] = 0;
+		KeyValueStore *kv_store = m_shards[shard];
+		compaction = std::async(std::launch::async, [kv_store]() {
+			kv_store->compact();
+		});
+	}
+
+	template <typename StoreData>
+	size_t UrlStore<StoreData>::shard_size(size_t shard) {
+		const leveldb::Range range("", "\xff\xff\xff\xff");
+		uint64_t size = 0;
+		m_shards[shard]->db()->GetApproximateSizes(&range, 1, &size);
+		return size;
 	}
 
 	template <typename StoreData>
 	bool UrlStore<StoreData>::has_pending_insert() {
+		std::lock_guard guard(m_pending_lock);
 		return m_pending_inserts.size() > 0;
 	}
 
 	template <typename StoreData>
 	string UrlStore<StoreData>::next_pending_insert() {
+		std::lock_guard guard(m_pending_lock);
+		if (m_pending_inserts.empty()) return "";
 		string file = m_pending_inserts.front();
 		m_pending_inserts.pop_front();
 		return file;
@@ -166,6 +556,7 @@ namespace UrlStore {
 
 	template <typename StoreData>
 	void UrlStore<StoreData>::add_pending_insert(const string &file) {
+		std::lock_guard guard(m_pending_lock);
 		m_pending_inserts.push_back(file);
 	}
 
@@ -210,7 +601,7 @@ namespace UrlStore {
 
 			store.add_pending_insert(filename);
 		} else {
-			UrlStoreBatch batch = get_write_data<StoreData>(store, write_data);
+			UrlStoreBatch batch = get_write_data<StoreData>(store, write_data, store.reserve_sequences(num_records(write_data)));
 			write_insert_data<StoreData>(store, batch);
 		}
 	}
@@ -234,18 +625,74 @@ namespace UrlStore {
 		return keys;
 	}
 
+	/*
+	 * Writes the binary response for the keys, the length of the data followed by the data for every key.
+	 * */
 	template <typename StoreData>
-	void handle_binary_post_request(UrlStore<StoreData> &store, const std::string &post_data, std::stringstream &response_stream) {
-		vector<string> public_keys = post_data_to_keys<StoreData>(post_data);
-		for (const string &public_key : public_keys) {
-			StoreData data = store.get(public_key);
-			const string bin_data = data.to_str();
+	void write_binary_response(UrlStore<StoreData> &store, const vector<string> &public_keys, std::ostream &response_stream) {
+		vector<string> values;
+		store.get_many(public_keys, values);
+
+		const string empty_data = StoreData().to_str();
+		for (const string &value : values) {
+			const string bin_data = value.size() ? StoreData(value).to_str() : empty_data;
 			const size_t len = bin_data.size();
 			response_stream.write((char *)&len, sizeof(size_t));
 			response_stream.write(bin_data.c_str(), len);
 		}
 	}
 
+	template <typename StoreData>
+	void handle_binary_post_request(UrlStore<StoreData> &store, const std::string &post_data, std::stringstream &response_stream) {
+		vector<string> public_keys = post_data_to_keys<StoreData>(post_data);
+		write_binary_response(store, public_keys, response_stream);
+	}
+
+	/*
+	 * Streaming version of handle_binary_post_request. The newline separated keys are read with read(buffer, len) in batches of
+	 * max_batch_keys keys and the response of every batch is passed to write(data, len) before the next batch is read, so neither the
+	 * request nor the response is held in memory.
+	 * */
+	template <typename StoreData>
+	void handle_binary_post_request(UrlStore<StoreData> &store, std::function<size_t(char *, size_t)> read,
+			std::function<void(const char *, size_t)> write) {
+
+		const size_t max_batch_keys = 10000;
+		const size_t buffer_len = 1024*1024;
+		std::unique_ptr<char[]> buffer = std::make_unique<char[]>(buffer_len);
+
+		vector<string> public_keys;
+		string partial_key;
+
+		auto flush = [&store, &public_keys, &write]() {
+			std::stringstream response_stream;
+			write_binary_response(store, public_keys, response_stream);
+			const string response = response_stream.str();
+			write(response.c_str(), response.size());
+			public_keys.clear();
+		};
+
+		while (true) {
+			const size_t read_bytes = read(buffer.get(), buffer_len);
+			if (read_bytes == 0) break;
+
+			size_t start = 0;
+			for (size_t i = 0; i < read_bytes; i++) {
+				if (buffer[i] != '\n') continue;
+				partial_key.append(&buffer[start], i - start);
+				public_keys.push_back(std::move(partial_key));
+				partial_key.clear();
+				start = i + 1;
+				if (public_keys.size() >= max_batch_keys) flush();
+			}
+			partial_key.append(&buffer[start], read_bytes - start);
+		}
+
+		// The last key has no newline, same as post_data_to_keys.
+		public_keys.push_back(std::move(partial_key));
+		flush();
+	}
+
 	template <typename StoreData>
 	void handle_post_request(UrlStore<StoreData> &store, const std::string &post_data, std::stringstream &response_stream) {
 		vector<string> public_keys = post_data_to_keys<StoreData>(post_data);
@@ -335,8 +782,12 @@ namespace UrlStore {
 		return ERROR;
 	}
 
+	/*
+	 * Parses write data and routes the records to the shard batches. The records get the sequence numbers from first_sequence and up,
+	 * the caller reserves num_records of them.
+	 * */
 	template <typename StoreData>
-	UrlStoreBatch<StoreData> get_write_data(UrlStore<StoreData> &store, const string &write_data) {
+	UrlStoreBatch<StoreData> get_write_data(UrlStore<StoreData> &store, const string &write_data, uint64_t first_sequence) {
 		Profiler::instance prof1("parse and write to batches");
 
 		const char *cstr = write_data.c_str();
@@ -346,7 +797,7 @@ namespace UrlStore {
 
 		size_t iter = 2*sizeof(size_t);
 		UrlStoreBatch<StoreData> batch;
-		while (iter < len) {
+		while (iter + sizeof(size_t) <= len) {
 			size_t data_len = *((size_t *)&cstr[iter]);
 			iter += sizeof(size_t);
 
@@ -354,11 +805,9 @@ namespace UrlStore {
 
 			StoreData data(&cstr[iter], data_len);
 			if (update_bitmask) {
-				StoreData to_update = store.get(data.public_key());
-				to_update.apply_update(data, update_bitmask);
-				batch.set(to_update);
+				batch.update(data, update_bitmask, first_sequence++);
 			} else {
-				batch.set(data);
+				batch.set(data, first_sequence++);
 			}
 
 			iter += data_len;
@@ -367,15 +816,24 @@ namespace UrlStore {
 		return batch;
 	}
 
+	/*
+	 * Reads and parses a pending file. The sequence numbers of the file are reserved when the previous file has reserved its numbers, so
+	 * the updates are applied in the order the files were received even though the files are parsed in parallel.
+	 * */
 	template <typename StoreData>
-	UrlStoreBatch<StoreData> read_insert_data(UrlStore<StoreData> &store, const string &filename) {
+	UrlStoreBatch<StoreData> read_insert_data(UrlStore<StoreData> &store, const string &filename, std::shared_future<void> previous,
+			std::promise<void> reserved) {
 
 		std::ifstream infile(filename, std::ios::binary);
 		std::stringstream buffer;
 		buffer << infile.rdbuf();
 		const string write_data = buffer.str();
 
-		UrlStoreBatch batch = get_write_data<StoreData>(store, write_data);
+		previous.wait();
+		const uint64_t first_sequence = store.reserve_sequences(num_records(write_data));
+		reserved.set_value();
+
+		UrlStoreBatch batch = get_write_data<StoreData>(store, write_data, first_sequence);
 
 		File::delete_file(filename);
 
@@ -388,35 +846,67 @@ namespace UrlStore {
 		store.write_batch(batch);
 	}
 
+	/*
+	 * Starts parsing the next group of pending files.
+	 * */
 	template <typename StoreData>
-	void run_inserter(UrlStore<StoreData> &store) {
-
-		const size_t num_files_between_compactions = 20;
+	vector<std::future<UrlStoreBatch<StoreData>>> parse_pending_inserts(UrlStore<StoreData> &store) {
 
-		vector<string> filenames;
+		const size_t max_files_per_group = 20;
 
-		while (store.has_pending_insert() && filenames.size() < num_files_between_compactions) {
+		vector<std::future<UrlStoreBatch<StoreData>>> futures;
+		std::promise<void> first;
+		first.set_value();
+		std::shared_future<void> previous = first.get_future().share();
+		while (futures.size() < max_files_per_group) {
 			const string filename = store.next_pending_insert();
-			filenames.push_back(filename);
-		}
+			if (filename.empty()) break;
 
-		vector<std::future<UrlStoreBatch<StoreData>>> futures;
-		for (const string &filename : filenames) {
-			std::future<UrlStoreBatch<StoreData>> fut = async(read_insert_data<StoreData>, std::ref(store), filename);
-			futures.emplace_back(move(fut));
+			std::promise<void> reserved;
+			std::shared_future<void> next = reserved.get_future().share();
+			futures.emplace_back(std::async(std::launch::async, read_insert_data<StoreData>, std::ref(store), filename, previous,
+				std::move(reserved)));
+			previous = next;
 		}
 
-		for (auto &fut : futures) {
-			UrlStoreBatch<StoreData> batch = fut.get();
-			write_insert_data<StoreData>(store, batch);
+		return futures;
+	}
+
+	/*
+	 * Inserts the pending files as a pipeline, the next group of files is parsed and routed to shard batches while the per shard
+	 * writers write the previous group. The shards are compacted by the writers when they reach their write amplification budget.
+	 * */
+	template <typename StoreData>
+	void run_inserter(UrlStore<StoreData> &store) {
+
+		vector<std::future<UrlStoreBatch<StoreData>>> parsing = parse_pending_inserts<StoreData>(store);
+
+		while (parsing.size()) {
+			vector<UrlStoreBatch<StoreData>> batches;
+			for (auto &fut : parsing) {
+				batches.push_back(fut.get());
+			}
+
+			parsing = parse_pending_inserts<StoreData>(store);
+
+			Profiler::instance prof("leveldb Write");
+			store.write_batches(batches);
 		}
 	}
 
 	template <typename StoreData>
 	void urlstore_inserter(UrlStore<StoreData> &store) {
 		using namespace std::literals::chrono_literals;
+
+		// Deltas are folded into their records when this many are written and there is nothing to insert.
+		const size_t deltas_between_folds = 10000000;
+
 		while (true) {
 			run_inserter<StoreData>(store);
+			if (!store.has_pending_insert() && store.num_deltas() > deltas_between_folds) {
+				Profiler::instance prof("fold deltas");
+				store.fold_deltas();
+			}
 			std::this_thread::sleep_for(100ms);
 		}
 	}
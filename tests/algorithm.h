@@ -105,6 +105,43 @@ BOOST_AUTO_TEST_CASE(intersection_test) {
 	}
 }
 
+BOOST_AUTO_TEST_CASE(intersection_kernels) {
+
+	{
+		// Long lists are searched with galloping, similar lists are scanned.
+		vector<uint64_t> short_list = {3, 1000, 5000, 99999};
+		vector<uint64_t> medium_list;
+		vector<uint64_t> long_list;
+		for (uint64_t i = 0; i < 100000; i++) {
+			if (i % 3 == 0 || i == 1000) medium_list.push_back(i);
+			long_list.push_back(i);
+		}
+
+		const vector<uint64_t> result = algorithm::intersection<uint64_t>({long_list, short_list, medium_list});
+
+		BOOST_REQUIRE_EQUAL(3, result.size());
+		BOOST_CHECK_EQUAL(3, result[0]);
+		BOOST_CHECK_EQUAL(1000, result[1]);
+		BOOST_CHECK_EQUAL(99999, result[2]);
+	}
+
+	{
+		vector<uint64_t> list;
+		for (uint64_t i = 0; i < 1000; i++) {
+			list.push_back(i * 2);
+			list.push_back(0xFFFFFFFFFFFFFF00ull + i % 200);
+		}
+		std::sort(list.begin(), list.end());
+
+		BOOST_CHECK_EQUAL(algorithm::gallop_to(list.data(), 0, list.size(), 5ull, [](const uint64_t &v) -> const uint64_t & { return v; }), 3);
+		BOOST_CHECK_EQUAL(algorithm::scan_to(list.data(), 0, list.size(), 5ull, [](const uint64_t &v) -> const uint64_t & { return v; }), 3);
+		BOOST_CHECK_EQUAL(algorithm::scan_to(list.data(), 10, list.size(), 0xFFFFFFFFFFFFFF05ull,
+			[](const uint64_t &v) -> const uint64_t & { return v; }), 1000 + 5 * 5);
+		BOOST_CHECK_EQUAL(algorithm::gallop_to(list.data(), 10, list.size(), 0xFFFFFFFFFFFFFFFFull,
+			[](const uint64_t &v) -> const uint64_t & { return v; }), list.size());
+	}
+}
+
 BOOST_AUTO_TEST_CASE(incremental_partitions) {
 
 	{
@@ -0,0 +1,168 @@
+/*
+ * MIT License
+ *
+ * Alexandria.org
+ *
+ * Copyright (c) 2021 Josef Cullhed, <info@alexandria.org>, et al.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "api/FastCgiServer.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace fast_cgi_test {
+
+	/*
+		Minimal blocking FastCGI client, sends one request and reads the response.
+	*/
+	int connect_to(int port) {
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+		sockaddr_in addr = {};
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(port);
+		inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+		if (connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0) {
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	void append_record(string &out, uint8_t type, uint16_t request_id, const string &content) {
+		const char header[8] = {1, (char)type, (char)(request_id >> 8), (char)request_id, (char)(content.size() >> 8),
+			(char)content.size(), 0, 0};
+		out.append(header, 8);
+		out.append(content);
+	}
+
+	void send_request(int fd, uint16_t request_id, const map<string, string> &params, const string &body, bool keep_conn) {
+		string out;
+		append_record(out, 1, request_id, string({0, 1, (char)keep_conn, 0, 0, 0, 0, 0}));
+		string pairs;
+		for (const auto &iter : params) {
+			pairs.push_back((char)iter.first.size());
+			pairs.push_back((char)iter.second.size());
+			pairs += iter.first + iter.second;
+		}
+		append_record(out, 4, request_id, pairs);
+		append_record(out, 4, request_id, "");
+		if (body.size()) append_record(out, 5, request_id, body);
+		append_record(out, 5, request_id, "");
+		send(fd, out.data(), out.size(), 0);
+	}
+
+	bool read_exact(int fd, char *buffer, size_t len) {
+		size_t pos = 0;
+		while (pos < len) {
+			const ssize_t read_bytes = read(fd, buffer + pos, len - pos);
+			if (read_bytes <= 0) return false;
+			pos += read_bytes;
+		}
+		return true;
+	}
+
+	// Reads records until the end of the request and returns the stdout stream.
+	string read_response(int fd) {
+		string response;
+		while (true) {
+			char header[8];
+			if (!read_exact(fd, header, 8)) return response;
+			const size_t len = ((uint8_t)header[4] << 8) | (uint8_t)header[5];
+			string content(len + (uint8_t)header[6], '\0');
+			if (!read_exact(fd, content.data(), content.size())) return response;
+			if (header[1] == 6) response.append(content.data(), len);
+			if (header[1] == 3) return response;
+		}
+	}
+
+}
+
+BOOST_AUTO_TEST_SUITE(fast_cgi_server)
+
+BOOST_AUTO_TEST_CASE(fast_cgi_server) {
+
+	Worker::FastCgiServer server("127.0.0.1:8019", 10);
+	BOOST_REQUIRE(server.start());
+
+	std::thread worker([&server]() {
+		Worker::FastCgiRequest request;
+		while (server.accept(request)) {
+			request.write("Content-type: text/plain\r\n\r\n");
+			request.write(string(request.param("REQUEST_URI")) + ":" + request.body);
+			server.finish(request);
+		}
+	});
+
+	int fd = fast_cgi_test::connect_to(8019);
+	BOOST_REQUIRE(fd >= 0);
+
+	// Two requests on the same connection.
+	fast_cgi_test::send_request(fd, 1, {{"REQUEST_URI", "/?q=test"}}, "", true);
+	BOOST_CHECK_EQUAL(fast_cgi_test::read_response(fd), "Content-type: text/plain\r\n\r\n/?q=test:");
+
+	fast_cgi_test::send_request(fd, 2, {{"REQUEST_URI", "/upload"}}, string(60000, 'b'), true);
+	BOOST_CHECK_EQUAL(fast_cgi_test::read_response(fd), "Content-type: text/plain\r\n\r\n/upload:" + string(60000, 'b'));
+
+	// Without keep_conn the server closes the connection after the response.
+	fast_cgi_test::send_request(fd, 3, {{"REQUEST_URI", "/last"}}, "", false);
+	BOOST_CHECK_EQUAL(fast_cgi_test::read_response(fd), "Content-type: text/plain\r\n\r\n/last:");
+	char buffer[1];
+	BOOST_CHECK_EQUAL(read(fd, buffer, 1), 0);
+	close(fd);
+
+	server.stop();
+	worker.join();
+}
+
+BOOST_AUTO_TEST_CASE(fast_cgi_server_overloaded) {
+
+	Worker::FastCgiServer server("127.0.0.1:8019", 1);
+	BOOST_REQUIRE(server.start());
+
+	int fd1 = fast_cgi_test::connect_to(8019);
+	int fd2 = fast_cgi_test::connect_to(8019);
+
+	// Nobody accepts, the first request fills the queue and the second is rejected.
+	fast_cgi_test::send_request(fd1, 1, {{"REQUEST_URI", "/1"}}, "", false);
+	while (server.num_queued() == 0) std::this_thread::yield();
+
+	fast_cgi_test::send_request(fd2, 1, {{"REQUEST_URI", "/2"}}, "", false);
+	BOOST_CHECK(fast_cgi_test::read_response(fd2).find("Status: 503") == 0);
+
+	Worker::FastCgiRequest request;
+	BOOST_REQUIRE(server.accept(request));
+	BOOST_CHECK_EQUAL(string(request.param("REQUEST_URI")), "/1");
+	BOOST_CHECK(request.param("QUERY_STRING") == nullptr);
+	request.write("ok");
+	server.finish(request);
+	BOOST_CHECK_EQUAL(fast_cgi_test::read_response(fd1), "ok");
+
+	close(fd1);
+	close(fd2);
+
+	server.stop();
+	BOOST_CHECK(!server.accept(request));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -76,6 +76,42 @@ BOOST_AUTO_TEST_CASE(add_to_hash_table) {
 
 }
 
+BOOST_AUTO_TEST_CASE(find_many) {
+
+	HashTableHelper::truncate("test_index");
+
+	{
+		vector<HashTableShardBuilder *> shards = HashTableHelper::create_shard_builders("test_index");
+
+		for (size_t i = 0; i < 5000; i++) {
+			HashTableHelper::add_data(shards, i, "Random test data with id: " + std::to_string(i));
+		}
+
+		HashTableHelper::write(shards);
+		HashTableHelper::sort(shards);
+
+		HashTableHelper::delete_shard_builders(shards);
+	}
+
+	HashTable hash_table("test_index");
+
+	vector<uint64_t> keys = {4999, 7, 1031, 7, 6000, 0, 2062};
+	for (uint64_t key = 100; key < 2000; key += 3) {
+		keys.push_back(key);
+	}
+
+	const vector<string> values = hash_table.find_many(keys);
+
+	BOOST_REQUIRE_EQUAL(values.size(), keys.size());
+	for (size_t i = 0; i < keys.size(); i++) {
+		BOOST_CHECK_EQUAL(values[i], hash_table.find(keys[i]));
+	}
+	BOOST_CHECK_EQUAL(values[1], "Random test data with id: 7");
+	BOOST_CHECK_EQUAL(values[4], "");
+
+	BOOST_CHECK_EQUAL(hash_table.find_many({}).size(), 0);
+}
+
 BOOST_AUTO_TEST_CASE(add_to_hash_table_reverse) {
 
 	HashTableHelper::truncate("test_index");
@@ -169,6 +205,251 @@ BOOST_AUTO_TEST_CASE(optimize) {
 	}
 }
 
+BOOST_AUTO_TEST_CASE(shard_survives_optimize) {
+
+	HashTableHelper::truncate("test_index");
+
+	HashTableShardBuilder builder("test_index", 0);
+	for (size_t i = 1; i <= 100; i++) {
+		builder.add(i, "data element " + std::to_string(i) + " v1");
+	}
+	builder.write();
+	for (size_t i = 1; i <= 100; i += 2) {
+		builder.add(i, "data element " + std::to_string(i) + " v2");
+	}
+	builder.write();
+
+	// The shard maps the files before they are sorted and optimized.
+	HashTableShard shard("test_index", 0);
+	BOOST_CHECK_EQUAL(shard.find(3), "data element 3 v2");
+
+	builder.sort();
+	builder.optimize();
+
+	// The old shard keeps reading the files it mapped.
+	BOOST_CHECK_EQUAL(shard.size(), 150);
+	BOOST_CHECK_EQUAL(shard.find(1), "data element 1 v2");
+	BOOST_CHECK_EQUAL(shard.find(2), "data element 2 v1");
+	BOOST_CHECK_EQUAL(shard.find(100), "data element 100 v1");
+	BOOST_CHECK((shard.find_many({99, 50, 1000}) == vector<string>{"data element 99 v2", "data element 50 v1", ""}));
+
+	HashTableShard new_shard("test_index", 0);
+	BOOST_CHECK_EQUAL(new_shard.size(), 100);
+	BOOST_CHECK_EQUAL(new_shard.find(1), "data element 1 v2");
+	BOOST_CHECK_EQUAL(new_shard.find(100), "data element 100 v1");
+}
+
+BOOST_AUTO_TEST_CASE(version_1_pos_file) {
+
+	HashTableHelper::truncate("test_index");
+
+	{
+		HashTableShardBuilder builder("test_index", 0);
+
+		builder.add(1031, "data element 1031");
+		builder.add(2062, "data element 2062");
+		builder.write();
+		builder.sort();
+	}
+
+	// Rewrite the pos file without header and lengths like older versions did.
+	{
+		HashTableShardBuilder builder("test_index", 0);
+		std::ifstream infile(builder.filename_pos(), std::ios::binary);
+		infile.seekg(HashTablePositions::header_len);
+		vector<uint64_t> records(6);
+		infile.read((char *)records.data(), records.size() * sizeof(uint64_t));
+		infile.close();
+
+		std::ofstream outfile(builder.filename_pos(), std::ios::binary | std::ios::trunc);
+		for (size_t i = 0; i < records.size(); i += 3) {
+			outfile.write((char *)&records[i], sizeof(uint64_t) * 2);
+		}
+	}
+
+	{
+		HashTableShard shard("test_index", 0);
+
+		BOOST_CHECK_EQUAL(shard.size(), 2);
+		BOOST_CHECK_EQUAL(shard.find(1031), "data element 1031");
+		BOOST_CHECK_EQUAL(shard.find(2062), "data element 2062");
+		BOOST_CHECK_EQUAL(shard.find(3093), "");
+	}
+
+	// Writing more data converts the file to the current version.
+	{
+		HashTableShardBuilder builder("test_index", 0);
+
+		builder.add(3093, "data element 3093");
+		builder.add(1031, "data element 1031 v2");
+		builder.write();
+
+		HashTableShard shard("test_index", 0);
+
+		BOOST_CHECK_EQUAL(shard.size(), 4);
+		BOOST_CHECK_EQUAL(shard.find(1031), "data element 1031 v2");
+		BOOST_CHECK_EQUAL(shard.find(2062), "data element 2062");
+		BOOST_CHECK_EQUAL(shard.find(3093), "data element 3093");
+	}
+
+	{
+		HashTableShardBuilder builder("test_index", 0);
+		builder.sort();
+
+		HashTableShard shard("test_index", 0);
+
+		BOOST_CHECK_EQUAL(shard.size(), 3);
+		BOOST_CHECK_EQUAL(shard.find(1031), "data element 1031 v2");
+		BOOST_CHECK((shard.find_many({3093, 2062, 1}) == vector<string>{"data element 3093", "data element 2062", ""}));
+	}
+}
+
+BOOST_AUTO_TEST_CASE(dictionary_compression) {
+
+	HashTableHelper::truncate("test_index");
+
+	auto make_value = [](size_t i) {
+		return "http://www.example" + std::to_string(i % 7) + ".com/page/" + std::to_string(i) + "\tExample page title number " + std::to_string(i) +
+			"\tThis is the meta description of the example page, it has some text that is common to many of the pages.";
+	};
+
+	size_t file_size_before = 0;
+	{
+		HashTableShardBuilder builder("test_index", 0);
+		for (size_t i = 1; i <= 500; i++) {
+			builder.add(i, make_value(i));
+		}
+		builder.write();
+		builder.sort();
+
+		HashTableShard shard("test_index", 0);
+		file_size_before = shard.file_size();
+	}
+
+	{
+		HashTableShardBuilder builder("test_index", 0);
+		builder.optimize();
+
+		BOOST_CHECK(std::ifstream(builder.filename_dict()).is_open());
+
+		HashTableShard shard("test_index", 0);
+
+		BOOST_CHECK_EQUAL(shard.size(), 500);
+		BOOST_CHECK(shard.file_size() < file_size_before);
+		BOOST_CHECK_EQUAL(shard.find(1), make_value(1));
+		BOOST_CHECK_EQUAL(shard.find(250), make_value(250));
+		BOOST_CHECK_EQUAL(shard.find(500), make_value(500));
+	}
+
+	// Values written after optimize are compressed with the dictionary.
+	{
+		HashTableShardBuilder builder("test_index", 0);
+		builder.add(501, make_value(501));
+		builder.add(2, "replaced value");
+		builder.write();
+
+		HashTableShard shard("test_index", 0);
+
+		BOOST_CHECK_EQUAL(shard.find(501), make_value(501));
+		BOOST_CHECK_EQUAL(shard.find(2), "replaced value");
+		BOOST_CHECK((shard.find_many({3, 501, 1000}) == vector<string>{make_value(3), make_value(501), ""}));
+	}
+
+	{
+		HashTableShardBuilder builder("test_index", 0);
+		builder.truncate();
+
+		BOOST_CHECK(!std::ifstream(builder.filename_dict()).is_open());
+	}
+}
+
+BOOST_AUTO_TEST_CASE(shard_survives_recompress) {
+
+	HashTableHelper::truncate("test_index");
+
+	auto make_value = [](size_t i, const string &version) {
+		return "http://www.example" + std::to_string(i % 7) + ".com/page/" + std::to_string(i) + "\tExample page title number " +
+			std::to_string(i) + "\tThis is the meta description of the " + version + " page, it has some text that is common to many pages.";
+	};
+
+	HashTableShardBuilder builder("test_index", 0);
+	for (size_t i = 1; i <= 500; i++) {
+		builder.add(i, make_value(i, "first"));
+	}
+	builder.write();
+	builder.sort();
+
+	// The shard is mapped before the shard has a dictionary.
+	HashTableShard shard_without_dict("test_index", 0);
+	BOOST_CHECK_EQUAL(shard_without_dict.find(1), make_value(1, "first"));
+
+	builder.optimize();
+	BOOST_CHECK(std::ifstream(builder.filename_dict()).is_open());
+
+	HashTableShard shard_with_dict("test_index", 0);
+	BOOST_CHECK_EQUAL(shard_with_dict.find(1), make_value(1, "first"));
+
+	// Replace all the values so the next optimize trains a different dictionary.
+	for (size_t i = 1; i <= 500; i++) {
+		builder.add(i, make_value(i, "second"));
+	}
+	builder.write();
+	builder.optimize();
+
+	// The shards keep using the dictionary of the data they mapped.
+	BOOST_CHECK_EQUAL(shard_without_dict.find(250), make_value(250, "first"));
+	BOOST_CHECK_EQUAL(shard_with_dict.find(250), make_value(250, "first"));
+	BOOST_CHECK((shard_with_dict.find_many({500, 2}) == vector<string>{make_value(500, "first"), make_value(2, "first")}));
+
+	HashTableShard shard("test_index", 0);
+	BOOST_CHECK_EQUAL(shard.size(), 500);
+	BOOST_CHECK_EQUAL(shard.find(250), make_value(250, "second"));
+	BOOST_CHECK(!std::ifstream(builder.filename_dict_tmp()).is_open());
+}
+
+BOOST_AUTO_TEST_CASE(optimize_corrupt_value) {
+
+	HashTableHelper::truncate("test_index");
+
+	const string corrupt_value = "not a compressed value";
+	{
+		HashTableShardBuilder builder("test_index", 0);
+		for (size_t i = 1; i <= 200; i++) {
+			builder.add(i, "http://www.example.com/page/" + std::to_string(i));
+		}
+		builder.write();
+
+		// Append a value that can not be decompressed.
+		std::ofstream outfile(builder.filename_data(), std::ios::binary | std::ios::app);
+		const uint64_t key = 1000;
+		const size_t data_len = corrupt_value.size();
+		outfile.write((char *)&key, Config::ht_key_size);
+		outfile.write((char *)&data_len, sizeof(size_t));
+		outfile.write(corrupt_value.c_str(), data_len);
+	}
+
+	{
+		HashTableShardBuilder builder("test_index", 0);
+		builder.optimize();
+
+		HashTableShard shard("test_index", 0);
+		BOOST_CHECK_EQUAL(shard.size(), 201);
+		BOOST_CHECK_EQUAL(shard.find(100), "http://www.example.com/page/100");
+
+		// The corrupt value is kept as it was stored instead of being replaced.
+		std::ifstream infile(builder.filename_data(), std::ios::binary);
+		string stored_value;
+		uint64_t key = 0;
+		size_t data_len;
+		while (infile.read((char *)&key, Config::ht_key_size) && infile.read((char *)&data_len, sizeof(size_t))) {
+			string value(data_len, '\0');
+			infile.read(value.data(), data_len);
+			if (key == 1000) stored_value = value;
+		}
+		BOOST_CHECK_EQUAL(stored_value, corrupt_value);
+	}
+}
+
 BOOST_AUTO_TEST_CASE(optimize_empty) {
 
 	HashTableHelper::truncate("main_index");
@@ -0,0 +1,64 @@
+/*
+ * MIT License
+ *
+ * Alexandria.org
+ *
+ * Copyright (c) 2021 Josef Cullhed, <info@alexandria.org>, et al.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "api/IndexRegistry.h"
+#include "file/File.h"
+
+BOOST_AUTO_TEST_SUITE(index_registry)
+
+BOOST_AUTO_TEST_CASE(index_registry) {
+
+	const FullTextShard<FullTextRecord> shard("test_registry_index", 0);
+	File::delete_file(shard.key_filename());
+
+	Worker::IndexRegistry registry("test_registry_index", "test_registry_link_index", "test_registry_domain_link_index", 0);
+
+	std::shared_ptr<Worker::Indexes> first = registry.current();
+	BOOST_CHECK(first == registry.current());
+	BOOST_CHECK_EQUAL(first->generation, 0);
+
+	// Writing the index files makes the next call load a new generation.
+	{
+		std::ofstream outfile(shard.key_filename(), std::ios::binary | std::ios::trunc);
+		outfile << "data";
+	}
+
+	std::shared_ptr<Worker::Indexes> second = registry.current();
+	BOOST_CHECK(first != second);
+	BOOST_CHECK(second->generation > 0);
+	BOOST_CHECK(second == registry.current());
+
+	// The old generation stays usable for the requests holding it.
+	BOOST_CHECK_EQUAL(first->hash_table.find(123), "");
+
+	registry.reload();
+	BOOST_CHECK(second != registry.current());
+	BOOST_CHECK_EQUAL(registry.current()->generation, second->generation);
+
+	File::delete_file(shard.key_filename());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
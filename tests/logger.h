@@ -46,4 +46,35 @@ BOOST_AUTO_TEST_CASE(test_logger1) {
 	BOOST_CHECK_EQUAL(line2, "test2");
 }
 
+BOOST_AUTO_TEST_CASE(test_logger_threads) {
+
+	const string marker = "logger_threads_" + std::to_string(std::chrono::system_clock::now().time_since_epoch().count());
+	const size_t dropped_before = logger::num_dropped();
+
+	std::vector<std::thread> threads;
+	for (size_t i = 0; i < 8; i++) {
+		threads.emplace_back([i, &marker]() {
+			for (size_t j = 0; j < 250; j++) {
+				LOG_INFO(marker + " " + std::to_string(i) + " " + std::to_string(j));
+			}
+		});
+	}
+	for (std::thread &thread : threads) {
+		thread.join();
+	}
+
+	logger::sync();
+
+	ifstream logfile(Config::log_file_path);
+	size_t num_lines = 0;
+	string line;
+	while (getline(logfile, line)) {
+		if (line.find(marker) != string::npos) num_lines++;
+	}
+
+	// 2000 records fit in the log buffer so none are dropped.
+	BOOST_CHECK_EQUAL(logger::num_dropped(), dropped_before);
+	BOOST_CHECK_EQUAL(num_lines, 2000);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -73,6 +73,7 @@ using std::pair;
 #include "cc_parser.h"
 #include "hash.h"
 #include "shard_builder.h"
+#include "posting_block.h"
 #include "n_gram.h"
 #include "link_counter.h"
 #include "url_store.h"
@@ -83,6 +84,10 @@ using std::pair;
 //#include "index_array.h"
 #include "memory.h"
 #include "thread_pool.h"
+#include "fast_cgi_server.h"
+#include "result_cache.h"
+#include "index_registry.h"
+#include "merger.h"
 
 void run_before() {
 	Config::read_config("../tests/test_config.conf");
@@ -25,6 +25,7 @@
  */
 
 #include "memory/memory.h"
+#include "memory/debugger.h"
 
 BOOST_AUTO_TEST_SUITE(memory)
 
@@ -33,4 +34,34 @@ BOOST_AUTO_TEST_CASE(mem) {
 	std::cout << "available_memory:" << available_memory << std::endl;
 }
 
+BOOST_AUTO_TEST_CASE(thread_counters) {
+
+	// Memory allocated by one thread and freed by another is still counted correctly.
+	std::vector<char *> allocations(32, nullptr);
+
+	const size_t mem_before = memory::allocated_memory();
+	const size_t num_before = memory::num_allocated();
+	{
+		std::vector<std::thread> threads;
+		for (size_t i = 0; i < allocations.size(); i++) {
+			threads.emplace_back([i, &allocations]() {
+				allocations[i] = new char[1000];
+			});
+		}
+		for (std::thread &thread : threads) {
+			thread.join();
+		}
+	}
+
+	BOOST_CHECK_EQUAL(memory::allocated_memory(), mem_before + 32 * 1000);
+	BOOST_CHECK_EQUAL(memory::num_allocated(), num_before + 32);
+
+	for (char *allocation : allocations) {
+		delete [] allocation;
+	}
+
+	BOOST_CHECK_EQUAL(memory::allocated_memory(), mem_before);
+	BOOST_CHECK_EQUAL(memory::num_allocated(), num_before);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,148 @@
+/*
+ * MIT License
+ *
+ * Alexandria.org
+ *
+ * Copyright (c) 2021 Josef Cullhed, <info@alexandria.org>, et al.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "indexer/merger.h"
+#include "indexer/index_builder.h"
+#include "indexer/index.h"
+#include "indexer/level.h"
+
+BOOST_AUTO_TEST_SUITE(merger)
+
+BOOST_AUTO_TEST_CASE(merge_budget) {
+
+	const size_t merge_threads = Config::indexer_merge_threads;
+	const size_t merge_memory_mb = Config::indexer_merge_memory_mb;
+	Config::indexer_merge_threads = 8;
+	Config::indexer_merge_memory_mb = 1;
+
+	std::atomic<size_t> running_bytes = 0;
+	std::atomic<size_t> max_running_bytes = 0;
+	std::mutex order_lock;
+	vector<size_t> merge_order;
+	vector<std::atomic<size_t>> appends(20);
+
+	indexer::merger::start_merge_thread();
+
+	for (size_t id = 0; id < 20; id++) {
+		const size_t size = (id + 1) * 20000;
+		indexer::merger::register_appender(id + 1, [id, &appends]() {
+			appends[id]++;
+		}, [size]() {
+			return size;
+		});
+		indexer::merger::register_merger(id + 1, [id, size, &running_bytes, &max_running_bytes, &order_lock, &merge_order]() {
+			{
+				std::lock_guard guard(order_lock);
+				merge_order.push_back(id);
+			}
+			const size_t now_running = running_bytes += size;
+			size_t max_running = max_running_bytes;
+			while (now_running > max_running && !max_running_bytes.compare_exchange_weak(max_running, now_running)) {
+			}
+			std::this_thread::sleep_for(10ms);
+			running_bytes -= size;
+		}, [size]() {
+			return size;
+		});
+	}
+
+	indexer::merger::stop_merge_thread();
+
+	for (size_t id = 0; id < 20; id++) {
+		BOOST_CHECK_EQUAL(appends[id], 1);
+		indexer::merger::deregister_merger(id + 1);
+	}
+
+	// Every merge runs once, the largest are started first and the running merges stay within the budget of 1mb.
+	BOOST_REQUIRE_EQUAL(merge_order.size(), 20);
+	BOOST_CHECK_EQUAL(merge_order[0], 19);
+	BOOST_CHECK(max_running_bytes <= 1024 * 1024);
+	BOOST_CHECK(max_running_bytes > 400000);
+
+	Config::indexer_merge_threads = merge_threads;
+	Config::indexer_merge_memory_mb = merge_memory_mb;
+}
+
+BOOST_AUTO_TEST_CASE(deregister_waits) {
+
+	std::atomic<bool> started = false;
+	std::atomic<bool> done = false;
+
+	indexer::merger::register_appender(12345, [&started, &done]() {
+		started = true;
+		std::this_thread::sleep_for(100ms);
+		done = true;
+	});
+
+	std::thread append_thread([]() {
+		indexer::merger::force_append();
+	});
+
+	while (!started) std::this_thread::sleep_for(1ms);
+	indexer::merger::deregister_merger(12345);
+	BOOST_CHECK(done);
+
+	append_thread.join();
+}
+
+BOOST_AUTO_TEST_CASE(index_builder_threads) {
+
+	{
+		indexer::index_builder<indexer::generic_record> idx("test", 0);
+		idx.truncate();
+
+		// Threads add to the same builder while it is appended.
+		std::vector<std::thread> threads;
+		for (size_t thread_id = 0; thread_id < 24; thread_id++) {
+			threads.emplace_back([thread_id, &idx]() {
+				for (size_t i = 0; i < 1000; i++) {
+					idx.add(123 + i % 2, indexer::generic_record(thread_id * 1000 + i, 0.1f));
+				}
+			});
+		}
+		idx.append();
+		for (std::thread &thread : threads) {
+			thread.join();
+		}
+
+		idx.append();
+		idx.merge();
+	}
+
+	{
+		indexer::index<indexer::generic_record> idx("test", 0);
+		size_t total;
+		std::vector<indexer::generic_record> res = idx.find(123, total);
+		BOOST_REQUIRE_EQUAL(res.size(), 12000);
+		BOOST_CHECK_EQUAL(total, 12000);
+		for (size_t i = 0; i < res.size(); i++) {
+			BOOST_CHECK_EQUAL(res[i].m_value, i * 2);
+		}
+	}
+
+}
+
+BOOST_AUTO_TEST_SUITE_END()
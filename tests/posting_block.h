@@ -0,0 +1,84 @@
+/*
+ * MIT License
+ *
+ * Alexandria.org
+ *
+ * Copyright (c) 2021 Josef Cullhed, <info@alexandria.org>, et al.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "full_text/PostingBlock.h"
+
+BOOST_AUTO_TEST_SUITE(posting_block)
+
+BOOST_AUTO_TEST_CASE(pack_unpack) {
+
+	for (size_t width = 0; width <= 64; width++) {
+		const uint64_t mask = width == 64 ? UINT64_MAX : (1ull << width) - 1;
+		uint64_t values[PostingBlock::block_len];
+		for (size_t i = 0; i < PostingBlock::block_len; i++) {
+			values[i] = (i * 0x9E3779B97F4A7C15ull) & mask;
+		}
+
+		uint64_t packed[PostingBlock::block_len];
+		PostingBlock::pack(values, PostingBlock::block_len, width, packed);
+
+		uint64_t unpacked[PostingBlock::block_len];
+		PostingBlock::unpack(packed, PostingBlock::block_len, width, unpacked);
+
+		for (size_t i = 0; i < PostingBlock::block_len; i++) {
+			BOOST_CHECK_EQUAL(values[i], unpacked[i]);
+		}
+	}
+}
+
+BOOST_AUTO_TEST_CASE(encode_decode) {
+
+	for (size_t num_records : {0, 1, 3, 128, 129, 1000}) {
+		vector<Link::FullTextRecord> records;
+		for (size_t i = 0; i < num_records; i++) {
+			records.push_back(Link::FullTextRecord{
+				.m_value = i * 1234567ull,
+				.m_score = (float)(i % 13) / 3.0f,
+				.m_source_domain = i % 7,
+				.m_target_hash = i * 0x9E3779B97F4A7C15ull
+			});
+		}
+
+		vector<uint64_t> stream = PostingBlock::encode(records, 100);
+
+		vector<Link::FullTextRecord> decoded;
+		PostingBlock::decode((const char *)stream.data(), stream.size() * sizeof(uint64_t), decoded);
+
+		BOOST_REQUIRE_EQUAL(decoded.size(), records.size());
+		for (size_t i = 0; i < num_records; i++) {
+			BOOST_CHECK_EQUAL(decoded[i].m_value, records[i].m_value);
+			BOOST_CHECK_EQUAL(decoded[i].m_score, records[i].m_score);
+			BOOST_CHECK_EQUAL(decoded[i].m_source_domain, records[i].m_source_domain);
+			BOOST_CHECK_EQUAL(decoded[i].m_target_hash, records[i].m_target_hash);
+		}
+
+		if (num_records >= 128) {
+			BOOST_CHECK(stream.size() * sizeof(uint64_t) < num_records * sizeof(Link::FullTextRecord));
+		}
+	}
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,95 @@
+/*
+ * MIT License
+ *
+ * Alexandria.org
+ *
+ * Copyright (c) 2021 Josef Cullhed, <info@alexandria.org>, et al.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "api/ResultCache.h"
+
+BOOST_AUTO_TEST_SUITE(result_cache)
+
+BOOST_AUTO_TEST_CASE(result_cache) {
+
+	Api::ResultCache cache(1024*1024, 4);
+
+	BOOST_CHECK(Api::ResultCache::make_key("q", "Hello, World") == Api::ResultCache::make_key("q", "hello world"));
+	BOOST_CHECK(Api::ResultCache::make_key("q", "hello world") != Api::ResultCache::make_key("s", "hello world"));
+
+	const string key = Api::ResultCache::make_key("q", "hello world");
+
+	string value;
+	BOOST_CHECK(!cache.find(key, 1, value));
+
+	cache.insert(key, "response 1", 1);
+	BOOST_CHECK(cache.find(key, 1, value));
+	BOOST_CHECK_EQUAL(value, "response 1");
+
+	cache.insert(key, "response 2", 1);
+	BOOST_CHECK(cache.find(key, 1, value));
+	BOOST_CHECK_EQUAL(value, "response 2");
+	BOOST_CHECK_EQUAL(cache.size(), 1);
+
+	// Entries from an older index generation are dropped.
+	BOOST_CHECK(!cache.find(key, 2, value));
+	BOOST_CHECK_EQUAL(cache.size(), 0);
+	BOOST_CHECK_EQUAL(cache.bytes(), 0);
+
+	cache.insert(key, "response 3", 2);
+	cache.clear();
+	BOOST_CHECK(!cache.find(key, 2, value));
+}
+
+BOOST_AUTO_TEST_CASE(result_cache_admission) {
+
+	const size_t max_bytes = 1024*1024;
+	Api::ResultCache cache(max_bytes, 1);
+
+	const string response(10000, 'x');
+
+	// Head queries requested many times.
+	for (size_t i = 0; i < 50; i++) {
+		const string key = Api::ResultCache::make_key("q", "head query " + std::to_string(i));
+		string value;
+		for (size_t j = 0; j < 5; j++) {
+			if (!cache.find(key, 1, value)) cache.insert(key, response, 1);
+		}
+	}
+
+	// A scan of one-off queries larger than the cache.
+	for (size_t i = 0; i < 1000; i++) {
+		const string key = Api::ResultCache::make_key("q", "tail query " + std::to_string(i));
+		string value;
+		if (!cache.find(key, 1, value)) cache.insert(key, response, 1);
+	}
+
+	BOOST_CHECK(cache.bytes() <= max_bytes);
+
+	size_t head_hits = 0;
+	for (size_t i = 0; i < 50; i++) {
+		string value;
+		if (cache.find(Api::ResultCache::make_key("q", "head query " + std::to_string(i)), 1, value)) head_hits++;
+	}
+	BOOST_CHECK_EQUAL(head_hits, 50);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
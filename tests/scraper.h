@@ -25,8 +25,96 @@
  */
 
 #include "scraper/scraper.h"
+#include "scraper/engine.h"
+#include "scraper/timer_wheel.h"
+#include "scraper/store.h"
 #include <queue>
 #include <vector>
+#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+#include <boost/iostreams/device/array.hpp>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace scraper_test {
+
+	/*
+		Minimal HTTP server for the engine test. Serves robots.txt and html pages for any host and records the requests as host + path.
+	*/
+	class stub_server {
+		public:
+			stub_server(int port) {
+				m_fd = socket(AF_INET, SOCK_STREAM, 0);
+				int enable = 1;
+				setsockopt(m_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+				sockaddr_in addr = {};
+				addr.sin_family = AF_INET;
+				addr.sin_port = htons(port);
+				inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+				bind(m_fd, (sockaddr *)&addr, sizeof(addr));
+				listen(m_fd, 1024);
+				m_thread = std::thread([this]() {
+					int client;
+					while ((client = accept(m_fd, nullptr, nullptr)) >= 0) {
+						handle(client);
+					}
+				});
+			}
+
+			~stub_server() {
+				shutdown(m_fd, SHUT_RDWR);
+				close(m_fd);
+				m_thread.join();
+			}
+
+			vector<string> requests() {
+				std::lock_guard guard(m_lock);
+				return m_requests;
+			}
+
+		private:
+			int m_fd;
+			std::thread m_thread;
+			std::mutex m_lock;
+			vector<string> m_requests;
+
+			void handle(int client) {
+				string request;
+				char buffer[4096];
+				ssize_t len;
+				while (request.find("\r\n\r\n") == string::npos && (len = read(client, buffer, sizeof(buffer))) > 0) {
+					request.append(buffer, len);
+				}
+
+				const size_t path_start = request.find(' ') + 1;
+				const string path = request.substr(path_start, request.find(' ', path_start) - path_start);
+				const size_t host_start = request.find("Host: ") + 6;
+				const string host = request.substr(host_start, request.find("\r\n", host_start) - host_start);
+				{
+					std::lock_guard guard(m_lock);
+					m_requests.push_back(host + path);
+				}
+
+				string body;
+				string content_type = "text/html; charset=utf-8";
+				if (path == "/robots.txt") {
+					body = "User-agent: *\nDisallow: /private\n";
+					content_type = "text/plain";
+				} else {
+					body = "<html><head><meta charset=\"utf-8\"><title>Page " + path + " on " + host + "</title></head>"
+						"<body><h1>" + host + "</h1><p>Some text on the page.</p></body></html>";
+				}
+				const string response = "HTTP/1.1 200 OK\r\nContent-Type: " + content_type + "\r\nContent-Length: " +
+					std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+				send(client, response.data(), response.size(), MSG_NOSIGNAL);
+				close(client);
+			}
+	};
+
+}
 
 BOOST_AUTO_TEST_SUITE(scraper)
 
@@ -53,6 +141,164 @@ BOOST_AUTO_TEST_CASE(scraper) {
 	BOOST_CHECK_EQUAL(cols[1], "Den sista gåvan av Abdulrazak Gurnah - recensioner & prisjämförelse - Omnible");
 }
 
+BOOST_AUTO_TEST_CASE(store_threads) {
+
+	Scraper::store store;
+
+	std::atomic<bool> running = true;
+	vector<std::thread> threads;
+	for (size_t i = 0; i < 8; i++) {
+		threads.emplace_back([&store, i]() {
+			for (size_t j = 0; j < 10000; j++) {
+				store.add_scraper_data("http://thread" + std::to_string(i) + ".com/" + std::to_string(j) + "\ttitle\n");
+				store.add_link_data("");
+				store.add_curl_error("");
+			}
+		});
+	}
+
+	// Swap the staged data while the threads are adding to it.
+	std::thread flusher([&store, &running]() {
+		while (running) {
+			store.flush();
+			std::this_thread::sleep_for(std::chrono::milliseconds(5));
+		}
+	});
+
+	for (std::thread &thread : threads) {
+		thread.join();
+	}
+	running = false;
+	flusher.join();
+	store.flush();
+	BOOST_CHECK_EQUAL(store.num_staged(), 0);
+	BOOST_CHECK_EQUAL(store.num_uploaded_lines(), 8 * 10000 * 3);
+
+	// Staging is per thread, the tail is the last result added by any thread.
+	store.add_scraper_data("http://last.com/\ttitle\n");
+	BOOST_CHECK_EQUAL(store.tail(), "http://last.com/\ttitle\n");
+
+	// Data below the upload limits is uploaded by flush.
+	UrlStore::DomainData domain_data;
+	domain_data.m_domain = "store-threads.com";
+	store.add_domain_data(domain_data);
+	UrlStore::RobotsData robots_data;
+	robots_data.m_domain = "store-threads.com";
+	store.add_robots_data(robots_data);
+	store.add_non_200_scraper_data("http://store-threads.com/404\t404\n");
+	store.add_curl_error("http://store-threads.com/timeout\n");
+	BOOST_CHECK_EQUAL(store.num_staged(), 5);
+
+	store.flush();
+
+	BOOST_CHECK_EQUAL(store.num_staged(), 0);
+	BOOST_CHECK_EQUAL(store.num_uploaded_lines(), 8 * 10000 * 3 + 3);
+}
+
+BOOST_AUTO_TEST_CASE(store_compress) {
+
+	const vector<string> first = {"http://a.com/\ttitle\n", "http://b.com/\ttitle\n"};
+	const vector<string> empty;
+	const vector<string> second = {"http://c.com/\ttitle\n"};
+
+	const string compressed = Scraper::store::compress_lines({&first, &empty, &second});
+
+	boost::iostreams::filtering_istream decompress_stream;
+	decompress_stream.push(boost::iostreams::gzip_decompressor());
+	decompress_stream.push(boost::iostreams::array_source(compressed.data(), compressed.size()));
+	const string lines((std::istreambuf_iterator<char>(decompress_stream)), std::istreambuf_iterator<char>());
+
+	BOOST_CHECK_EQUAL(lines, "http://a.com/\ttitle\nhttp://b.com/\ttitle\nhttp://c.com/\ttitle\n");
+}
+
+BOOST_AUTO_TEST_CASE(timer_wheel) {
+
+	Scraper::timer_wheel<int> wheel(10, 8, 1000);
+
+	wheel.schedule(1, 0);
+	wheel.schedule(2, 25);
+	wheel.schedule(3, 200);
+	BOOST_CHECK_EQUAL(wheel.size(), 3);
+
+	vector<int> expired;
+	wheel.advance(1005, expired);
+	BOOST_CHECK_EQUAL(expired.size(), 0);
+
+	wheel.advance(1010, expired);
+	BOOST_REQUIRE_EQUAL(expired.size(), 1);
+	BOOST_CHECK_EQUAL(expired[0], 1);
+
+	wheel.advance(1030, expired);
+	BOOST_REQUIRE_EQUAL(expired.size(), 2);
+	BOOST_CHECK_EQUAL(expired[1], 2);
+
+	// Item 3 is further away than one revolution of the wheel and passes its slot twice before it expires.
+	wheel.advance(1190, expired);
+	BOOST_CHECK_EQUAL(expired.size(), 2);
+	wheel.advance(1200, expired);
+	BOOST_REQUIRE_EQUAL(expired.size(), 3);
+	BOOST_CHECK_EQUAL(expired[2], 3);
+	BOOST_CHECK_EQUAL(wheel.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(engine) {
+
+	scraper_test::stub_server server(8020);
+
+	vector<string> urls;
+	for (size_t domain = 0; domain < 20; domain++) {
+		const string host = "http://domain" + std::to_string(domain) + ".com";
+		for (size_t page = 0; page < 5; page++) {
+			urls.push_back(host + "/page" + std::to_string(page));
+		}
+		urls.push_back(host + "/private/page");
+	}
+
+	Scraper::store store;
+	{
+		Scraper::engine engine(&store, 2);
+		engine.set_timeout(0);
+		engine.set_connect_to("127.0.0.1:8020");
+		engine.push_urls(urls);
+		BOOST_CHECK_EQUAL(engine.num_scrapers(), 20);
+		BOOST_CHECK(!engine.full());
+		engine.set_max_connections(2);
+		BOOST_CHECK(engine.full());
+		engine.set_max_connections(1000);
+		engine.start();
+
+		// Statistics are gathered while the workers run.
+		Scraper::stats stats;
+		while (!engine.finished()) {
+			engine.gather_statistics(stats, 0);
+			BOOST_CHECK(engine.num_scrapers() <= 20);
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+		engine.gather_statistics(stats, 0);
+		BOOST_CHECK_EQUAL(engine.num_scrapers(), 0);
+		engine.stop();
+	}
+
+	// One robots.txt per domain and every page except the ones robots.txt disallows.
+	vector<string> requests = server.requests();
+	BOOST_CHECK_EQUAL(requests.size(), 20 * 6);
+	BOOST_CHECK_EQUAL(std::count(requests.begin(), requests.end(), "domain7.com/robots.txt"), 1);
+	BOOST_CHECK_EQUAL(std::count(requests.begin(), requests.end(), "domain7.com/page4"), 1);
+	BOOST_CHECK_EQUAL(std::count(requests.begin(), requests.end(), "domain7.com/private/page"), 0);
+
+	// Requests to one domain are made one at a time in the order of the urls.
+	vector<string> domain_requests;
+	std::copy_if(requests.begin(), requests.end(), std::back_inserter(domain_requests), [](const string &request) {
+		return request.find("domain3.com/") == 0;
+	});
+	BOOST_CHECK(domain_requests == vector<string>({"domain3.com/robots.txt", "domain3.com/page0", "domain3.com/page1",
+		"domain3.com/page2", "domain3.com/page3", "domain3.com/page4"}));
+
+	vector<string> cols;
+	boost::algorithm::split(cols, store.tail(), boost::is_any_of("\t"));
+	BOOST_CHECK(cols[1].find("Page /page") == 0);
+}
+
 BOOST_AUTO_TEST_CASE(scraper_multithreaded) {
 
 	return;
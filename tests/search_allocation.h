@@ -35,4 +35,22 @@ BOOST_AUTO_TEST_CASE(create) {
 	SearchAllocation::delete_storage(search_alloc);
 }
 
+BOOST_AUTO_TEST_CASE(release_memory) {
+	const size_t size = 1000000;
+	FullTextResultSet<FullTextRecord> result_set(size);
+
+	memset((void *)result_set.data_pointer(), 1, size * sizeof(FullTextRecord));
+	result_set.release_memory(1000);
+
+	// The kept records are untouched and the released pages read as zero.
+	BOOST_CHECK_EQUAL(result_set.data_pointer()[999].m_value, 0x0101010101010101ull);
+	BOOST_CHECK_EQUAL(result_set.data_pointer()[size - 1].m_value, 0);
+
+	SearchAllocation::Allocation *allocation = SearchAllocation::create_allocation();
+	allocation->storage->result_sets[0]->data_pointer()[Config::ft_max_results_per_section * 2].m_value = 1;
+	SearchAllocation::release_allocation(allocation);
+	BOOST_CHECK_EQUAL(allocation->storage->result_sets[0]->data_pointer()[Config::ft_max_results_per_section * 2].m_value, 0);
+	SearchAllocation::delete_allocation(allocation);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -25,6 +25,8 @@
  */
 
 #include "search_engine/SearchEngine.h"
+#include "full_text/FullTextShardBuilder.h"
+#include "full_text/FullTextShard.h"
 
 BOOST_AUTO_TEST_SUITE(search_engine)
 
@@ -91,4 +93,208 @@ BOOST_AUTO_TEST_CASE(apply_domain_link_scores) {
 	}
 }
 
+BOOST_AUTO_TEST_CASE(block_max_intersection) {
+
+	FullTextShardBuilder<FullTextRecord> builder("block_max_test", 11);
+
+	builder.truncate();
+	builder.truncate_cache_files();
+
+	const size_t num_records[3] = {800, 1900, 3000};
+	for (uint64_t key = 0; key < 3; key++) {
+		for (uint64_t i = 0; i < num_records[key]; i++) {
+			const uint64_t value = (i * 7919 + key * 104729) % 2000;
+			FullTextRecord record = {
+				.m_value = value * 1000003,
+				.m_score = (float)((value * 31 + key * 17) % 1000) / 100.0f,
+				.m_domain_hash = value % 97
+			};
+			builder.add((key + 1) * Config::shard_hash_table_size, record);
+		}
+	}
+
+	builder.append();
+	builder.merge();
+
+	FullTextShard<FullTextRecord> shard("block_max_test", 11);
+
+	vector<Link::FullTextRecord> links;
+	for (uint64_t i = 0; i < 300; i++) {
+		links.push_back(Link::FullTextRecord{.m_value = i, .m_score = (float)(i % 100) / 400.0f, .m_source_domain = i % 5,
+			.m_target_hash = ((i * 13) % 2000) * 1000003});
+	}
+	sort(links.begin(), links.end(), [](const Link::FullTextRecord &a, const Link::FullTextRecord &b) {
+		return a.m_target_hash < b.m_target_hash;
+	});
+	vector<DomainLink::FullTextRecord> domain_links = {
+		DomainLink::FullTextRecord{.m_value = 1, .m_score = 0.2f, .m_source_domain = 1, .m_target_domain = 3}
+	};
+
+	const size_t max_size = Config::ft_max_results_per_section * Config::ft_max_sections;
+	vector<FullTextResultSet<FullTextRecord> *> result_sets;
+	for (uint64_t key = 0; key < 3; key++) {
+		result_sets.push_back(new FullTextResultSet<FullTextRecord>(max_size));
+		shard.find((key + 1) * Config::shard_hash_table_size, result_sets.back());
+		BOOST_REQUIRE(result_sets.back()->has_blocks());
+	}
+
+	const size_t limit = 10;
+
+	FullTextResultSet<FullTextRecord> expected(max_size);
+	SearchEngine::calculate_intersection<FullTextRecord>(result_sets, &expected);
+	SearchEngine::apply_domain_link_scores(domain_links, &expected);
+	SearchEngine::apply_link_scores(links, &expected);
+	SearchEngine::get_unsorted_results_with_top_scores<FullTextRecord>(&expected, limit);
+
+	for (uint64_t key = 0; key < 3; key++) {
+		result_sets[key]->close_sections();
+		shard.find((key + 1) * Config::shard_hash_table_size, result_sets[key]);
+	}
+
+	SearchMetric metric;
+	SearchEngine::reset_search_metric(metric);
+	FullTextResultSet<FullTextRecord> result(max_size);
+	auto bonus = SearchEngine::make_link_bonus(links, domain_links);
+	SearchEngine::block_max_intersection<FullTextRecord>(result_sets, bonus, limit, &result, metric);
+
+	BOOST_REQUIRE_EQUAL(result.size(), expected.size());
+	for (size_t i = 0; i < result.size(); i++) {
+		BOOST_CHECK_EQUAL(result.data_pointer()[i].m_value, expected.data_pointer()[i].m_value);
+		BOOST_CHECK_EQUAL(result.data_pointer()[i].m_score, expected.data_pointer()[i].m_score);
+	}
+
+	for (FullTextResultSet<FullTextRecord> *result_set : result_sets) {
+		delete result_set;
+	}
+}
+
+BOOST_AUTO_TEST_CASE(block_max_intersection_result_limit) {
+
+	const size_t results_per_section = Config::ft_max_results_per_section;
+	const size_t result_limit = Config::result_limit;
+	Config::ft_max_results_per_section = 512;
+	Config::result_limit = 200;
+
+	FullTextShardBuilder<FullTextRecord> builder("block_max_test", 12);
+
+	builder.truncate();
+	builder.truncate_cache_files();
+
+	const uint64_t key_a = Config::shard_hash_table_size;
+	const uint64_t key_b = 2 * Config::shard_hash_table_size;
+	auto add = [&builder](uint64_t key, uint64_t begin, uint64_t end, float score) {
+		for (uint64_t value = begin; value < end; value++) {
+			builder.add(key, FullTextRecord{.m_value = value, .m_score = score + (float)(value % 1000) / 4000.0f, .m_domain_hash = value});
+		}
+	};
+
+	/*
+		The first sections of both keys only share the values 0 to 127, the rest of the first section of key a is skipped since it can
+		not beat them. Those skipped records would reach the result limit but they have no matches, so the second section of key a
+		has to be searched and it has the best results together with the first section of key b.
+	*/
+	add(key_a, 0, 128, 10.0f);
+	add(key_a, 128, 512, 6.0f);
+	add(key_a, 1000, 1512, 5.0f);
+
+	add(key_b, 0, 128, 4.0f);
+	add(key_b, 1000, 1384, 10.0f);
+	add(key_b, 128, 512, 3.0f);
+	add(key_b, 1384, 1512, 3.0f);
+	add(key_b, 5000, 5512, 1.0f);
+
+	builder.append();
+	builder.merge();
+
+	FullTextShard<FullTextRecord> shard("block_max_test", 12);
+
+	const size_t max_size = Config::ft_max_results_per_section * Config::ft_max_sections;
+	vector<FullTextResultSet<FullTextRecord> *> result_sets;
+	for (uint64_t key : {key_a, key_b}) {
+		result_sets.push_back(new FullTextResultSet<FullTextRecord>(max_size));
+		shard.find(key, result_sets.back());
+		BOOST_REQUIRE(result_sets.back()->has_blocks());
+		BOOST_REQUIRE(result_sets.back()->num_sections() > 1);
+	}
+
+	const size_t limit = 10;
+
+	FullTextResultSet<FullTextRecord> expected(max_size);
+	SearchEngine::calculate_intersection<FullTextRecord>(result_sets, &expected);
+	SearchEngine::get_unsorted_results_with_top_scores<FullTextRecord>(&expected, limit);
+
+	for (size_t i = 0; i < result_sets.size(); i++) {
+		result_sets[i]->close_sections();
+		shard.find(i == 0 ? key_a : key_b, result_sets[i]);
+	}
+
+	SearchMetric metric;
+	SearchEngine::reset_search_metric(metric);
+	FullTextResultSet<FullTextRecord> result(max_size);
+	auto bonus = SearchEngine::make_link_bonus({}, {});
+	SearchEngine::block_max_intersection<FullTextRecord>(result_sets, bonus, limit, &result, metric);
+
+	BOOST_REQUIRE_EQUAL(result.size(), expected.size());
+	for (size_t i = 0; i < result.size(); i++) {
+		BOOST_CHECK_EQUAL(result.data_pointer()[i].m_value, expected.data_pointer()[i].m_value);
+		BOOST_CHECK_EQUAL(result.data_pointer()[i].m_score, expected.data_pointer()[i].m_score);
+		BOOST_CHECK(result.data_pointer()[i].m_value >= 1000);
+	}
+
+	for (FullTextResultSet<FullTextRecord> *result_set : result_sets) {
+		delete result_set;
+	}
+
+	Config::ft_max_results_per_section = results_per_section;
+	Config::result_limit = result_limit;
+}
+
+BOOST_AUTO_TEST_CASE(intersection_pool) {
+
+	SearchEngine::IntersectionPool pool(4);
+
+	BOOST_CHECK_EQUAL(pool.num_threads(), 4);
+
+	for (size_t num_tasks : {0, 1, 3, 4, 100, 1000}) {
+		vector<std::atomic<int>> counts(num_tasks);
+		pool.run(num_tasks, [&counts](size_t task) {
+			counts[task]++;
+		});
+		for (size_t i = 0; i < num_tasks; i++) {
+			BOOST_CHECK_EQUAL(counts[i].load(), 1);
+		}
+	}
+
+	BOOST_CHECK_THROW(pool.run(10, [](size_t task) {
+		if (task == 5) throw std::runtime_error("task failed");
+	}), std::runtime_error);
+
+	// The pool is still usable after a failed run.
+	std::atomic<size_t> sum = 0;
+	pool.run(10, [&sum](size_t task) {
+		sum += task;
+	});
+	BOOST_CHECK_EQUAL(sum.load(), 45);
+
+	// Runs from the tasks of the pool run on the thread of the task instead of waiting for the pool.
+	vector<std::atomic<int>> nested_counts(30);
+	pool.run(3, [&pool, &nested_counts](size_t task) {
+		pool.run(10, [&nested_counts, task](size_t nested_task) {
+			nested_counts[task * 10 + nested_task]++;
+		});
+	});
+	for (size_t i = 0; i < nested_counts.size(); i++) {
+		BOOST_CHECK_EQUAL(nested_counts[i].load(), 1);
+	}
+
+	SearchEngine::IntersectionPool single_pool(1);
+	std::atomic<size_t> nested_sum = 0;
+	single_pool.run(2, [&single_pool, &nested_sum](size_t task) {
+		single_pool.run(2, [&nested_sum](size_t nested_task) {
+			nested_sum += nested_task + 1;
+		});
+	});
+	BOOST_CHECK_EQUAL(nested_sum.load(), 6);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -166,4 +166,223 @@ BOOST_AUTO_TEST_CASE(shard_builder2) {
 
 }
 
+BOOST_AUTO_TEST_CASE(shard_mapped_lookup) {
+
+	FullTextShardBuilder<FullTextRecord> builder("single_db_test", 10);
+
+	builder.truncate();
+	builder.truncate_cache_files();
+
+	for (uint64_t key = 1; key <= 100; key++) {
+		for (uint64_t value = 0; value < key % 5 + 1; value++) {
+			FullTextRecord record = {
+				.m_value = value,
+				.m_score = 0.1f,
+				.m_domain_hash = key
+			};
+			builder.add(key * Config::shard_hash_table_size, record);
+		}
+	}
+
+	builder.append();
+	builder.merge();
+
+	FullTextShard<FullTextRecord> shard("single_db_test", 10);
+
+	FullTextResultSet<FullTextRecord> result_set(Config::ft_max_results_per_section * Config::ft_max_sections);
+
+	for (uint64_t key = 1; key <= 100; key++) {
+		shard.prefetch(key * Config::shard_hash_table_size);
+		shard.find(key * Config::shard_hash_table_size, &result_set);
+
+		BOOST_CHECK_EQUAL(result_set.size(), key % 5 + 1);
+		BOOST_CHECK_EQUAL(result_set.data_pointer()[0].m_domain_hash, key);
+		BOOST_CHECK_EQUAL(shard.total_num_results(key * Config::shard_hash_table_size), key % 5 + 1);
+
+		result_set.close_sections();
+	}
+
+	shard.prefetch(101 * Config::shard_hash_table_size);
+	shard.find(101 * Config::shard_hash_table_size, &result_set);
+	BOOST_CHECK_EQUAL(result_set.size(), 0);
+	BOOST_CHECK_EQUAL(shard.total_num_results(101 * Config::shard_hash_table_size), 0);
+}
+
+BOOST_AUTO_TEST_CASE(shard_mapping_survives_merge) {
+
+	FullTextShardBuilder<FullTextRecord> builder("single_db_test", 10);
+
+	builder.truncate();
+	builder.truncate_cache_files();
+
+	const uint64_t key = 7 * Config::shard_hash_table_size;
+	builder.add(key, {.m_value = 1, .m_score = 0.1f, .m_domain_hash = 1});
+	builder.append();
+	builder.merge();
+
+	FullTextResultSet<FullTextRecord> result_set(Config::ft_max_results_per_section * Config::ft_max_sections);
+
+	FullTextShard<FullTextRecord> old_shard("single_db_test", 10);
+	old_shard.find(key, &result_set);
+	BOOST_CHECK_EQUAL(result_set.size(), 1);
+	result_set.close_sections();
+
+	for (uint64_t value = 2; value <= 1000; value++) {
+		builder.add(key, {.m_value = value, .m_score = 0.1f, .m_domain_hash = 1});
+	}
+	builder.append();
+	builder.merge();
+
+	// The merge replaces the files, the mapped shard keeps reading the files it mapped.
+	old_shard.find(key, &result_set);
+	BOOST_CHECK_EQUAL(result_set.size(), 1);
+	BOOST_CHECK_EQUAL(old_shard.total_num_results(key), 1);
+	result_set.close_sections();
+
+	FullTextShard<FullTextRecord> new_shard("single_db_test", 10);
+	new_shard.find(key, &result_set);
+	BOOST_CHECK_EQUAL(result_set.size(), 1000);
+	BOOST_CHECK_EQUAL(new_shard.total_num_results(key), 1000);
+	result_set.close_sections();
+}
+
+BOOST_AUTO_TEST_CASE(shard_reads_v2_format) {
+
+	FullTextShardBuilder<FullTextRecord> builder("single_db_test", 10);
+
+	builder.truncate();
+	builder.truncate_cache_files();
+
+	// Write a version 2 shard by hand, one page in bucket 0 with two keys and raw records.
+	const uint64_t keys[2] = {1 * Config::shard_hash_table_size, 2 * Config::shard_hash_table_size};
+	const FullTextRecord records[3] = {
+		{.m_value = 10, .m_score = 0.3f, .m_domain_hash = 1},
+		{.m_value = 20, .m_score = 0.2f, .m_domain_hash = 2},
+		{.m_value = 21, .m_score = 0.1f, .m_domain_hash = 2}
+	};
+
+	{
+		std::ofstream key_writer(builder.key_filename(), std::ios::binary | std::ios::trunc);
+		for (size_t i = 0; i < Config::shard_hash_table_size; i++) {
+			const uint64_t pos = i == 0 ? 0 : SIZE_MAX;
+			key_writer.write((char *)&pos, sizeof(uint64_t));
+		}
+		const uint64_t marker[2] = {0x32304B5446584C41ull, 2};
+		key_writer.write((char *)marker, sizeof(marker));
+
+		const uint64_t page[] = {
+			2, // num_keys
+			keys[0], // fence table
+			keys[0], keys[1],
+			0, sizeof(FullTextRecord),
+			sizeof(FullTextRecord), 2 * sizeof(FullTextRecord),
+			1, 2
+		};
+		std::ofstream data_writer(builder.target_filename(), std::ios::binary | std::ios::trunc);
+		data_writer.write((char *)page, sizeof(page));
+		data_writer.write((char *)records, sizeof(records));
+	}
+
+	FullTextResultSet<FullTextRecord> result_set(Config::ft_max_results_per_section * Config::ft_max_sections);
+
+	{
+		FullTextShard<FullTextRecord> shard("single_db_test", 10);
+
+		shard.find(keys[0], &result_set);
+		BOOST_REQUIRE_EQUAL(result_set.size(), 1);
+		BOOST_CHECK_EQUAL(result_set.data_pointer()[0].m_value, 10ull);
+		BOOST_CHECK_EQUAL(shard.total_num_results(keys[0]), 1);
+		result_set.close_sections();
+
+		shard.find(keys[1], &result_set);
+		BOOST_REQUIRE_EQUAL(result_set.size(), 2);
+		BOOST_CHECK_EQUAL(result_set.data_pointer()[0].m_value, 20ull);
+		BOOST_CHECK_EQUAL(result_set.data_pointer()[1].m_value, 21ull);
+		BOOST_CHECK_EQUAL(shard.total_num_results(keys[1]), 2);
+		result_set.close_sections();
+	}
+
+	// Merging into the version 2 file rewrites it in the current format without losing the old records.
+	builder.add(3 * Config::shard_hash_table_size, {.m_value = 30, .m_score = 0.1f, .m_domain_hash = 3});
+	builder.append();
+	builder.merge();
+
+	{
+		FullTextShard<FullTextRecord> shard("single_db_test", 10);
+
+		shard.find(keys[1], &result_set);
+		BOOST_REQUIRE_EQUAL(result_set.size(), 2);
+		BOOST_CHECK_EQUAL(result_set.data_pointer()[0].m_value, 20ull);
+		result_set.close_sections();
+
+		shard.find(3 * Config::shard_hash_table_size, &result_set);
+		BOOST_REQUIRE_EQUAL(result_set.size(), 1);
+		BOOST_CHECK_EQUAL(result_set.data_pointer()[0].m_value, 30ull);
+		result_set.close_sections();
+	}
+}
+
+BOOST_AUTO_TEST_CASE(shard_streaming_merge) {
+
+	const size_t results_per_section = Config::ft_max_results_per_section;
+	const size_t max_sections = Config::ft_max_sections;
+	Config::ft_max_results_per_section = 10;
+	Config::ft_max_sections = 2;
+
+	FullTextShardBuilder<FullTextRecord> builder("single_db_test", 10);
+
+	builder.truncate();
+	builder.truncate_cache_files();
+
+	const uint64_t key = 123456ull;
+	const uint64_t same_page_key = key + Config::shard_hash_table_size;
+
+	// 50 unique values for key spread over several merges, every value is added twice.
+	for (uint64_t round = 0; round < 5; round++) {
+		for (uint64_t value = round * 10; value < round * 10 + 10; value++) {
+			FullTextRecord record = {
+				.m_value = value,
+				.m_score = (float)value,
+				.m_domain_hash = value
+			};
+			builder.add(key, record);
+			builder.append();
+			builder.add(key, record);
+		}
+		builder.add(same_page_key, {.m_value = round, .m_score = 1.0f, .m_domain_hash = round});
+		builder.add(key + 1, {.m_value = round, .m_score = 1.0f, .m_domain_hash = round});
+		builder.append();
+		if (round % 2 == 1) builder.merge();
+	}
+	builder.merge();
+
+	FullTextShard<FullTextRecord> shard("single_db_test", 10);
+
+	FullTextResultSet<FullTextRecord> result_set(Config::ft_max_results_per_section * Config::ft_max_sections);
+	shard.find(key, &result_set);
+
+	// The first section holds the 10 records with the highest scores ordered by value.
+	BOOST_CHECK_EQUAL(result_set.size(), 10);
+	for (size_t i = 0; i < result_set.size(); i++) {
+		BOOST_CHECK_EQUAL(result_set.data_pointer()[i].m_value, 40 + i);
+	}
+
+	result_set.close_sections();
+
+	shard.find(same_page_key, &result_set);
+	BOOST_CHECK_EQUAL(result_set.size(), 5);
+	BOOST_CHECK_EQUAL(shard.total_num_results(same_page_key), 5);
+
+	result_set.close_sections();
+
+	shard.find(key + 1, &result_set);
+	BOOST_CHECK_EQUAL(result_set.size(), 5);
+	for (size_t i = 0; i < result_set.size(); i++) {
+		BOOST_CHECK_EQUAL(result_set.data_pointer()[i].m_value, i);
+	}
+
+	Config::ft_max_results_per_section = results_per_section;
+	Config::ft_max_sections = max_sections;
+}
+
 BOOST_AUTO_TEST_SUITE_END()
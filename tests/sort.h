@@ -177,4 +177,60 @@ BOOST_AUTO_TEST_CASE(merge_many_arrays_of_struct) {
 
 }
 
+BOOST_AUTO_TEST_CASE(loser_tree_merge) {
+
+	auto compare = [](const struct TestDataStruct1 &a, const struct TestDataStruct1 &b) {
+		return a.data1 < b.data1;
+	};
+
+	// Equal records come out in the order of the arrays.
+	{
+		vector<struct TestDataStruct1> arr1{TestDataStruct1{.data1 = 1, .data2 = 1}, TestDataStruct1{.data1 = 2, .data2 = 1}};
+		vector<struct TestDataStruct1> arr2{TestDataStruct1{.data1 = 1, .data2 = 2}};
+		vector<struct TestDataStruct1> arr3{TestDataStruct1{.data1 = 0, .data2 = 3}, TestDataStruct1{.data1 = 2, .data2 = 3}};
+		vector<struct TestDataStruct1> res;
+
+		Sort::merge_arrays(vector<vector<struct TestDataStruct1>>{arr1, arr2, arr3}, compare, res);
+
+		BOOST_REQUIRE_EQUAL(res.size(), 5);
+		BOOST_CHECK(res[0].data1 == 0 && res[0].data2 == 3);
+		BOOST_CHECK(res[1].data1 == 1 && res[1].data2 == 1);
+		BOOST_CHECK(res[2].data1 == 1 && res[2].data2 == 2);
+		BOOST_CHECK(res[3].data1 == 2 && res[3].data2 == 1);
+		BOOST_CHECK(res[4].data1 == 2 && res[4].data2 == 3);
+	}
+
+	// Random arrays compared with a stable sort, merged both on one thread and in parts.
+	for (size_t num_arrays : {1, 2, 3, 7, 16, 33}) {
+		vector<vector<struct TestDataStruct1>> arrays(num_arrays);
+		vector<struct TestDataStruct1> expected;
+		for (size_t i = 0; i < num_arrays; i++) {
+			const size_t len = rand() % 2000;
+			for (size_t j = 0; j < len; j++) {
+				arrays[i].push_back(TestDataStruct1{.data1 = rand() % 1000, .data2 = (int)i});
+			}
+			std::sort(arrays[i].begin(), arrays[i].end(), compare);
+			expected.insert(expected.end(), arrays[i].begin(), arrays[i].end());
+		}
+		std::stable_sort(expected.begin(), expected.end(), compare);
+
+		vector<std::span<const struct TestDataStruct1>> spans(arrays.begin(), arrays.end());
+
+		vector<struct TestDataStruct1> res(expected.size());
+		Sort::loser_tree_merge(spans, compare, res.data());
+
+		vector<struct TestDataStruct1> res_parallel(expected.size());
+		Sort::parallel_merge(spans, compare, res_parallel.data(), 4, [](size_t num_tasks, auto task) {
+			vector<std::thread> threads;
+			for (size_t i = 0; i < num_tasks; i++) threads.emplace_back(task, i);
+			for (std::thread &thread : threads) thread.join();
+		});
+
+		for (size_t i = 0; i < expected.size(); i++) {
+			BOOST_REQUIRE(res[i].data1 == expected[i].data1 && res[i].data2 == expected[i].data2);
+			BOOST_REQUIRE(res_parallel[i].data1 == expected[i].data1 && res_parallel[i].data2 == expected[i].data2);
+		}
+	}
+}
+
 BOOST_AUTO_TEST_SUITE_END()
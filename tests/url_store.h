@@ -31,6 +31,35 @@ using namespace std::literals::chrono_literals;
 
 using json = nlohmann::json;
 
+namespace url_store_test {
+
+	// UrlData in a store of its own, the url store of the test server is already open in this process.
+	class deferred_data : public UrlStore::UrlData {
+		public:
+			using UrlStore::UrlData::UrlData;
+			inline static const std::string uri = "deferred_test";
+	};
+
+	string deferred_put(const vector<deferred_data> &datas, size_t update_bitmask) {
+		string put_data;
+		UrlStore::append_bitmask<deferred_data>(0x1, put_data);
+		UrlStore::append_bitmask<deferred_data>(update_bitmask, put_data);
+		for (const deferred_data &data : datas) {
+			UrlStore::append_data_str(data, put_data);
+		}
+		return put_data;
+	}
+
+	deferred_data make_data(const URL &url, size_t link_count, size_t last_visited) {
+		deferred_data data;
+		data.m_url = url;
+		data.m_link_count = link_count;
+		data.m_http_code = 200;
+		data.m_last_visited = last_visited;
+		return data;
+	}
+}
+
 BOOST_AUTO_TEST_SUITE(url_store)
 
 BOOST_AUTO_TEST_CASE(url_data) {
@@ -141,6 +170,112 @@ BOOST_AUTO_TEST_CASE(update) {
 	BOOST_CHECK_EQUAL(ret_data.m_last_visited, 20220110);
 }
 
+BOOST_AUTO_TEST_CASE(update_sequence) {
+
+	URL url("https://www.example.com/update_sequence");
+	UrlStore::UrlData url_data;
+	url_data.m_url = url;
+	url_data.m_link_count = 1;
+	url_data.m_http_code = 200;
+	url_data.m_last_visited = 20220101;
+
+	UrlStore::set(url_data);
+
+	// Updates are applied in the order they were written.
+	for (size_t i = 2; i <= 5; i++) {
+		UrlStore::UrlData update_data;
+		update_data.m_url = url;
+		update_data.m_link_count = i;
+		update_data.m_http_code = 500;
+		update_data.m_last_visited = 20220100 + i;
+		UrlStore::update(update_data, i % 2 ? UrlStore::update_last_visited : UrlStore::update_link_count);
+	}
+
+	UrlStore::UrlData ret_data;
+	int error = UrlStore::get(url.str(), ret_data);
+
+	BOOST_CHECK_EQUAL(error, UrlStore::OK);
+	BOOST_CHECK_EQUAL(ret_data.m_url.str(), url.str());
+	BOOST_CHECK_EQUAL(ret_data.m_link_count, 4);
+	BOOST_CHECK_EQUAL(ret_data.m_http_code, 200);
+	BOOST_CHECK_EQUAL(ret_data.m_last_visited, 20220105);
+
+	// A set replaces the record and the updates before it.
+	UrlStore::set(url_data);
+	error = UrlStore::get(url.str(), ret_data);
+
+	BOOST_CHECK_EQUAL(error, UrlStore::OK);
+	BOOST_CHECK_EQUAL(ret_data.m_link_count, 1);
+	BOOST_CHECK_EQUAL(ret_data.m_last_visited, 20220101);
+}
+
+BOOST_AUTO_TEST_CASE(deferred_sequence) {
+
+	using namespace url_store_test;
+
+	for (size_t i = 0; i < Config::url_store_shards; i++) {
+		boost::filesystem::remove_all("/mnt/" + std::to_string(i % 8) + "/store/" + deferred_data::uri);
+	}
+	boost::filesystem::create_directories(Config::url_store_cache_path);
+
+	URL url("https://www.example.com/deferred_sequence");
+	std::stringstream response;
+
+	{
+		UrlStore::UrlStore<deferred_data> store;
+
+		const uint64_t first_sequence = store.next_sequence();
+
+		UrlStore::handle_put_request(store, deferred_put({make_data(url, 1, 20220101)}, 0x0), response);
+		UrlStore::handle_put_request(store, deferred_put({make_data(url, 2, 0), make_data(url, 3, 0)}, UrlStore::update_link_count),
+			response);
+		UrlStore::handle_put_request(store, deferred_put({make_data(url, 0, 20220103)}, UrlStore::update_last_visited), response);
+		UrlStore::run_inserter(store);
+
+		// The files are parsed in parallel but the last written value wins, and only one sequence number is reserved per record.
+		deferred_data ret_data = store.get(url.str());
+		BOOST_CHECK_EQUAL(ret_data.m_link_count, 3);
+		BOOST_CHECK_EQUAL(ret_data.m_http_code, 200);
+		BOOST_CHECK_EQUAL(ret_data.m_last_visited, 20220103);
+		BOOST_CHECK_EQUAL(store.next_sequence() - first_sequence, 5);
+
+		// A delta with a sequence number ahead of the clock, like the ones written when sequences are reserved faster than the clock.
+		UrlStore::UrlStoreBatch<deferred_data> batch;
+		batch.update(make_data(url, 4, 0), UrlStore::update_link_count, store.next_sequence() + 3600ull*1000*1000);
+		store.write_batch(batch);
+	}
+
+	{
+		UrlStore::UrlStore<deferred_data> store;
+
+		deferred_data ret_data = store.get(url.str());
+		BOOST_CHECK_EQUAL(ret_data.m_link_count, 4);
+
+		// The reopened store continues after the stored deltas.
+		UrlStore::handle_put_request(store, deferred_put({make_data(url, 5, 0)}, UrlStore::update_link_count), response);
+		UrlStore::run_inserter(store);
+
+		ret_data = store.get(url.str());
+		BOOST_CHECK_EQUAL(ret_data.m_link_count, 5);
+		BOOST_CHECK_EQUAL(ret_data.m_last_visited, 20220103);
+
+		store.fold_deltas();
+
+		ret_data = store.get(url.str());
+		BOOST_CHECK_EQUAL(ret_data.m_link_count, 5);
+		BOOST_CHECK_EQUAL(ret_data.m_last_visited, 20220103);
+	}
+
+	{
+		UrlStore::UrlStore<deferred_data> store;
+
+		// The sequence is stored with the deltas so it is kept after they are folded.
+		const uint64_t now = std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::system_clock::now().time_since_epoch()).count();
+		BOOST_CHECK(store.next_sequence() > now + 1800ull*1000*1000);
+	}
+}
+
 BOOST_AUTO_TEST_CASE(get_many) {
 
 	vector<string> urls = {
@@ -181,6 +316,39 @@ BOOST_AUTO_TEST_CASE(get_many) {
 	}
 }
 
+BOOST_AUTO_TEST_CASE(get_many_missing) {
+
+	vector<UrlStore::UrlData> datas;
+	vector<string> urls;
+	for (size_t i = 0; i < 1000; i++) {
+		UrlStore::UrlData url_data;
+		url_data.m_url = URL("https://www.example" + std::to_string(i) + ".com/get_many_missing");
+		url_data.m_link_count = i;
+		url_data.m_http_code = 200;
+		datas.push_back(url_data);
+		urls.push_back(url_data.m_url.str());
+	}
+	UrlStore::set_many(datas);
+	std::this_thread::sleep_for(200ms);
+
+	// Missing and repeated keys are answered in request order.
+	urls.insert(urls.begin() + 500, "https://www.example.com/get_many_missing_not_stored");
+	urls.push_back(urls[10]);
+
+	vector<UrlStore::UrlData> ret_data;
+	int error = UrlStore::get_many(urls, ret_data);
+
+	BOOST_CHECK_EQUAL(error, UrlStore::OK);
+	BOOST_REQUIRE_EQUAL(ret_data.size(), 1002);
+	for (size_t i = 0; i < 1000; i++) {
+		const size_t pos = i < 500 ? i : i + 1;
+		BOOST_CHECK_EQUAL(ret_data[pos].m_url.str(), datas[i].m_url.str());
+		BOOST_CHECK_EQUAL(ret_data[pos].m_link_count, i);
+	}
+	BOOST_CHECK_EQUAL(ret_data[500].m_http_code, 0);
+	BOOST_CHECK_EQUAL(ret_data[1001].m_link_count, 10);
+}
+
 BOOST_AUTO_TEST_CASE(get_json) {
 
 	vector<URL> urls = {